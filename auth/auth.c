@@ -46,6 +46,139 @@ static const serf__authn_scheme_t *serf_authn_schemes[] = {
 };
 
 
+/*** Per server authentication cache ***/
+
+/* The authn info of a server, with its own pool so it can be dropped from the
+   cache. INFO must be the first member, see entry_for_info(). */
+struct serf__authn_cache_entry_t {
+    serf__authn_info_t info;
+
+    apr_pool_t *pool;           /* the entry, its key and INFO.pool */
+    const char *host_url;       /* key in ctx->server_authn_info */
+
+    /* Time the credentials expire, 0 if there are none or they don't. */
+    apr_time_t expires;
+
+    /* Least recently used list, most recently used first. */
+    serf__authn_cache_entry_t *prev;
+    serf__authn_cache_entry_t *next;
+};
+
+static serf__authn_cache_entry_t *entry_for_info(serf__authn_info_t *info)
+{
+    return (serf__authn_cache_entry_t *)info;
+}
+
+static void lru_unlink(serf_context_t *ctx, serf__authn_cache_entry_t *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        ctx->authn_lru_head = entry->next;
+
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        ctx->authn_lru_tail = entry->prev;
+
+    entry->prev = entry->next = NULL;
+}
+
+static void lru_push_front(serf_context_t *ctx,
+                           serf__authn_cache_entry_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = ctx->authn_lru_head;
+    if (ctx->authn_lru_head)
+        ctx->authn_lru_head->prev = entry;
+    else
+        ctx->authn_lru_tail = entry;
+    ctx->authn_lru_head = entry;
+}
+
+static void evict_entry(serf_context_t *ctx, serf__authn_cache_entry_t *entry)
+{
+    serf__log(LOGLVL_DEBUG, LOGCOMP_AUTHN, __FILE__, ctx->config,
+              "Forget authentication state of %s\n", entry->host_url);
+
+    lru_unlink(ctx, entry);
+    apr_hash_set(ctx->server_authn_info, entry->host_url,
+                 APR_HASH_KEY_STRING, NULL);
+    apr_pool_destroy(entry->pool);
+}
+
+/* Forget the scheme state of ENTRY, but keep the entry itself. */
+static void expire_entry(serf__authn_cache_entry_t *entry)
+{
+    apr_pool_clear(entry->info.pool);
+    entry->info.scheme = NULL;
+    entry->info.baton = NULL;
+    entry->info.failed_authn_types = 0;
+    entry->expires = 0;
+}
+
+serf__authn_info_t *serf__get_authn_info_for_server(serf_connection_t *conn)
+{
+    serf_context_t *ctx = conn->ctx;
+    serf__authn_cache_entry_t *entry;
+    apr_pool_t *pool;
+
+    entry = apr_hash_get(ctx->server_authn_info, conn->host_url,
+                         APR_HASH_KEY_STRING);
+
+    if (entry) {
+        if (entry != ctx->authn_lru_head) {
+            lru_unlink(ctx, entry);
+            lru_push_front(ctx, entry);
+        }
+        return &entry->info;
+    }
+
+    while (ctx->authn_lru_tail &&
+           apr_hash_count(ctx->server_authn_info) >= ctx->authn_cache_max) {
+        evict_entry(ctx, ctx->authn_lru_tail);
+    }
+
+    apr_pool_create(&pool, ctx->pool);
+    entry = apr_pcalloc(pool, sizeof(*entry));
+    entry->pool = pool;
+    entry->host_url = apr_pstrdup(pool, conn->host_url);
+    apr_pool_create(&entry->info.pool, pool);
+
+    apr_hash_set(ctx->server_authn_info, entry->host_url,
+                 APR_HASH_KEY_STRING, entry);
+    lru_push_front(ctx, entry);
+
+    return &entry->info;
+}
+
+/* Like serf__get_authn_info_for_server, but forgets the server's credentials
+   when they're too old. Only call this when no authentication handshake
+   is using the server's state, e.g. when setting up a new request. */
+static serf__authn_info_t *get_fresh_authn_info(serf_connection_t *conn)
+{
+    serf__authn_info_t *authn_info = serf__get_authn_info_for_server(conn);
+    serf__authn_cache_entry_t *entry = entry_for_info(authn_info);
+
+    if (entry->expires && entry->expires <= apr_time_now()) {
+        serf__log(LOGLVL_DEBUG, LOGCOMP_AUTHN, __FILE__, conn->config,
+                  "Credentials of %s expired\n", entry->host_url);
+        expire_entry(entry);
+    }
+
+    return authn_info;
+}
+
+/* Start the TTL of the server credentials in AUTHN_INFO. */
+static void credentials_obtained(serf_context_t *ctx,
+                                 serf__authn_info_t *authn_info)
+{
+    serf__authn_cache_entry_t *entry = entry_for_info(authn_info);
+
+    if (ctx->authn_cache_ttl)
+        entry->expires = apr_time_now() + ctx->authn_cache_ttl;
+}
+
 /* Reads and discards all bytes in the response body. */
 static apr_status_t discard_body(serf_bucket_t *response)
 {
@@ -126,6 +259,9 @@ static int handle_auth_headers(int code,
         /* If this is the first time we use this scheme on this connection,
            make sure to initialize the authentication handler first. */
         if (authn_info->scheme != scheme) {
+            /* The state of the previous scheme is of no use to this one. */
+            authn_info->baton = NULL;
+
             status = scheme->init_conn_func(scheme, code, conn,
                                             conn->pool);
             if (!status)
@@ -144,8 +280,11 @@ static int handle_auth_headers(int code,
                              auth_hdr, auth_attr, ctx->pool);
         }
 
-        if (status == APR_SUCCESS)
+        if (status == APR_SUCCESS) {
+            if (code == 401)
+                credentials_obtained(ctx, authn_info);
             break;
+        }
 
         /* No success authenticating with this scheme, try the next.
            If no more authn schemes are found the status of this scheme will be
@@ -419,24 +558,6 @@ const char *serf__construct_realm(peer_t peer,
     }
 }
 
-serf__authn_info_t *serf__get_authn_info_for_server(serf_connection_t *conn)
-{
-    serf_context_t *ctx = conn->ctx;
-    serf__authn_info_t *authn_info;
-
-    authn_info = apr_hash_get(ctx->server_authn_info, conn->host_url,
-                              APR_HASH_KEY_STRING);
-
-    if (!authn_info) {
-        authn_info = apr_pcalloc(ctx->pool, sizeof(serf__authn_info_t));
-        apr_hash_set(ctx->server_authn_info,
-                     apr_pstrdup(ctx->pool, conn->host_url),
-                     APR_HASH_KEY_STRING, authn_info);
-    }
-
-    return authn_info;
-}
-
 apr_status_t serf__auth_setup_connection(peer_t peer,
                                          serf_connection_t *conn)
 {
@@ -451,7 +572,7 @@ apr_status_t serf__auth_setup_connection(peer_t peer,
         }
     }
     else {
-        authn_info = serf__get_authn_info_for_server(conn);
+        authn_info = get_fresh_authn_info(conn);
         if (authn_info->scheme) {
             authn_info->scheme->init_conn_func(authn_info->scheme, 401,
                                                conn, conn->pool);
@@ -480,12 +601,24 @@ apr_status_t serf__auth_setup_request(peer_t peer,
     {
         serf__authn_info_t *authn_info;
 
-        authn_info = serf__get_authn_info_for_server(request->conn);
+        /* Remember the uri, a 401 response needs it to find the protection
+           space of the realm. */
+        if (request->respool)
+            request->auth_uri = apr_pstrdup(request->respool, uri);
+
+        authn_info = get_fresh_authn_info(request->conn);
         if (authn_info->scheme) {
+            const char *auth_hdr;
+
             authn_info->scheme->setup_request_func(authn_info->scheme,
                                                    HOST, 0, request->conn,
                                                    request, method, uri,
                                                    hdrs_bkt);
+
+            auth_hdr = serf_bucket_headers_get(hdrs_bkt, "Authorization");
+            if (auth_hdr && request->respool)
+                request->auth_header = apr_pstrdup(request->respool,
+                                                   auth_hdr);
         }
     }
 
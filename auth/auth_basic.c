@@ -23,13 +23,87 @@
 #include <apr_base64.h>
 #include <apr_strings.h>
 
+/* The credentials for one realm of a server. PATH is the protection space:
+   requests to uri's starting with PATH will probably need these credentials
+   too, so they are sent preemptively (RFC 7617, section 2.2). */
+typedef struct basic_realm_t {
+    const char *realm;
+    const char *path;
+    const char *value;
+    struct basic_realm_t *next;
+} basic_realm_t;
+
 /* Stores the context information related to Basic authentication.
    This information is stored in the per server cache in the serf context. */
 typedef struct basic_authn_info_t {
     const char *header;
-    const char *value;
+    const char *value;          /* the last used credentials */
+    basic_realm_t *realms;
 } basic_authn_info_t;
 
+/* Returns the directory part of URI, up to and including the last '/'. */
+static const char *uri_dir(const char *uri, apr_pool_t *pool)
+{
+    const char *end;
+
+    if (!uri || *uri != '/')
+        return "/";
+
+    end = strchr(uri, '?');
+    if (!end)
+        end = uri + strlen(uri);
+    while (end > uri && *(end - 1) != '/')
+        end--;
+
+    return apr_pstrmemdup(pool, uri, end - uri);
+}
+
+/* Returns the common leading part of paths A and B, up to a '/'. */
+static const char *common_dir(const char *a, const char *b, apr_pool_t *pool)
+{
+    apr_size_t i, len = 0;
+
+    for (i = 0; a[i] && a[i] == b[i]; i++) {
+        if (a[i] == '/')
+            len = i + 1;
+    }
+
+    return len ? apr_pstrmemdup(pool, a, len) : "/";
+}
+
+static basic_realm_t *find_realm(basic_authn_info_t *basic_info,
+                                 const char *realm)
+{
+    basic_realm_t *iter;
+
+    for (iter = basic_info->realms; iter; iter = iter->next) {
+        if (strcmp(iter->realm, realm) == 0)
+            return iter;
+    }
+    return NULL;
+}
+
+/* Returns the realm with the longest protection space that contains URI. */
+static basic_realm_t *find_realm_for_uri(basic_authn_info_t *basic_info,
+                                         const char *uri)
+{
+    basic_realm_t *iter, *found = NULL;
+    apr_size_t found_len = 0;
+
+    if (!uri)
+        return NULL;
+
+    for (iter = basic_info->realms; iter; iter = iter->next) {
+        apr_size_t len = strlen(iter->path);
+
+        if (len >= found_len && strncmp(uri, iter->path, len) == 0) {
+            found = iter;
+            found_len = len;
+        }
+    }
+    return found;
+}
+
 /* Implements serf__auth_handler_func_t callback. */
 static apr_status_t
 serf__handle_basic_auth(const serf__authn_scheme_t *scheme,
@@ -46,10 +120,12 @@ serf__handle_basic_auth(const serf__authn_scheme_t *scheme,
     serf_context_t *ctx = conn->ctx;
     serf__authn_info_t *authn_info;
     basic_authn_info_t *basic_info;
+    basic_realm_t *realm_info;
     apr_status_t status;
     apr_pool_t *cred_pool;
     char *username, *password, *realm_name;
     const char *eq, *realm = NULL;
+    const char *path;
 
     /* Can't do Basic authentication if there's no callback to get
        username & password. */
@@ -88,6 +164,21 @@ serf__handle_basic_auth(const serf__authn_scheme_t *scheme,
                                       pool);
     }
 
+    basic_info->header = (code == 401) ? "Authorization" : "Proxy-Authorization";
+    path = uri_dir(code == 401 ? request->auth_uri : NULL, authn_info->pool);
+
+    /* If we know the credentials for this realm but didn't send them, try
+       them first. Only ask the application if they were rejected. */
+    realm_info = find_realm(basic_info, realm_name ? realm_name : "");
+    if (realm_info && code == 401 &&
+        (!request->auth_header ||
+         strcmp(realm_info->value, request->auth_header) != 0)) {
+        realm_info->path = common_dir(realm_info->path, path,
+                                      authn_info->pool);
+        basic_info->value = realm_info->value;
+        return APR_SUCCESS;
+    }
+
     /* Ask the application for credentials */
     apr_pool_create(&cred_pool, pool);
     status = serf__provide_credentials(ctx,
@@ -100,25 +191,35 @@ serf__handle_basic_auth(const serf__authn_scheme_t *scheme,
         return status;
     }
 
-    tmp = apr_pstrcat(conn->pool, username, ":", password, NULL);
+    tmp = apr_pstrcat(cred_pool, username, ":", password, NULL);
     tmp_len = strlen(tmp);
-    apr_pool_destroy(cred_pool);
 
-    serf__encode_auth_header(&basic_info->value,
+    if (!realm_info) {
+        realm_info = apr_pcalloc(authn_info->pool, sizeof(*realm_info));
+        realm_info->realm = apr_pstrdup(authn_info->pool,
+                                        realm_name ? realm_name : "");
+        realm_info->path = path;
+        realm_info->next = basic_info->realms;
+        basic_info->realms = realm_info;
+    } else {
+        realm_info->path = common_dir(realm_info->path, path,
+                                      authn_info->pool);
+    }
+    serf__encode_auth_header(&realm_info->value,
                              scheme->name,
-                             tmp, tmp_len, pool);
-    basic_info->header = (code == 401) ? "Authorization" : "Proxy-Authorization";
+                             tmp, tmp_len, authn_info->pool);
+    apr_pool_destroy(cred_pool);
+
+    basic_info->value = realm_info->value;
 
     return APR_SUCCESS;
 }
 
 /* For Basic authentication we expect all authn info to be the same for all
-   connections in the context to the same server (same realm, username,
-   password). Therefore we can keep the header value in the per-server store
-   context instead of per connection. Implements serf__init_conn_func_t
-   callback.
-   TODO: we currently don't cache this info per realm, so each time a request
-   'switches realms', we have to ask the application for new credentials. */
+   connections in the context to the same server (same realms, usernames,
+   passwords). Therefore we can keep the credentials per realm in the
+   per-server store context instead of per connection. Implements
+   serf__init_conn_func_t callback. */
 static apr_status_t
 serf__init_basic_connection(const serf__authn_scheme_t *scheme,
                             int code,
@@ -135,7 +236,8 @@ serf__init_basic_connection(const serf__authn_scheme_t *scheme,
     }
 
     if (!authn_info->baton) {
-        authn_info->baton = apr_pcalloc(pool, sizeof(basic_authn_info_t));
+        authn_info->baton = apr_pcalloc(authn_info->pool,
+                                        sizeof(basic_authn_info_t));
     }
 
     return APR_SUCCESS;
@@ -155,6 +257,8 @@ serf__setup_request_basic_auth(const serf__authn_scheme_t *scheme,
     serf_context_t *ctx = conn->ctx;
     serf__authn_info_t *authn_info;
     basic_authn_info_t *basic_info;
+    basic_realm_t *realm_info = NULL;
+    const char *value;
 
     if (peer == HOST) {
         authn_info = serf__get_authn_info_for_server(conn);
@@ -164,8 +268,15 @@ serf__setup_request_basic_auth(const serf__authn_scheme_t *scheme,
     basic_info = authn_info->baton;
 
     if (basic_info && basic_info->header && basic_info->value) {
-        serf_bucket_headers_setn(hdrs_bkt, basic_info->header,
-                                 basic_info->value);
+        /* Send the credentials of the realm this uri probably belongs to,
+           or else the last used ones. */
+        if (peer == HOST)
+            realm_info = find_realm_for_uri(basic_info, uri);
+        value = realm_info ? realm_info->value : basic_info->value;
+
+        /* The value lives in the server's authn cache entry, which can
+           expire before this request is written: copy it. */
+        serf_bucket_headers_set(hdrs_bkt, basic_info->header, value);
         return APR_SUCCESS;
     }
 
@@ -28,13 +28,25 @@
 /** Digest authentication, implements RFC 2617. **/
 
 /* TODO: add support for the domain attribute. This defines the protection
-   space, so that serf can decide per URI if it should reuse the cached
-   credentials for the server, or not. */
+   space, so that serf can decide per URI which of the cached realms to use. */
+
+/* The credentials for one realm of a server. Only the username and HA1 are
+   kept, the password itself is not needed anymore once HA1 is known. */
+typedef struct digest_realm_t {
+    const char *realm;
+    const char *username;
+    const char *ha1;
+    struct digest_realm_t *next;
+} digest_realm_t;
 
 /* Stores the context information related to Digest authentication.
-   This information is stored in the per server cache in the serf context. */
+   This information is stored in the per server cache in the serf context,
+   so it is shared by all connections to that server: a new connection can
+   continue with the current nonce without a new challenge. */
 typedef struct digest_authn_info_t {
-    /* nonce-count for digest authentication */
+    /* nonce-count for digest authentication, the number of requests sent with
+       the current nonce. serf only uses a context from one thread, so this
+       doesn't need to be an atomic counter. */
     unsigned int digest_nc;
 
     const char *header;
@@ -49,15 +61,99 @@ typedef struct digest_authn_info_t {
     const char *qop;
     const char *username;
 
+    /* All realms of this server for which we have credentials */
+    digest_realm_t *realms;
+
     apr_pool_t *pool;
+
+    /* Holds nonce, cnonce, opaque, algorithm and qop. Replaced with each new
+       nonce, so a server that rotates its nonces doesn't grow POOL. */
+    apr_pool_t *nonce_pool;
 } digest_authn_info_t;
 
+/* The parameters used to build the Authorization header of a request, needed
+   to validate the Authentication-Info header of its response. These are
+   stored per request as the nonce might change while requests are in
+   flight. */
+typedef struct digest_request_t {
+    const char *uri;
+    const char *nonce;
+    const char *cnonce;
+    const char *qop;
+    const char *ha1;
+} digest_request_t;
+
 static char
 int_to_hex(int v)
 {
     return (v < 10) ? '0' + v : 'a' + (v - 10);
 }
 
+static digest_realm_t *find_realm(digest_authn_info_t *digest_info,
+                                  const char *realm)
+{
+    digest_realm_t *iter;
+
+    for (iter = digest_info->realms; iter; iter = iter->next) {
+        if (strcmp(iter->realm, realm) == 0)
+            return iter;
+    }
+    return NULL;
+}
+
+/* Returns non-zero if REQUEST was sent with credentials for REALM_NAME. */
+static int sent_for_realm(serf_request_t *request, const char *realm_name,
+                          apr_pool_t *pool)
+{
+    const char *prefix;
+
+    if (!request->auth_header)
+        return 0;
+
+    prefix = apr_psprintf(pool, "Digest realm=\"%s\",", realm_name);
+    return strncmp(request->auth_header, prefix, strlen(prefix)) == 0;
+}
+
+/* Stores the server NONCE and the QOP, OPAQUE and ALGORITHM parameters that
+   go with it in a new nonce pool, and releases the previous one. The
+   arguments may point into the previous nonce pool. The nonce-count restarts
+   for each nonce, as does the client nonce. */
+static void set_nonce_params(digest_authn_info_t *digest_info,
+                             const char *nonce, const char *qop,
+                             const char *opaque, const char *algorithm)
+{
+    apr_pool_t *pool;
+    int same_nonce = digest_info->nonce && nonce &&
+                     strcmp(digest_info->nonce, nonce) == 0;
+
+    apr_pool_create(&pool, digest_info->pool);
+    digest_info->nonce = apr_pstrdup(pool, nonce);
+    digest_info->qop = apr_pstrdup(pool, qop);
+    digest_info->opaque = apr_pstrdup(pool, opaque);
+    digest_info->algorithm = apr_pstrdup(pool, algorithm);
+    if (same_nonce) {
+        digest_info->cnonce = apr_pstrdup(pool, digest_info->cnonce);
+    } else {
+        digest_info->cnonce = NULL;
+        digest_info->digest_nc = 1;
+    }
+
+    if (digest_info->nonce_pool)
+        apr_pool_destroy(digest_info->nonce_pool);
+    digest_info->nonce_pool = pool;
+}
+
+/* Sets a new server NONCE, keeping the other parameters of the last
+   challenge. */
+static void set_nonce(digest_authn_info_t *digest_info, const char *nonce)
+{
+    if (digest_info->nonce && nonce && strcmp(digest_info->nonce, nonce) == 0)
+        return;
+
+    set_nonce_params(digest_info, nonce, digest_info->qop,
+                     digest_info->opaque, digest_info->algorithm);
+}
+
 /**
  * Convert a string if ASCII characters HASHVAL to its hexadecimal
  * representation.
@@ -181,7 +277,7 @@ build_auth_header(const char **out_header,
 
     if (digest_info->qop) {
         if (! digest_info->cnonce)
-            digest_info->cnonce = random_cnonce(digest_info->pool);
+            digest_info->cnonce = random_cnonce(digest_info->nonce_pool);
 
         hdr = apr_psprintf(pool, "%s, nc=%08x, cnonce=\"%s\", qop=\"%s\"",
                            hdr,
@@ -245,13 +341,13 @@ serf__handle_digest_auth(const serf__authn_scheme_t *scheme,
     const char *qop = NULL;
     const char *opaque = NULL;
     const char *key;
+    int stale = 0;
     serf_connection_t *conn = request->conn;
     serf_context_t *ctx = conn->ctx;
     serf__authn_info_t *authn_info;
     digest_authn_info_t *digest_info;
-    apr_status_t status;
-    apr_pool_t *cred_pool;
-    char *username, *password;
+    digest_realm_t *realm_info;
+    apr_status_t status = APR_SUCCESS;
 
     /* Can't do Digest authentication if there's no callback to get
        username & password. */
@@ -305,6 +401,8 @@ serf__handle_digest_auth(const serf__authn_scheme_t *scheme,
             qop = val;
         else if (strcmp(key, "opaque") == 0)
             opaque = val;
+        else if (strcmp(key, "stale") == 0)
+            stale = (strcasecmp(val, "true") == 0);
 
         /* Ignore all unsupported attributes. */
     }
@@ -317,41 +415,51 @@ serf__handle_digest_auth(const serf__authn_scheme_t *scheme,
                                   conn, realm_name,
                                   pool);
 
-    /* Ask the application for credentials */
-    apr_pool_create(&cred_pool, pool);
-    status = serf__provide_credentials(ctx,
-                                       &username, &password,
-                                       request,
-                                       code, scheme->name,
-                                       realm, cred_pool);
-    if (status) {
-        apr_pool_destroy(cred_pool);
-        return status;
-    }
-
     digest_info->header = (code == 401) ? "Authorization" :
                                           "Proxy-Authorization";
 
+    /* Only ask the application for credentials if we don't know them yet
+       for this realm, or if they were rejected. A stale nonce means the
+       credentials were fine, only the nonce has to be replaced. */
+    realm_info = find_realm(digest_info, realm_name);
+    if (!realm_info ||
+        (!stale && (code != 401 ||
+                    sent_for_realm(request, realm_name, pool)))) {
+        apr_pool_t *cred_pool;
+        char *username, *password;
+
+        apr_pool_create(&cred_pool, pool);
+        status = serf__provide_credentials(ctx,
+                                           &username, &password,
+                                           request,
+                                           code, scheme->name,
+                                           realm, cred_pool);
+        if (status) {
+            apr_pool_destroy(cred_pool);
+            return status;
+        }
+
+        if (!realm_info) {
+            realm_info = apr_pcalloc(digest_info->pool, sizeof(*realm_info));
+            realm_info->realm = apr_pstrdup(digest_info->pool, realm_name);
+            realm_info->next = digest_info->realms;
+            digest_info->realms = realm_info;
+        }
+        realm_info->username = apr_pstrdup(digest_info->pool, username);
+        status = build_digest_ha1(&realm_info->ha1, username, password,
+                                  realm_info->realm, digest_info->pool);
+
+        apr_pool_destroy(cred_pool);
+    }
+
     /* Store the digest authentication parameters in the context cached for
        this server in the serf context, so we can use it to create the
        Authorization header when setting up requests on the same or different
-       connections (e.g. in case of KeepAlive off on the server).
-       TODO: we currently don't cache this info per realm, so each time a request
-       'switches realms', we have to ask the application for new credentials. */
-    digest_info->pool = conn->pool;
-    digest_info->qop = apr_pstrdup(digest_info->pool, qop);
-    digest_info->nonce = apr_pstrdup(digest_info->pool, nonce);
-    digest_info->cnonce = NULL;
-    digest_info->opaque = apr_pstrdup(digest_info->pool, opaque);
-    digest_info->algorithm = apr_pstrdup(digest_info->pool, algorithm);
-    digest_info->realm = apr_pstrdup(digest_info->pool, realm_name);
-    digest_info->username = apr_pstrdup(digest_info->pool, username);
-    digest_info->digest_nc++;
-
-    status = build_digest_ha1(&digest_info->ha1, username, password,
-                              digest_info->realm, digest_info->pool);
-
-    apr_pool_destroy(cred_pool);
+       connections (e.g. in case of KeepAlive off on the server). */
+    set_nonce_params(digest_info, nonce, qop, opaque, algorithm);
+    digest_info->realm = realm_info->realm;
+    digest_info->username = realm_info->username;
+    digest_info->ha1 = realm_info->ha1;
 
     /* If the handshake is finished tell serf it can send as much requests as it
        likes. */
@@ -377,11 +485,17 @@ serf__init_digest_connection(const serf__authn_scheme_t *scheme,
     }
 
     if (!authn_info->baton) {
-        authn_info->baton = apr_pcalloc(pool, sizeof(digest_authn_info_t));
+        digest_authn_info_t *digest_info;
+
+        digest_info = apr_pcalloc(authn_info->pool, sizeof(*digest_info));
+        digest_info->pool = authn_info->pool;
+        authn_info->baton = digest_info;
     }
 
-    /* Make serf send the initial requests one by one */
-    serf__connection_set_pipelining(conn, 0);
+    /* Make serf send the initial requests one by one, unless another
+       connection already completed the handshake with this server. */
+    if (!((digest_authn_info_t *)authn_info->baton)->realm)
+        serf__connection_set_pipelining(conn, 0);
 
     return APR_SUCCESS;
 }
@@ -400,6 +514,7 @@ serf__setup_request_digest_auth(const serf__authn_scheme_t *scheme,
     serf_context_t *ctx = conn->ctx;
     serf__authn_info_t *authn_info;
     digest_authn_info_t *digest_info;
+    apr_pool_t *pool = request->respool ? request->respool : conn->pool;
     apr_status_t status;
 
     if (peer == HOST) {
@@ -410,11 +525,10 @@ serf__setup_request_digest_auth(const serf__authn_scheme_t *scheme,
     digest_info = authn_info->baton;
 
     if (digest_info && digest_info->realm) {
+        digest_request_t *digest_req;
         const char *value;
         const char *path;
 
-        /* TODO: per request pool? */
-
         /* for request 'CONNECT serf.googlecode.com:443', the uri also should be
            serf.googlecode.com:443. apr_uri_parse can't handle this, so special
            case. */
@@ -424,7 +538,7 @@ serf__setup_request_digest_auth(const serf__authn_scheme_t *scheme,
             apr_uri_t parsed_uri;
 
             /* Extract path from uri. */
-            status = apr_uri_parse(conn->pool, uri, &parsed_uri);
+            status = apr_uri_parse(pool, uri, &parsed_uri);
             if (status)
                 return status;
 
@@ -435,7 +549,7 @@ serf__setup_request_digest_auth(const serf__authn_scheme_t *scheme,
         digest_info->header = (peer == HOST) ? "Authorization" :
             "Proxy-Authorization";
         status = build_auth_header(&value, digest_info, path, method,
-                                   conn->pool);
+                                   pool);
         if (status)
             return status;
 
@@ -443,10 +557,17 @@ serf__setup_request_digest_auth(const serf__authn_scheme_t *scheme,
                                  value);
         digest_info->digest_nc++;
 
-        /* Store the uri of this request on the serf_request_t object, to make
-           it available when validating the Authentication-Info header of the
-           matching response. */
-        request->auth_baton = (void *)path;
+        /* Store the uri and nonce of this request on the serf_request_t
+           object, to make them available when validating the
+           Authentication-Info header of the matching response. Copy them,
+           the server's state can be replaced or expire in the meantime. */
+        digest_req = apr_palloc(pool, sizeof(*digest_req));
+        digest_req->uri = path;
+        digest_req->nonce = apr_pstrdup(pool, digest_info->nonce);
+        digest_req->cnonce = apr_pstrdup(pool, digest_info->cnonce);
+        digest_req->qop = apr_pstrdup(pool, digest_info->qop);
+        digest_req->ha1 = apr_pstrdup(pool, digest_info->ha1);
+        request->auth_baton = digest_req;
     }
 
     return APR_SUCCESS;
@@ -468,8 +589,12 @@ serf__validate_response_digest_auth(const serf__authn_scheme_t *scheme,
     const char *rspauth = NULL;
     const char *qop = NULL;
     const char *nc_str = NULL;
+    const char *nextnonce = NULL;
     serf_bucket_t *hdrs;
     serf_context_t *ctx = conn->ctx;
+    serf__authn_info_t *authn_info;
+    digest_authn_info_t *digest_info;
+    digest_request_t *digest_req = request->auth_baton;
     apr_status_t status;
 
     hdrs = serf_bucket_response_get_headers(response);
@@ -518,29 +643,28 @@ serf__validate_response_digest_auth(const serf__authn_scheme_t *scheme,
             qop = val;
         else if (strcmp(key, "nc") == 0)
             nc_str = val;
+        else if (strcmp(key, "nextnonce") == 0)
+            nextnonce = val;
     }
 
-    if (rspauth) {
+    if (peer == HOST) {
+        authn_info = serf__get_authn_info_for_server(conn);
+    } else {
+        authn_info = &ctx->proxy_authn_info;
+    }
+    digest_info = authn_info->baton;
+
+    if (rspauth && digest_req) {
         const char *ha2, *tmp, *resp_hdr_hex;
         unsigned char resp_hdr[APR_MD5_DIGESTSIZE];
-        const char *req_uri = request->auth_baton;
-        serf__authn_info_t *authn_info;
-        digest_authn_info_t *digest_info;
 
-        if (peer == HOST) {
-            authn_info = serf__get_authn_info_for_server(conn);
-        } else {
-            authn_info = &ctx->proxy_authn_info;
-        }
-        digest_info = authn_info->baton;
-
-        status = build_digest_ha2(&ha2, req_uri, "", qop, pool);
+        status = build_digest_ha2(&ha2, digest_req->uri, "", qop, pool);
         if (status)
             return status;
 
         tmp = apr_psprintf(pool, "%s:%s:%s:%s:%s:%s",
-                           digest_info->ha1, digest_info->nonce, nc_str,
-                           digest_info->cnonce, digest_info->qop, ha2);
+                           digest_req->ha1, digest_req->nonce, nc_str,
+                           digest_req->cnonce, digest_req->qop, ha2);
         apr_md5(resp_hdr, tmp, strlen(tmp));
         resp_hdr_hex =  hex_encode(resp_hdr, pool);
 
@@ -550,6 +674,11 @@ serf__validate_response_digest_auth(const serf__authn_scheme_t *scheme,
         }
     }
 
+    /* The server wants the next requests to use a new nonce, this saves a
+       401 response with stale=true later on. */
+    if (nextnonce && digest_info && digest_info->realm)
+        set_nonce(digest_info, nextnonce);
+
     return APR_SUCCESS;
 }
 
@@ -31,8 +31,6 @@
 #include <apr_strings.h>
 
 /** TODO:
- ** - send session key directly on new connections where we already know
- **   the server requires Kerberos authn.
  ** - Add a way for serf to give detailed error information back to the
  **   application.
  ** - This file is both GSSAPI and Kerberos/NTLM independent, so update names
@@ -85,8 +83,9 @@
  * Note: Step 1 of the handshake will only happen on the first connection, once
  * we know the server requires Kerberos authentication, the initial requests
  * on the other connections will include a session key, so we start at
- * step 2 in the handshake.
- * ### TODO: Not implemented yet!
+ * step 2 in the handshake. This is only done when enabled with
+ * serf_config_authn_negotiate_reuse, as it costs a request to the KDC for
+ * each new connection, even if the server doesn't need it anymore.
  */
 
 /* Current state of the authentication of the current request. */
@@ -176,8 +175,80 @@ typedef struct
 
     const char *header;
     const char *value;
+
+    /* Add an initial token to the first request on this connection, the
+       server is known to require Negotiate authentication. */
+    int preemptive;
 } gss_authn_info_t;
 
+/* Stores what we learned about the Negotiate authentication of a server.
+   This information is stored in the per server cache in the serf context,
+   so new connections to the server can skip the initial 401 response. */
+typedef struct
+{
+    /* The handshake was completed on a connection to this server. */
+    int established;
+
+    /* Persistence state of the last connection that found out. */
+    authn_persistence_state_t pstate;
+} gss_server_info_t;
+
+/* Returns the credentials handle for SCHEME, shared by all connections
+   in the serf context. The user's credentials don't depend on the server,
+   so they only have to be looked up once. */
+static apr_status_t
+get_cred(serf__spnego_cred_t **cred_p,
+         const serf__authn_scheme_t *scheme,
+         serf_connection_t *conn,
+         apr_pool_t *scratch_pool)
+{
+    serf_context_t *ctx = conn->ctx;
+    void **cred_slot = (scheme->type == SERF_AUTHN_NTLM) ? &ctx->ntlm_cred :
+                                                          &ctx->negotiate_cred;
+    apr_status_t status;
+
+    if (!*cred_slot) {
+        serf__spnego_cred_t *cred;
+
+        status = serf__spnego_acquire_cred(&cred, conn, scheme, ctx->pool,
+                                           scratch_pool);
+        if (status)
+            return status;
+        *cred_slot = cred;
+    }
+
+    *cred_p = *cred_slot;
+
+    return APR_SUCCESS;
+}
+
+/* Returns the state of the server of CONN, or NULL if reusing Negotiate
+   authentication state isn't enabled or the server's authentication info
+   doesn't belong to SCHEME (yet). */
+static gss_server_info_t *
+get_server_info(const serf__authn_scheme_t *scheme,
+                serf_connection_t *conn)
+{
+    serf__authn_info_t *authn_info;
+
+    if (!conn->ctx->negotiate_reuse)
+        return NULL;
+
+    authn_info = serf__get_authn_info_for_server(conn);
+    if (authn_info->scheme != scheme)
+        return NULL;
+
+    if (!authn_info->baton) {
+        gss_server_info_t *server_info;
+
+        server_info = apr_pcalloc(authn_info->pool, sizeof(*server_info));
+        server_info->pstate = pstate_undecided;
+        authn_info->baton = server_info;
+    }
+
+    return authn_info->baton;
+}
+
 /* On the initial 401 response of the server, request a session key from
    the Kerberos KDC to pass to the server, proving that we are who we
    claim to be. The session key can only be used with the HTTP service
@@ -289,7 +360,7 @@ do_auth(const serf__authn_scheme_t *scheme,
            host/proxy. 
            Only add the Authorization header if we know the server requires
            per-request authentication (stateless). */
-        if (gss_info->pstate != pstate_stateless)
+        if (gss_info->pstate != pstate_stateless && !gss_info->preemptive)
             return APR_SUCCESS;
     }
 
@@ -309,6 +380,14 @@ do_auth(const serf__authn_scheme_t *scheme,
 
                 gss_info->pstate = pstate_stateless;
                 serf__connection_set_pipelining(conn, 0);
+
+                if (peer == HOST) {
+                    gss_server_info_t *server_info;
+
+                    server_info = get_server_info(scheme, conn);
+                    if (server_info)
+                        server_info->pstate = pstate_stateless;
+                }
                 break;
             }
         case pstate_stateless:
@@ -381,18 +460,38 @@ serf__init_spnego_connection(const serf__authn_scheme_t *scheme,
     gss_info = authn_info->baton;
 
     if (!gss_info) {
+        serf__spnego_cred_t *cred;
         apr_status_t status;
 
+        status = get_cred(&cred, scheme, conn, pool);
+        if (status) {
+            return status;
+        }
+
         gss_info = apr_pcalloc(conn->pool, sizeof(*gss_info));
         gss_info->pool = conn->pool;
         gss_info->state = gss_api_auth_not_started;
         gss_info->pstate = pstate_init;
-        status = serf__spnego_create_sec_context(&gss_info->gss_ctx, scheme,
-                                                 gss_info->pool, pool);
+        status = serf__spnego_create_sec_context(&gss_info->gss_ctx, cred,
+                                                 scheme, gss_info->pool, pool);
         if (status) {
             return status;
         }
         authn_info->baton = gss_info;
+
+        /* If another connection authenticated to this server already, don't
+           wait for the 401 response but start the handshake with the first
+           request. */
+        if (code == 401) {
+            gss_server_info_t *server_info = get_server_info(scheme, conn);
+
+            if (server_info && server_info->established) {
+                if (server_info->pstate == pstate_stateless)
+                    gss_info->pstate = pstate_stateless;
+                else
+                    gss_info->preemptive = 1;
+            }
+        }
     }
 
     /* Make serf send the initial requests one by one */
@@ -453,8 +552,8 @@ serf__setup_request_spnego_auth(const serf__authn_scheme_t *scheme,
         serf__log(LOGLVL_DEBUG, LOGCOMP_AUTHN, __FILE__, conn->config,
                   "Set Negotiate authn header on retried request.\n");
 
-        serf_bucket_headers_setn(hdrs_bkt, gss_info->header,
-                                 gss_info->value);
+        serf_bucket_headers_set(hdrs_bkt, gss_info->header,
+                                gss_info->value);
 
         /* Remember that we're using this request for authentication
            handshake. */
@@ -469,7 +568,39 @@ serf__setup_request_spnego_auth(const serf__authn_scheme_t *scheme,
 
     switch (gss_info->pstate) {
         case pstate_init:
-            /* We shouldn't normally arrive here, do nothing. */
+            if (gss_info->preemptive) {
+                apr_status_t status;
+
+                /* The server is known to require Negotiate authentication,
+                   add an initial token to the first request on this
+                   connection. */
+                serf__log(LOGLVL_DEBUG, LOGCOMP_AUTHN, __FILE__, conn->config,
+                          "Add initial Negotiate header to first request.\n");
+
+                status = do_auth(scheme,
+                                 peer,
+                                 code,
+                                 gss_info,
+                                 conn,
+                                 request,
+                                 0l,    /* no response authn header */
+                                 conn->pool);
+                gss_info->preemptive = 0;
+                if (status)
+                    return status;
+
+                if (gss_info->header && gss_info->value) {
+                    serf_bucket_headers_set(hdrs_bkt, gss_info->header,
+                                            gss_info->value);
+
+                    /* Don't mark the request as part of a handshake: if the
+                       server rejects this token, start a new handshake
+                       instead of failing. */
+                    gss_info->header = NULL;
+                    gss_info->value = NULL;
+                }
+            }
+            /* Otherwise we shouldn't normally arrive here, do nothing. */
             break;
         case pstate_undecided: /* fall through */
             serf__log(LOGLVL_DEBUG, LOGCOMP_AUTHN, __FILE__, conn->config,
@@ -505,8 +636,8 @@ serf__setup_request_spnego_auth(const serf__authn_scheme_t *scheme,
                 if (status)
                     return status;
 
-                serf_bucket_headers_setn(hdrs_bkt, gss_info->header,
-                                         gss_info->value);
+                serf_bucket_headers_set(hdrs_bkt, gss_info->header,
+                                        gss_info->value);
 
                 /* Remember that we're using this request for authentication
                    handshake. */
@@ -627,9 +758,25 @@ serf__validate_response_spnego_auth(const serf__authn_scheme_t *scheme,
     }
 
     if (gss_info->state == gss_api_auth_completed) {
+        gss_server_info_t *server_info = NULL;
+
+        if (peer == HOST)
+            server_info = get_server_info(scheme, conn);
+
         switch(gss_info->pstate) {
             case pstate_init:
                 /* Authentication of the first request is done. */
+                if (server_info) {
+                    server_info->established = 1;
+
+                    /* Another connection found out that the server supports
+                       persistent authentication already. */
+                    if (server_info->pstate == pstate_stateful) {
+                        gss_info->pstate = pstate_stateful;
+                        serf__connection_set_pipelining(conn, 1);
+                        break;
+                    }
+                }
                 gss_info->pstate = pstate_undecided;
                 break;
             case pstate_undecided:
@@ -638,6 +785,8 @@ serf__validate_response_spnego_auth(const serf__authn_scheme_t *scheme,
                    request. That means it supports persistent authentication. */
                 gss_info->pstate = pstate_stateful;
                 serf__connection_set_pipelining(conn, 1);
+                if (server_info)
+                    server_info->pstate = pstate_stateful;
                 break;
             default:
                 /* Nothing to do here. */
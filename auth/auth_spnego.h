@@ -36,13 +36,30 @@ extern "C" {
 #endif
 
 typedef struct serf__spnego_context_t serf__spnego_context_t;
+typedef struct serf__spnego_cred_t serf__spnego_cred_t;
 
 typedef struct serf__spnego_buffer_t {
     apr_size_t length;
     void *value;
 } serf__spnego_buffer_t;
 
-/* Create outbound security context.
+/* Acquire an outbound credentials handle for SCHEME.
+ *
+ * The handle can be shared by all security contexts to the same server, so
+ * the credentials are looked up only once. It will be released automatically
+ * on RESULT_POOL cleanup. CONN is only used for logging.
+ *
+ * All temporary allocations will be performed in SCRATCH_POOL.
+ */
+apr_status_t
+serf__spnego_acquire_cred(serf__spnego_cred_t **cred_p,
+                          serf_connection_t *conn,
+                          const serf__authn_scheme_t *scheme,
+                          apr_pool_t *result_pool,
+                          apr_pool_t *scratch_pool);
+
+/* Create outbound security context, using the credentials handle CRED.
+ * CRED should live at least as long as RESULT_POOL.
  *
  * All temporary allocations will be performed in SCRATCH_POOL, while security
  * context will be allocated in result_pool and will be destroyed automatically
@@ -51,6 +68,7 @@ typedef struct serf__spnego_buffer_t {
  */
 apr_status_t
 serf__spnego_create_sec_context(serf__spnego_context_t **ctx_p,
+                                serf__spnego_cred_t *cred,
                                 const serf__authn_scheme_t *scheme,
                                 apr_pool_t *result_pool,
                                 apr_pool_t *scratch_pool);
@@ -33,11 +33,21 @@ static gss_OID_desc spnego_mech_oid = { 6, "\x2b\x06\x01\x05\x05\x02" };
 #define GSS_SPNEGO_MECHANISM &spnego_mech_oid
 #endif
 
+struct serf__spnego_cred_t
+{
+    /* GSSAPI credentials handle, GSS_C_NO_CREDENTIAL to use the default
+       credentials */
+    gss_cred_id_t gss_cred;
+};
+
 struct serf__spnego_context_t
 {
     /* GSSAPI context */
     gss_ctx_id_t gss_ctx;
 
+    /* Credentials handle, shared with other contexts. */
+    serf__spnego_cred_t *cred;
+
     /* Mechanism used to authenticate. */
     gss_OID gss_mech;
 };
@@ -111,8 +121,69 @@ cleanup_sec_buffer(void *data)
     return APR_SUCCESS;
 }
 
+/* Releases the GSS credentials handle, when the pool used to create it gets
+   cleared or destroyed. */
+static apr_status_t
+cleanup_cred(void *data)
+{
+    serf__spnego_cred_t *cred = data;
+
+    if (cred->gss_cred != GSS_C_NO_CREDENTIAL) {
+        OM_uint32 dummy_stat;
+
+        (void)gss_release_cred(&dummy_stat, &cred->gss_cred);
+        cred->gss_cred = GSS_C_NO_CREDENTIAL;
+    }
+
+    return APR_SUCCESS;
+}
+
+apr_status_t
+serf__spnego_acquire_cred(serf__spnego_cred_t **cred_p,
+                          serf_connection_t *conn,
+                          const serf__authn_scheme_t *scheme,
+                          apr_pool_t *result_pool,
+                          apr_pool_t *scratch_pool)
+{
+    serf__spnego_cred_t *cred;
+    gss_OID_set_desc mechs;
+    OM_uint32 gss_min_stat, gss_maj_stat;
+
+    cred = apr_pcalloc(result_pool, sizeof(*cred));
+    cred->gss_cred = GSS_C_NO_CREDENTIAL;
+
+    mechs.count = 1;
+    mechs.elements = GSS_SPNEGO_MECHANISM;
+
+    gss_maj_stat = gss_acquire_cred(&gss_min_stat,
+                                    GSS_C_NO_NAME,     /* default principal */
+                                    GSS_C_INDEFINITE,
+                                    &mechs,
+                                    GSS_C_INITIATE,
+                                    &cred->gss_cred,
+                                    NULL,              /* actual mechs */
+                                    NULL);             /* time_rec */
+    if (GSS_ERROR(gss_maj_stat)) {
+        /* No ticket yet, fall back to looking up the default credentials
+           for every context, as the user might still run kinit. */
+        serf__log(LOGLVL_DEBUG, LOGCOMP_AUTHN, __FILE__, conn->config,
+                  "No GSS credentials acquired, using the defaults.\n");
+        cred->gss_cred = GSS_C_NO_CREDENTIAL;
+    }
+    else {
+        apr_pool_cleanup_register(result_pool, cred,
+                                  cleanup_cred,
+                                  apr_pool_cleanup_null);
+    }
+
+    *cred_p = cred;
+
+    return APR_SUCCESS;
+}
+
 apr_status_t
 serf__spnego_create_sec_context(serf__spnego_context_t **ctx_p,
+                                serf__spnego_cred_t *cred,
                                 const serf__authn_scheme_t *scheme,
                                 apr_pool_t *result_pool,
                                 apr_pool_t *scratch_pool)
@@ -123,6 +194,7 @@ serf__spnego_create_sec_context(serf__spnego_context_t **ctx_p,
 
     ctx->gss_ctx = GSS_C_NO_CONTEXT;
     ctx->gss_mech = GSS_SPNEGO_MECHANISM;
+    ctx->cred = cred;
 
     apr_pool_cleanup_register(result_pool, ctx,
                               cleanup_ctx,
@@ -192,7 +264,7 @@ serf__spnego_init_sec_context(serf_connection_t *conn,
     /* Establish a security context to the server. */
     gss_maj_stat = gss_init_sec_context
         (&gss_min_stat,             /* minor_status */
-         GSS_C_NO_CREDENTIAL,       /* XXXXX claimant_cred_handle */
+         ctx->cred->gss_cred,       /* claimant_cred_handle */
          &ctx->gss_ctx,              /* gssapi context handle */
          host_gss_name,             /* HTTP@server name */
          ctx->gss_mech,             /* mech_type (SPNEGO) */
@@ -30,9 +30,15 @@
 #define SEC_E_MUTUAL_AUTH_FAILED _HRESULT_TYPEDEF_(0x80090363L)
 #endif
 
-struct serf__spnego_context_t
+struct serf__spnego_cred_t
 {
     CredHandle sspi_credentials;
+};
+
+struct serf__spnego_context_t
+{
+    /* Credentials handle, shared with other contexts. */
+    serf__spnego_cred_t *cred;
     CtxtHandle sspi_context;
     BOOL initalized;
     apr_pool_t *pool;
@@ -95,9 +101,19 @@ cleanup_ctx(void *data)
         SecInvalidateHandle(&ctx->sspi_context);
     }
 
-    if (SecIsValidHandle(&ctx->sspi_credentials)) {
-        FreeCredentialsHandle(&ctx->sspi_credentials);
-        SecInvalidateHandle(&ctx->sspi_credentials);
+    return APR_SUCCESS;
+}
+
+/* Releases the SSPI credentials handle, when the pool used to create it gets
+   cleared or destroyed. */
+static apr_status_t
+cleanup_cred(void *data)
+{
+    serf__spnego_cred_t *cred = data;
+
+    if (SecIsValidHandle(&cred->sspi_credentials)) {
+        FreeCredentialsHandle(&cred->sspi_credentials);
+        SecInvalidateHandle(&cred->sspi_credentials);
     }
 
     return APR_SUCCESS;
@@ -112,29 +128,24 @@ cleanup_sec_buffer(void *data)
 }
 
 apr_status_t
-serf__spnego_create_sec_context(serf__spnego_context_t **ctx_p,
-                                const serf__authn_scheme_t *scheme,
-                                apr_pool_t *result_pool,
-                                apr_pool_t *scratch_pool)
+serf__spnego_acquire_cred(serf__spnego_cred_t **cred_p,
+                          serf_connection_t *conn,
+                          const serf__authn_scheme_t *scheme,
+                          apr_pool_t *result_pool,
+                          apr_pool_t *scratch_pool)
 {
     SECURITY_STATUS sspi_status;
-    serf__spnego_context_t *ctx;
+    serf__spnego_cred_t *cred;
     const char *sspi_package;
 
-    ctx = apr_pcalloc(result_pool, sizeof(*ctx));
-
-    SecInvalidateHandle(&ctx->sspi_context);
-    SecInvalidateHandle(&ctx->sspi_credentials);
-    ctx->initalized = FALSE;
-    ctx->pool = result_pool;
-    ctx->target_name = NULL;
-    ctx->authn_type = scheme->type;
+    cred = apr_pcalloc(result_pool, sizeof(*cred));
+    SecInvalidateHandle(&cred->sspi_credentials);
 
-    apr_pool_cleanup_register(result_pool, ctx,
-                              cleanup_ctx,
+    apr_pool_cleanup_register(result_pool, cred,
+                              cleanup_cred,
                               apr_pool_cleanup_null);
 
-    if (ctx->authn_type == SERF_AUTHN_NEGOTIATE)
+    if (scheme->type == SERF_AUTHN_NEGOTIATE)
         sspi_package = "Negotiate";
     else
         sspi_package = "NTLM";
@@ -142,12 +153,39 @@ serf__spnego_create_sec_context(serf__spnego_context_t **ctx_p,
     sspi_status = AcquireCredentialsHandleA(
         NULL, sspi_package, SECPKG_CRED_OUTBOUND,
         NULL, NULL, NULL, NULL,
-        &ctx->sspi_credentials, NULL);
+        &cred->sspi_credentials, NULL);
 
     if (FAILED(sspi_status)) {
         return map_sspi_status(sspi_status);
     }
 
+    *cred_p = cred;
+
+    return APR_SUCCESS;
+}
+
+apr_status_t
+serf__spnego_create_sec_context(serf__spnego_context_t **ctx_p,
+                                serf__spnego_cred_t *cred,
+                                const serf__authn_scheme_t *scheme,
+                                apr_pool_t *result_pool,
+                                apr_pool_t *scratch_pool)
+{
+    serf__spnego_context_t *ctx;
+
+    ctx = apr_pcalloc(result_pool, sizeof(*ctx));
+
+    SecInvalidateHandle(&ctx->sspi_context);
+    ctx->cred = cred;
+    ctx->initalized = FALSE;
+    ctx->pool = result_pool;
+    ctx->target_name = NULL;
+    ctx->authn_type = scheme->type;
+
+    apr_pool_cleanup_register(result_pool, ctx,
+                              cleanup_ctx,
+                              apr_pool_cleanup_null);
+
     *ctx_p = ctx;
 
     return APR_SUCCESS;
@@ -265,7 +303,7 @@ serf__spnego_init_sec_context(serf_connection_t *conn,
     sspi_out_buffer_desc.ulVersion = SECBUFFER_VERSION;
 
     status = InitializeSecurityContextA(
-        &ctx->sspi_credentials,
+        &ctx->cred->sspi_credentials,
         ctx->initalized ? &ctx->sspi_context : NULL,
         ctx->target_name,
         ISC_REQ_ALLOCATE_MEMORY
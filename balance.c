@@ -0,0 +1,323 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Balancing requests over the addresses of a host.
+
+   A balancer resolves its host and opens connections to every address of
+   the family of the first address, the backends. Every new request goes to
+   the backend with the lowest score: its latency times its nr. of
+   outstanding requests plus one. The latency is an exponentially weighted
+   moving average of the time between writing a request and the start of
+   its response; until a backend has a sample, the connect time of its
+   connection stands in.
+
+   A backend is ejected, i.e. gets no new requests, for EJECT_TIME when its
+   latency is more than EJECT_FACTOR times the average of the others, or
+   when a connection to it can't be made. The last backend is never
+   ejected for its latency. When an ejection ends, the backend starts over
+   with an unknown latency.
+
+   With a proxy all connections go to the proxy, and there's one backend.
+ */
+
+#include <apr_pools.h>
+#include <apr_network_io.h>
+#include <apr_uri.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+/* The weight of a new sample in the latency average: 1/8. */
+#define EWMA_SHIFT 3
+
+#define EJECT_FACTOR 4
+#define EJECT_TIME apr_time_from_sec(30)
+
+struct serf__backend_t {
+    serf_balancer_t *balancer;
+    apr_sockaddr_t *address;
+
+    /* The connections to this backend. */
+    apr_array_header_t *conns;
+
+    /* Average latency, -1 if unknown. */
+    apr_interval_time_t latency;
+
+    /* Time the ejection ends, 0 if not ejected. */
+    apr_time_t ejected_until;
+};
+
+struct serf_balancer_t {
+    serf_context_t *ctx;
+    apr_pool_t *pool;
+
+    /* The backends, serf__backend_t *. */
+    apr_array_header_t *backends;
+};
+
+#define GET_BACKEND(balancer, i) \
+    (((serf__backend_t **)(balancer)->backends->elts)[i])
+#define GET_BACKEND_CONN(backend, i) \
+    (((serf_connection_t **)(backend)->conns->elts)[i])
+
+
+/* Returns the nr. of requests queued on BACKEND. */
+static unsigned int outstanding(serf__backend_t *backend)
+{
+    unsigned int nr = 0;
+    int i;
+
+    for (i = 0; i < backend->conns->nelts; i++) {
+        serf_connection_t *conn = GET_BACKEND_CONN(backend, i);
+
+        nr += conn->written.length + conn->unwritten.length;
+    }
+
+    return nr;
+}
+
+/* Returns the latency of BACKEND, or its best guess. */
+static apr_interval_time_t latency_of(serf__backend_t *backend)
+{
+    int i;
+
+    if (backend->latency >= 0)
+        return backend->latency;
+
+    for (i = 0; i < backend->conns->nelts; i++) {
+        serf_connection_t *conn = GET_BACKEND_CONN(backend, i);
+
+        if (conn->latency >= 0)
+            return conn->latency;
+    }
+
+    /* Unknown, try it. */
+    return 0;
+}
+
+static int is_ejected(serf__backend_t *backend, apr_time_t now)
+{
+    if (!backend->ejected_until)
+        return 0;
+
+    if (backend->ejected_until > now)
+        return 1;
+
+    /* The ejection is over, measure the backend again. */
+    backend->ejected_until = 0;
+    backend->latency = -1;
+
+    return 0;
+}
+
+static void eject(serf__backend_t *backend, const char *reason)
+{
+    serf_connection_t *conn = GET_BACKEND_CONN(backend, 0);
+
+    backend->ejected_until = apr_time_now() + EJECT_TIME;
+
+    serf__log(LOGLVL_INFO, LOGCOMP_CONN, __FILE__, conn->config,
+              "ejected backend 0x%x of %s: %s\n", backend, conn->host_url,
+              reason);
+}
+
+static serf__backend_t *pick_backend(serf_balancer_t *balancer)
+{
+    serf__backend_t *best = NULL, *first_back = NULL;
+    apr_uint64_t best_score = 0;
+    apr_time_t now = apr_time_now();
+    int i;
+
+    for (i = 0; i < balancer->backends->nelts; i++) {
+        serf__backend_t *backend = GET_BACKEND(balancer, i);
+        apr_uint64_t score;
+
+        if (is_ejected(backend, now)) {
+            if (!first_back ||
+                backend->ejected_until < first_back->ejected_until)
+                first_back = backend;
+            continue;
+        }
+
+        score = ((apr_uint64_t)latency_of(backend) + 1) *
+                (outstanding(backend) + 1);
+        if (!best || score < best_score) {
+            best = backend;
+            best_score = score;
+        }
+    }
+
+    /* All ejected, take the one that comes back first. */
+    return best ? best : first_back;
+}
+
+/* Returns the connection of BACKEND with the fewest queued requests. */
+static serf_connection_t *pick_conn(serf__backend_t *backend)
+{
+    serf_connection_t *best = NULL;
+    unsigned int best_nr = 0;
+    int i;
+
+    for (i = 0; i < backend->conns->nelts; i++) {
+        serf_connection_t *conn = GET_BACKEND_CONN(backend, i);
+        unsigned int nr = conn->written.length +
+                          conn->unwritten.length;
+
+        if (!best || nr < best_nr) {
+            best = conn;
+            best_nr = nr;
+        }
+    }
+
+    return best;
+}
+
+void serf__balancer_response_started(serf_request_t *request)
+{
+    serf__backend_t *backend = request->conn->backend;
+    serf_balancer_t *balancer = backend->balancer;
+    apr_interval_time_t sample, others = 0;
+    int i, nr_of_others = 0;
+
+    sample = apr_time_now() - request->written_time;
+
+    if (backend->latency < 0)
+        backend->latency = sample;
+    else
+        backend->latency += (sample - backend->latency) >> EWMA_SHIFT;
+
+    if (backend->ejected_until)
+        return;
+
+    /* Compare with the other backends that get requests. */
+    for (i = 0; i < balancer->backends->nelts; i++) {
+        serf__backend_t *other = GET_BACKEND(balancer, i);
+
+        if (other == backend || other->ejected_until || other->latency < 0)
+            continue;
+        others += other->latency;
+        nr_of_others++;
+    }
+
+    if (nr_of_others &&
+        backend->latency > EJECT_FACTOR * (others / nr_of_others))
+        eject(backend, "slow");
+}
+
+void serf__balancer_conn_failed(serf_connection_t *conn, apr_status_t status)
+{
+    serf__backend_t *backend = conn->backend;
+
+    /* The connection may have moved on to another address already. */
+    if (conn->address != backend->address)
+        return;
+
+    eject(backend, "connect failed");
+}
+
+apr_status_t serf_balancer_create(
+    serf_balancer_t **balancer,
+    serf_context_t *ctx,
+    apr_uri_t host_info,
+    int conns_per_backend,
+    serf_connection_setup_t setup,
+    void *setup_baton,
+    serf_connection_closed_t closed,
+    void *closed_baton,
+    apr_pool_t *pool)
+{
+    serf_balancer_t *b;
+    apr_sockaddr_t *addresses = NULL, *address;
+    apr_status_t status;
+
+    if (conns_per_backend < 1)
+        conns_per_backend = 1;
+
+    /* Set the port number explicitly, needed to create the socket later. */
+    if (!host_info.port) {
+        host_info.port = apr_uri_port_of_scheme(host_info.scheme);
+    }
+
+    if (!ctx->proxy_address) {
+        status = apr_sockaddr_info_get(&addresses, host_info.hostname,
+                                       APR_UNSPEC, host_info.port, 0, pool);
+        if (status)
+            return status;
+    }
+
+    b = apr_pcalloc(pool, sizeof(*b));
+    b->ctx = ctx;
+    b->pool = pool;
+    b->backends = apr_array_make(pool, 4, sizeof(serf__backend_t *));
+
+    /* Without a proxy, a backend for every address of the preferred
+       family. With a proxy, one backend. */
+    address = addresses;
+    do {
+        serf__backend_t *backend;
+        int i;
+
+        if (address && address->family != addresses->family) {
+            address = address->next;
+            continue;
+        }
+
+        backend = apr_pcalloc(pool, sizeof(*backend));
+        backend->balancer = b;
+        backend->address = address;
+        backend->latency = -1;
+        backend->conns = apr_array_make(pool, conns_per_backend,
+                                        sizeof(serf_connection_t *));
+
+        for (i = 0; i < conns_per_backend; i++) {
+            serf_connection_t *conn;
+
+            status = serf__connection_create_at(&conn, ctx, host_info,
+                                                address, setup, setup_baton,
+                                                closed, closed_baton, pool);
+            if (status)
+                return status;
+
+            conn->backend = backend;
+            APR_ARRAY_PUSH(backend->conns, serf_connection_t *) = conn;
+        }
+        APR_ARRAY_PUSH(b->backends, serf__backend_t *) = backend;
+
+        address = address ? address->next : NULL;
+    } while (address);
+
+    *balancer = b;
+
+    return APR_SUCCESS;
+}
+
+serf_request_t *serf_balancer_request_create(
+    serf_balancer_t *balancer,
+    serf_request_setup_t setup,
+    void *setup_baton)
+{
+    serf__backend_t *backend = pick_backend(balancer);
+
+    return serf_connection_request_create(pick_conn(backend), setup,
+                                          setup_baton);
+}
+
+int serf_balancer_get_nr_of_backends(
+    serf_balancer_t *balancer)
+{
+    return balancer->backends->nelts;
+}
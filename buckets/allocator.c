@@ -21,6 +21,7 @@
 
 #include "serf.h"
 #include "serf_bucket_util.h"
+#include "serf_private.h"
 
 
 typedef struct node_header_t {
@@ -95,16 +96,42 @@ struct serf_bucket_alloc_t {
     node_header_t *freelist;    /* free STANDARD_NODE_SIZE blocks */
     apr_memnode_t *blocks;      /* blocks we allocated for subdividing */
 
+    apr_size_t held;            /* bytes taken from the apr_allocator */
+    apr_size_t *total;          /* shared count of HELD, or NULL */
+
     track_state_t *track;
 };
 
 /* ==================================================================== */
 
 
+/* The size of MEMNODE, as taken from the apr_allocator. */
+#define MEMNODE_SIZE(memnode) \
+    ((apr_size_t)((memnode)->endp - (char *)(memnode)))
+
+static void account_alloc(serf_bucket_alloc_t *allocator,
+                          apr_memnode_t *memnode)
+{
+    allocator->held += MEMNODE_SIZE(memnode);
+    if (allocator->total)
+        *allocator->total += MEMNODE_SIZE(memnode);
+}
+
+static void account_free(serf_bucket_alloc_t *allocator,
+                         apr_memnode_t *memnode)
+{
+    allocator->held -= MEMNODE_SIZE(memnode);
+    if (allocator->total)
+        *allocator->total -= MEMNODE_SIZE(memnode);
+}
+
 static apr_status_t allocator_cleanup(void *data)
 {
     serf_bucket_alloc_t *allocator = data;
 
+    if (allocator->total)
+        *allocator->total -= allocator->held;
+
     /* If we allocated anything, give it back. */
     if (allocator->blocks) {
         apr_allocator_free(allocator->allocator, allocator->blocks);
@@ -164,6 +191,13 @@ apr_pool_t *serf_bucket_allocator_get_pool(
     return allocator->pool;
 }
 
+void serf__bucket_allocator_account(serf_bucket_alloc_t *allocator,
+                                    apr_size_t *total)
+{
+    allocator->total = total;
+    *total += allocator->held;
+}
+
 
 void *serf_bucket_mem_alloc(
     serf_bucket_alloc_t *allocator,
@@ -204,6 +238,7 @@ void *serf_bucket_mem_alloc(
                 /* link the block into our tracking list */
                 allocator->blocks = active;
                 active->next = head;
+                account_alloc(allocator, active);
             }
 
             node = (node_header_t *)active->first_avail;
@@ -217,6 +252,7 @@ void *serf_bucket_mem_alloc(
 
         if (memnode == NULL)
             return NULL;
+        account_alloc(allocator, memnode);
 
         node = (node_header_t *)memnode->first_avail;
         node->u.memnode = memnode;
@@ -271,11 +307,115 @@ void serf_bucket_mem_free(
 #endif
 
         /* now free it */
+        account_free(allocator, node->u.memnode);
         apr_allocator_free(allocator->allocator, node->u.memnode);
     }
 }
 
 
+/* A block of an allocator, and whether all of its nodes are free. */
+typedef struct trim_block_t {
+    apr_memnode_t *block;
+    apr_size_t nr_free;
+    int unused;
+} trim_block_t;
+
+static int trim_block_cmp(const void *a, const void *b)
+{
+    const char *x = (const char *)((const trim_block_t *)a)->block;
+    const char *y = (const char *)((const trim_block_t *)b)->block;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Returns the block of BLOCKS, sorted by address, that holds ADDR. */
+static trim_block_t *find_trim_block(trim_block_t *blocks,
+                                     apr_size_t nr_blocks,
+                                     const void *addr)
+{
+    apr_size_t lo = 0, hi = nr_blocks;
+
+    while (hi - lo > 1) {
+        apr_size_t mid = lo + (hi - lo) / 2;
+
+        if ((const char *)blocks[mid].block <= (const char *)addr)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return &blocks[lo];
+}
+
+void serf_bucket_allocator_trim(
+    serf_bucket_alloc_t *allocator)
+{
+    apr_memnode_t *scratch, *block, **prev;
+    trim_block_t *blocks;
+    apr_size_t nr_blocks = 0, i;
+    node_header_t *node, **link;
+
+    for (block = allocator->blocks; block; block = block->next)
+        nr_blocks++;
+    if (!nr_blocks)
+        return;
+
+    /* Sort the blocks by address, so the block of each node on the
+       freelist can be found without walking them all. */
+    scratch = apr_allocator_alloc(allocator->allocator,
+                                  nr_blocks * sizeof(*blocks));
+    if (scratch == NULL)
+        return;
+    blocks = (trim_block_t *)scratch->first_avail;
+
+    for (block = allocator->blocks, i = 0; block; block = block->next, i++) {
+        blocks[i].block = block;
+        blocks[i].nr_free = 0;
+    }
+    qsort(blocks, nr_blocks, sizeof(*blocks), trim_block_cmp);
+
+    /* Count the nodes of each block that are on the freelist. */
+    for (node = allocator->freelist; node; node = node->u.next)
+        find_trim_block(blocks, nr_blocks, node)->nr_free++;
+
+    for (i = 0; i < nr_blocks; i++) {
+        char *begin = (char *)blocks[i].block + APR_MEMNODE_T_SIZE;
+        apr_size_t nr_used = (blocks[i].block->first_avail - begin) /
+                             STANDARD_NODE_SIZE;
+
+        blocks[i].unused = (blocks[i].nr_free == nr_used);
+    }
+
+    /* Unlink the nodes of the unused blocks from the freelist. */
+    link = &allocator->freelist;
+    while (*link) {
+        if (find_trim_block(blocks, nr_blocks, *link)->unused)
+            *link = (*link)->u.next;
+        else
+            link = &(*link)->u.next;
+    }
+
+    /* And give those blocks back, keeping the order of the others: new
+       nodes are taken from the first one. */
+    prev = &allocator->blocks;
+    while (*prev) {
+        block = *prev;
+
+        if (!find_trim_block(blocks, nr_blocks, block)->unused) {
+            /* Still in use. */
+            prev = &block->next;
+            continue;
+        }
+
+        *prev = block->next;
+        block->next = NULL;
+        account_free(allocator, block);
+        apr_allocator_free(allocator->allocator, block);
+    }
+
+    apr_allocator_free(allocator->allocator, scratch);
+}
+
+
 /* ==================================================================== */
 
 
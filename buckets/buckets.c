@@ -586,3 +586,116 @@ apr_status_t serf_linebuf_fetch(
     }
     /* NOTREACHED */
 }
+
+
+void serf__linebuf_init(serf__linebuf_t *linebuf)
+{
+    linebuf->state = SERF_LINEBUF_EMPTY;
+    linebuf->used = 0;
+    linebuf->line = "";
+    linebuf->buf = NULL;
+}
+
+void serf__linebuf_destroy(serf__linebuf_t *linebuf,
+                           serf_bucket_alloc_t *allocator)
+{
+    if (linebuf->buf) {
+        serf_bucket_mem_free(allocator, linebuf->buf);
+        linebuf->buf = NULL;
+    }
+}
+
+apr_status_t serf__linebuf_fetch(serf__linebuf_t *linebuf,
+                                 serf_bucket_t *bucket,
+                                 int acceptable,
+                                 serf_bucket_alloc_t *allocator)
+{
+    /* If we had a complete line, then assume the caller has used it. The
+     * buffer isn't needed until a line spans reads again.
+     */
+    if (linebuf->state == SERF_LINEBUF_READY) {
+        linebuf->state = SERF_LINEBUF_EMPTY;
+        linebuf->used = 0;
+        linebuf->line = "";
+        serf__linebuf_destroy(linebuf, allocator);
+    }
+
+    while (1) {
+        apr_status_t status;
+        const char *data;
+        apr_size_t len;
+
+        if (linebuf->state == SERF_LINEBUF_CRLF_SPLIT) {
+            /* See serf_linebuf_fetch. The line is in our buffer already,
+             * as peeking may invalidate the data of the bucket.
+             */
+            status = serf_bucket_peek(bucket, &data, &len);
+            if (SERF_BUCKET_READ_ERROR(status))
+                return status;
+
+            if (len > 0) {
+                if (*data == '\n') {
+                    /* ### check status */
+                    (void) serf_bucket_read(bucket, 1, &data, &len);
+                }
+                linebuf->state = SERF_LINEBUF_READY;
+            } else {
+                /* no data available, try again later. */
+                return APR_EAGAIN;
+            }
+        }
+        else {
+            int found;
+
+            status = serf_bucket_readline(bucket, acceptable, &found,
+                                          &data, &len);
+            if (SERF_BUCKET_READ_ERROR(status)) {
+                return status;
+            }
+            if (APR_STATUS_IS_EOF(status) && len == 0) {
+                return status;
+            }
+            if (linebuf->used + len + 1 > SERF_LINEBUF_LIMIT) {
+                return SERF_ERROR_LINE_TOO_LONG;
+            }
+
+            if (found == SERF_NEWLINE_NONE) {
+                linebuf->state = SERF_LINEBUF_PARTIAL;
+            }
+            else if (found == SERF_NEWLINE_CRLF_SPLIT) {
+                linebuf->state = SERF_LINEBUF_CRLF_SPLIT;
+
+                /* Toss the partial CR. We won't ever need it. */
+                if (len > 0)
+                    --len;
+            }
+            else {
+                len -= 1 + (found == SERF_NEWLINE_CRLF);
+
+                linebuf->state = SERF_LINEBUF_READY;
+            }
+
+            if (linebuf->state == SERF_LINEBUF_READY && !linebuf->buf) {
+                /* The whole line was read at once, use it where it is. */
+                linebuf->line = data;
+                linebuf->used = len;
+            }
+            else {
+                /* The line spans reads, collect it in our buffer. */
+                if (!linebuf->buf) {
+                    linebuf->buf = serf_bucket_mem_alloc(allocator,
+                                                         SERF_LINEBUF_LIMIT);
+                    linebuf->line = linebuf->buf;
+                }
+                if (len > 0)
+                    memcpy(&linebuf->buf[linebuf->used], data, len);
+                linebuf->used += len;
+                linebuf->buf[linebuf->used] = '\0';
+            }
+        }
+
+        if (status || linebuf->state == SERF_LINEBUF_READY)
+            return status;
+    }
+    /* NOTREACHED */
+}
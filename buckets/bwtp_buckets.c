@@ -21,6 +21,7 @@
 #include "serf.h"
 #include "serf_bucket_util.h"
 #include "serf_bucket_types.h"
+#include "serf_private.h"
 
 #include <stdlib.h>
 
@@ -52,7 +53,7 @@ typedef struct incoming_context_t {
     } state;
 
     /* Buffer for accumulating a line from the response. */
-    serf_linebuf_t linebuf;
+    serf__linebuf_t linebuf;
 
     int type; /* 0 = header, 1 = message */ /* TODO enum? */
     int channel;
@@ -325,7 +326,7 @@ serf_bucket_t *serf_bucket_bwtp_incoming_frame_create(
     ctx->channel = -1;
     ctx->phrase = NULL;
 
-    serf_linebuf_init(&ctx->linebuf);
+    serf__linebuf_init(&ctx->linebuf);
 
     return serf_bucket_create(&serf_bucket_type_bwtp_incoming_frame, allocator, ctx);
 }
@@ -342,39 +343,48 @@ static void bwtp_incoming_destroy_and_data(serf_bucket_t *bucket)
     if (ctx->body != NULL)
         serf_bucket_destroy(ctx->body);
     serf_bucket_destroy(ctx->headers);
+    serf__linebuf_destroy(&ctx->linebuf, bucket->allocator);
 
     serf_default_destroy_and_data(bucket);
 }
 
-static apr_status_t fetch_line(incoming_context_t *ctx, int acceptable)
+static apr_status_t fetch_line(serf_bucket_t *bkt, incoming_context_t *ctx,
+                               int acceptable)
 {
-    return serf_linebuf_fetch(&ctx->linebuf, ctx->stream, acceptable);
+    return serf__linebuf_fetch(&ctx->linebuf, ctx->stream, acceptable,
+                               bkt->allocator);
 }
 
 static apr_status_t parse_status_line(incoming_context_t *ctx,
                                       serf_bucket_alloc_t *allocator)
 {
     int res;
+    char *line;
     char *reason; /* ### stupid APR interface makes this non-const */
 
-    /* ctx->linebuf.line should be of form: BW* */
-    res = apr_date_checkmask(ctx->linebuf.line, "BW*");
+    /* The numbers are parsed with apr_strtoi64, which needs a NUL
+       terminated line. */
+    line = serf_bstrmemdup(allocator, ctx->linebuf.line, ctx->linebuf.used);
+
+    /* line should be of form: BW* */
+    res = apr_date_checkmask(line, "BW*");
     if (!res) {
         /* Not an BWTP response?  Well, at least we won't understand it. */
+        serf_bucket_mem_free(allocator, line);
         return APR_EGENERAL;
     }
 
-    if (ctx->linebuf.line[2] == 'H') {
+    if (line[2] == 'H') {
         ctx->type = 0;
     }
-    else if (ctx->linebuf.line[2] == 'M') {
+    else if (line[2] == 'M') {
         ctx->type = 1;
     }
     else {
         ctx->type = -1;
     }
 
-    ctx->channel = apr_strtoi64(ctx->linebuf.line + 3, &reason, 16);
+    ctx->channel = apr_strtoi64(line + 3, &reason, 16);
 
     /* Skip leading spaces for the reason string. */
     if (apr_isspace(*reason)) {
@@ -384,18 +394,19 @@ static apr_status_t parse_status_line(incoming_context_t *ctx,
     ctx->length = apr_strtoi64(reason, &reason, 16);
 
     /* Skip leading spaces for the reason string. */
-    if (reason - ctx->linebuf.line < ctx->linebuf.used) {
+    if (reason - line < ctx->linebuf.used) {
         if (apr_isspace(*reason)) {
             reason++;
         }
 
         ctx->phrase = serf_bstrmemdup(allocator, reason,
-                                      ctx->linebuf.used
-                                      - (reason - ctx->linebuf.line));
+                                      ctx->linebuf.used - (reason - line));
     } else {
         ctx->phrase = NULL;
     }
 
+    serf_bucket_mem_free(allocator, line);
+
     return APR_SUCCESS;
 }
 
@@ -407,7 +418,7 @@ static apr_status_t fetch_headers(serf_bucket_t *bkt, incoming_context_t *ctx)
     /* RFC 2616 says that CRLF is the only line ending, but we can easily
      * accept any kind of line ending.
      */
-    status = fetch_line(ctx, SERF_NEWLINE_ANY);
+    status = fetch_line(bkt, ctx, SERF_NEWLINE_ANY);
     if (SERF_BUCKET_READ_ERROR(status)) {
         return status;
     }
@@ -424,7 +435,7 @@ static apr_status_t fetch_headers(serf_bucket_t *bkt, incoming_context_t *ctx)
         }
 
         /* Skip over initial : and spaces. */
-        while (apr_isspace(*++c))
+        while (++c < ctx->linebuf.line + ctx->linebuf.used && apr_isspace(*c))
             continue;
 
         /* Always copy the headers (from the linebuf into new mem). */
@@ -455,7 +466,7 @@ static apr_status_t run_machine(serf_bucket_t *bkt, incoming_context_t *ctx)
         /* RFC 2616 says that CRLF is the only line ending, but we can easily
          * accept any kind of line ending.
          */
-        status = fetch_line(ctx, SERF_NEWLINE_ANY);
+        status = fetch_line(bkt, ctx, SERF_NEWLINE_ANY);
         if (SERF_BUCKET_READ_ERROR(status))
             return status;
 
@@ -17,6 +17,7 @@
 
 #include "serf.h"
 #include "serf_bucket_util.h"
+#include "serf_private.h"
 
 typedef struct dechunk_context_t {
     serf_bucket_t *stream;
@@ -32,7 +33,7 @@ typedef struct dechunk_context_t {
     apr_int64_t body_left;
 
     /* Buffer for accumulating a chunk size. */
-    serf_linebuf_t linebuf;
+    serf__linebuf_t linebuf;
 } dechunk_context_t;
 
 
@@ -46,7 +47,7 @@ serf_bucket_t *serf_bucket_dechunk_create(
     ctx->stream = stream;
     ctx->state = STATE_SIZE;
 
-    serf_linebuf_init(&ctx->linebuf);
+    serf__linebuf_init(&ctx->linebuf);
 
     return serf_bucket_create(&serf_bucket_type_dechunk, allocator, ctx);
 }
@@ -56,6 +57,7 @@ static void serf_dechunk_destroy_and_data(serf_bucket_t *bucket)
     dechunk_context_t *ctx = bucket->data;
 
     serf_bucket_destroy(ctx->stream);
+    serf__linebuf_destroy(&ctx->linebuf, bucket->allocator);
 
     serf_default_destroy_and_data(bucket);
 }
@@ -72,21 +74,29 @@ static apr_status_t serf_dechunk_read(serf_bucket_t *bucket,
         case STATE_SIZE:
 
             /* fetch a line terminated by CRLF */
-            status = serf_linebuf_fetch(&ctx->linebuf, ctx->stream,
-                                        SERF_NEWLINE_CRLF);
+            status = serf__linebuf_fetch(&ctx->linebuf, ctx->stream,
+                                         SERF_NEWLINE_CRLF, bucket->allocator);
             if (SERF_BUCKET_READ_ERROR(status))
                 return status;
 
             /* if a line was read, then parse it. */
             if (ctx->linebuf.state == SERF_LINEBUF_READY) {
-                /* NUL-terminate the line. if it filled the entire buffer,
-                   then just assume the thing is too large. */
-                if (ctx->linebuf.used == sizeof(ctx->linebuf.line))
+                char size[32];
+                apr_size_t len = ctx->linebuf.used;
+
+                /* NUL-terminate a copy of the line, the chunk size and
+                   maybe the start of an extension. If the size doesn't
+                   fit, then just assume the thing is too large. */
+                if (len >= sizeof(size))
+                    len = sizeof(size) - 1;
+                memcpy(size, ctx->linebuf.line, len);
+                size[len] = '\0';
+                if (len == sizeof(size) - 1 &&
+                    strspn(size, "0123456789abcdefABCDEF") == len)
                     return APR_FROM_OS_ERROR(ERANGE);
-                ctx->linebuf.line[ctx->linebuf.used] = '\0';
 
                 /* convert from HEX digits. */
-                ctx->body_left = apr_strtoi64(ctx->linebuf.line, NULL, 16);
+                ctx->body_left = apr_strtoi64(size, NULL, 16);
                 if (errno == ERANGE) {
                     return APR_FROM_OS_ERROR(ERANGE);
                 }
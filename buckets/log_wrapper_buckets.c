@@ -22,8 +22,10 @@
 
 typedef struct log_wrapped_context_t {
     const serf_bucket_type_t *old_type;
-    const char *prefix;
+    const char *prefix;         /* NULL if only tapping, not logging */
     serf_config_t *config;
+    serf__bucket_tap_t tap;
+    void *tap_baton;
 } log_wrapped_context_t;
 
 /* Extended serf_bucket_t. */
@@ -48,6 +50,11 @@ serf_log_wrapped_readline(serf_bucket_t *bucket,
     apr_status_t status = ctx->old_type->readline(bucket, acceptable, found,
                                                   data, len);
 
+    if (ctx->tap && *len)
+        ctx->tap(ctx->tap_baton, *data, *len);
+    if (!ctx->prefix)
+        return status;
+
     if (SERF_BUCKET_READ_ERROR(status))
         serf__log(LOGLVL_ERROR, LOGCOMP_CONN, ctx->prefix, ctx->config,
                   "Error %d while reading.\n", status);
@@ -77,6 +84,14 @@ serf_log_wrapped_read_iovec(serf_bucket_t *bucket,
     apr_status_t status = ctx->old_type->read_iovec(bucket, requested, vecs_size,
                                                     vecs, vecs_used);
 
+    if (ctx->tap) {
+        for (i = 0; i < *vecs_used; i++)
+            if (vecs[i].iov_len)
+                ctx->tap(ctx->tap_baton, vecs[i].iov_base, vecs[i].iov_len);
+    }
+    if (!ctx->prefix)
+        return status;
+
     if (SERF_BUCKET_READ_ERROR(status))
         serf__log(LOGLVL_ERROR, LOGCOMP_CONN, ctx->prefix, ctx->config,
                   "Error %d while reading.\n", status);
@@ -104,6 +119,11 @@ serf_log_wrapped_read(serf_bucket_t *bucket, apr_size_t requested,
 
     apr_status_t status = ctx->old_type->read(bucket, requested, data, len);
 
+    if (ctx->tap && *len)
+        ctx->tap(ctx->tap_baton, *data, *len);
+    if (!ctx->prefix)
+        return status;
+
     if (SERF_BUCKET_READ_ERROR(status))
         serf__log(LOGLVL_ERROR, LOGCOMP_CONN, ctx->prefix, ctx->config,
                   "Error %d while reading.\n", status);
@@ -122,9 +142,12 @@ static void serf_log_wrapped_destroy(serf_bucket_t *bucket)
 {
     serf_log_wrapped_bucket_t *lwbkt = (serf_log_wrapped_bucket_t *)bucket;
     const serf_bucket_type_t *bkt_type = lwbkt->more_data->old_type;
+    serf_bucket_alloc_t *allocator = bucket->allocator;
+    void *wrapper_type = (void *)bucket->type;
 
-    serf_bucket_mem_free(bucket->allocator, lwbkt->more_data);
+    serf_bucket_mem_free(allocator, lwbkt->more_data);
     bkt_type->destroy(bucket);
+    serf_bucket_mem_free(allocator, wrapper_type);
 }
 
 static apr_status_t serf_log_wrapped_set_config(serf_bucket_t *bucket,
@@ -138,11 +161,12 @@ static apr_status_t serf_log_wrapped_set_config(serf_bucket_t *bucket,
     return ctx->old_type->set_config(bucket, config);
 }
 
-serf_bucket_t *serf__bucket_log_wrapper_create(serf_bucket_t *wrapped,
-                                               const char *prefix,
-                                               serf_bucket_alloc_t *alloc)
+static serf_bucket_t *wrap_bucket(serf_bucket_t *wrapped,
+                                  const char *prefix,
+                                  serf__bucket_tap_t tap,
+                                  void *tap_baton,
+                                  serf_bucket_alloc_t *alloc)
 {
-#ifdef SERF_LOGGING_ENABLED
     serf_log_wrapped_bucket_t *bkt = serf_bucket_mem_alloc(alloc, sizeof(*bkt));
     log_wrapped_context_t *ctx = serf_bucket_mem_alloc(alloc, sizeof(*ctx));
     serf_bucket_type_t *bkt_type = serf_bucket_mem_alloc(alloc, sizeof(*bkt_type));
@@ -168,6 +192,8 @@ serf_bucket_t *serf__bucket_log_wrapper_create(serf_bucket_t *wrapped,
     ctx->old_type = wrapped->type;
     ctx->prefix = prefix;
     ctx->config = NULL;
+    ctx->tap = tap;
+    ctx->tap_baton = tap_baton;
 
     /* Construct the new extended bucket. */
     bkt->wrapped_bkt.type = bkt_type;
@@ -180,7 +206,33 @@ serf_bucket_t *serf__bucket_log_wrapper_create(serf_bucket_t *wrapped,
     serf_default_destroy(wrapped);
 
     return (serf_bucket_t *)bkt;
+}
+
+serf_bucket_t *serf__bucket_log_wrapper_create(serf_bucket_t *wrapped,
+                                               const char *prefix,
+                                               serf_bucket_alloc_t *alloc)
+{
+#ifdef SERF_LOGGING_ENABLED
+    return wrap_bucket(wrapped, prefix, NULL, NULL, alloc);
 #else
     return wrapped;
 #endif
 }
+
+serf_bucket_t *serf__bucket_tap_create(serf_bucket_t *wrapped,
+                                       serf__bucket_tap_t tap,
+                                       void *tap_baton,
+                                       serf_bucket_alloc_t *alloc)
+{
+    /* Wrapping a wrapped bucket doesn't work, both would use the same
+       more_data. If the bucket is already logged, tap into that wrapper. */
+    if (wrapped->type->read == serf_log_wrapped_read) {
+        serf_log_wrapped_bucket_t *lwbkt = (serf_log_wrapped_bucket_t *)wrapped;
+
+        lwbkt->more_data->tap = tap;
+        lwbkt->more_data->tap_baton = tap_baton;
+        return wrapped;
+    }
+
+    return wrap_bucket(wrapped, NULL, tap, tap_baton, alloc);
+}
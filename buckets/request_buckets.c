@@ -18,6 +18,7 @@
 
 #include "serf.h"
 #include "serf_bucket_util.h"
+#include "serf_private.h"
 
 
 typedef struct request_context_t {
@@ -87,6 +88,27 @@ void serf_bucket_request_set_root(
                         NULL);
 }
 
+serf_bucket_t *serf__bucket_request_swap_body(serf_bucket_t *bucket,
+                                              serf_bucket_t *body)
+{
+    request_context_t *ctx = (request_context_t *)bucket->data;
+    serf_bucket_t *old_body = ctx->body;
+
+    ctx->body = body;
+
+    return old_body;
+}
+
+void serf__bucket_request_get_line(serf_bucket_t *bucket,
+                                   const char **method,
+                                   const char **uri)
+{
+    request_context_t *ctx = (request_context_t *)bucket->data;
+
+    *method = ctx->method;
+    *uri = ctx->uri;
+}
+
 static void serialize_data(serf_bucket_t *bucket)
 {
     request_context_t *ctx = bucket->data;
@@ -42,7 +42,7 @@ typedef struct response_context_t {
     serf_config_t *config;
 
     /* Buffer for accumulating a line from the response. */
-    serf_linebuf_t linebuf;
+    serf__linebuf_t linebuf;
 
     /* Error status that will be returned instead of APR_EOF when the response
        body was read completely. */
@@ -90,7 +90,7 @@ serf_bucket_t *serf_bucket_response_create(
     ctx->error_on_eof = 0;
     ctx->config = NULL;
 
-    serf_linebuf_init(&ctx->linebuf);
+    serf__linebuf_init(&ctx->linebuf);
 
     return serf_bucket_create(&serf_bucket_type_response, allocator, ctx);
 }
@@ -122,13 +122,16 @@ static void serf_response_destroy_and_data(serf_bucket_t *bucket)
     if (ctx->body != NULL)
         serf_bucket_destroy(ctx->body);
     serf_bucket_destroy(ctx->headers);
+    serf__linebuf_destroy(&ctx->linebuf, bucket->allocator);
 
     serf_default_destroy_and_data(bucket);
 }
 
-static apr_status_t fetch_line(response_context_t *ctx, int acceptable)
+static apr_status_t fetch_line(serf_bucket_t *bkt, response_context_t *ctx,
+                               int acceptable)
 {
-    return serf_linebuf_fetch(&ctx->linebuf, ctx->stream, acceptable);
+    return serf__linebuf_fetch(&ctx->linebuf, ctx->stream, acceptable,
+                               bkt->allocator);
 }
 
 static apr_status_t parse_status_line(response_context_t *ctx,
@@ -136,11 +139,13 @@ static apr_status_t parse_status_line(response_context_t *ctx,
 {
     int res;
     char *reason; /* ### stupid APR interface makes this non-const */
+    const char *end = ctx->linebuf.line + ctx->linebuf.used;
 
     /* ctx->linebuf.line should be of form: 'HTTP/1.1 200 OK',
        but we also explicitly allow the forms 'HTTP/1.1 200' (no reason)
        and 'HTTP/1.1 401.1 Logon failed' (iis extended error codes)
-       NOTE: Since r2465 linebuf.line is always NUL terminated string. */
+       NOTE: linebuf.line isn't NUL terminated, but followed by a newline
+       or a NUL, neither of which can match the mask or a status code. */
     res = apr_date_checkmask(ctx->linebuf.line, "HTTP/#.# ###*");
     if (!res) {
         /* Not an HTTP response?  Well, at least we won't understand it. */
@@ -154,7 +159,7 @@ static apr_status_t parse_status_line(response_context_t *ctx,
         return SERF_ERROR_BAD_HTTP_RESPONSE;
 
     /* Skip leading spaces for the reason string. */
-    while (apr_isspace(*reason)) {
+    while (reason < end && apr_isspace(*reason)) {
         reason++;
     }
 
@@ -174,7 +179,7 @@ static apr_status_t fetch_headers(serf_bucket_t *bkt, response_context_t *ctx)
     /* RFC 2616 says that CRLF is the only line ending, but we can easily
      * accept any kind of line ending.
      */
-    status = fetch_line(ctx, SERF_NEWLINE_ANY);
+    status = fetch_line(bkt, ctx, SERF_NEWLINE_ANY);
     /* Convert generic 'line too long' error to specific one. */
     if (status == SERF_ERROR_LINE_TOO_LONG) {
         return SERF_ERROR_RESPONSE_HEADER_TOO_LONG;
@@ -233,7 +238,7 @@ static apr_status_t run_machine(serf_bucket_t *bkt, response_context_t *ctx)
         /* RFC 2616 says that CRLF is the only line ending, but we can easily
          * accept any kind of line ending.
          */
-        status = fetch_line(ctx, SERF_NEWLINE_ANY);
+        status = fetch_line(bkt, ctx, SERF_NEWLINE_ANY);
 
         /* Convert generic 'line too long' error to specific one. */
         if (status == SERF_ERROR_LINE_TOO_LONG)
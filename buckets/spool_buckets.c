@@ -0,0 +1,425 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <apr_pools.h>
+#include <apr_file_io.h>
+#include <apr_strings.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+/* The spooled data is kept in memory blocks of this size, until the memory
+   size of the spool is reached. */
+#define SPOOL_BLOCK_SIZE 8192
+
+typedef struct spool_block_t {
+    struct spool_block_t *next;
+    apr_size_t len;
+    char data[SPOOL_BLOCK_SIZE];
+} spool_block_t;
+
+struct serf_spool_t {
+    apr_pool_t *pool;
+
+    /* The source of the data, NULL once it was destroyed. SOURCE_STATUS is
+       the last status it returned. */
+    serf_bucket_t *source;
+    apr_status_t source_status;
+
+    /* The first MEM_LEN bytes are in the memory blocks, the next FILE_LEN
+       bytes in a temporary file. */
+    apr_size_t memory_size;
+    spool_block_t *first;
+    spool_block_t *last;
+    apr_size_t mem_len;
+    apr_file_t *file;
+    apr_off_t file_len;
+};
+
+typedef struct spool_context_t {
+    serf_spool_t *spool;
+
+    /* The read position in the spooled data. BLOCK and BLOCK_OFFSET are
+       the memory block and the position in it for read position BLOCK_POS,
+       which falls behind OFFSET when the source is read. */
+    apr_off_t offset;
+    spool_block_t *block;
+    apr_size_t block_offset;
+    apr_off_t block_pos;
+
+    /* Buffer for data read from the spool file, allocated when needed. */
+    char *buf;
+    serf_bucket_alloc_t *allocator;
+} spool_context_t;
+
+#define SPOOL_LEN(spool) ((apr_off_t)(spool)->mem_len + (spool)->file_len)
+
+
+/* Destroys the source of SPOOL, if it wasn't read completely. */
+static apr_status_t cleanup_spool(void *baton)
+{
+    serf_spool_t *spool = baton;
+
+    if (spool->source) {
+        serf_bucket_destroy(spool->source);
+        spool->source = NULL;
+    }
+
+    return APR_SUCCESS;
+}
+
+serf_spool_t *serf_spool_create(
+    serf_bucket_t *source,
+    apr_size_t memory_size,
+    apr_pool_t *pool)
+{
+    serf_spool_t *spool = apr_pcalloc(pool, sizeof(*spool));
+
+    spool->pool = pool;
+    spool->source = source;
+    spool->memory_size = memory_size;
+
+    apr_pool_cleanup_register(pool, spool, cleanup_spool,
+                              apr_pool_cleanup_null);
+
+    return spool;
+}
+
+/* Append DATA to the spool: to memory while it fits, then to the file. */
+static apr_status_t spool_append(serf_spool_t *spool,
+                                 const char *data, apr_size_t len)
+{
+    apr_status_t status;
+
+    while (len && !spool->file && spool->mem_len < spool->memory_size) {
+        spool_block_t *block = spool->last;
+        apr_size_t chunk;
+
+        if (!block || block->len == SPOOL_BLOCK_SIZE) {
+            block = apr_palloc(spool->pool, sizeof(*block));
+            block->next = NULL;
+            block->len = 0;
+            if (spool->last)
+                spool->last->next = block;
+            else
+                spool->first = block;
+            spool->last = block;
+        }
+
+        chunk = SPOOL_BLOCK_SIZE - block->len;
+        if (chunk > spool->memory_size - spool->mem_len)
+            chunk = spool->memory_size - spool->mem_len;
+        if (chunk > len)
+            chunk = len;
+
+        memcpy(block->data + block->len, data, chunk);
+        block->len += chunk;
+        spool->mem_len += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+
+    if (!len)
+        return APR_SUCCESS;
+
+    if (!spool->file) {
+        const char *temp_dir;
+        char *path;
+
+        status = apr_temp_dir_get(&temp_dir, spool->pool);
+        if (status)
+            return status;
+
+        path = apr_pstrcat(spool->pool, temp_dir, "/serf-spool-XXXXXX",
+                           NULL);
+        status = apr_file_mktemp(&spool->file, path,
+                                 APR_CREATE | APR_READ | APR_WRITE |
+                                 APR_EXCL | APR_DELONCLOSE | APR_BINARY,
+                                 spool->pool);
+        if (status)
+            return status;
+    }
+    else {
+        apr_off_t offset = spool->file_len;
+
+        /* Readers move the file position. */
+        status = apr_file_seek(spool->file, APR_SET, &offset);
+        if (status)
+            return status;
+    }
+
+    status = apr_file_write_full(spool->file, data, len, NULL);
+    if (status)
+        return status;
+    spool->file_len += len;
+
+    return APR_SUCCESS;
+}
+
+/* Return the status for a read that ends at the read position of CTX. */
+static apr_status_t spool_status(spool_context_t *ctx)
+{
+    serf_spool_t *spool = ctx->spool;
+
+    if (ctx->offset == SPOOL_LEN(spool) &&
+        APR_STATUS_IS_EOF(spool->source_status))
+        return APR_EOF;
+
+    return APR_SUCCESS;
+}
+
+/* Get the spooled data at the read position of CTX, without consuming it.
+   The read position must be before the end of the spooled data. */
+static apr_status_t get_spooled(spool_context_t *ctx, apr_size_t requested,
+                                const char **data, apr_size_t *len)
+{
+    serf_spool_t *spool = ctx->spool;
+    apr_status_t status;
+    apr_off_t offset;
+
+    if (ctx->offset < (apr_off_t)spool->mem_len) {
+        if (!ctx->block || ctx->block_pos != ctx->offset ||
+            ctx->block_offset == ctx->block->len) {
+            spool_block_t *block = spool->first;
+            apr_off_t start = 0;
+
+            /* Continue from the last known block, the read position only
+               moves forward. */
+            if (ctx->block) {
+                block = ctx->block;
+                start = ctx->block_pos - ctx->block_offset;
+            }
+            while (ctx->offset - start >= (apr_off_t)block->len) {
+                start += block->len;
+                block = block->next;
+            }
+            ctx->block = block;
+            ctx->block_offset = (apr_size_t)(ctx->offset - start);
+            ctx->block_pos = ctx->offset;
+        }
+
+        *data = ctx->block->data + ctx->block_offset;
+        *len = ctx->block->len - ctx->block_offset;
+        if (requested < *len)
+            *len = requested;
+
+        return APR_SUCCESS;
+    }
+
+    if (!ctx->buf) {
+        ctx->buf = serf_bucket_mem_alloc(ctx->allocator, SERF_DATABUF_BUFSIZE);
+    }
+
+    offset = ctx->offset - spool->mem_len;
+    status = apr_file_seek(spool->file, APR_SET, &offset);
+    if (status)
+        return status;
+
+    *len = SERF_DATABUF_BUFSIZE;
+    if (requested < *len)
+        *len = requested;
+    if (SPOOL_LEN(spool) - ctx->offset < (apr_off_t)*len)
+        *len = (apr_size_t)(SPOOL_LEN(spool) - ctx->offset);
+
+    status = apr_file_read_full(spool->file, ctx->buf, *len, len);
+    if (status)
+        return status;
+    *data = ctx->buf;
+
+    return APR_SUCCESS;
+}
+
+static void consume_spooled(spool_context_t *ctx, apr_size_t len)
+{
+    if (ctx->offset < (apr_off_t)ctx->spool->mem_len) {
+        ctx->block_offset += len;
+        ctx->block_pos += len;
+    }
+    ctx->offset += len;
+}
+
+serf_bucket_t *serf_bucket_spool_create(
+    serf_spool_t *spool,
+    serf_bucket_alloc_t *allocator)
+{
+    spool_context_t *ctx;
+
+    ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
+    ctx->spool = spool;
+    ctx->offset = 0;
+    ctx->block = NULL;
+    ctx->block_offset = 0;
+    ctx->block_pos = 0;
+    ctx->buf = NULL;
+    ctx->allocator = allocator;
+
+    return serf_bucket_create(&serf_bucket_type_spool, allocator, ctx);
+}
+
+/* Read from the source of the spool, and spool the data read.
+
+   The source is destroyed as soon as it returns APR_EOF, the data it
+   returned then is gone with it. In that case *LEN is set to 0 and
+   APR_SUCCESS is returned, with the data left to read from the spool. */
+static apr_status_t read_source(spool_context_t *ctx, int readline,
+                                apr_size_t requested, int acceptable,
+                                int *found, const char **data,
+                                apr_size_t *len)
+{
+    serf_spool_t *spool = ctx->spool;
+    apr_status_t status;
+
+    if (!spool->source) {
+        *len = 0;
+        return spool->source_status;
+    }
+
+    if (readline)
+        status = serf_bucket_readline(spool->source, acceptable, found,
+                                      data, len);
+    else
+        status = serf_bucket_read(spool->source, requested, data, len);
+
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+    spool->source_status = status;
+
+    if (*len) {
+        apr_status_t spool_status = spool_append(spool, *data, *len);
+        if (spool_status)
+            return spool_status;
+    }
+
+    if (APR_STATUS_IS_EOF(status)) {
+        serf_bucket_destroy(spool->source);
+        spool->source = NULL;
+
+        if (*len) {
+            *len = 0;
+            return APR_SUCCESS;
+        }
+        return status;
+    }
+    ctx->offset += *len;
+
+    return status;
+}
+
+static apr_status_t serf_spool_read(serf_bucket_t *bucket,
+                                    apr_size_t requested,
+                                    const char **data, apr_size_t *len)
+{
+    spool_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    if (ctx->offset == SPOOL_LEN(ctx->spool)) {
+        status = read_source(ctx, 0, requested, 0, NULL, data, len);
+        if (status || ctx->offset == SPOOL_LEN(ctx->spool))
+            return status;
+    }
+
+    status = get_spooled(ctx, requested, data, len);
+    if (status)
+        return status;
+    consume_spooled(ctx, *len);
+
+    return spool_status(ctx);
+}
+
+static apr_status_t serf_spool_readline(serf_bucket_t *bucket,
+                                        int acceptable, int *found,
+                                        const char **data, apr_size_t *len)
+{
+    spool_context_t *ctx = bucket->data;
+    const char *start;
+    apr_size_t avail;
+    apr_status_t status;
+
+    if (ctx->offset == SPOOL_LEN(ctx->spool)) {
+        status = read_source(ctx, 1, 0, acceptable, found, data, len);
+        if (status || ctx->offset == SPOOL_LEN(ctx->spool))
+            return status;
+    }
+
+    status = get_spooled(ctx, SERF_READ_ALL_AVAIL, &start, &avail);
+    if (status)
+        return status;
+
+    *data = start;
+    serf_util_readline(data, &avail, acceptable, found);
+    *len = *data - start;
+    *data = start;
+    consume_spooled(ctx, *len);
+
+    return spool_status(ctx);
+}
+
+static apr_status_t serf_spool_peek(serf_bucket_t *bucket,
+                                    const char **data,
+                                    apr_size_t *len)
+{
+    spool_context_t *ctx = bucket->data;
+    serf_spool_t *spool = ctx->spool;
+    apr_status_t status;
+
+    if (ctx->offset == SPOOL_LEN(spool)) {
+        if (!spool->source) {
+            *len = 0;
+            return spool->source_status;
+        }
+        return serf_bucket_peek(spool->source, data, len);
+    }
+
+    /* Only data in memory can be peeked at without reading. */
+    if (ctx->offset >= (apr_off_t)spool->mem_len) {
+        *len = 0;
+        return APR_SUCCESS;
+    }
+
+    status = get_spooled(ctx, SERF_READ_ALL_AVAIL, data, len);
+    if (status)
+        return status;
+
+    if (ctx->offset + *len == SPOOL_LEN(spool) &&
+        APR_STATUS_IS_EOF(spool->source_status))
+        return APR_EOF;
+
+    return APR_SUCCESS;
+}
+
+static void serf_spool_destroy(serf_bucket_t *bucket)
+{
+    spool_context_t *ctx = bucket->data;
+
+    if (ctx->buf)
+        serf_bucket_mem_free(bucket->allocator, ctx->buf);
+
+    serf_default_destroy_and_data(bucket);
+}
+
+const serf_bucket_type_t serf_bucket_type_spool = {
+    "SPOOL",
+    serf_spool_read,
+    serf_spool_readline,
+    serf_default_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_buckets_are_v2,
+    serf_spool_peek,
+    serf_spool_destroy,
+    serf_default_read_bucket,
+    serf_default_ignore_config,
+};
@@ -116,8 +116,12 @@ typedef struct bucket_list {
 } bucket_list_t;
 
 typedef struct serf_ssl_stream_t {
-    /* Helper to read data. Wraps stream. */
-    serf_databuf_t databuf;
+    /* Helper to read data. Wraps stream. Allocated on first use, NULL
+       after serf_ssl_release_buffers() released it. */
+    serf_databuf_t *databuf;
+
+    /* The reader of DATABUF. */
+    serf_databuf_reader_t read;
 
     /* Our source for more data. */
     serf_bucket_t *stream;
@@ -191,8 +195,8 @@ typedef struct ssl_context_t {
     /* The bucket-independent ssl context that this bucket is associated with */
     serf_ssl_context_t *ssl_ctx;
 
-    /* Pointer to the 'right' databuf. */
-    serf_databuf_t *databuf;
+    /* Pointer to the 'right' stream, encrypt or decrypt. */
+    serf_ssl_stream_t *ssl_stream;
 
     /* Pointer to our stream, so we can find it later. */
     serf_bucket_t **our_stream;
@@ -1513,14 +1517,12 @@ static serf_ssl_context_t *ssl_init_context(serf_bucket_alloc_t *allocator)
     ssl_ctx->encrypt.stream = NULL;
     ssl_ctx->encrypt.stream_next = NULL;
     ssl_ctx->encrypt_pending = serf_bucket_aggregate_create(allocator);
-    serf_databuf_init(&ssl_ctx->encrypt.databuf);
-    ssl_ctx->encrypt.databuf.read = ssl_encrypt;
-    ssl_ctx->encrypt.databuf.read_baton = ssl_ctx;
+    ssl_ctx->encrypt.databuf = NULL;
+    ssl_ctx->encrypt.read = ssl_encrypt;
 
     ssl_ctx->decrypt.stream = NULL;
-    serf_databuf_init(&ssl_ctx->decrypt.databuf);
-    ssl_ctx->decrypt.databuf.read = ssl_decrypt;
-    ssl_ctx->decrypt.databuf.read_baton = ssl_ctx;
+    ssl_ctx->decrypt.databuf = NULL;
+    ssl_ctx->decrypt.read = ssl_decrypt;
 
     ssl_ctx->crypt_status = APR_SUCCESS;
     ssl_ctx->want_read = FALSE;
@@ -1536,6 +1538,11 @@ static apr_status_t ssl_free_context(
         serf_bucket_destroy(ssl_ctx->encrypt_pending);
     }
 
+    if (ssl_ctx->encrypt.databuf)
+        serf_bucket_mem_free(ssl_ctx->allocator, ssl_ctx->encrypt.databuf);
+    if (ssl_ctx->decrypt.databuf)
+        serf_bucket_mem_free(ssl_ctx->allocator, ssl_ctx->decrypt.databuf);
+
     /* SSL_free implicitly frees the underlying BIO. */
     SSL_free(ssl_ctx->ssl);
     SSL_CTX_free(ssl_ctx->ctx);
@@ -1720,7 +1727,7 @@ serf_bucket_t *serf_bucket_ssl_decrypt_create(
 
     ctx = bkt->data;
 
-    ctx->databuf = &ctx->ssl_ctx->decrypt.databuf;
+    ctx->ssl_stream = &ctx->ssl_ctx->decrypt;
     if (ctx->ssl_ctx->decrypt.stream != NULL) {
         return NULL;
     }
@@ -1752,7 +1759,7 @@ serf_bucket_t *serf_bucket_ssl_encrypt_create(
 
     ctx = bkt->data;
 
-    ctx->databuf = &ctx->ssl_ctx->encrypt.databuf;
+    ctx->ssl_stream = &ctx->ssl_ctx->encrypt;
     ctx->our_stream = &ctx->ssl_ctx->encrypt.stream;
     if (ctx->ssl_ctx->encrypt.stream == NULL) {
         serf_bucket_t *tmp = serf_bucket_aggregate_create(stream->allocator);
@@ -2071,7 +2078,8 @@ static void serf_ssl_encrypt_destroy_and_data(serf_bucket_t *bucket)
 
         /* Reset our status and databuf. */
         ssl_ctx->crypt_status = APR_SUCCESS;
-        ssl_ctx->encrypt.databuf.status = APR_SUCCESS;
+        if (ssl_ctx->encrypt.databuf)
+            ssl_ctx->encrypt.databuf->status = APR_SUCCESS;
 
         /* Advance to the next stream - if we have one. */
         if (ssl_ctx->encrypt.stream_next == NULL) {
@@ -2096,13 +2104,58 @@ static void serf_ssl_encrypt_destroy_and_data(serf_bucket_t *bucket)
     serf_ssl_destroy_and_data(bucket);
 }
 
+/* Returns the databuf of the stream of CTX, (re)allocating it if needed. */
+static serf_databuf_t *get_databuf(ssl_context_t *ctx)
+{
+    serf_ssl_stream_t *ssl_stream = ctx->ssl_stream;
+
+    if (!ssl_stream->databuf) {
+        ssl_stream->databuf = serf_bucket_mem_alloc(
+                                  ctx->ssl_ctx->allocator,
+                                  sizeof(*ssl_stream->databuf));
+        serf_databuf_init(ssl_stream->databuf);
+        ssl_stream->databuf->read = ssl_stream->read;
+        ssl_stream->databuf->read_baton = ctx->ssl_ctx;
+    }
+
+    return ssl_stream->databuf;
+}
+
+/* Frees the databuf of SSL_STREAM if it holds nothing worth keeping. */
+static void release_databuf(serf_ssl_context_t *ssl_ctx,
+                            serf_ssl_stream_t *ssl_stream)
+{
+    serf_databuf_t *databuf = ssl_stream->databuf;
+
+    /* A fresh databuf behaves the same as an empty one that can still be
+       read from, but not as one that hit EOF or an error. */
+    if (!databuf || databuf->remaining ||
+        (databuf->status && !APR_STATUS_IS_EAGAIN(databuf->status)))
+        return;
+
+    serf_bucket_mem_free(ssl_ctx->allocator, databuf);
+    ssl_stream->databuf = NULL;
+}
+
+void serf_ssl_release_buffers(serf_ssl_context_t *ssl_ctx)
+{
+    release_databuf(ssl_ctx, &ssl_ctx->encrypt);
+    release_databuf(ssl_ctx, &ssl_ctx->decrypt);
+
+#ifdef SSL_MODE_RELEASE_BUFFERS
+    /* From now on OpenSSL frees its record buffers whenever they are
+       empty. */
+    SSL_set_mode(ssl_ctx->ssl, SSL_MODE_RELEASE_BUFFERS);
+#endif
+}
+
 static apr_status_t serf_ssl_read(serf_bucket_t *bucket,
                                   apr_size_t requested,
                                   const char **data, apr_size_t *len)
 {
     ssl_context_t *ctx = bucket->data;
 
-    return serf_databuf_read(ctx->databuf, requested, data, len);
+    return serf_databuf_read(get_databuf(ctx), requested, data, len);
 }
 
 static apr_status_t serf_ssl_readline(serf_bucket_t *bucket,
@@ -2112,7 +2165,8 @@ static apr_status_t serf_ssl_readline(serf_bucket_t *bucket,
 {
     ssl_context_t *ctx = bucket->data;
 
-    return serf_databuf_readline(ctx->databuf, acceptable, found, data, len);
+    return serf_databuf_readline(get_databuf(ctx), acceptable, found, data,
+                                 len);
 }
 
 static apr_status_t serf_ssl_peek(serf_bucket_t *bucket,
@@ -2121,7 +2175,7 @@ static apr_status_t serf_ssl_peek(serf_bucket_t *bucket,
 {
     ssl_context_t *ctx = bucket->data;
 
-    return serf_databuf_peek(ctx->databuf, data, len);
+    return serf_databuf_peek(get_databuf(ctx), data, len);
 }
 
 static apr_status_t serf_ssl_set_config(serf_bucket_t *bucket,
@@ -0,0 +1,108 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Memory budget of a context.
+
+   The bucket allocators of all connections, of their requests and of
+   coalesced request groups count the memory they take from APR in
+   ctx->mem_used. Before every run of the context loop the total is
+   compared with the budget. Over the budget, the idle memory of the
+   connections is trimmed; if that doesn't bring it under, the context
+   goes over budget: connections start no new requests. Below RESUME_LEVEL
+   the context continues as before.
+
+   Requests that were partly written are finished, and the responses of
+   written requests are still read, which frees their buckets. Priority
+   requests and tunnel CONNECTs are still sent, the requests that hold
+   memory may be waiting for them.
+ */
+
+#include <apr_pools.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+/* Resume at 7/8 of the budget, so the context doesn't flip state on
+   every allocation. */
+#define RESUME_LEVEL(budget) ((budget) - (budget) / 8)
+
+/* Update the pollsets of all connections of CTX, for reading and writing
+   new requests. */
+static void set_over_budget(serf_context_t *ctx, int over_budget)
+{
+    int i;
+
+    ctx->over_budget = over_budget;
+
+    for (i = 0; i < ctx->conns->nelts; i++) {
+        serf_connection_t *conn = GET_CONN(ctx, i);
+
+        conn->dirty_conn = 1;
+    }
+    ctx->dirty_pollset = 1;
+
+    serf__log(LOGLVL_INFO, LOGCOMP_CONN, __FILE__, ctx->config,
+              "%s memory budget of %" APR_SIZE_T_FMT " bytes, %"
+              APR_SIZE_T_FMT " bytes used\n",
+              over_budget ? "over" : "back under", ctx->mem_budget,
+              ctx->mem_used);
+
+    if (ctx->pressure_func)
+        ctx->pressure_func(ctx->pressure_baton, over_budget, ctx->mem_used);
+}
+
+void serf__budget_check(serf_context_t *ctx)
+{
+    int i;
+
+    if (!ctx->mem_budget) {
+        if (ctx->over_budget)
+            set_over_budget(ctx, 0);
+        return;
+    }
+
+    if (ctx->over_budget) {
+        if (ctx->mem_used < RESUME_LEVEL(ctx->mem_budget))
+            set_over_budget(ctx, 0);
+        return;
+    }
+
+    if (ctx->mem_used <= ctx->mem_budget)
+        return;
+
+    /* Give back what isn't used before holding anything back. */
+    for (i = 0; i < ctx->conns->nelts; i++)
+        serf_connection_trim(GET_CONN(ctx, i));
+
+    if (ctx->mem_used > ctx->mem_budget)
+        set_over_budget(ctx, 1);
+}
+
+void serf_context_set_memory_budget(serf_context_t *ctx,
+                                    apr_size_t budget,
+                                    serf_memory_pressure_t pressure_func,
+                                    void *pressure_baton)
+{
+    ctx->mem_budget = budget;
+    ctx->pressure_func = pressure_func;
+    ctx->pressure_baton = pressure_baton;
+}
+
+apr_size_t serf_context_get_memory_used(serf_context_t *ctx)
+{
+    return ctx->mem_used;
+}
@@ -0,0 +1,600 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Response cache.
+
+   A private cache (RFC 7234) for the GET requests of a context. Every
+   cached response is a file in the cache directory, named after the MD5 of
+   the request's url. The file holds the response as received: status line,
+   headers and body, including its transfer and content encoding. The time
+   the response was stored is the file's modification time.
+
+   A cached response is served to the application by passing a stream over
+   the mmap'ed file to the request's acceptor, so the response bucket parses
+   it like any response from the network, without copying the body.
+
+   The new requests of a connection are looked up before the connection is
+   opened, see serf__process_cached_requests:
+   - a fresh response is delivered without sending the request;
+   - for a stale response with an ETag or Last-Modified header the request
+     is made conditional (If-None-Match, If-Modified-Since). A 304 Not
+     Modified answer renews the stored response, which is then delivered;
+   - other responses to cacheable requests are stored, via a tap on the
+     connection's response stream.
+   A successful request with an unsafe method (POST, PUT, DELETE, ...)
+   removes the cached response of its url, RFC 7234 4.4.
+
+   Not supported: Vary, and merging the headers of a 304 into the stored
+   response.
+ */
+
+#include <string.h>
+
+#include <apr_pools.h>
+#include <apr_file_io.h>
+#include <apr_file_info.h>
+#include <apr_mmap.h>
+#include <apr_md5.h>
+#include <apr_date.h>
+#include <apr_strings.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+struct serf__cache_t {
+    const char *dir;
+};
+
+struct serf__cache_req_t {
+    /* The file of the cached response. */
+    const char *path;
+
+    /* The opened cached response, if any. */
+    apr_file_t *file;
+#if APR_HAS_MMAP
+    apr_mmap_t *mmap;
+#endif
+
+    /* The stream the cached response is delivered from. */
+    serf_bucket_t *stream;
+
+    /* Set while a conditional request for a stale response is pending. */
+    int revalidating;
+
+    /* Set if a successful response removes the cached response, for
+       requests with an unsafe method. */
+    int invalidating;
+
+    /* Set if the response should be stored, STORE is the temporary file it
+       is written to. */
+    int storing;
+    apr_file_t *store;
+    char *store_path;
+};
+
+/* Returns 1 if the Cache-Control header value CC has DIRECTIVE. If VALUE
+   isn't NULL, its argument is stored there (-1 if it has none). */
+static int cc_directive(const char *cc, const char *directive,
+                        apr_int64_t *value)
+{
+    apr_size_t len = strlen(directive);
+
+    while (cc && *cc) {
+        while (*cc == ' ' || *cc == '\t' || *cc == ',')
+            cc++;
+
+        if (strncasecmp(cc, directive, len) == 0 &&
+            (cc[len] == '\0' || cc[len] == ',' || cc[len] == '=' ||
+             cc[len] == ' ' || cc[len] == '\t')) {
+            if (value) {
+                cc += len;
+                while (*cc == ' ' || *cc == '\t')
+                    cc++;
+                if (*cc == '=') {
+                    cc++;
+                    if (*cc == '"')
+                        cc++;
+                    *value = apr_atoi64(cc);
+                }
+                else {
+                    *value = -1;
+                }
+            }
+            return 1;
+        }
+
+        cc = strchr(cc, ',');
+    }
+
+    return 0;
+}
+
+/* Returns how long the response with headers HDRS is fresh. */
+static apr_interval_time_t freshness_lifetime(serf_bucket_t *hdrs)
+{
+    const char *cc = serf_bucket_headers_get(hdrs, "Cache-Control");
+    const char *expires = serf_bucket_headers_get(hdrs, "Expires");
+    const char *last_modified = serf_bucket_headers_get(hdrs,
+                                                        "Last-Modified");
+    apr_time_t date = apr_date_parse_http(serf_bucket_headers_get(hdrs,
+                                                                  "Date"));
+    apr_int64_t max_age;
+
+    if (cc_directive(cc, "no-cache", NULL))
+        return 0;
+
+    if (cc_directive(cc, "max-age", &max_age))
+        return max_age > 0 ? apr_time_from_sec(max_age) : 0;
+
+    if (expires) {
+        apr_time_t expires_time = apr_date_parse_http(expires);
+
+        if (!date || expires_time <= date)
+            return 0;
+        return expires_time - date;
+    }
+
+    /* Heuristic freshness, 10% of the time since the last modification. */
+    if (last_modified && date) {
+        apr_time_t lm = apr_date_parse_http(last_modified);
+
+        if (lm && lm < date)
+            return (date - lm) / 10;
+    }
+
+    return 0;
+}
+
+/* Returns non-zero if METHOD is safe, RFC 7231 4.2.1. */
+static int is_safe_method(const char *method)
+{
+    return strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0 ||
+           strcmp(method, "OPTIONS") == 0 || strcmp(method, "TRACE") == 0;
+}
+
+/* Returns the file of the cached response for URL. */
+static const char *entry_path(serf__cache_t *cache, const char *url,
+                              apr_pool_t *pool)
+{
+    unsigned char digest[APR_MD5_DIGESTSIZE];
+    char hex[APR_MD5_DIGESTSIZE * 2 + 1];
+    int i;
+
+    apr_md5(digest, url, strlen(url));
+    for (i = 0; i < APR_MD5_DIGESTSIZE; i++)
+        apr_snprintf(hex + i * 2, 3, "%02x", digest[i]);
+
+    return apr_pstrcat(pool, cache->dir, "/", hex, NULL);
+}
+
+
+/* Returns a new stream over the opened cached response of RC. */
+static serf_bucket_t *entry_stream(serf__cache_req_t *rc,
+                                   serf_bucket_alloc_t *allocator)
+{
+    apr_off_t offset = 0;
+
+#if APR_HAS_MMAP
+    if (rc->mmap)
+        return serf_bucket_mmap_create(rc->mmap, allocator);
+#endif
+
+    apr_file_seek(rc->file, APR_SET, &offset);
+    return serf_bucket_file_create(rc->file, allocator);
+}
+
+/* Read the status line and headers of RESP, a response read from memory or
+   from a file. */
+static apr_status_t read_headers(serf_bucket_t *resp)
+{
+    apr_status_t status;
+
+    status = serf_bucket_response_wait_for_headers(resp);
+
+    /* The response bucket can reach the body and report the status of the
+       last read at the same time, ask again. */
+    if (APR_STATUS_IS_EOF(status) || APR_STATUS_IS_EAGAIN(status))
+        status = serf_bucket_response_wait_for_headers(resp);
+
+    return status;
+}
+
+/* Open the cached response of REQUEST. Returns in *RESP a response bucket
+   over it, of which the headers are read, and in *STORED the time the
+   response was stored. */
+static apr_status_t open_entry(serf_request_t *request,
+                               serf_bucket_t **resp,
+                               apr_time_t *stored)
+{
+    serf__cache_req_t *rc = request->cache;
+    apr_finfo_t finfo;
+    apr_status_t status;
+
+    status = apr_file_open(&rc->file, rc->path, APR_READ | APR_BINARY,
+                           APR_OS_DEFAULT, request->respool);
+    if (status)
+        return status;
+
+    status = apr_file_info_get(&finfo, APR_FINFO_SIZE | APR_FINFO_MTIME,
+                               rc->file);
+    if (status)
+        return status;
+    *stored = finfo.mtime;
+
+#if APR_HAS_MMAP
+    if (finfo.size > 0 &&
+        apr_mmap_create(&rc->mmap, rc->file, 0, (apr_size_t)finfo.size,
+                        APR_MMAP_READ, request->respool) != APR_SUCCESS)
+        rc->mmap = NULL;
+#endif
+
+    *resp = serf_bucket_response_create(entry_stream(rc, request->allocator),
+                                        request->allocator);
+
+    status = read_headers(*resp);
+    if (status) {
+        serf_bucket_destroy(*resp);
+        *resp = NULL;
+        return SERF_BUCKET_READ_ERROR(status) ? status : APR_EGENERAL;
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Forget the cached response opened for RC. */
+static void close_entry(serf__cache_req_t *rc)
+{
+#if APR_HAS_MMAP
+    if (rc->mmap) {
+        apr_mmap_delete(rc->mmap);
+        rc->mmap = NULL;
+    }
+#endif
+    if (rc->file) {
+        apr_file_close(rc->file);
+        rc->file = NULL;
+    }
+}
+
+/* Stop storing the response of RC, and remove what was stored so far. */
+static void discard_store(serf__cache_req_t *rc, apr_pool_t *pool)
+{
+    rc->storing = 0;
+
+    if (rc->store) {
+        apr_file_close(rc->store);
+        rc->store = NULL;
+    }
+    if (rc->store_path) {
+        apr_file_remove(rc->store_path, pool);
+        rc->store_path = NULL;
+    }
+}
+
+/* Returns non-zero if the response with status CODE and headers HDRS may be
+   stored, and can be used later. */
+static int is_storable(int code, serf_bucket_t *hdrs)
+{
+    const char *cc = serf_bucket_headers_get(hdrs, "Cache-Control");
+    int explicit_freshness;
+
+    if (cc_directive(cc, "no-store", NULL) ||
+        serf_bucket_headers_get(hdrs, "Vary"))
+        return 0;
+
+    explicit_freshness = cc_directive(cc, "max-age", NULL) ||
+                         serf_bucket_headers_get(hdrs, "Expires");
+
+    /* Only final responses that stand for the resource itself: never 1xx,
+       nor 206 or 304, which would replace a stored full response. Codes
+       that aren't cacheable by default only with explicit freshness, see
+       RFC 7231 6.1. */
+    switch (code) {
+      case 200: case 203: case 204: case 300: case 301: case 308: case 404:
+      case 405: case 410: case 414: case 501:
+        break;
+      case 302: case 307:
+        if (!explicit_freshness)
+            return 0;
+        break;
+      default:
+        return 0;
+    }
+
+    /* Useless if it can't be fresh, nor be revalidated. */
+    return freshness_lifetime(hdrs) > 0 ||
+           serf_bucket_headers_get(hdrs, "ETag") ||
+           serf_bucket_headers_get(hdrs, "Last-Modified");
+}
+
+/* Tap on the response stream of a connection, stores the data of the
+   response that is being read if needed. */
+static void cache_response_data(void *baton, const char *data,
+                                apr_size_t len)
+{
+    serf_connection_t *conn = baton;
+    serf_request_t *request = conn->written.head;
+    serf__cache_req_t *rc;
+    apr_status_t status;
+
+    if (!request)
+        request = conn->unwritten.head;
+    if (!request || !request->cache || !request->cache->storing)
+        return;
+    rc = request->cache;
+
+    if (!rc->store) {
+        rc->store_path = apr_pstrcat(request->respool,
+                                     conn->ctx->cache->dir, "/.XXXXXX",
+                                     NULL);
+        status = apr_file_mktemp(&rc->store, rc->store_path,
+                                 APR_CREATE | APR_WRITE | APR_EXCL |
+                                 APR_BINARY, request->respool);
+        if (status) {
+            rc->store = NULL;
+            rc->store_path = NULL;
+            rc->storing = 0;
+            return;
+        }
+    }
+
+    status = apr_file_write_full(rc->store, data, len, NULL);
+    if (status)
+        discard_store(rc, request->respool);
+}
+
+void serf__cache_conn_setup(serf_connection_t *conn)
+{
+    serf_bucket_t *agg;
+
+    if (!conn->ctx->cache)
+        return;
+
+    /* The stream can be tapped by the traffic capture already, tap an
+       aggregate around it. */
+    agg = serf_bucket_aggregate_create(conn->allocator);
+    serf_bucket_aggregate_append(agg, conn->stream);
+    conn->stream = serf__bucket_tap_create(agg, cache_response_data, conn,
+                                           conn->allocator);
+}
+
+apr_status_t serf__cache_lookup(serf_request_t *request, int *fresh)
+{
+    serf_connection_t *conn = request->conn;
+    serf__cache_req_t *rc;
+    serf_bucket_t *req_hdrs, *resp, *hdrs;
+    const char *method, *uri, *cc, *pragma, *age, *etag, *last_modified;
+    apr_int64_t max_age;
+    apr_interval_time_t current_age;
+    apr_time_t stored;
+    int revalidate;
+
+    *fresh = 0;
+
+    rc = apr_pcalloc(request->respool, sizeof(*rc));
+    request->cache = rc;
+
+    /* Only GET requests made with a request bucket are cached. */
+    if (request->ssltunnel || !request->req_bkt ||
+        !SERF_BUCKET_IS_REQUEST(request->req_bkt))
+        return APR_SUCCESS;
+
+    serf__bucket_request_get_line(request->req_bkt, &method, &uri);
+    if (uri[0] == '/')
+        uri = apr_pstrcat(request->respool, conn->host_url, uri, NULL);
+
+    if (!is_safe_method(method)) {
+        rc->path = entry_path(conn->ctx->cache, uri, request->respool);
+        rc->invalidating = 1;
+        return APR_SUCCESS;
+    }
+    if (strcmp(method, "GET") != 0)
+        return APR_SUCCESS;
+
+    req_hdrs = serf_bucket_request_get_headers(request->req_bkt);
+    cc = serf_bucket_headers_get(req_hdrs, "Cache-Control");
+    if (cc_directive(cc, "no-store", NULL) ||
+        serf_bucket_headers_get(req_hdrs, "Range"))
+        return APR_SUCCESS;
+
+    rc->path = entry_path(conn->ctx->cache, uri, request->respool);
+    rc->storing = 1;
+
+    if (open_entry(request, &resp, &stored) != APR_SUCCESS) {
+        /* Not cached, or not readable. */
+        close_entry(rc);
+        return APR_SUCCESS;
+    }
+    hdrs = serf_bucket_response_get_headers(resp);
+
+    pragma = serf_bucket_headers_get(req_hdrs, "Pragma");
+    revalidate = cc_directive(cc, "no-cache", NULL) ||
+                 (cc_directive(cc, "max-age", &max_age) && max_age == 0) ||
+                 (!cc && cc_directive(pragma, "no-cache", NULL));
+
+    current_age = apr_time_now() - stored;
+    if (current_age < 0)
+        current_age = 0;
+    age = serf_bucket_headers_get(hdrs, "Age");
+    if (age)
+        current_age += apr_time_from_sec(apr_atoi64(age));
+
+    if (!revalidate && current_age < freshness_lifetime(hdrs)) {
+        serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+                  "response for %s served from cache\n", uri);
+        serf_bucket_destroy(resp);
+        rc->storing = 0;
+        *fresh = 1;
+        return APR_SUCCESS;
+    }
+
+    /* Stale. Ask the server if it's still valid, unless the application
+       sent a conditional request itself. */
+    etag = serf_bucket_headers_get(hdrs, "ETag");
+    last_modified = serf_bucket_headers_get(hdrs, "Last-Modified");
+    if ((etag || last_modified) &&
+        !serf_bucket_headers_get(req_hdrs, "If-None-Match") &&
+        !serf_bucket_headers_get(req_hdrs, "If-Modified-Since")) {
+        if (etag)
+            serf_bucket_headers_set(req_hdrs, "If-None-Match", etag);
+        if (last_modified)
+            serf_bucket_headers_set(req_hdrs, "If-Modified-Since",
+                                    last_modified);
+        rc->revalidating = 1;
+    }
+    else {
+        close_entry(rc);
+    }
+    serf_bucket_destroy(resp);
+
+    return APR_SUCCESS;
+}
+
+serf_bucket_t *serf__cache_get_stream(serf_request_t *request)
+{
+    serf__cache_req_t *rc = request->cache;
+
+    if (!rc->stream)
+        rc->stream = entry_stream(rc, request->allocator);
+
+    return rc->stream;
+}
+
+apr_status_t serf__cache_not_modified(serf_request_t *request,
+                                      int *not_modified)
+{
+    serf__cache_req_t *rc = request->cache;
+    serf_status_line sl;
+    apr_status_t status;
+
+    *not_modified = 0;
+
+    if (!rc || !rc->revalidating)
+        return APR_SUCCESS;
+
+    /* Can't look into the application's own bucket types, handle it as a
+       new response. */
+    if (!SERF_BUCKET_IS_RESPONSE(request->resp_bkt)) {
+        rc->revalidating = 0;
+        close_entry(rc);
+        return APR_SUCCESS;
+    }
+
+    status = serf_bucket_response_status(request->resp_bkt, &sl);
+    if (!sl.version)
+        return status ? status : APR_EAGAIN;
+
+    if (sl.code != 304) {
+        /* A new response, which replaces the cached one. */
+        rc->revalidating = 0;
+        close_entry(rc);
+        return APR_SUCCESS;
+    }
+
+    /* Read the rest of the 304, it has no body. */
+    do {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_bucket_read(request->resp_bkt, SERF_READ_ALL_AVAIL,
+                                  &data, &len);
+    } while (!status);
+    if (!APR_STATUS_IS_EOF(status))
+        return status;
+
+    rc->revalidating = 0;
+    discard_store(rc, request->respool);
+
+    /* The cached response is fresh again. */
+    (void)apr_file_mtime_set(rc->path, apr_time_now(), request->respool);
+    *not_modified = 1;
+
+    return APR_SUCCESS;
+}
+
+void serf__cache_response_done(serf_request_t *request)
+{
+    serf__cache_req_t *rc = request->cache;
+    serf_status_line sl;
+
+    if (!rc)
+        return;
+
+    if (rc->invalidating) {
+        /* Only an error response leaves the cached response alone. */
+        if (!SERF_BUCKET_IS_RESPONSE(request->resp_bkt) ||
+            serf_bucket_response_status(request->resp_bkt,
+                                        &sl) != APR_SUCCESS ||
+            sl.code < 400)
+            (void)apr_file_remove(rc->path, request->respool);
+        rc->invalidating = 0;
+        return;
+    }
+
+    if (!rc->store)
+        return;
+
+    if (SERF_BUCKET_IS_RESPONSE(request->resp_bkt) &&
+        serf_bucket_response_status(request->resp_bkt, &sl) == APR_SUCCESS &&
+        is_storable(sl.code,
+                    serf_bucket_response_get_headers(request->resp_bkt))) {
+        apr_file_close(rc->store);
+        rc->store = NULL;
+        if (apr_file_rename(rc->store_path, rc->path,
+                            request->respool) == APR_SUCCESS)
+            rc->store_path = NULL;
+    }
+
+    discard_store(rc, request->respool);
+}
+
+void serf__cache_request_done(serf_request_t *request)
+{
+    serf__cache_req_t *rc = request->cache;
+
+    if (!rc)
+        return;
+
+    if (rc->stream) {
+        serf_bucket_destroy(rc->stream);
+        rc->stream = NULL;
+    }
+    close_entry(rc);
+    discard_store(rc, request->respool);
+}
+
+apr_status_t serf_context_set_response_cache(serf_context_t *ctx,
+                                             const char *directory)
+{
+    serf__cache_t *cache;
+    apr_status_t status;
+
+    if (!directory) {
+        ctx->cache = NULL;
+        return APR_SUCCESS;
+    }
+
+    status = apr_dir_make_recursive(directory, APR_OS_DEFAULT, ctx->pool);
+    if (status)
+        return status;
+
+    cache = apr_pcalloc(ctx->pool, sizeof(*cache));
+    cache->dir = apr_pstrdup(ctx->pool, directory);
+    ctx->cache = cache;
+
+    return APR_SUCCESS;
+}
@@ -0,0 +1,256 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Traffic capture.
+
+   Records the shape of the traffic of a context: for every request the
+   method, uri, header and body sizes of request and response, the status
+   and the time the request was created. The contents of headers and bodies
+   are not stored. The data is gathered with taps on the request buckets and
+   on the connection's response stream, so with https the plaintext above
+   the SSL layer is measured.
+
+   Capture file format, one record per line, fields separated by a space:
+
+     conn offset latency method uri req_hdr req_body status resp_hdr resp_body
+
+   conn is a sequence number per transport connection, offset is the time
+   in usec the request was created relative to the start of the capture and
+   latency the time in usec until its response was read completely. Lines
+   starting with '#' are comments.
+
+   test/serf_replay.c replays a capture file against a local server.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr_pools.h>
+#include <apr_file_io.h>
+#include <apr_strings.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+#define CAPTURE_HEADER "# serf traffic capture 1\n" \
+    "# conn offset latency method uri req_hdr req_body " \
+    "status resp_hdr resp_body\n"
+
+struct serf__capture_t {
+    apr_file_t *file;
+    apr_time_t start;
+    unsigned int nr_of_conns;
+};
+
+/* Counts the bytes of one HTTP message, request or response. */
+typedef struct capture_msg_t {
+    char line[1024];        /* the first line, possibly truncated */
+    apr_size_t line_len;
+    int line_done;
+    int newlines;           /* nr of consecutive newlines seen */
+    int headers_done;
+    apr_size_t hdr_len;     /* status/request line and headers */
+    apr_off_t body_len;     /* the (raw) body */
+} capture_msg_t;
+
+struct serf__capture_conn_t {
+    unsigned int id;
+    capture_msg_t resp;
+};
+
+struct serf__capture_req_t {
+    capture_msg_t req;
+};
+
+static void scan_msg(capture_msg_t *msg, const char *data, apr_size_t len)
+{
+    apr_size_t i;
+
+    if (msg->headers_done) {
+        msg->body_len += len;
+        return;
+    }
+
+    for (i = 0; i < len; i++) {
+        char c = data[i];
+
+        if (!msg->line_done) {
+            if (c == '\n')
+                msg->line_done = 1;
+            else if (c != '\r' && msg->line_len < sizeof(msg->line) - 1)
+                msg->line[msg->line_len++] = c;
+        }
+
+        if (c == '\n') {
+            if (++msg->newlines == 2) {
+                /* Empty line, end of headers. */
+                msg->headers_done = 1;
+                msg->hdr_len += i + 1;
+                msg->body_len += len - i - 1;
+                return;
+            }
+        }
+        else if (c != '\r') {
+            msg->newlines = 0;
+        }
+    }
+
+    msg->hdr_len += len;
+}
+
+static void capture_request_data(void *baton, const char *data, apr_size_t len)
+{
+    serf__capture_req_t *rc = baton;
+
+    scan_msg(&rc->req, data, len);
+}
+
+static void capture_response_data(void *baton, const char *data,
+                                  apr_size_t len)
+{
+    serf__capture_conn_t *cc = baton;
+
+    scan_msg(&cc->resp, data, len);
+}
+
+/* Returns the length of the first word of LINE, and in *NEXT the start of
+   the next word. */
+static apr_size_t first_word(const char *line, const char **next)
+{
+    const char *end = line;
+
+    while (*end && *end != ' ')
+        end++;
+
+    *next = end;
+    while (**next == ' ')
+        (*next)++;
+
+    return end - line;
+}
+
+void serf__capture_conn_setup(serf_connection_t *conn)
+{
+    serf__capture_t *capture = conn->ctx->capture;
+    serf__capture_conn_t *cc = conn->capture;
+
+    if (!capture)
+        return;
+
+    if (!cc) {
+        cc = apr_pcalloc(conn->pool, sizeof(*cc));
+        conn->capture = cc;
+    }
+    else {
+        memset(&cc->resp, 0, sizeof(cc->resp));
+    }
+    cc->id = ++capture->nr_of_conns;
+
+    conn->stream = serf__bucket_tap_create(conn->stream, capture_response_data,
+                                           cc, conn->allocator);
+}
+
+void serf__capture_request_start(serf_request_t *request)
+{
+    serf__capture_t *capture = request->conn->ctx->capture;
+    serf__capture_req_t *rc;
+    serf_bucket_alloc_t *allocator;
+    serf_bucket_t *agg;
+
+    if (!capture || request->ssltunnel || !request->req_bkt)
+        return;
+
+    rc = apr_pcalloc(request->respool, sizeof(*rc));
+    request->capture = rc;
+    if (request->capture_time < capture->start)
+        request->capture_time = capture->start;
+
+    /* The request bucket turns itself into an aggregate on the first read,
+       which would drop the tap, so tap an aggregate around it instead. */
+    allocator = request->req_bkt->allocator;
+    agg = serf_bucket_aggregate_create(allocator);
+    serf_bucket_aggregate_append(agg, request->req_bkt);
+    request->req_bkt = serf__bucket_tap_create(agg, capture_request_data, rc,
+                                               allocator);
+}
+
+void serf__capture_response_done(serf_request_t *request)
+{
+    serf_connection_t *conn = request->conn;
+    serf__capture_t *capture = conn->ctx->capture;
+    serf__capture_conn_t *cc = conn->capture;
+    serf__capture_req_t *rc = request->capture;
+
+    if (!cc)
+        return;
+
+    if (capture && rc) {
+        const char *method, *uri, *rest, *status_str;
+        apr_size_t method_len, uri_len;
+        int status = 0;
+
+        rc->req.line[rc->req.line_len] = '\0';
+        cc->resp.line[cc->resp.line_len] = '\0';
+
+        method = rc->req.line;
+        method_len = first_word(method, &uri);
+        uri_len = first_word(uri, &rest);
+        if (!method_len || !uri_len) {
+            method = uri = "-";
+            method_len = uri_len = 1;
+        }
+
+        /* HTTP/1.1 200 OK */
+        first_word(cc->resp.line, &status_str);
+        if (cc->resp.line_done)
+            status = atoi(status_str);
+
+        apr_file_printf(capture->file,
+                        "%u %" APR_TIME_T_FMT " %" APR_TIME_T_FMT
+                        " %.*s %.*s %" APR_SIZE_T_FMT " %" APR_OFF_T_FMT
+                        " %d %" APR_SIZE_T_FMT " %" APR_OFF_T_FMT "\n",
+                        cc->id,
+                        request->capture_time - capture->start,
+                        apr_time_now() - request->capture_time,
+                        (int)method_len, method, (int)uri_len, uri,
+                        rc->req.hdr_len, rc->req.body_len,
+                        status, cc->resp.hdr_len, cc->resp.body_len);
+    }
+
+    /* Next response on this connection. */
+    memset(&cc->resp, 0, sizeof(cc->resp));
+}
+
+apr_status_t serf_context_capture_traffic(serf_context_t *ctx,
+                                          apr_file_t *file,
+                                          apr_pool_t *pool)
+{
+    serf__capture_t *capture;
+    apr_size_t len = strlen(CAPTURE_HEADER);
+
+    if (!file) {
+        ctx->capture = NULL;
+        return APR_SUCCESS;
+    }
+
+    capture = apr_pcalloc(pool, sizeof(*capture));
+    capture->file = file;
+    capture->start = apr_time_now();
+    ctx->capture = capture;
+
+    return apr_file_write_full(file, CAPTURE_HEADER, len, NULL);
+}
@@ -0,0 +1,569 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Request coalescing.
+
+   A GET request for which an identical GET is in flight in the same
+   context isn't sent; it follows the request in flight, the leader, and
+   gets a copy of its response. Requests are identical if they have the
+   same url and the same values for the headers in KEY_HEADERS.
+
+   The raw response of the leader is read from a tap on its connection's
+   response stream, and kept in a list of chunks shared by all followers.
+   Each follower reads the chunks through its own bucket, which its
+   acceptor wraps like a network stream. Every chunk counts the followers
+   that still have to read it, and is freed when the last one did.
+
+   Followers can only join before the first byte of the leader's response
+   was read. They get the response once the leader's status line shows it
+   isn't an authentication challenge; that response, and a leader that is
+   cancelled or loses its connection, abort the group. The followers that
+   didn't read any of the response yet are then sent like any other
+   request. The others are cancelled as if their connection was reset:
+   their handler is called without a response, so the application can send
+   them again.
+
+   The followers are kept in the cached queue of their connection, like
+   responses from the response cache, and delivered the same way.
+ */
+
+#include <string.h>
+
+#include <apr_pools.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+/* The request headers that must be equal for requests to be coalesced. */
+static const char * const KEY_HEADERS[] = {
+    "Accept",
+    "Accept-Encoding",
+    "Accept-Language",
+    "Authorization",
+    "Cookie",
+    NULL
+};
+
+struct serf__coalesce_t {
+    /* The groups that can take followers, key: see make_key. */
+    apr_hash_t *groups;
+};
+
+typedef struct coalesce_chunk_t {
+    struct coalesce_chunk_t *next;
+    apr_size_t len;
+    /* Nr. of followers that didn't read this chunk yet. */
+    unsigned int readers;
+    char data[1];
+} coalesce_chunk_t;
+
+struct serf__coalesce_group_t {
+    serf_context_t *ctx;
+    apr_pool_t *pool;
+    serf_bucket_alloc_t *allocator;
+
+    /* The key in the groups hash, NULL once the group was removed. */
+    const char *key;
+
+    serf_request_t *leader;
+    unsigned int nr_of_followers;
+
+    /* Nr. of requests referencing this group, leader and followers. */
+    unsigned int refs;
+
+    /* The leader's response so far. Chunks that all followers have read
+       are freed, so FIRST is the oldest chunk somebody still needs. */
+    coalesce_chunk_t *first;
+    coalesce_chunk_t *last;
+
+    int started;        /* the leader's response started arriving */
+    int streaming;      /* followers may read the response */
+    int complete;       /* the leader's response was read completely */
+    int aborted;
+};
+
+/* The stream a follower reads the leader's response from. CHUNK is the
+   chunk being read, NULL before the first one arrived. A follower holds on
+   to its chunk until it moves to the next one. */
+typedef struct coalesce_stream_t {
+    serf__coalesce_group_t *group;
+    coalesce_chunk_t *chunk;
+    apr_size_t offset;
+} coalesce_stream_t;
+
+static const serf_bucket_type_t serf_bucket_type_coalesce;
+
+
+/* Returns the key of the GET request REQUEST, NULL if it can't be
+   coalesced. */
+static const char *make_key(serf_request_t *request)
+{
+    serf_bucket_t *hdrs, *body;
+    const char *method, *uri, *key;
+    int i;
+
+    if (request->ssltunnel || !request->req_bkt ||
+        !SERF_BUCKET_IS_REQUEST(request->req_bkt))
+        return NULL;
+
+    serf__bucket_request_get_line(request->req_bkt, &method, &uri);
+    if (strcmp(method, "GET") != 0)
+        return NULL;
+
+    /* Only requests without a body are identical for sure. */
+    body = serf__bucket_request_swap_body(request->req_bkt, NULL);
+    serf__bucket_request_swap_body(request->req_bkt, body);
+    if (body)
+        return NULL;
+
+    /* Partial and conditional responses can't be shared, this includes
+       revalidations of the response cache. */
+    hdrs = serf_bucket_request_get_headers(request->req_bkt);
+    if (serf_bucket_headers_get(hdrs, "Range") ||
+        serf_bucket_headers_get(hdrs, "If-None-Match") ||
+        serf_bucket_headers_get(hdrs, "If-Modified-Since"))
+        return NULL;
+
+    key = apr_pstrcat(request->respool, request->conn->host_url, uri, NULL);
+    for (i = 0; KEY_HEADERS[i]; i++) {
+        const char *value = serf_bucket_headers_get(hdrs, KEY_HEADERS[i]);
+
+        key = apr_pstrcat(request->respool, key, "\n",
+                          value ? value : "", NULL);
+    }
+
+    return key;
+}
+
+/* Remove GROUP from the groups that take followers. */
+static void close_group(serf__coalesce_group_t *group)
+{
+    serf__coalesce_t *coalesce = group->ctx->coalesce;
+
+    if (!group->key)
+        return;
+
+    if (coalesce && apr_hash_get(coalesce->groups, group->key,
+                                 APR_HASH_KEY_STRING) == group)
+        apr_hash_set(coalesce->groups, group->key, APR_HASH_KEY_STRING,
+                     NULL);
+    group->key = NULL;
+}
+
+static void abort_group(serf__coalesce_group_t *group)
+{
+    close_group(group);
+
+    if (!group->aborted && !group->complete) {
+        group->aborted = 1;
+        group->ctx->cached_pending = 1;
+    }
+}
+
+/* Free the chunks of GROUP that all followers have read. */
+static void free_read_chunks(serf__coalesce_group_t *group)
+{
+    while (group->first && !group->first->readers) {
+        coalesce_chunk_t *chunk = group->first;
+
+        group->first = chunk->next;
+        if (!group->first)
+            group->last = NULL;
+        serf_bucket_mem_free(group->allocator, chunk);
+    }
+}
+
+static void release_group(serf__coalesce_group_t *group)
+{
+    if (--group->refs)
+        return;
+
+    close_group(group);
+    group->first = NULL;
+    group->last = NULL;
+    apr_pool_destroy(group->pool);
+}
+
+/* Tap on the response stream of a connection, keeps the data of a leader's
+   response for its followers. */
+static void coalesce_response_data(void *baton, const char *data,
+                                   apr_size_t len)
+{
+    serf_connection_t *conn = baton;
+    serf_request_t *request = conn->written.head;
+    serf__coalesce_group_t *group;
+    coalesce_chunk_t *chunk;
+
+    if (!request)
+        request = conn->unwritten.head;
+    if (!request || !request->coalesce || request->coalesce->leader != request)
+        return;
+    group = request->coalesce;
+
+    /* No followers can join anymore. */
+    group->started = 1;
+    close_group(group);
+
+    if (!group->nr_of_followers || group->aborted || !len)
+        return;
+
+    chunk = serf_bucket_mem_alloc(group->allocator,
+                                  sizeof(*chunk) - 1 + len);
+    chunk->next = NULL;
+    chunk->len = len;
+    chunk->readers = group->nr_of_followers;
+    memcpy(chunk->data, data, len);
+
+    if (group->last)
+        group->last->next = chunk;
+    else
+        group->first = chunk;
+    group->last = chunk;
+
+    if (group->streaming)
+        group->ctx->cached_pending = 1;
+}
+
+void serf__coalesce_conn_setup(serf_connection_t *conn)
+{
+    serf_bucket_t *agg;
+
+    if (!conn->ctx->coalesce)
+        return;
+
+    /* The stream may be tapped already, tap an aggregate around it. */
+    agg = serf_bucket_aggregate_create(conn->allocator);
+    serf_bucket_aggregate_append(agg, conn->stream);
+    conn->stream = serf__bucket_tap_create(agg, coalesce_response_data, conn,
+                                           conn->allocator);
+}
+
+apr_status_t serf__coalesce_lookup(serf_request_t *request, int *follower)
+{
+    serf_context_t *ctx = request->conn->ctx;
+    serf__coalesce_t *coalesce = ctx->coalesce;
+    serf__coalesce_group_t *group;
+    const char *key;
+    apr_pool_t *pool;
+
+    *follower = 0;
+
+    key = make_key(request);
+    if (!key)
+        return APR_SUCCESS;
+
+    group = apr_hash_get(coalesce->groups, key, APR_HASH_KEY_STRING);
+    if (group) {
+        group->nr_of_followers++;
+        group->refs++;
+        request->coalesce = group;
+        *follower = 1;
+
+        serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__,
+                  request->conn->config,
+                  "request coalesced with request 0x%x\n", group->leader);
+        return APR_SUCCESS;
+    }
+
+    /* A new leader. */
+    apr_pool_create(&pool, ctx->pool);
+    group = apr_pcalloc(pool, sizeof(*group));
+    group->ctx = ctx;
+    group->pool = pool;
+    group->allocator = serf_bucket_allocator_create(pool, NULL, NULL);
+    serf__bucket_allocator_account(group->allocator, &ctx->mem_used);
+    group->key = apr_pstrdup(pool, key);
+    group->leader = request;
+    group->refs = 1;
+    request->coalesce = group;
+
+    apr_hash_set(coalesce->groups, group->key, APR_HASH_KEY_STRING, group);
+
+    return APR_SUCCESS;
+}
+
+void serf__coalesce_check_response(serf_request_t *request)
+{
+    serf__coalesce_group_t *group = request->coalesce;
+    serf_status_line sl;
+
+    if (!group || group->leader != request || group->streaming ||
+        group->aborted)
+        return;
+
+    /* Can't look into the application's own bucket types, let the
+       followers get their own responses. */
+    if (!SERF_BUCKET_IS_RESPONSE(request->resp_bkt)) {
+        abort_group(group);
+        return;
+    }
+
+    (void)serf_bucket_response_status(request->resp_bkt, &sl);
+    if (!sl.version)
+        return;
+
+    /* serf handles authentication challenges itself and sends the leader
+       again; the followers shouldn't see the challenge. */
+    if (sl.code == 401 || sl.code == 407) {
+        abort_group(group);
+        return;
+    }
+
+    group->streaming = 1;
+    group->ctx->cached_pending = 1;
+}
+
+void serf__coalesce_response_done(serf_request_t *request)
+{
+    serf__coalesce_group_t *group = request->coalesce;
+
+    if (!group || group->leader != request || group->aborted)
+        return;
+
+    close_group(group);
+    group->streaming = 1;
+    group->complete = 1;
+    group->ctx->cached_pending = 1;
+}
+
+int serf__coalesce_aborted(serf_request_t *request)
+{
+    return request->coalesce && request->coalesce->aborted;
+}
+
+int serf__coalesce_unread(serf_request_t *request)
+{
+    coalesce_stream_t *ctx;
+
+    if (!request->coalesce_stream)
+        return 1;
+
+    ctx = request->coalesce_stream->data;
+    return ctx->chunk == NULL;
+}
+
+/* Stop reading the chunks of GROUP from CHUNK on. */
+static void drop_chunks(serf__coalesce_group_t *group,
+                        coalesce_chunk_t *chunk)
+{
+    for (; chunk; chunk = chunk->next)
+        chunk->readers--;
+    free_read_chunks(group);
+}
+
+serf_bucket_t *serf__coalesce_get_stream(serf_request_t *request)
+{
+    coalesce_stream_t *ctx;
+
+    if (request->coalesce_stream)
+        return request->coalesce_stream;
+
+    ctx = serf_bucket_mem_alloc(request->allocator, sizeof(*ctx));
+    ctx->group = request->coalesce;
+    ctx->chunk = NULL;
+    ctx->offset = 0;
+
+    request->coalesce_stream = serf_bucket_create(&serf_bucket_type_coalesce,
+                                                  request->allocator, ctx);
+    return request->coalesce_stream;
+}
+
+void serf__coalesce_request_done(serf_request_t *request)
+{
+    serf__coalesce_group_t *group = request->coalesce;
+
+    if (!group)
+        return;
+
+    if (request->coalesce_stream) {
+        serf_bucket_destroy(request->coalesce_stream);
+        request->coalesce_stream = NULL;
+    }
+    else if (group->leader != request) {
+        drop_chunks(group, group->first);
+    }
+    request->coalesce = NULL;
+
+    if (group->leader == request) {
+        group->leader = NULL;
+        abort_group(group);
+    }
+    else {
+        group->nr_of_followers--;
+    }
+
+    release_group(group);
+}
+
+/* Returns the chunk with data for CTX to read, NULL if none arrived yet. */
+static coalesce_chunk_t *current_chunk(coalesce_stream_t *ctx)
+{
+    coalesce_chunk_t *chunk = ctx->chunk;
+
+    if (!chunk) {
+        ctx->chunk = ctx->group->first;
+        ctx->offset = 0;
+        return ctx->chunk;
+    }
+
+    if (ctx->offset == chunk->len && chunk->next) {
+        /* Move on, and free the chunk if all followers did. */
+        ctx->chunk = chunk->next;
+        ctx->offset = 0;
+        chunk->readers--;
+        free_read_chunks(ctx->group);
+        return ctx->chunk;
+    }
+
+    return ctx->offset < chunk->len ? chunk : NULL;
+}
+
+/* Returns the status after a read of CTX that returned data. */
+static apr_status_t read_status(coalesce_stream_t *ctx)
+{
+    if (ctx->group->complete && ctx->offset == ctx->chunk->len &&
+        !ctx->chunk->next)
+        return APR_EOF;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t serf_coalesce_read(serf_bucket_t *bucket,
+                                       apr_size_t requested,
+                                       const char **data, apr_size_t *len)
+{
+    coalesce_stream_t *ctx = bucket->data;
+    serf__coalesce_group_t *group = ctx->group;
+    coalesce_chunk_t *chunk;
+
+    *len = 0;
+
+    if (group->aborted)
+        return SERF_ERROR_ABORTED_CONNECTION;
+    if (!group->streaming)
+        return APR_EAGAIN;
+
+    chunk = current_chunk(ctx);
+    if (!chunk)
+        return group->complete ? APR_EOF : APR_EAGAIN;
+
+    *data = chunk->data + ctx->offset;
+    *len = chunk->len - ctx->offset;
+    if (requested < *len)
+        *len = requested;
+    ctx->offset += *len;
+
+    return read_status(ctx);
+}
+
+static apr_status_t serf_coalesce_readline(serf_bucket_t *bucket,
+                                           int acceptable, int *found,
+                                           const char **data,
+                                           apr_size_t *len)
+{
+    coalesce_stream_t *ctx = bucket->data;
+    serf__coalesce_group_t *group = ctx->group;
+    coalesce_chunk_t *chunk;
+    const char *start;
+    apr_size_t avail;
+
+    *len = 0;
+    *found = SERF_NEWLINE_NONE;
+
+    if (group->aborted)
+        return SERF_ERROR_ABORTED_CONNECTION;
+    if (!group->streaming)
+        return APR_EAGAIN;
+
+    chunk = current_chunk(ctx);
+    if (!chunk)
+        return group->complete ? APR_EOF : APR_EAGAIN;
+
+    start = chunk->data + ctx->offset;
+    avail = chunk->len - ctx->offset;
+    *data = start;
+    serf_util_readline(data, &avail, acceptable, found);
+    *len = *data - start;
+    *data = start;
+    ctx->offset += *len;
+
+    return read_status(ctx);
+}
+
+static apr_status_t serf_coalesce_peek(serf_bucket_t *bucket,
+                                       const char **data,
+                                       apr_size_t *len)
+{
+    coalesce_stream_t *ctx = bucket->data;
+    serf__coalesce_group_t *group = ctx->group;
+    coalesce_chunk_t *chunk;
+
+    *len = 0;
+
+    if (group->aborted)
+        return SERF_ERROR_ABORTED_CONNECTION;
+    if (!group->streaming)
+        return APR_SUCCESS;
+
+    chunk = current_chunk(ctx);
+    if (!chunk)
+        return group->complete ? APR_EOF : APR_SUCCESS;
+
+    *data = chunk->data + ctx->offset;
+    *len = chunk->len - ctx->offset;
+
+    return (group->complete && !chunk->next) ? APR_EOF : APR_SUCCESS;
+}
+
+static void serf_coalesce_destroy(serf_bucket_t *bucket)
+{
+    coalesce_stream_t *ctx = bucket->data;
+    serf__coalesce_group_t *group = ctx->group;
+
+    /* Don't keep the chunks this follower will never read. */
+    drop_chunks(group, ctx->chunk ? ctx->chunk : group->first);
+
+    serf_default_destroy_and_data(bucket);
+}
+
+static const serf_bucket_type_t serf_bucket_type_coalesce = {
+    "COALESCE",
+    serf_coalesce_read,
+    serf_coalesce_readline,
+    serf_default_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_buckets_are_v2,
+    serf_coalesce_peek,
+    serf_coalesce_destroy,
+    serf_default_read_bucket,
+    serf_default_ignore_config,
+};
+
+void serf_context_set_request_coalescing(serf_context_t *ctx, int enabled)
+{
+    if (!enabled) {
+        ctx->coalesce = NULL;
+        return;
+    }
+
+    if (!ctx->coalesce) {
+        ctx->coalesce = apr_pcalloc(ctx->pool, sizeof(*ctx->coalesce));
+        ctx->coalesce->groups = apr_hash_make(ctx->pool);
+    }
+}
@@ -19,10 +19,16 @@
 #include "serf_bucket_util.h"
 #include "serf_private.h"
 
-/* Use a linked list to store the config values, as we'll only store a couple
-   of values per context. */
+/* Keys are a category and a number. Serf's own keys use small numbers, their
+   values are stored in a fixed array of slots indexed by that number, so a
+   lookup is an array index. Keys of applications (see serf.h) use the second
+   byte; they're rare and are kept in a linked list. */
+#define CONFIG_KEY_NUMBER(key) ((key) & 0x00FFFFFF)
+#define CONFIG_NR_OF_SLOTS 16
+
 struct serf__config_hdr_t {
     apr_pool_t *pool;
+    void *slots[CONFIG_NR_OF_SLOTS];
     struct config_entry_t *first;
 };
 
@@ -42,10 +48,16 @@ static serf__config_hdr_t *create_config_hdr(apr_pool_t *pool)
 static apr_status_t
 add_or_replace_entry(serf__config_hdr_t *hdr, serf_config_key_t key, void *value)
 {
+    apr_uint32_t nr = CONFIG_KEY_NUMBER(key);
     config_entry_t *iter = hdr->first;
     config_entry_t *last = iter;
     int found = FALSE;
 
+    if (nr < CONFIG_NR_OF_SLOTS) {
+        hdr->slots[nr] = value;
+        return APR_SUCCESS;
+    }
+
     /* Find the entry with the matching key. If it exists, replace its value. */
     while (iter != NULL) {
         if (iter->key == key) {
@@ -75,6 +87,22 @@ add_or_replace_entry(serf__config_hdr_t *hdr, serf_config_key_t key, void *value
     return APR_SUCCESS;
 }
 
+static void *get_entry(const serf__config_hdr_t *hdr, serf_config_key_t key)
+{
+    apr_uint32_t nr = CONFIG_KEY_NUMBER(key);
+    const config_entry_t *iter;
+
+    if (nr < CONFIG_NR_OF_SLOTS)
+        return hdr->slots[nr];
+
+    for (iter = hdr->first; iter != NULL; iter = iter->next) {
+        if (iter->key == key)
+            return iter->value;
+    }
+
+    return NULL;
+}
+
 /*** Config Store ***/
 apr_status_t serf__config_store_init(serf_context_t *ctx)
 {
@@ -83,27 +111,10 @@ apr_status_t serf__config_store_init(serf_context_t *ctx)
     ctx->config_store.pool = pool;
     ctx->config_store.global_per_context = create_config_hdr(pool);
     ctx->config_store.global_per_host = apr_hash_make(pool);
-    ctx->config_store.global_per_conn = apr_hash_make(pool);
 
     return APR_ENOTIMPL;
 }
 
-/* Defines the key to use for per host settings */
-static const char * host_key_for_conn(serf_connection_t *conn,
-                                      apr_pool_t *pool)
-{
-    /* SCHEME://HOSTNAME:PORT, e.g. http://localhost:12345 */
-    return conn->host_url;
-}
-
-/* Defines the key to use for per connection settings */
-static const char * conn_key_for_conn(serf_connection_t *conn,
-                                      apr_pool_t *pool)
-{
-    /* Key needs to be unique per connection, so stringify its pointer value */
-    return apr_psprintf(pool, "%x", (unsigned int)conn);
-}
-
 /* TODO: when will this be released? Related config to a specific lifecyle:
    connection or context */
 apr_status_t serf__config_store_get_config(serf_context_t *ctx,
@@ -117,35 +128,26 @@ apr_status_t serf__config_store_get_config(serf_context_t *ctx,
     cfg->ctx_pool = ctx->pool;
     cfg->per_context = config_store->global_per_context;
 
-    if (conn) {
-        const char *host_key, *conn_key;
-        serf__config_hdr_t *per_conn, *per_host;
-        apr_pool_t *tmp_pool;
-        apr_status_t status;
-
+    if (conn && conn->config) {
+        /* The host and connection scopes are resolved once, when the
+           connection is created. */
         cfg->conn_pool = conn->pool;
+        cfg->per_host = conn->config->per_host;
+        cfg->per_conn = conn->config->per_conn;
+    }
+    else if (conn) {
+        /* SCHEME://HOSTNAME:PORT, e.g. http://localhost:12345 */
+        const char *host_key = conn->host_url ? conn->host_url : "";
+        serf__config_hdr_t *per_host;
 
-        if ((status = apr_pool_create(&tmp_pool, out_pool)) != APR_SUCCESS)
-            return status;
+        cfg->conn_pool = conn->pool;
 
-        /* Find the config values for this connection, create empty structure
-           if needed */
-        conn_key = conn_key_for_conn(conn, tmp_pool);
-        per_conn = apr_hash_get(config_store->global_per_conn, conn_key,
-                                APR_HASH_KEY_STRING);
-        if (!per_conn) {
-            per_conn = create_config_hdr(conn->pool);
-            apr_hash_set(config_store->global_per_conn,
-                         apr_pstrdup(conn->pool, conn_key),
-                         APR_HASH_KEY_STRING, per_conn);
-        }
-        cfg->per_conn = per_conn;
+        /* The connection values live as long as the connection. */
+        cfg->per_conn = create_config_hdr(conn->pool);
 
         /* Find the config values for this host, create empty structure
            if needed */
-        host_key = host_key_for_conn(conn, tmp_pool);
-        per_host = apr_hash_get(config_store->global_per_host,
-                                host_key,
+        per_host = apr_hash_get(config_store->global_per_host, host_key,
                                 APR_HASH_KEY_STRING);
         if (!per_host) {
             per_host = create_config_hdr(config_store->pool);
@@ -154,8 +156,6 @@ apr_status_t serf__config_store_get_config(serf_context_t *ctx,
                          APR_HASH_KEY_STRING, per_host);
         }
         cfg->per_host = per_host;
-
-        apr_pool_destroy(tmp_pool);
     }
 
     *config = cfg;
@@ -273,22 +273,14 @@ apr_status_t serf_config_get_object(serf_config_t *config,
     else
         target = config->per_conn;
 
-    *value = NULL;
-    if (target) {
-        config_entry_t *iter = target->first;
-        /* Find the matching key and return its value */
-        while (iter != NULL) {
-            if (iter->key == key) {
-                *value = iter->value;
-                return APR_SUCCESS;
-            }
-            iter = iter->next;
-        }
-        return APR_SUCCESS;
-    } else {
+    if (!target) {
         /* Config object doesn't manage keys in this category */
+        *value = NULL;
         return APR_EINVAL;
     }
+
+    *value = get_entry(target, key);
+    return APR_SUCCESS;
 }
 
 apr_status_t serf_config_remove_value(serf_config_t *config,
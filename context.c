@@ -117,6 +117,22 @@ void serf_config_authn_types(serf_context_t *ctx,
 }
 
 
+void serf_config_authn_cache(serf_context_t *ctx,
+                             unsigned int max_servers,
+                             apr_interval_time_t ttl)
+{
+    ctx->authn_cache_max = max_servers ? max_servers : 1;
+    ctx->authn_cache_ttl = ttl;
+}
+
+
+void serf_config_authn_negotiate_reuse(serf_context_t *ctx,
+                                       int reuse)
+{
+    ctx->negotiate_reuse = reuse;
+}
+
+
 serf_context_t *serf_context_create_ex(
     void *user_baton,
     serf_socket_add_t addf,
@@ -169,6 +185,9 @@ serf_context_t *serf_context_create_ex(
 
     ctx->authn_types = SERF_AUTHN_ALL;
     ctx->server_authn_info = apr_hash_make(pool);
+    ctx->authn_cache_max = 64;
+    ctx->authn_cache_ttl = apr_time_from_sec(3600);
+    ctx->proxy_authn_info.pool = pool;
 
     /* Assume returned status is APR_SUCCESS */
     serf__config_store_init(ctx);
@@ -189,9 +208,30 @@ serf_context_t *serf_context_create(apr_pool_t *pool)
 apr_status_t serf_context_prerun(serf_context_t *ctx)
 {
     apr_status_t status = APR_SUCCESS;
+
+    /* Answer requests from the response cache before connecting. */
+    if ((status = serf__process_cached_requests(ctx)) != APR_SUCCESS)
+        return status;
+
     if ((status = serf__open_connections(ctx)) != APR_SUCCESS)
         return status;
 
+    /* Hold back or let through requests and reads, depending on the
+       memory in use. */
+    serf__budget_check(ctx);
+
+    /* Continue with connections that were throttled by a rate limit, send
+       the request bodies that waited too long for a 100 Continue, hedge
+       the requests that are late, and trim the connections that are
+       idle. */
+    (void)serf__ratelimit_wakeup(ctx);
+    (void)serf__expect_continue_wakeup(ctx);
+    (void)serf__hedge_wakeup(ctx);
+    (void)serf__idle_trim_wakeup(ctx);
+
+    if ((status = serf__process_resumed_reads(ctx)) != APR_SUCCESS)
+        return status;
+
     if ((status = check_dirty_pollsets(ctx)) != APR_SUCCESS)
         return status;
     return status;
@@ -276,12 +316,37 @@ apr_status_t serf_context_run(
     apr_int32_t num;
     const apr_pollfd_t *desc;
     serf_pollset_t *ps = (serf_pollset_t*)ctx->pollset_baton;
+    apr_short_interval_time_t poll_duration = duration;
+    apr_interval_time_t wakeup, expect_wakeup, hedge_wakeup, trim_wakeup;
 
     if ((status = serf_context_prerun(ctx)) != APR_SUCCESS) {
         return status;
     }
 
-    if ((status = apr_pollset_poll(ps->pollset, duration, &num,
+    /* Wake up in time for connections throttled by a rate limit, for
+       requests waiting for a 100 Continue, to hedge late requests and to
+       trim idle connections. */
+    wakeup = serf__ratelimit_wakeup(ctx);
+    expect_wakeup = serf__expect_continue_wakeup(ctx);
+    if (expect_wakeup >= 0 && (wakeup < 0 || expect_wakeup < wakeup))
+        wakeup = expect_wakeup;
+    hedge_wakeup = serf__hedge_wakeup(ctx);
+    if (hedge_wakeup >= 0 && (wakeup < 0 || hedge_wakeup < wakeup))
+        wakeup = hedge_wakeup;
+    trim_wakeup = serf__idle_trim_wakeup(ctx);
+    if (trim_wakeup >= 0 && (wakeup < 0 || trim_wakeup < wakeup))
+        wakeup = trim_wakeup;
+    if (wakeup >= 0 && (duration < 0 || wakeup < duration))
+        /* Wake up at least once a minute, poll takes a short interval. */
+        poll_duration = (apr_short_interval_time_t)
+                        (wakeup > 60 * APR_USEC_PER_SEC ? 60 * APR_USEC_PER_SEC
+                                                        : wakeup);
+
+    /* Don't wait for the network while cached responses can be delivered. */
+    if (ctx->cached_pending)
+        poll_duration = 0;
+
+    if ((status = apr_pollset_poll(ps->pollset, poll_duration, &num,
                                    &desc)) != APR_SUCCESS) {
         /* EINTR indicates a handled signal happened during the poll call,
            ignore, the application can safely retry. */
@@ -296,8 +361,15 @@ apr_status_t serf_context_run(
         /* Use the strict documented error for poll timeouts, to allow proper
            handling of the other timeout types when returned from
            serf_event_trigger */
-        if (APR_STATUS_IS_TIMEUP(status))
+        if (APR_STATUS_IS_TIMEUP(status)) {
+            /* We woke up early for a throttled connection, a request
+               waiting for 100 Continue or to be hedged, an idle connection
+               or a cached response, that's not the timeout our caller
+               asked for. */
+            if (poll_duration != duration)
+                return APR_SUCCESS;
             return APR_TIMEUP; /* Return the documented error */
+        }
         return status;
     }
 
@@ -0,0 +1,561 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Segmented downloads.
+
+   A download starts with a probe on one connection: a GET for the first
+   segment with a Range header. A 206 response tells the total size in its
+   Content-Range header, and that the server supports ranges. The file is
+   then extended to that size, and the other segments are fetched over up to
+   MAX_CONNS connections to the same server. Every connection has at most
+   two segments queued, so it can pipeline the next one; when a segment is
+   done the connection takes the next one that is left. The data of every
+   segment is written in place, at its offset in the file.
+
+   If the server answers the probe with a 200, it doesn't support ranges,
+   and the whole body is written by the probe. A 416 of which the
+   Content-Range header gives a length of 0 means the resource is empty:
+   the download is done.
+
+   The segments after the probe carry an If-Range header with the validator
+   of the probe's response, so a resource that changes during the download
+   results in an error instead of a corrupt file.
+
+   A segment of which the request is cancelled, e.g. because its connection
+   was reset, is requested again from the first byte that wasn't written
+   yet.
+
+   When the download is done, or fails, the extra connections are closed.
+ */
+
+#include <string.h>
+
+#include <apr_pools.h>
+#include <apr_file_io.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_uri.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+#define DEFAULT_SEGMENT_SIZE (1024 * 1024)
+
+/* Nr. of segments queued per connection. */
+#define SEGMENTS_PER_CONN 2
+
+struct serf_download_t {
+    serf_context_t *ctx;
+    apr_pool_t *pool;
+
+    apr_uri_t url;
+    const char *path;
+    apr_file_t *file;
+
+    int max_conns;
+    int nr_of_conns;
+    /* The connections opened after the probe's, element type:
+       serf_connection_t *. */
+    apr_array_header_t *conns;
+    apr_off_t segment_size;
+
+    serf_connection_setup_t setup;
+    void *setup_baton;
+    serf_download_done_t done;
+    void *done_baton;
+
+    /* The ETag or Last-Modified header of the probe's response, for the
+       If-Range header of the other segments. NULL if none. */
+    const char *validator;
+
+    /* The size of the resource, -1 if unknown. NEXT_OFFSET is the start of
+       the next segment to request, COMPLETED the nr. of bytes of the
+       segments that are done. */
+    apr_off_t length;
+    apr_off_t next_offset;
+    apr_off_t completed;
+
+    int finished;
+    apr_status_t status;
+};
+
+typedef struct segment_t {
+    serf_download_t *download;
+
+    /* The first and last byte of the segment. END is -1 when the whole body
+       is fetched, without a Range header. OFFSET is the next byte to
+       write. */
+    apr_off_t start;
+    apr_off_t end;
+    apr_off_t offset;
+
+    int probe;
+    int headers_done;
+    /* The body of the response isn't part of the resource. */
+    int discard;
+} segment_t;
+
+/* Stop DOWNLOAD with STATUS, from the handler of REQUEST. The extra
+   connections are closed, except the one of REQUEST: closing it from its
+   own handler would destroy REQUEST, it goes with the download's pool. */
+static void finish(serf_download_t *download, serf_request_t *request,
+                   apr_status_t status)
+{
+    serf_connection_t *current = serf_request_get_conn(request);
+    int i;
+
+    if (download->finished)
+        return;
+
+    download->finished = 1;
+    download->status = status;
+
+    for (i = 0; i < download->conns->nelts; i++) {
+        serf_connection_t *conn = APR_ARRAY_IDX(download->conns, i,
+                                                serf_connection_t *);
+
+        if (conn != current)
+            serf_connection_close(conn);
+    }
+    apr_array_clear(download->conns);
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, download->ctx->config,
+              "download of %s done, status %d\n", download->path, status);
+
+    if (download->done)
+        download->done(download->done_baton, status, download->completed);
+}
+
+static apr_status_t setup_segment(serf_request_t *request,
+                                  void *setup_baton,
+                                  serf_bucket_t **req_bkt,
+                                  serf_response_acceptor_t *acceptor,
+                                  void **acceptor_baton,
+                                  serf_response_handler_t *handler,
+                                  void **handler_baton,
+                                  apr_pool_t *pool);
+
+/* Queue a request for SEG on CONN. */
+static void request_segment(serf_connection_t *conn, segment_t *seg)
+{
+    seg->headers_done = 0;
+    serf_connection_request_create(conn, setup_segment, seg);
+}
+
+/* Queue the next segment of DOWNLOAD on CONN, if any is left. */
+static void queue_next_segment(serf_download_t *download,
+                               serf_connection_t *conn)
+{
+    segment_t *seg;
+
+    if (download->finished || download->length < 0 ||
+        download->next_offset >= download->length)
+        return;
+
+    seg = apr_pcalloc(download->pool, sizeof(*seg));
+    seg->download = download;
+    seg->start = download->next_offset;
+    seg->end = seg->start + download->segment_size - 1;
+    if (seg->end >= download->length)
+        seg->end = download->length - 1;
+    seg->offset = seg->start;
+    download->next_offset = seg->end + 1;
+
+    request_segment(conn, seg);
+}
+
+/* Open new connections for the segments that are left of DOWNLOAD. */
+static apr_status_t open_connections(serf_download_t *download)
+{
+    while (download->nr_of_conns < download->max_conns &&
+           download->next_offset < download->length) {
+        serf_connection_t *conn;
+        apr_status_t status;
+        int i;
+
+        status = serf_connection_create2(&conn, download->ctx, download->url,
+                                         download->setup,
+                                         download->setup_baton,
+                                         NULL, NULL, download->pool);
+        if (status)
+            return status;
+        download->nr_of_conns++;
+        APR_ARRAY_PUSH(download->conns, serf_connection_t *) = conn;
+
+        for (i = 0; i < SEGMENTS_PER_CONN; i++)
+            queue_next_segment(download, conn);
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Parse the Content-Range header VALUE: bytes START-END/LENGTH. LENGTH is
+   -1 if the server doesn't know it. */
+static apr_status_t parse_content_range(const char *value,
+                                        apr_off_t *start,
+                                        apr_off_t *end,
+                                        apr_off_t *length)
+{
+    char *p;
+
+    if (!value || strncmp(value, "bytes ", 6) != 0)
+        return SERF_ERROR_BAD_HTTP_RESPONSE;
+    value += 6;
+
+    if (apr_strtoff(start, value, &p, 10) || *p != '-')
+        return SERF_ERROR_BAD_HTTP_RESPONSE;
+    if (apr_strtoff(end, p + 1, &p, 10) || *p != '/' || *end < *start)
+        return SERF_ERROR_BAD_HTTP_RESPONSE;
+
+    if (p[1] == '*') {
+        *length = -1;
+    }
+    else if (apr_strtoff(length, p + 1, &p, 10) || *length <= *end) {
+        return SERF_ERROR_BAD_HTTP_RESPONSE;
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Check the status line and headers of the response for SEG. */
+static apr_status_t check_headers(segment_t *seg, serf_request_t *request,
+                                  serf_bucket_t *response)
+{
+    serf_download_t *download = seg->download;
+    serf_bucket_t *hdrs = serf_bucket_response_get_headers(response);
+    serf_status_line sl;
+    apr_off_t start, end, length;
+    apr_status_t status;
+
+    status = serf_bucket_response_status(response, &sl);
+    if (status)
+        return status;
+
+    /* The whole body, the server doesn't support ranges. */
+    if (sl.code == 200 && (seg->probe || seg->end < 0)) {
+        const char *cl = serf_bucket_headers_get(hdrs, "Content-Length");
+
+        seg->probe = 0;
+        seg->end = -1;
+        seg->offset = 0;
+        download->length = -1;
+        if (cl && apr_strtoff(&length, cl, NULL, 10) == APR_SUCCESS)
+            download->length = length;
+        download->next_offset = download->length;
+
+        if (download->length >= 0)
+            return apr_file_trunc(download->file, download->length);
+        return APR_SUCCESS;
+    }
+
+    /* No range can be satisfied for an empty resource, RFC 7233 4.4. */
+    if (sl.code == 416 && (seg->probe || seg->discard)) {
+        const char *cr = serf_bucket_headers_get(hdrs, "Content-Range");
+
+        if (!cr || strcmp(cr, "bytes */0") != 0)
+            return SERF_ERROR_BAD_HTTP_RESPONSE;
+
+        seg->probe = 0;
+        seg->discard = 1;
+        download->length = 0;
+        download->next_offset = 0;
+
+        return apr_file_trunc(download->file, 0);
+    }
+
+    if (sl.code != 206)
+        return SERF_ERROR_BAD_HTTP_RESPONSE;
+
+    status = parse_content_range(serf_bucket_headers_get(hdrs,
+                                                         "Content-Range"),
+                                 &start, &end, &length);
+    if (status)
+        return status;
+    if (start != seg->offset || end > seg->end ||
+        (!seg->probe && end != seg->end))
+        return SERF_ERROR_BAD_HTTP_RESPONSE;
+
+    if (seg->probe) {
+        const char *etag = serf_bucket_headers_get(hdrs, "ETag");
+
+        if (length < 0)
+            return SERF_ERROR_BAD_HTTP_RESPONSE;
+
+        /* Only strong validators can be used with If-Range. */
+        if (etag && strncmp(etag, "W/", 2) != 0)
+            download->validator = apr_pstrdup(download->pool, etag);
+        else if (serf_bucket_headers_get(hdrs, "Last-Modified"))
+            download->validator = apr_pstrdup(download->pool,
+                                  serf_bucket_headers_get(hdrs,
+                                                          "Last-Modified"));
+
+        seg->probe = 0;
+        seg->end = end;
+        download->length = length;
+        download->next_offset = end + 1;
+
+        status = apr_file_trunc(download->file, length);
+        if (status)
+            return status;
+
+        queue_next_segment(download, serf_request_get_conn(request));
+        return open_connections(download);
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Write the data of SEG's response to the file, at its offset. */
+static apr_status_t write_segment(segment_t *seg, const char *data,
+                                  apr_size_t len)
+{
+    serf_download_t *download = seg->download;
+    apr_off_t offset = seg->offset;
+    apr_status_t status;
+
+    if (seg->end >= 0 && (apr_off_t)len > seg->end + 1 - seg->offset)
+        return SERF_ERROR_BAD_HTTP_RESPONSE;
+
+    status = apr_file_seek(download->file, APR_SET, &offset);
+    if (status)
+        return status;
+
+    status = apr_file_write_full(download->file, data, len, NULL);
+    if (status)
+        return status;
+    seg->offset += len;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t segment_done(segment_t *seg, serf_request_t *request)
+{
+    serf_download_t *download = seg->download;
+
+    if (seg->discard) {
+        /* The error page of an empty resource. */
+        finish(download, request, APR_SUCCESS);
+        return APR_SUCCESS;
+    }
+
+    if (seg->end < 0) {
+        /* The whole body without ranges. */
+        if (download->length >= 0 && seg->offset != download->length)
+            return SERF_ERROR_BAD_HTTP_RESPONSE;
+        download->length = seg->offset;
+        download->completed = seg->offset;
+        finish(download, request, APR_SUCCESS);
+        return APR_SUCCESS;
+    }
+
+    if (seg->offset != seg->end + 1)
+        return SERF_ERROR_BAD_HTTP_RESPONSE;
+
+    download->completed += seg->end + 1 - seg->start;
+    if (download->completed == download->length) {
+        finish(download, request, APR_SUCCESS);
+        return APR_SUCCESS;
+    }
+
+    queue_next_segment(download, serf_request_get_conn(request));
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t handle_segment(serf_request_t *request,
+                                   serf_bucket_t *response,
+                                   void *handler_baton,
+                                   apr_pool_t *pool)
+{
+    segment_t *seg = handler_baton;
+    serf_download_t *download = seg->download;
+    apr_status_t status;
+
+    if (download->finished)
+        return download->status ? download->status : APR_EOF;
+
+    /* Cancelled, ask again for what we don't have yet. */
+    if (!response) {
+        if (seg->end < 0)
+            seg->offset = 0;
+        request_segment(serf_request_get_conn(request), seg);
+        return APR_SUCCESS;
+    }
+
+    if (!seg->headers_done) {
+        status = serf_bucket_response_wait_for_headers(response);
+        if (status && !SERF_BUCKET_READ_ERROR(status))
+            status = serf_bucket_response_wait_for_headers(response);
+        if (APR_STATUS_IS_EAGAIN(status))
+            return status;
+        if (!status)
+            status = check_headers(seg, request, response);
+        if (status) {
+            finish(download, request, status);
+            return status;
+        }
+        seg->headers_done = 1;
+    }
+
+    while (1) {
+        const char *data;
+        apr_size_t len;
+        apr_status_t write_status;
+
+        status = serf_bucket_read(response, SERF_READ_ALL_AVAIL, &data, &len);
+        if (SERF_BUCKET_READ_ERROR(status)) {
+            finish(download, request, status);
+            return status;
+        }
+
+        if (len && !seg->discard) {
+            write_status = write_segment(seg, data, len);
+            if (write_status) {
+                finish(download, request, write_status);
+                return write_status;
+            }
+        }
+
+        if (APR_STATUS_IS_EOF(status)) {
+            apr_status_t done_status = segment_done(seg, request);
+            if (done_status) {
+                finish(download, request, done_status);
+                return done_status;
+            }
+            return APR_EOF;
+        }
+
+        if (status)
+            return status;
+    }
+}
+
+static serf_bucket_t *accept_segment(serf_request_t *request,
+                                     serf_bucket_t *stream,
+                                     void *acceptor_baton,
+                                     apr_pool_t *pool)
+{
+    serf_bucket_alloc_t *bkt_alloc = serf_request_get_alloc(request);
+    serf_bucket_t *c;
+
+    /* Create a barrier so the response doesn't eat us! */
+    c = serf_bucket_barrier_create(stream, bkt_alloc);
+
+    return serf_bucket_response_create(c, bkt_alloc);
+}
+
+static apr_status_t setup_segment(serf_request_t *request,
+                                  void *setup_baton,
+                                  serf_bucket_t **req_bkt,
+                                  serf_response_acceptor_t *acceptor,
+                                  void **acceptor_baton,
+                                  serf_response_handler_t *handler,
+                                  void **handler_baton,
+                                  apr_pool_t *pool)
+{
+    segment_t *seg = setup_baton;
+    serf_download_t *download = seg->download;
+    serf_bucket_t *hdrs;
+
+    *req_bkt = serf_request_bucket_request_create(request, "GET",
+                                                  download->path, NULL,
+                                                  serf_request_get_alloc(
+                                                      request));
+    hdrs = serf_bucket_request_get_headers(*req_bkt);
+
+    if (seg->probe || seg->end >= 0) {
+        serf_bucket_headers_set(hdrs, "Range",
+                                apr_psprintf(pool, "bytes=%" APR_OFF_T_FMT
+                                             "-%" APR_OFF_T_FMT,
+                                             seg->offset, seg->end));
+        if (!seg->probe && download->validator)
+            serf_bucket_headers_set(hdrs, "If-Range", download->validator);
+    }
+
+    *acceptor = accept_segment;
+    *acceptor_baton = NULL;
+    *handler = handle_segment;
+    *handler_baton = seg;
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf_download_create(serf_download_t **download,
+                                  serf_context_t *ctx,
+                                  const char *url,
+                                  apr_file_t *file,
+                                  int max_conns,
+                                  apr_off_t segment_size,
+                                  serf_connection_setup_t setup,
+                                  void *setup_baton,
+                                  serf_download_done_t done,
+                                  void *done_baton,
+                                  apr_pool_t *pool)
+{
+    serf_download_t *dl;
+    serf_connection_t *conn;
+    segment_t *seg;
+    apr_status_t status;
+
+    dl = apr_pcalloc(pool, sizeof(*dl));
+    dl->ctx = ctx;
+    dl->pool = pool;
+    dl->file = file;
+    dl->max_conns = max_conns > 0 ? max_conns : 1;
+    dl->conns = apr_array_make(pool, dl->max_conns,
+                               sizeof(serf_connection_t *));
+    dl->segment_size = segment_size > 0 ? segment_size
+                                        : DEFAULT_SEGMENT_SIZE;
+    dl->setup = setup;
+    dl->setup_baton = setup_baton;
+    dl->done = done;
+    dl->done_baton = done_baton;
+    dl->length = -1;
+
+    status = apr_uri_parse(pool, url, &dl->url);
+    if (status)
+        return status;
+    if (!dl->url.hostname)
+        return APR_EINVAL;
+    dl->path = dl->url.path ? dl->url.path : "/";
+    if (dl->url.query)
+        dl->path = apr_pstrcat(pool, dl->path, "?", dl->url.query, NULL);
+
+    status = serf_connection_create2(&conn, ctx, dl->url, setup, setup_baton,
+                                     NULL, NULL, pool);
+    if (status)
+        return status;
+    dl->nr_of_conns = 1;
+
+    /* The probe, for the first segment. */
+    seg = apr_pcalloc(pool, sizeof(*seg));
+    seg->download = dl;
+    seg->start = 0;
+    seg->end = dl->segment_size - 1;
+    seg->offset = 0;
+    seg->probe = 1;
+    request_segment(conn, seg);
+
+    *download = dl;
+
+    return APR_SUCCESS;
+}
+
+apr_off_t serf_download_get_length(const serf_download_t *download)
+{
+    return download->length;
+}
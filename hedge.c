@@ -0,0 +1,409 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Hedged requests.
+
+   For every host the context keeps a histogram of the time between
+   sending an idempotent request (GET, HEAD or OPTIONS without a body) and
+   the start of its response. When such a request is sent, the configured
+   percentile of that histogram tells when it is late. A late request gets
+   a duplicate, created with the same setup callback on another connection
+   to the same host, see serf__hedge_wakeup.
+
+   Whichever of the two gets the first byte of its response wins. The
+   other is cancelled with serf_request_cancel if it wasn't written yet;
+   otherwise it can't be taken off its connection, and its response is
+   read and dropped.
+
+   While both are in flight, a request that is cancelled because its
+   connection is reset doesn't notify the application: the other one will
+   deliver the response.
+ */
+
+#include <string.h>
+
+#include <apr_pools.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+/* Two buckets per power of two microseconds, up to about 71 minutes. */
+#define HEDGE_BUCKETS 64
+
+/* Don't hedge before the histogram of a host has this many samples. */
+#define HEDGE_MIN_SAMPLES 20
+
+/* The counts are halved at this many samples, so the histogram follows
+   changes in the latency of a host. */
+#define HEDGE_MAX_SAMPLES 1000
+
+typedef struct hedge_host_t {
+    apr_uint32_t counts[HEDGE_BUCKETS];
+    apr_uint32_t total;
+} hedge_host_t;
+
+struct serf__hedge_t {
+    apr_pool_t *pool;
+    double percentile;
+
+    /* The histograms, key: host url. */
+    apr_hash_t *hosts;
+
+    /* Nr. of requests in state SERF__HEDGE_WAITING. */
+    unsigned int nr_waiting;
+};
+
+
+static int bucket_of(apr_interval_time_t usec)
+{
+    apr_uint64_t v = usec > 0 ? usec : 1;
+    int log = 0, i;
+
+    while ((v >> log) > 1)
+        log++;
+
+    /* The bit below the highest one tells which half of [2^log, 2^(log+1))
+       V falls in. */
+    i = 2 * log + (log > 0 ? (int)((v >> (log - 1)) & 1) : 0);
+
+    return i < HEDGE_BUCKETS ? i : HEDGE_BUCKETS - 1;
+}
+
+/* Returns the upper limit of histogram bucket I. */
+static apr_interval_time_t bucket_limit(int i)
+{
+    apr_interval_time_t base = (apr_interval_time_t)1 << (i / 2);
+
+    return (i & 1) ? base * 2 : base + (base + 1) / 2;
+}
+
+static hedge_host_t *get_host(serf__hedge_t *hedge, serf_connection_t *conn)
+{
+    hedge_host_t *host;
+
+    host = apr_hash_get(hedge->hosts, conn->host_url, APR_HASH_KEY_STRING);
+    if (!host) {
+        host = apr_pcalloc(hedge->pool, sizeof(*host));
+        apr_hash_set(hedge->hosts, apr_pstrdup(hedge->pool, conn->host_url),
+                     APR_HASH_KEY_STRING, host);
+    }
+
+    return host;
+}
+
+static void record_latency(hedge_host_t *host, apr_interval_time_t latency)
+{
+    if (host->total == HEDGE_MAX_SAMPLES) {
+        int i;
+
+        host->total = 0;
+        for (i = 0; i < HEDGE_BUCKETS; i++) {
+            host->counts[i] /= 2;
+            host->total += host->counts[i];
+        }
+    }
+
+    host->counts[bucket_of(latency)]++;
+    host->total++;
+}
+
+/* Returns the latency at PERCENTILE of HOST, -1 if it isn't known yet. */
+static apr_interval_time_t latency_at(hedge_host_t *host, double percentile)
+{
+    apr_uint32_t target, count = 0;
+    int i;
+
+    if (host->total < HEDGE_MIN_SAMPLES)
+        return -1;
+
+    target = (apr_uint32_t)(host->total * percentile / 100.0);
+    if (target < 1)
+        target = 1;
+
+    for (i = 0; i < HEDGE_BUCKETS; i++) {
+        count += host->counts[i];
+        if (count >= target)
+            return bucket_limit(i);
+    }
+
+    return bucket_limit(HEDGE_BUCKETS - 1);
+}
+
+/* Returns non-zero if REQUEST can be sent twice. */
+static int is_idempotent(serf_request_t *request)
+{
+    serf_bucket_t *body;
+    const char *method, *uri;
+
+    if (request->ssltunnel || request->cached || request->resp_bkt ||
+        !request->req_bkt || !SERF_BUCKET_IS_REQUEST(request->req_bkt))
+        return 0;
+
+    serf__bucket_request_get_line(request->req_bkt, &method, &uri);
+    if (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0 &&
+        strcmp(method, "OPTIONS") != 0)
+        return 0;
+
+    body = serf__bucket_request_swap_body(request->req_bkt, NULL);
+    serf__bucket_request_swap_body(request->req_bkt, body);
+
+    return body == NULL;
+}
+
+static void stop_waiting(serf_request_t *request)
+{
+    serf__hedge_t *hedge = request->conn->ctx->hedge;
+
+    if (request->hedge_state == SERF__HEDGE_WAITING)
+        hedge->nr_waiting--;
+    request->hedge_state = SERF__HEDGE_NONE;
+}
+
+static serf_bucket_t *discard_acceptor(serf_request_t *request,
+                                       serf_bucket_t *stream,
+                                       void *acceptor_baton,
+                                       apr_pool_t *pool)
+{
+    serf_bucket_alloc_t *allocator = serf_request_get_alloc(request);
+
+    return serf_bucket_response_create(
+               serf_bucket_barrier_create(stream, allocator), allocator);
+}
+
+static apr_status_t discard_handler(serf_request_t *request,
+                                    serf_bucket_t *response,
+                                    void *handler_baton,
+                                    apr_pool_t *pool)
+{
+    if (!response)
+        return APR_SUCCESS;
+
+    while (1) {
+        const char *data;
+        apr_size_t len;
+        apr_status_t status;
+
+        status = serf_bucket_read(response, SERF_READ_ALL_AVAIL, &data, &len);
+        if (status)
+            return status;
+    }
+}
+
+/* REQUEST lost the race with its peer, get rid of it. */
+static void drop_loser(serf_request_t *request)
+{
+    request->hedge_peer = NULL;
+    stop_waiting(request);
+
+    if (!request->writing_started) {
+        serf_request_cancel(request);
+        return;
+    }
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, request->conn->config,
+              "dropping the response of hedged request 0x%x\n", request);
+
+    /* Taking a written request off its connection would make the next
+       response go to the wrong request. */
+    request->acceptor = discard_acceptor;
+    request->acceptor_baton = NULL;
+    request->handler = discard_handler;
+    request->handler_baton = NULL;
+}
+
+/* Send a duplicate of the late REQUEST on another connection to its host. */
+static void send_hedge(serf_request_t *request)
+{
+    serf_context_t *ctx = request->conn->ctx;
+    serf_connection_t *other = NULL;
+    serf_request_t *dup;
+    unsigned int nr_of_reqs = 0;
+    int i;
+
+    stop_waiting(request);
+
+    /* The connection to the same host with the fewest requests. */
+    for (i = 0; i < ctx->conns->nelts; i++) {
+        serf_connection_t *conn = GET_CONN(ctx, i);
+        unsigned int nr = conn->written.length +
+                          conn->unwritten.length;
+
+        if (conn == request->conn || !conn->host_url ||
+            strcmp(conn->host_url, request->conn->host_url) != 0)
+            continue;
+
+        if (!other || nr < nr_of_reqs) {
+            other = conn;
+            nr_of_reqs = nr;
+        }
+    }
+
+    if (!other)
+        return;
+
+    dup = serf_connection_request_create(other, request->setup,
+                                         request->setup_baton);
+    (void)serf_request_set_priority(dup, request->priority_class,
+                                    request->deadline);
+    dup->hedge_state = SERF__HEDGE_DUPLICATE;
+    dup->hedge_peer = request;
+    request->hedge_state = SERF__HEDGE_SENT;
+    request->hedge_peer = dup;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, request->conn->config,
+              "hedging request 0x%x with request 0x%x on connection 0x%x\n",
+              request, dup, other);
+}
+
+void serf__hedge_request_start(serf_request_t *request)
+{
+    serf__hedge_t *hedge = request->conn->ctx->hedge;
+    apr_interval_time_t latency;
+
+    if (!hedge || !hedge->percentile || request->hedge_sent)
+        return;
+
+    if (request->hedge_state == SERF__HEDGE_DUPLICATE) {
+        request->hedge_sent = apr_time_now();
+        return;
+    }
+
+    if (request->hedge_state != SERF__HEDGE_NONE || !is_idempotent(request))
+        return;
+
+    request->hedge_sent = apr_time_now();
+
+    latency = latency_at(get_host(hedge, request->conn), hedge->percentile);
+    if (latency >= 0) {
+        request->hedge_state = SERF__HEDGE_WAITING;
+        request->hedge_at = request->hedge_sent + latency;
+        hedge->nr_waiting++;
+    }
+}
+
+void serf__hedge_response_started(serf_request_t *request)
+{
+    serf__hedge_t *hedge = request->conn->ctx->hedge;
+
+    if (!request->hedge_sent)
+        return;
+
+    if (hedge->percentile)
+        record_latency(get_host(hedge, request->conn),
+                       apr_time_now() - request->hedge_sent);
+    request->hedge_sent = 0;
+
+    if (request->hedge_peer) {
+        serf_request_t *loser = request->hedge_peer;
+
+        request->hedge_peer = NULL;
+        drop_loser(loser);
+    }
+    stop_waiting(request);
+}
+
+/* Hedge REQUEST if it's late, or update *NEXT, the time of the next
+   hedge. */
+static void check_late(serf_request_t *request, apr_time_t now,
+                       apr_time_t *next)
+{
+    if (request->hedge_state != SERF__HEDGE_WAITING)
+        return;
+
+    if (request->hedge_at <= now)
+        send_hedge(request);
+    else if (!*next || request->hedge_at < *next)
+        *next = request->hedge_at;
+}
+
+apr_interval_time_t serf__hedge_wakeup(serf_context_t *ctx)
+{
+    apr_time_t now, next = 0;
+    int i;
+
+    if (!ctx->hedge || !ctx->hedge->percentile || !ctx->hedge->nr_waiting)
+        return -1;
+
+    now = apr_time_now();
+    for (i = 0; i < ctx->conns->nelts; i++) {
+        serf_connection_t *conn = GET_CONN(ctx, i);
+        serf_request_t *request;
+
+        for (request = conn->written.head; request; request = request->next)
+            check_late(request, now, &next);
+
+        /* Requests that started writing are at the head of the queue. */
+        request = conn->unwritten.head;
+        if (request && request->writing_started)
+            check_late(request, now, &next);
+    }
+
+    return next ? next - now : -1;
+}
+
+int serf__hedge_notify_cancel(serf_request_t *request)
+{
+    return request->hedge_peer == NULL;
+}
+
+void serf__hedge_request_cancelled(serf_request_t *request)
+{
+    if (request->hedge_peer) {
+        serf_request_t *peer = request->hedge_peer;
+
+        request->hedge_peer = NULL;
+        drop_loser(peer);
+    }
+}
+
+void serf__hedge_request_done(serf_request_t *request)
+{
+    if (request->hedge_state == SERF__HEDGE_NONE && !request->hedge_peer)
+        return;
+
+    stop_waiting(request);
+
+    /* The peer carries on by itself. */
+    if (request->hedge_peer) {
+        serf_request_t *peer = request->hedge_peer;
+
+        peer->hedge_peer = NULL;
+        if (peer->hedge_state == SERF__HEDGE_SENT)
+            peer->hedge_state = SERF__HEDGE_NONE;
+        request->hedge_peer = NULL;
+    }
+}
+
+apr_status_t serf_context_set_hedging(serf_context_t *ctx, double percentile)
+{
+    if (percentile < 0.0 || percentile >= 100.0)
+        return APR_EINVAL;
+
+    if (!ctx->hedge) {
+        if (!percentile)
+            return APR_SUCCESS;
+
+        ctx->hedge = apr_pcalloc(ctx->pool, sizeof(*ctx->hedge));
+        ctx->hedge->pool = ctx->pool;
+        ctx->hedge->hosts = apr_hash_make(ctx->pool);
+    }
+    ctx->hedge->percentile = percentile;
+
+    return APR_SUCCESS;
+}
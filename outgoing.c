@@ -24,6 +24,9 @@
 
 #include "serf_private.h"
 
+/* Max. nr. of bytes of small requests gathered for one writev. */
+#define MAX_GATHER_SIZE 65536
+
 /* cleanup for sockets */
 static apr_status_t clean_skt(void *data)
 {
@@ -38,6 +41,7 @@ static apr_status_t clean_skt(void *data)
         serf_config_remove_value(conn->config, SERF_CONFIG_CONN_LOCALIP);
         serf_config_remove_value(conn->config, SERF_CONFIG_CONN_REMOTEIP);
     }
+    conn->mock_open = 0;
 
     return status;
 }
@@ -84,6 +88,36 @@ static apr_status_t clean_conn(void *data)
     return APR_SUCCESS;
 }
 
+/* Returns non-zero if REQUEST, the next request to write on CONN, should
+   wait: while the context is over its memory budget, or while requests of
+   a higher priority class are queued or in progress on any connection of
+   the context, a connection sends lower class requests only when it has no
+   other requests in progress. Priority requests (authentication retries,
+   requeued requests) and the CONNECT request of a tunnel never wait, others
+   might depend on them. */
+static int defer_request(serf_connection_t *conn, serf_request_t *request)
+{
+    serf_context_t *ctx = conn->ctx;
+    int i;
+
+    if (request->writing_started || request->priority || request->ssltunnel)
+        return 0;
+
+    /* Admit no new requests while over the memory budget. */
+    if (ctx->over_budget)
+        return 1;
+
+    if (conn->completed_requests == conn->completed_responses)
+        return 0;
+
+    for (i = request->priority_class + 1; i < SERF_PRIORITY_CLASSES; i++) {
+        if (ctx->reqs_per_class[i])
+            return 1;
+    }
+
+    return 0;
+}
+
 /* Check if there is data waiting to be sent over the socket. This can happen
    in two situations:
    - The connection queue has atleast one request with unwritten data.
@@ -98,7 +132,20 @@ request_or_data_pending(serf_request_t **next_req, serf_connection_t *conn)
 {
     /* Skip all requests that have been written completely but we're still
        waiting for a response. */
-    serf_request_t *request = conn->unwritten_reqs;
+    serf_request_t *request = conn->unwritten.head;
+
+    /* Hold back a lower priority request, as if there was nothing to write.
+       The connection is woken up again when its responses come in, or when
+       the memory budget allows new requests again. */
+    if (request && defer_request(conn, request))
+        request = NULL;
+
+    /* A request waiting for a 100 Continue has nothing more to write until
+       the server answers. */
+    if (request && request->writing_started &&
+        (request->expect_state == SERF__EXPECT_WAITING ||
+         request->expect_state == SERF__EXPECT_REJECTED))
+        request = NULL;
 
     if (next_req)
         *next_req = request;
@@ -122,6 +169,18 @@ request_or_data_pending(serf_request_t **next_req, serf_connection_t *conn)
     return 0;
 }
 
+/* Returns non-zero if the application paused the request whose response
+   is read next on CONN. */
+static int reading_paused(serf_connection_t *conn)
+{
+    serf_request_t *request = conn->written.head;
+
+    if (!request)
+        request = conn->unwritten.head;
+
+    return request && request->paused;
+}
+
 /* Update the pollset for this connection. We tweak the pollset based on
  * whether we want to read and/or write, given conditions within the
  * connection. If the connection is not (yet) in the pollset, then it
@@ -133,7 +192,7 @@ apr_status_t serf__conn_update_pollset(serf_connection_t *conn)
     apr_status_t status;
     apr_pollfd_t desc = { 0 };
 
-    if (!conn->skt) {
+    if (!conn->skt && !conn->mock_open) {
         return APR_SUCCESS;
     }
 
@@ -149,11 +208,12 @@ apr_status_t serf__conn_update_pollset(serf_connection_t *conn)
 
     /* Now put it back in with the correct read/write values. */
     desc.reqevents = APR_POLLHUP | APR_POLLERR;
-    if ((conn->written_reqs || conn->unwritten_reqs) &&
+    if ((conn->written.head || conn->unwritten.head) &&
         conn->state != SERF_CONN_INIT) {
         /* If there are any outstanding events, then we want to read. */
         /* ### not true. we only want to read IF we have sent some data */
-        desc.reqevents |= APR_POLLIN;
+        if (!conn->read_throttled_until && !reading_paused(conn))
+            desc.reqevents |= APR_POLLIN;
 
         /* Don't write if OpenSSL told us that it needs to read data first. */
         if (conn->stop_writing != 1) {
@@ -170,9 +230,10 @@ apr_status_t serf__conn_update_pollset(serf_connection_t *conn)
 
                 if ((conn->probable_keepalive_limit &&
                      conn->completed_requests > conn->probable_keepalive_limit) ||
-                    (conn->max_outstanding_requests &&
+                    (serf__pipeline_limit(conn) &&
                      conn->completed_requests - conn->completed_responses >=
-                     conn->max_outstanding_requests)) {
+                     serf__pipeline_limit(conn)) ||
+                    conn->write_throttled_until) {
                         /* we wouldn't try to write any way right now. */
                 }
                 else if (request_or_data_pending(NULL, conn)) {
@@ -183,7 +244,7 @@ apr_status_t serf__conn_update_pollset(serf_connection_t *conn)
     }
 
     /* If we can have async responses, always look for something to read. */
-    if (conn->async_responses) {
+    if (conn->async_responses && !conn->read_throttled_until) {
         desc.reqevents |= APR_POLLIN;
     }
 
@@ -267,6 +328,17 @@ static apr_status_t do_conn_setup(serf_connection_t *conn)
         return status;
     }
 
+    /* Without wrapping buckets the data read from the requests stays valid
+       until the requests are destroyed, so it can be gathered. */
+    conn->gather = (ostream == conn->ostream_tail);
+
+    if (SERF_BUCKET_IS_SSL_DECRYPT(conn->stream))
+        conn->ssl_ctx = serf_bucket_ssl_decrypt_context_get(conn->stream);
+
+    serf__capture_conn_setup(conn);
+    serf__cache_conn_setup(conn);
+    serf__coalesce_conn_setup(conn);
+
     /* Share the configuration with all the buckets in the newly created output
      chain (see PLAIN or ENCRYPTED scenario's), including the request buckets
      created by the application (ostream_tail will handle this for us). */
@@ -369,6 +441,59 @@ static void store_ipaddresses_in_config(serf_config_t *config,
     }
 }
 
+/* Create a non-blocking socket for CONN and start connecting it. */
+static apr_status_t open_socket(serf_connection_t *conn)
+{
+    apr_status_t status;
+    apr_socket_t *skt;
+
+    apr_pool_clear(conn->skt_pool);
+    apr_pool_cleanup_register(conn->skt_pool, conn, clean_skt,
+                              apr_pool_cleanup_null);
+
+    status = apr_socket_create(&skt, conn->address->family,
+                               SOCK_STREAM,
+#if APR_MAJOR_VERSION > 0
+                               APR_PROTO_TCP,
+#endif
+                               conn->skt_pool);
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "created socket for conn 0x%x, status %d\n", conn, status);
+    if (status != APR_SUCCESS)
+        return status;
+
+    /* Set the socket to be non-blocking */
+    if ((status = apr_socket_timeout_set(skt, 0)) != APR_SUCCESS)
+        return status;
+
+    /* Disable Nagle's algorithm */
+    if ((status = apr_socket_opt_set(skt,
+                                     APR_TCP_NODELAY, 1)) != APR_SUCCESS)
+        return status;
+
+    /* Configured. Store it into the connection now. */
+    conn->skt = skt;
+
+    /* Remember time when we started connecting to server to calculate
+       network latency. */
+    conn->connect_time = apr_time_now();
+
+    /* Now that the socket is set up, let's connect it. This should
+     * return immediately.
+     */
+    status = apr_socket_connect(skt, conn->address);
+    store_ipaddresses_in_config(conn->config, skt);
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "connected socket for conn 0x%x, status %d\n", conn, status);
+    if (status != APR_SUCCESS) {
+        if (!APR_STATUS_IS_EINPROGRESS(status))
+            return status;
+    }
+
+    return APR_SUCCESS;
+}
+
 /* Create and connect sockets for any connections which don't have them
  * yet. This is the core of our lazy-connect behavior.
  */
@@ -379,11 +504,10 @@ apr_status_t serf__open_connections(serf_context_t *ctx)
     for (i = ctx->conns->nelts; i--; ) {
         serf_connection_t *conn = GET_CONN(ctx, i);
         apr_status_t status;
-        apr_socket_t *skt;
 
         conn->seen_in_pollset = 0;
 
-        if (conn->skt != NULL) {
+        if (conn->skt != NULL || conn->mock_open) {
 #ifdef SERF_DEBUG_BUCKET_USE
             check_buckets_drained(conn);
 #endif
@@ -391,51 +515,18 @@ apr_status_t serf__open_connections(serf_context_t *ctx)
         }
 
         /* Delay opening until we have something to deliver! */
-        if (conn->unwritten_reqs == NULL) {
+        if (conn->unwritten.head == NULL) {
             continue;
         }
 
-        apr_pool_clear(conn->skt_pool);
-        apr_pool_cleanup_register(conn->skt_pool, conn, clean_skt,
-                                  apr_pool_cleanup_null);
-
-        status = apr_socket_create(&skt, conn->address->family,
-                                   SOCK_STREAM,
-#if APR_MAJOR_VERSION > 0
-                                   APR_PROTO_TCP,
-#endif
-                                   conn->skt_pool);
-        serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
-                  "created socket for conn 0x%x, status %d\n", conn, status);
-        if (status != APR_SUCCESS)
-            return status;
-
-        /* Set the socket to be non-blocking */
-        if ((status = apr_socket_timeout_set(skt, 0)) != APR_SUCCESS)
-            return status;
-
-        /* Disable Nagle's algorithm */
-        if ((status = apr_socket_opt_set(skt,
-                                         APR_TCP_NODELAY, 1)) != APR_SUCCESS)
-            return status;
-
-        /* Configured. Store it into the connection now. */
-        conn->skt = skt;
-
-        /* Remember time when we started connecting to server to calculate
-           network latency. */
-        conn->connect_time = apr_time_now();
-
-        /* Now that the socket is set up, let's connect it. This should
-         * return immediately.
-         */
-        status = apr_socket_connect(skt, conn->address);
-        store_ipaddresses_in_config(conn->config, skt);
-
-        serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
-                  "connected socket for conn 0x%x, status %d\n", conn, status);
-        if (status != APR_SUCCESS) {
-            if (!APR_STATUS_IS_EINPROGRESS(status))
+        if (conn->mock_writev) {
+            /* Nothing to connect, the transport is ready immediately. */
+            conn->mock_open = 1;
+            conn->connect_time = apr_time_now();
+        }
+        else {
+            status = open_socket(conn);
+            if (status)
                 return status;
         }
 
@@ -478,6 +569,66 @@ apr_status_t serf__open_connections(serf_context_t *ctx)
     return APR_SUCCESS;
 }
 
+/* Destroy the buckets of the gathered requests of CONN of which all data
+   was written, or of all of them if ALL is set. */
+static void release_gathered(serf_connection_t *conn, int all)
+{
+    serf_request_t *request;
+
+    for (request = conn->written.head; request && conn->nr_gathered;
+         request = request->next) {
+        if (request->gathered_bkt &&
+            (all || request->gathered_end <= conn->vec_written)) {
+            serf_bucket_destroy(request->gathered_bkt);
+            request->gathered_bkt = NULL;
+            conn->nr_gathered--;
+        }
+    }
+}
+
+/* Copy the unwritten data of CONN, so it no longer depends on the buckets
+   it was read from. */
+static void copy_vec(serf_connection_t *conn)
+{
+    apr_size_t len = 0;
+    char *copy;
+    int i;
+
+    for (i = 0; i < conn->vec_len; i++)
+        len += conn->vec[i].iov_len;
+
+    copy = serf_bucket_mem_alloc(conn->allocator, len);
+    len = 0;
+    for (i = 0; i < conn->vec_len; i++) {
+        memcpy(copy + len, conn->vec[i].iov_base, conn->vec[i].iov_len);
+        len += conn->vec[i].iov_len;
+    }
+
+    /* The old copy may have been the source. */
+    if (conn->vec_copy)
+        serf_bucket_mem_free(conn->allocator, conn->vec_copy);
+    conn->vec_copy = copy;
+
+    conn->vec[0].iov_base = copy;
+    conn->vec[0].iov_len = len;
+    conn->vec_len = 1;
+}
+
+/* Drop the unwritten data of CONN. */
+static void clear_vec(serf_connection_t *conn)
+{
+    conn->vec_len = 0;
+    conn->vec_gathered = 0;
+    /* The dropped data will never be written, don't count it as queued. */
+    conn->vec_queued = conn->vec_written;
+    release_gathered(conn, 1);
+
+    if (conn->vec_copy) {
+        serf_bucket_mem_free(conn->allocator, conn->vec_copy);
+        conn->vec_copy = NULL;
+    }
+}
+
 static apr_status_t no_more_writes(serf_connection_t *conn)
 {
     /* Note that we should hold new requests until we open our new socket. */
@@ -486,7 +637,7 @@ static apr_status_t no_more_writes(serf_connection_t *conn)
               "stop writing on conn 0x%x\n", conn);
 
     /* Clear our iovec. */
-    conn->vec_len = 0;
+    clear_vec(conn);
 
     /* Update the pollset to know we don't want to write on this socket any
      * more.
@@ -516,22 +667,154 @@ static apr_status_t is_conn_closing(serf_bucket_t *response)
     return APR_SUCCESS;
 }
 
-static void link_requests(serf_request_t **list, serf_request_t **tail,
-                          serf_request_t *request)
+/* Link REQUEST into QUEUE after AFTER, or at its head if AFTER is NULL. */
+static void queue_insert(serf__req_queue_t *queue, serf_request_t *after,
+                         serf_request_t *request)
+{
+    request->prev = after;
+    request->next = after ? after->next : queue->head;
+    if (request->next)
+        request->next->prev = request;
+    else
+        queue->tail = request;
+    if (after)
+        after->next = request;
+    else
+        queue->head = request;
+
+    request->queue = queue;
+    queue->length++;
+}
+
+static void queue_append(serf__req_queue_t *queue, serf_request_t *request)
+{
+    queue_insert(queue, queue->tail, request);
+}
+
+static void queue_remove(serf__req_queue_t *queue, serf_request_t *request)
 {
-    if (*list == NULL) {
-        *list = request;
-        *tail = request;
+    if (request->prev)
+        request->prev->next = request->next;
+    else
+        queue->head = request->next;
+    if (request->next)
+        request->next->prev = request->prev;
+    else
+        queue->tail = request->prev;
+
+    request->next = NULL;
+    request->prev = NULL;
+    request->queue = NULL;
+    queue->length--;
+}
+
+/* The unwritten requests are written in order of rank, highest first: the
+   CONNECT request of an ssltunnel, then priority requests, then the others,
+   each by priority class. Within a rank, requests with a deadline go first,
+   earliest first, and the others in the order in which they were queued. */
+static int request_rank(const serf_request_t *request)
+{
+    return (request->ssltunnel * 2 + request->priority) *
+           SERF_PRIORITY_CLASSES + request->priority_class;
+}
+
+/* REQUEST, which is still in the unwritten queue of CONN, no longer counts
+   as the last request of its rank. */
+static void drop_rank_tail(serf_connection_t *conn, serf_request_t *request)
+{
+    int rank = request_rank(request);
+    serf_request_t *prev = request->prev;
+
+    if (conn->rank_tails[rank] != request)
+        return;
+
+    if (prev && !prev->writing_started && request_rank(prev) == rank)
+        conn->rank_tails[rank] = prev;
+    else
+        conn->rank_tails[rank] = NULL;
+}
+
+/* Add REQUEST to the unwritten requests of CONN, in the order in which they
+   should be written. Requests of which writing has started stay first. */
+static void insert_request(serf_connection_t *conn, serf_request_t *request)
+{
+    int rank = request_rank(request);
+    serf_request_t *after = NULL;
+    int i;
+
+    /* Go after the requests of the same or a higher rank, ... */
+    for (i = rank; i < SERF__NR_OF_RANKS && !after; i++)
+        after = conn->rank_tails[i];
+
+    /* ... or else after the requests that are (partially) written. */
+    if (!after && conn->unwritten.head &&
+        conn->unwritten.head->writing_started) {
+        after = conn->unwritten.head;
+        while (after->next && after->next->writing_started)
+            after = after->next;
     }
-    else {
-        (*tail)->next = request;
-        *tail = request;
+
+    /* Go before the requests of the same rank with a later or no
+       deadline. */
+    if (request->deadline) {
+        while (after && !after->writing_started &&
+               request_rank(after) == rank &&
+               (!after->deadline || request->deadline < after->deadline))
+            after = after->prev;
     }
+
+    queue_insert(&conn->unwritten, after, request);
+
+    if (!conn->rank_tails[rank] || conn->rank_tails[rank] == after)
+        conn->rank_tails[rank] = request;
+}
+
+/* Remove REQUEST from the unwritten requests of CONN. */
+static void unlink_unwritten_request(serf_connection_t *conn,
+                                     serf_request_t *request)
+{
+    drop_rank_tail(conn, request);
+    queue_remove(&conn->unwritten, request);
+}
+
+/* Remove REQUEST from the queue that holds it, if any. */
+static void unlink_request(serf_connection_t *conn, serf_request_t *request)
+{
+    if (request->queue == &conn->unwritten)
+        unlink_unwritten_request(conn, request);
+    else if (request->queue)
+        queue_remove(request->queue, request);
+}
+
+/* Move REQUEST to PRIORITY_CLASS in the request counters of the context. */
+static void set_priority_class(serf_request_t *request, int priority_class)
+{
+    serf_context_t *ctx = request->conn->ctx;
+
+    ctx->reqs_per_class[request->priority_class]--;
+    ctx->reqs_per_class[priority_class]++;
+    request->priority_class = priority_class;
 }
 
 static apr_status_t destroy_request(serf_request_t *request)
 {
     serf_connection_t *conn = request->conn;
+    serf_context_t *ctx = conn->ctx;
+
+    /* When the last request of a class is done, the lower class requests
+       held back by defer_request can go. */
+    if (--ctx->reqs_per_class[request->priority_class] == 0 &&
+        request->priority_class > SERF_PRIORITY_BACKGROUND) {
+        int i;
+
+        for (i = 0; i < ctx->conns->nelts; i++) {
+            serf_connection_t *other = GET_CONN(ctx, i);
+
+            if (other->unwritten.head)
+                other->dirty_conn = 1;
+        }
+        ctx->dirty_pollset = 1;
+    }
 
     /* The request and response buckets are no longer needed,
        nor is the request's pool.  */
@@ -545,6 +828,24 @@ static apr_status_t destroy_request(serf_request_t *request)
         serf_bucket_destroy(request->req_bkt);
         request->req_bkt = NULL;
     }
+    if (request->gathered_bkt) {
+        /* Its data may still wait to be written. */
+        if (request->gathered_end > conn->vec_written && conn->vec_len)
+            copy_vec(conn);
+        serf_bucket_destroy(request->gathered_bkt);
+        request->gathered_bkt = NULL;
+        conn->nr_gathered--;
+    }
+    if (request->expect_state == SERF__EXPECT_WAITING)
+        ctx->expect_waiting--;
+    if (request->expect_body) {
+        serf_bucket_destroy(request->expect_body);
+        request->expect_body = NULL;
+    }
+    serf__cache_request_done(request);
+    serf__coalesce_request_done(request);
+    serf__resume_request_done(request);
+    serf__hedge_request_done(request);
 
     if (request->respool) {
         serf_debug__bucket_alloc_check(request->allocator);
@@ -559,11 +860,14 @@ static apr_status_t destroy_request(serf_request_t *request)
 }
 
 static apr_status_t cancel_request(serf_request_t *request,
-                                   serf_request_t **list,
                                    int notify_request)
 {
+    /* Unlink it first, so the handler can queue new requests. */
+    unlink_request(request->conn, request);
+
     /* If we haven't run setup, then we won't have a handler to call. */
-    if (request->handler && notify_request) {
+    if (request->handler && notify_request &&
+        serf__hedge_notify_cancel(request)) {
         /* We actually don't care what the handler returns.
          * We have bigger matters at hand.
          */
@@ -571,36 +875,9 @@ static apr_status_t cancel_request(serf_request_t *request,
                             request->respool);
     }
 
-    if (*list == request) {
-        *list = request->next;
-    }
-    else {
-        serf_request_t *scan = *list;
-
-        while (scan->next && scan->next != request)
-            scan = scan->next;
-
-        if (scan->next) {
-            scan->next = scan->next->next;
-        }
-    }
-
     return destroy_request(request);
 }
 
-/* Calculate the length of a linked list of requests. */
-static unsigned int req_list_length(serf_request_t *req)
-{
-    unsigned int length = 0;
-
-    while (req) {
-        length++;
-        req = req->next;
-    }
-
-    return length;
-}
-
 static apr_status_t remove_connection(serf_context_t *ctx,
                                       serf_connection_t *conn)
 {
@@ -621,61 +898,114 @@ static void handle_conn_closed(serf_connection_t *conn, apr_status_t status)
                     conn->pool);
 }
 
+/* Prepare REQUEST, of which the response was partly read, to be sent
+   again for the rest of the response. Returns 0 if it can't be resumed. */
+static int resume_request(serf_request_t *request)
+{
+    serf_response_acceptor_t acceptor;
+    serf_response_handler_t handler;
+    void *acceptor_baton, *handler_baton;
+    apr_status_t status;
+
+    if (!serf__resume_prepare(request))
+        return 0;
+
+    /* Only the request bucket is needed, the response continues with the
+       acceptor and handler it has. */
+    status = request->setup(request, request->setup_baton,
+                            &request->req_bkt,
+                            &acceptor, &acceptor_baton,
+                            &handler, &handler_baton,
+                            request->respool);
+    if (status || !request->req_bkt ||
+        !SERF_BUCKET_IS_REQUEST(request->req_bkt)) {
+        if (request->req_bkt) {
+            serf_bucket_destroy(request->req_bkt);
+            request->req_bkt = NULL;
+        }
+        return 0;
+    }
+
+    serf__resume_set_range(request);
+    request->writing_started = 0;
+
+    return 1;
+}
+
 static apr_status_t reset_connection(serf_connection_t *conn,
                                      int requeue_requests)
 {
     serf_context_t *ctx = conn->ctx;
     apr_status_t status;
-    serf_request_t *old_reqs;
+    serf__req_queue_t old_reqs;
+    serf_request_t *request;
+    int i;
 
     serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
               "reset connection 0x%x\n", conn);
 
+    if (conn->pipeline.max_depth)
+        serf__pipeline_reset(conn);
+
+    /* Don't try to resume any writes. The gathered requests are cancelled
+       or requeued below, their data isn't needed anymore. */
+    clear_vec(conn);
+
     conn->probable_keepalive_limit = conn->completed_responses;
     conn->completed_requests = 0;
     conn->completed_responses = 0;
 
-    /* Clear the unwritten_reqs queue, so the application can requeue cancelled
+    /* Clear the unwritten queue, so the application can requeue cancelled
        requests on it for the new socket. */
-    old_reqs = conn->unwritten_reqs;
-    conn->unwritten_reqs = NULL;
-    conn->unwritten_reqs_tail = NULL;
+    old_reqs = conn->unwritten;
+    for (request = old_reqs.head; request; request = request->next)
+        request->queue = &old_reqs;
+    conn->unwritten.head = NULL;
+    conn->unwritten.tail = NULL;
+    conn->unwritten.length = 0;
+    for (i = 0; i < SERF__NR_OF_RANKS; i++)
+        conn->rank_tails[i] = NULL;
 
     /* First, cancel all written requests for which we haven't received a 
        response yet. Inform the application that the request is cancelled, 
-       so it can requeue them if needed. */
-    while (conn->written_reqs) {
-        cancel_request(conn->written_reqs, &conn->written_reqs,
-                       requeue_requests);
+       so it can requeue them if needed. Requests of which the response can
+       be resumed are sent again for the rest of the response. */
+    while (conn->written.head) {
+        request = conn->written.head;
+
+        if (requeue_requests && request->resume && resume_request(request)) {
+            queue_remove(&conn->written, request);
+            insert_request(conn, request);
+            continue;
+        }
+        cancel_request(request, requeue_requests);
     }
-    conn->written_reqs_tail = NULL;
 
     /* Handle all outstanding unwritten requests.
        TODO: what about a partially written request? */
-    while (old_reqs) {
+    while (old_reqs.head) {
+        request = old_reqs.head;
+
+        queue_remove(&old_reqs, request);
+
         /* If we haven't started to write the connection, bring it over
          * unchanged to our new socket.
          * Do not copy a CONNECT request to the new connection, the ssl tunnel
          * setup code will create a new CONNECT request already.
          */
-        if (requeue_requests && !old_reqs->writing_started &&
-            !old_reqs->ssltunnel) {
-
-            serf_request_t *req = old_reqs;
-            old_reqs = old_reqs->next;
-            req->next = NULL;
-            link_requests(&conn->unwritten_reqs, &conn->unwritten_reqs_tail,
-                          req);
+        if (requeue_requests && !request->writing_started &&
+            !request->ssltunnel) {
+            insert_request(conn, request);
         }
         else {
             /* We don't want to requeue the request or this request was partially
                written. Inform the application that the request is cancelled. */
-            cancel_request(old_reqs, &old_reqs, requeue_requests);
+            cancel_request(request, requeue_requests);
         }
     }
 
     /* Requests queue has been prepared for a new socket, close the old one. */
-    if (conn->skt != NULL) {
+    if (conn->skt != NULL || conn->mock_open) {
         remove_connection(ctx, conn);
         status = clean_skt(conn);
         if (conn->closed != NULL) {
@@ -687,12 +1017,10 @@ static apr_status_t reset_connection(serf_connection_t *conn,
         serf_bucket_destroy(conn->stream);
         conn->stream = NULL;
     }
+    conn->ssl_ctx = NULL;
 
     destroy_ostream(conn);
 
-    /* Don't try to resume any writes */
-    conn->vec_len = 0;
-
     conn->dirty_conn = 1;
     conn->ctx->dirty_pollset = 1;
     conn->state = SERF_CONN_INIT;
@@ -702,10 +1030,6 @@ static apr_status_t reset_connection(serf_connection_t *conn,
     /* Let our context know that we've 'reset' the socket already. */
     conn->seen_in_pollset |= APR_POLLHUP;
 
-    /* Recalculate the current list length */
-    conn->nr_of_written_reqs = 0;
-    conn->nr_of_unwritten_reqs = req_list_length(conn->unwritten_reqs);
-
     /* Found the connection. Closed it. All done. */
     return APR_SUCCESS;
 }
@@ -715,8 +1039,12 @@ static apr_status_t socket_writev(serf_connection_t *conn)
     apr_size_t written;
     apr_status_t status;
 
-    status = apr_socket_sendv(conn->skt, conn->vec,
-                              conn->vec_len, &written);
+    if (conn->mock_writev)
+        status = conn->mock_writev(conn->mock_baton, conn->vec,
+                                   conn->vec_len, &written);
+    else
+        status = apr_socket_sendv(conn->skt, conn->vec,
+                                  conn->vec_len, &written);
     if (status && !APR_STATUS_IS_EAGAIN(status))
         serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
                   "socket_sendv error %d\n", status);
@@ -729,6 +1057,8 @@ static apr_status_t socket_writev(serf_connection_t *conn)
         serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
                   "--- socket_sendv: %d bytes. --\n", written);
 
+        conn->vec_written += written;
+
         for (i = 0; i < conn->vec_len; i++) {
             len += conn->vec[i].iov_len;
             if (written < len) {
@@ -751,41 +1081,281 @@ static apr_status_t socket_writev(serf_connection_t *conn)
         }
         if (len == written) {
             conn->vec_len = 0;
+            conn->vec_gathered = 0;
+            if (conn->vec_copy) {
+                serf_bucket_mem_free(conn->allocator, conn->vec_copy);
+                conn->vec_copy = NULL;
+            }
         }
+        if (conn->nr_gathered)
+            release_gathered(conn, 0);
         serf__log_nopref(LOGLVL_DEBUG, LOGCOMP_RAWMSG, conn->config, "\n");
 
-        /* Log progress information */
-        serf__context_progress_delta(conn->ctx, 0, written);
+        /* Log progress information */
+        serf__context_progress_delta(conn->ctx, 0, written);
+    }
+
+    return status;
+}
+
+static apr_status_t setup_request(serf_request_t *request)
+{
+    serf_connection_t *conn = request->conn;
+    apr_status_t status;
+
+    /* Now that we are about to serve the request, allocate a pool. */
+    apr_pool_create(&request->respool, conn->pool);
+    request->allocator = serf_bucket_allocator_create(request->respool,
+                                                      NULL, NULL);
+    serf__bucket_allocator_account(request->allocator, &conn->ctx->mem_used);
+    apr_pool_cleanup_register(request->respool, request,
+                              clean_resp, apr_pool_cleanup_null);
+
+    /* Fill in the rest of the values for the request. */
+    status = request->setup(request, request->setup_baton,
+                            &request->req_bkt,
+                            &request->acceptor,
+                            &request->acceptor_baton,
+                            &request->handler,
+                            &request->handler_baton,
+                            request->respool);
+    return status;
+}
+
+/* Look up REQUEST, which isn't written yet, in the response cache and in
+   the coalescing groups. If a fresh response is found, or an identical
+   request is in flight, the request moves to the cached requests of CONN
+   and *CACHED is set. */
+static apr_status_t lookup_cached(serf_connection_t *conn,
+                                  serf_request_t *request,
+                                  int *cached)
+{
+    serf_context_t *ctx = conn->ctx;
+    apr_status_t status;
+    int follower = 0;
+
+    *cached = 0;
+
+    if (request->req_bkt == NULL) {
+        status = setup_request(request);
+        if (status)
+            return status;
+    }
+    request->looked_up = 1;
+
+    if (ctx->cache) {
+        status = serf__cache_lookup(request, cached);
+        if (status)
+            return status;
+    }
+    if (!*cached && ctx->coalesce) {
+        status = serf__coalesce_lookup(request, &follower);
+        if (status)
+            return status;
+        *cached = follower;
+    }
+    if (!*cached)
+        return APR_SUCCESS;
+
+    unlink_unwritten_request(conn, request);
+    queue_append(&conn->cached, request);
+    request->cached = 1;
+    /* A follower waits for the response of its leader. */
+    if (!follower)
+        ctx->cached_pending = 1;
+
+    return APR_SUCCESS;
+}
+
+/* Look up the new requests of CONN in the response cache and the
+   coalescing groups. */
+static apr_status_t lookup_cached_requests(serf_connection_t *conn)
+{
+    serf_request_t *request = conn->unwritten.head;
+
+    while (request) {
+        serf_request_t *next = request->next;
+
+        if (!request->writing_started && !request->looked_up) {
+            apr_status_t status;
+            int cached;
+
+            status = lookup_cached(conn, request, &cached);
+            if (status)
+                return status;
+        }
+        request = next;
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Hold callback of the aggregate that takes the place of the request body
+   while waiting for a 100 Continue. */
+static apr_status_t expect_hold_body(void *baton, serf_bucket_t *aggregate)
+{
+    serf_request_t *request = baton;
+
+    if (request->expect_state == SERF__EXPECT_WAITING ||
+        request->expect_state == SERF__EXPECT_REJECTED)
+        return APR_EAGAIN;
+
+    return APR_EOF;
+}
+
+/* Send REQUEST with Expect: 100-continue. Its body is held back until the
+   server answers or the timeout expires. */
+static void expect_continue_start(serf_request_t *request)
+{
+    serf_bucket_t *body;
+
+    if (request->ssltunnel || !SERF_BUCKET_IS_REQUEST(request->req_bkt))
+        return;
+
+    body = serf__bucket_request_swap_body(request->req_bkt, NULL);
+    if (!body)
+        return;
+
+    request->expect_body = body;
+    request->expect_hold =
+        serf_bucket_aggregate_create(request->req_bkt->allocator);
+    serf_bucket_aggregate_hold_open(request->expect_hold, expect_hold_body,
+                                    request);
+    serf__bucket_request_swap_body(request->req_bkt, request->expect_hold);
+
+    serf_bucket_headers_setn(serf_bucket_request_get_headers(request->req_bkt),
+                             "Expect", "100-continue");
+
+    request->expect_state = SERF__EXPECT_WAITING;
+    request->expect_until = apr_time_now() + request->expect_timeout;
+    request->conn->ctx->expect_waiting++;
+}
+
+/* Stop waiting for a 100 Continue for REQUEST. If SEND_BODY is set, the
+   body is sent now, otherwise it's never sent. */
+static void expect_continue_done(serf_request_t *request, int send_body)
+{
+    serf_connection_t *conn = request->conn;
+
+    if (request->expect_state == SERF__EXPECT_WAITING)
+        conn->ctx->expect_waiting--;
+
+    if (send_body) {
+        serf_bucket_aggregate_append(request->expect_hold,
+                                     request->expect_body);
+        request->expect_body = NULL;
+        request->expect_state = SERF__EXPECT_SENDING;
+
+        conn->dirty_conn = 1;
+        conn->ctx->dirty_pollset = 1;
+    }
+    else {
+        request->expect_state = SERF__EXPECT_REJECTED;
+    }
+}
+
+apr_interval_time_t serf__expect_continue_wakeup(serf_context_t *ctx)
+{
+    apr_time_t now, next = 0;
+    int i;
+
+    if (!ctx->expect_waiting)
+        return -1;
+
+    now = apr_time_now();
+    for (i = 0; i < ctx->conns->nelts; i++) {
+        serf_connection_t *conn = GET_CONN(ctx, i);
+        serf_request_t *request = conn->unwritten.head;
+
+        /* Requests that started writing are at the head of the queue. */
+        if (!request || request->expect_state != SERF__EXPECT_WAITING)
+            continue;
+
+        if (request->expect_until <= now) {
+            /* The server doesn't answer, maybe it doesn't support
+               100-continue. Send the body anyway. */
+            expect_continue_done(request, 1);
+        }
+        else if (!next || request->expect_until < next) {
+            next = request->expect_until;
+        }
+    }
+
+    return next ? next - now : -1;
+}
+
+/* Look at the status of the response to REQUEST, which was sent with
+   Expect: 100-continue. An interim 1xx response is dropped and *DROPPED is
+   set, a 100 Continue also releases the request body. A final status
+   before the body was released means the body won't be sent. */
+static apr_status_t check_expect_continue(serf_request_t *request,
+                                          int *dropped)
+{
+    serf_status_line sl;
+    apr_status_t status;
+
+    *dropped = 0;
+
+    /* Can't look into the application's own bucket types. */
+    if (!SERF_BUCKET_IS_RESPONSE(request->resp_bkt)) {
+        if (request->expect_state == SERF__EXPECT_WAITING)
+            expect_continue_done(request, 1);
+        request->expect_state = SERF__EXPECT_NONE;
+        return APR_SUCCESS;
+    }
+
+    status = serf_bucket_response_status(request->resp_bkt, &sl);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+    if (!sl.version) {
+        /* If the response ends here, let the application handle it. */
+        return APR_STATUS_IS_EOF(status) ? APR_SUCCESS : status;
     }
 
-    return status;
+    if (sl.code >= 100 && sl.code < 200 && sl.code != 101) {
+        status = serf_bucket_response_wait_for_headers(request->resp_bkt);
+        /* The headers may be complete, with EAGAIN from reading ahead. */
+        if (APR_STATUS_IS_EAGAIN(status))
+            status = serf_bucket_response_wait_for_headers(request->resp_bkt);
+        if (status)
+            return status;
+
+        serf_bucket_destroy(request->resp_bkt);
+        request->resp_bkt = NULL;
+        *dropped = 1;
+
+        if (sl.code == 100 && request->expect_state == SERF__EXPECT_WAITING)
+            expect_continue_done(request, 1);
+
+        return APR_SUCCESS;
+    }
+
+    /* The final response. */
+    if (request->expect_state == SERF__EXPECT_WAITING)
+        expect_continue_done(request, 0);
+    else
+        request->expect_state = SERF__EXPECT_NONE;
+
+    return APR_SUCCESS;
 }
 
-static apr_status_t setup_request(serf_request_t *request)
+/* Returns non-zero if the data of REQUEST, which was read completely from
+   OSTREAMH, can stay in the VEC of CONN while the next request is read. */
+static int may_gather(serf_connection_t *conn, serf_request_t *request,
+                      serf_bucket_t *ostreamh)
 {
-    serf_connection_t *conn = request->conn;
-    apr_status_t status;
+    if (!conn->gather || ostreamh != conn->ostream_head ||
+        conn->async_responses || !request->next)
+        return 0;
 
-    /* Now that we are about to serve the request, allocate a pool. */
-    apr_pool_create(&request->respool, conn->pool);
-    request->allocator = serf_bucket_allocator_create(request->respool,
-                                                      NULL, NULL);
-    apr_pool_cleanup_register(request->respool, request,
-                              clean_resp, apr_pool_cleanup_null);
+    if (!conn->vec_len || conn->vec_len >= IOV_MAX)
+        return 0;
 
-    /* Fill in the rest of the values for the request. */
-    status = request->setup(request, request->setup_baton,
-                            &request->req_bkt,
-                            &request->acceptor,
-                            &request->acceptor_baton,
-                            &request->handler,
-                            &request->handler_baton,
-                            request->respool);
-    return status;
+    return conn->vec_queued - conn->vec_written < MAX_GATHER_SIZE;
 }
 
-/* write data out to the connection */
-static apr_status_t write_to_connection(serf_connection_t *conn)
+/* write the requests out to the connection */
+static apr_status_t write_requests(serf_connection_t *conn)
 {
     if (conn->probable_keepalive_limit &&
         conn->completed_requests > conn->probable_keepalive_limit) {
@@ -808,6 +1378,11 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
         serf_bucket_t *ostreamt;
         serf_bucket_t *ostreamh;
         int reqs_in_progress;
+        unsigned int max_in_flight;
+        apr_size_t write_avail;
+        apr_size_t read_len = 0;
+        int vecs_read, i;
+        int gather;
 
         reqs_in_progress = conn->completed_requests - conn->completed_responses;
 
@@ -822,8 +1397,8 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
 
         /* We try to limit the number of in-flight requests so that we
            don't have to repeat too many if the connection drops.  */
-        if (conn->max_outstanding_requests
-            && (reqs_in_progress >= conn->max_outstanding_requests))
+        max_in_flight = serf__pipeline_limit(conn);
+        if (max_in_flight && (reqs_in_progress >= max_in_flight))
         {
             /* backoff for now. */
             return APR_SUCCESS;
@@ -836,8 +1411,9 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
             return APR_SUCCESS;
         }
 
-        /* If we have unwritten data, then write what we can. */
-        while (conn->vec_len) {
+        /* If we have unwritten data, then write what we can. Gathered data
+           can wait for more. */
+        while (conn->vec_len && !conn->vec_gathered) {
             status = socket_writev(conn);
 
             /* If the write would have blocked, then we're done. Don't try
@@ -870,6 +1446,28 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
             return APR_SUCCESS;
         }
 
+        /* No need to write the request if the response is in the cache, or
+           if an identical request is in flight. */
+        if (request && !request->writing_started && !request->looked_up &&
+            (conn->ctx->cache || conn->ctx->coalesce)) {
+            int cached;
+
+            status = lookup_cached(conn, request, &cached);
+            if (status)
+                return status;
+            if (cached)
+                continue;
+        }
+
+        /* Respect the rate limits: we're throttled if no bytes may be
+           written, or if no new request may be started now. */
+        write_avail = serf__ratelimit_write_avail(conn);
+        if (!write_avail)
+            return APR_SUCCESS;
+        if (request && !request->writing_started &&
+            !serf__ratelimit_start_request(conn))
+            return APR_SUCCESS;
+
         status = prepare_conn_streams(conn, &ostreamt, &ostreamh);
         if (status) {
             return status;
@@ -885,7 +1483,19 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
             }
 
             if (!request->writing_started) {
+                drop_rank_tail(conn, request);
                 request->writing_started = 1;
+                if (request->expect_timeout)
+                    expect_continue_start(request);
+                if (conn->ctx->resume_responses)
+                    serf__resume_request_start(request);
+                if (conn->ctx->hedge)
+                    serf__hedge_request_start(request);
+                /* Last, the others need to see the request bucket, not the
+                   capture's tap around it. */
+                serf__capture_request_start(request);
+                if (conn->backend || conn->pipeline.max_depth)
+                    request->written_time = apr_time_now();
                 serf_bucket_aggregate_append(ostreamt, request->req_bkt);
             }
         }
@@ -896,10 +1506,20 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
            a lower number, like the size of one or a few TCP packets, the
            available TCP buffer size ... */
         read_status = serf_bucket_read_iovec(ostreamh,
-                                             SERF_READ_ALL_AVAIL,
-                                             IOV_MAX,
-                                             conn->vec,
-                                             &conn->vec_len);
+                                             write_avail,
+                                             IOV_MAX - conn->vec_len,
+                                             conn->vec + conn->vec_len,
+                                             &vecs_read);
+
+        for (i = conn->vec_len; i < conn->vec_len + vecs_read; i++)
+            read_len += conn->vec[i].iov_len;
+        conn->vec_len += vecs_read;
+        conn->vec_queued += read_len;
+        if (vecs_read)
+            conn->vec_gathered = 0;
+
+        if (conn->ctx->ratelimit_enabled)
+            serf__ratelimit_written(conn, read_len);
 
         if (!conn->hit_eof) {
             if (APR_STATUS_IS_EAGAIN(read_status)) {
@@ -927,9 +1547,16 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
             }
         }
 
+        /* A request that was read completely can leave its data in VEC
+           while the next one is read, so that small pipelined requests go
+           out in one writev. */
+        gather = request && conn->hit_eof &&
+                 APR_STATUS_IS_EAGAIN(read_status) &&
+                 may_gather(conn, request, ostreamh);
+
         /* If we got some data, then deliver it. */
         /* ### what to do if we got no data?? is that a problem? */
-        if (conn->vec_len > 0) {
+        if (conn->vec_len > 0 && !gather) {
             status = socket_writev(conn);
 
             /* If we can't write any more, or an error occurred, then
@@ -952,33 +1579,38 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
             conn->ctx->dirty_pollset = 1;
         }
         else if (request && read_status && conn->hit_eof &&
-                 conn->vec_len == 0) {
+                 (conn->vec_len == 0 || gather)) {
             /* If we hit the end of the request bucket and all of its data has
-             * been written, then clear it out to signify that we're done
-             * sending the request. On the next iteration through this loop:
+             * been written (or gathered), then clear it out to signify that
+             * we're done sending the request. On the next iteration through
+             * this loop:
              * - if there are remaining bytes they will be written, and as the 
              * request bucket will be completely read it will be destroyed then.
              * - we'll see if there are other requests that need to be sent 
              * ("pipelining").
              */
             conn->hit_eof = 0;
-            serf_bucket_destroy(request->req_bkt);
+            if (gather) {
+                /* Keep the bucket until its data is written. */
+                request->gathered_bkt = request->req_bkt;
+                request->gathered_end = conn->vec_queued;
+                conn->nr_gathered++;
+                conn->vec_gathered = 1;
+            }
+            else {
+                serf_bucket_destroy(request->req_bkt);
+            }
             request->req_bkt = NULL;
 
             /* Move the request to the written queue */
-            link_requests(&conn->written_reqs, &conn->written_reqs_tail,
-                          request);
-            conn->nr_of_written_reqs++;
-            conn->unwritten_reqs = conn->unwritten_reqs->next;
-            conn->nr_of_unwritten_reqs--;
-            request->next = NULL;
+            unlink_unwritten_request(conn, request);
+            queue_append(&conn->written, request);
 
             /* If our connection has async responses enabled, we're not
              * going to get a reply back, so kill the request.
              */
             if (conn->async_responses) {
-                conn->unwritten_reqs = request->next;
-                conn->nr_of_unwritten_reqs--;
+                queue_remove(&conn->written, request);
                 destroy_request(request);
             }
 
@@ -998,6 +1630,26 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
     /* NOTREACHED */
 }
 
+/* write data out to the connection */
+static apr_status_t write_to_connection(serf_connection_t *conn)
+{
+    apr_status_t status = write_requests(conn);
+
+    /* Whatever stopped the writing of requests, send what was gathered. */
+    while (!status && conn->vec_len && conn->vec_gathered) {
+        status = socket_writev(conn);
+
+        if (APR_STATUS_IS_EAGAIN(status))
+            return APR_SUCCESS;
+        if (APR_STATUS_IS_EPIPE(status)
+            || APR_STATUS_IS_ECONNRESET(status)
+            || APR_STATUS_IS_ECONNABORTED(status))
+            return no_more_writes(conn);
+    }
+
+    return status;
+}
+
 /* A response message was received from the server, so call
    the handler as specified on the original request. */
 static apr_status_t handle_response(serf_request_t *request,
@@ -1134,7 +1786,7 @@ serf__provide_credentials(serf_context_t *ctx,
         /* request->next will be NULL if this was the last request written */
         authn_req = request->next;
         if (!authn_req)
-            authn_req = conn->unwritten_reqs;
+            authn_req = conn->unwritten.head;
 
         /* assert: app_request != NULL */
         if (!authn_req)
@@ -1171,10 +1823,10 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
     /* Whatever is coming in on the socket corresponds to the first request
      * on our chain.
      */
-    serf_request_t *request = conn->written_reqs;
+    serf_request_t *request = conn->written.head;
     if (!request) {
         /* Request wasn't completely written yet! */
-        request = conn->unwritten_reqs;
+        request = conn->unwritten.head;
     }
 
     /* If the stop_writing flag was set on the connection, reset it now because
@@ -1196,6 +1848,16 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
 
         apr_pool_clear(tmppool);
 
+        /* The application doesn't want more of this response for now. Leave
+           the data in the socket, TCP flow control will slow down the
+           server. */
+        if (request->paused && !conn->async_responses) {
+            conn->dirty_conn = 1;
+            conn->ctx->dirty_pollset = 1;
+            status = APR_SUCCESS;
+            goto error;
+        }
+
         /* Only interested in the input stream here. */
         status = prepare_conn_streams(conn, &dummy1, &dummy2);
         if (status) {
@@ -1263,13 +1925,31 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
          * acceptor to get one created.
          */
         if (request->resp_bkt == NULL) {
+            serf_bucket_t *stream = conn->stream;
+
             if (! request->acceptor) {
                 /* Request wasn't even setup.
                    Server replying before it received anything? */
               return SERF_ERROR_BAD_HTTP_RESPONSE;
             }
 
-            request->resp_bkt = (*request->acceptor)(request, conn->stream,
+            /* A response that can be resumed is read through a stream
+               that survives the connection. */
+            if (request->resume)
+                stream = serf__resume_get_stream(request);
+
+            /* The first response of a hedged pair wins. */
+            if (request->hedge_sent)
+                serf__hedge_response_started(request);
+            if (request->written_time) {
+                if (conn->backend)
+                    serf__balancer_response_started(request);
+                if (conn->pipeline.max_depth)
+                    serf__pipeline_response_started(request);
+                request->written_time = 0;
+            }
+
+            request->resp_bkt = (*request->acceptor)(request, stream,
                                                      request->acceptor_baton,
                                                      tmppool);
             apr_pool_clear(tmppool);
@@ -1278,8 +1958,58 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
             serf_bucket_set_config(request->resp_bkt, conn->config);
         }
 
+        if (request->expect_state == SERF__EXPECT_WAITING ||
+            request->expect_state == SERF__EXPECT_SENDING) {
+            int dropped;
+
+            status = check_expect_continue(request, &dropped);
+            if (APR_STATUS_IS_EAGAIN(status)) {
+                status = APR_SUCCESS;
+                goto error;
+            }
+            if (status) {
+                goto error;
+            }
+            /* Interim response, loop to read the next one. */
+            if (dropped) {
+                continue;
+            }
+        }
+
+        /* The cached response is still valid, deliver that instead. */
+        if (request->cache) {
+            int not_modified;
+
+            status = serf__cache_not_modified(request, &not_modified);
+            if (APR_STATUS_IS_EAGAIN(status)) {
+                status = APR_SUCCESS;
+                goto error;
+            }
+            if (not_modified) {
+                serf_bucket_destroy(request->resp_bkt);
+                request->resp_bkt = (*request->acceptor)(
+                                        request,
+                                        serf__cache_get_stream(request),
+                                        request->acceptor_baton,
+                                        tmppool);
+                apr_pool_clear(tmppool);
+                serf_bucket_set_config(request->resp_bkt, conn->config);
+            }
+        }
+
+        if (request->coalesce)
+            serf__coalesce_check_response(request);
+
         status = handle_response(request, tmppool);
 
+        /* The connection was lost in the middle of a response that can be
+           resumed. Reconnect, the request is sent again for the rest. */
+        if (serf__resume_interrupted(request)) {
+            reset_connection(conn, 1);
+            status = APR_SUCCESS;
+            goto error;
+        }
+
         /* If we received APR_SUCCESS, run this loop again. */
         if (!status) {
             continue;
@@ -1344,30 +2074,31 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
             goto error;
         }
 
+        /* The server answered before the request body was sent, and may
+           still expect the body on this connection. Close it. */
+        if (request->expect_state == SERF__EXPECT_REJECTED)
+            close_connection = SERF_ERROR_CLOSING;
+
         /* The response has been fully-read, so that means the request has
          * either been fully-delivered (most likely), or that we don't need to
          * write the rest of it anymore, e.g. when a 408 Request timeout was
          $ received.
          * Remove it from our queue and loop to read another response.
          */
-        if (request == conn->written_reqs) {
-            conn->written_reqs = request->next;
-            conn->nr_of_written_reqs--;
-        } else {
-            conn->unwritten_reqs = request->next;
-            conn->nr_of_unwritten_reqs--;
-        }
+        unlink_request(conn, request);
 
+        serf__capture_response_done(request);
+        if (APR_STATUS_IS_EOF(status)) {
+            serf__cache_response_done(request);
+            serf__coalesce_response_done(request);
+        }
         destroy_request(request);
 
-        request = conn->written_reqs;
+        request = conn->written.head;
         if (!request) {
-            /* Received responses for all written requests */
-            conn->written_reqs_tail = NULL;
-            /* Request wasn't completely written yet! */
-            request = conn->unwritten_reqs;
-            if (!request)
-                conn->unwritten_reqs_tail = NULL;
+            /* Received responses for all written requests. The request
+               wasn't completely written yet! */
+            request = conn->unwritten.head;
         }
 
         conn->completed_responses++;
@@ -1375,7 +2106,7 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
         /* We have received a response. If there are no more outstanding
            requests on this connection, we should stop polling for READ events
            for now. */
-        if (!conn->written_reqs && !conn->unwritten_reqs) {
+        if (!conn->written.head && !conn->unwritten.head) {
             conn->dirty_conn = 1;
             conn->ctx->dirty_pollset = 1;
         }
@@ -1415,6 +2146,173 @@ error:
     return status;
 }
 
+/* Continue reading on the connections of CTX where a paused response was
+   resumed. The rest of the response may already be buffered in the stream,
+   in which case the socket won't become readable anymore. */
+apr_status_t serf__process_resumed_reads(serf_context_t *ctx)
+{
+    int i;
+
+    if (!ctx->reads_resumed)
+        return APR_SUCCESS;
+    ctx->reads_resumed = 0;
+
+    for (i = 0; i < ctx->conns->nelts; i++) {
+        serf_connection_t *conn = GET_CONN(ctx, i);
+        apr_status_t status;
+
+        if (!conn->read_resumed)
+            continue;
+        conn->read_resumed = 0;
+
+        if (!conn->stream || reading_paused(conn) ||
+            (!conn->written.head && !conn->unwritten.head))
+            continue;
+
+        status = serf__process_connection(conn, APR_POLLIN);
+        if (status) {
+            conn->status = status;
+            return status;
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Deliver a cached response to REQUEST, or the response of its leader to
+   a follower. Returns APR_EOF when the response was handled completely. */
+static apr_status_t deliver_cached(serf_request_t *request, apr_pool_t *pool)
+{
+    apr_status_t status;
+
+    if (request->resp_bkt == NULL) {
+        serf_bucket_t *stream;
+
+        if (request->coalesce)
+            stream = serf__coalesce_get_stream(request);
+        else
+            stream = serf__cache_get_stream(request);
+
+        request->resp_bkt = (*request->acceptor)(
+                                request, stream,
+                                request->acceptor_baton, pool);
+        apr_pool_clear(pool);
+        serf_bucket_set_config(request->resp_bkt, request->conn->config);
+    }
+
+    do {
+        apr_pool_clear(pool);
+        status = (*request->handler)(request, request->resp_bkt,
+                                     request->handler_baton, pool);
+    } while (!status && !request->paused);
+
+    return status;
+}
+
+/* The group of the follower REQUEST was aborted before it read any of the
+   leader's response: send it itself. It isn't looked up again. */
+static void requeue_follower(serf_request_t *request)
+{
+    serf_connection_t *conn = request->conn;
+
+    queue_remove(&conn->cached, request);
+    request->cached = 0;
+
+    /* The response over the group's stream, its handler didn't get any of
+       it. */
+    if (request->resp_bkt) {
+        serf_bucket_destroy(request->resp_bkt);
+        request->resp_bkt = NULL;
+    }
+    serf__coalesce_request_done(request);
+
+    insert_request(conn, request);
+    conn->dirty_conn = 1;
+    conn->ctx->dirty_pollset = 1;
+}
+
+/* Look up the new requests of connections of CTX that aren't opened yet in
+   the response cache and the coalescing groups, and deliver the cached
+   responses that are waiting. Once a request is written the lookup happens
+   in write_to_connection. */
+apr_status_t serf__process_cached_requests(serf_context_t *ctx)
+{
+    apr_pool_t *tmppool;
+    int i;
+
+    if (!ctx->cache && !ctx->coalesce)
+        return APR_SUCCESS;
+
+    for (i = 0; i < ctx->conns->nelts; i++) {
+        serf_connection_t *conn = GET_CONN(ctx, i);
+        apr_status_t status;
+
+        if (conn->skt == NULL && !conn->mock_open) {
+            status = lookup_cached_requests(conn);
+            if (status)
+                return status;
+        }
+    }
+
+    if (!ctx->cached_pending)
+        return APR_SUCCESS;
+    ctx->cached_pending = 0;
+
+    apr_pool_create(&tmppool, ctx->pool);
+
+    for (i = 0; i < ctx->conns->nelts; i++) {
+        serf_connection_t *conn = GET_CONN(ctx, i);
+        serf_request_t *request = conn->cached.head;
+
+        while (request) {
+            serf_request_t *next = request->next;
+            apr_status_t status;
+
+            /* The leader didn't get a usable response. The follower sends
+               its own request, or if it got part of the response already,
+               is handled like a request on a reset connection. */
+            if (serf__coalesce_aborted(request)) {
+                if (serf__coalesce_unread(request))
+                    requeue_follower(request);
+                else
+                    cancel_request(request, 1);
+                request = next;
+                continue;
+            }
+
+            if (request->paused) {
+                request = next;
+                continue;
+            }
+
+            status = deliver_cached(request, tmppool);
+            if (APR_STATUS_IS_EAGAIN(status) ||
+                (!status && request->paused)) {
+                /* Try again on the next run. A follower is woken up when
+                   more of the leader's response arrives. */
+                if (!request->paused && !request->coalesce)
+                    ctx->cached_pending = 1;
+                request = next;
+                continue;
+            }
+            if (!APR_STATUS_IS_EOF(status)) {
+                ctx->cached_pending = 1;
+                apr_pool_destroy(tmppool);
+                return status;
+            }
+
+            queue_remove(&conn->cached, request);
+            destroy_request(request);
+
+            request = next;
+        }
+    }
+
+    apr_pool_destroy(tmppool);
+
+    return APR_SUCCESS;
+}
+
 /* process all events on the connection */
 apr_status_t serf__process_connection(serf_connection_t *conn,
                                       apr_int16_t events)
@@ -1425,8 +2323,18 @@ apr_status_t serf__process_connection(serf_connection_t *conn,
      * the like sitting on the connection, we give the app a chance to read
      * it before we trigger a reset condition.
      */
-    if ((events & APR_POLLIN) != 0) {
-        if ((status = read_from_connection(conn)) != APR_SUCCESS)
+    /* Don't read if the connection's rate limits don't allow it now, unless
+       the connection is hung up: then read what's left. */
+    if ((events & APR_POLLIN) != 0 &&
+        ((events & APR_POLLHUP) != 0 || serf__ratelimit_may_read(conn))) {
+        apr_off_t read_before = conn->ctx->progress_read;
+
+        status = read_from_connection(conn);
+
+        /* Everything read from the socket during read_from_connection was
+           read for this connection. */
+        serf__ratelimit_read(conn, conn->ctx->progress_read - read_before);
+        if (status != APR_SUCCESS)
             return status;
 
         /* If we decided to reset our connection, return now as we don't
@@ -1463,7 +2371,7 @@ apr_status_t serf__process_connection(serf_connection_t *conn,
            convert it to an APR status code. */
         {
             apr_os_sock_t osskt;
-            if (!apr_os_sock_get(&osskt, conn->skt)) {
+            if (conn->skt && !apr_os_sock_get(&osskt, conn->skt)) {
                 int error;
                 apr_socklen_t l = sizeof(error);
 
@@ -1478,6 +2386,11 @@ apr_status_t serf__process_connection(serf_connection_t *conn,
                        Current Windows versions already handle re-ordering for
                        api users by using statistics on the recently failed
                        connections to order the list of addresses. */
+                    /* Don't route requests of a balancer to a backend that
+                       can't be reached. */
+                    if (conn->backend && conn->completed_requests == 0)
+                        serf__balancer_conn_failed(conn, status);
+
                     if (conn->completed_requests == 0
                         && conn->address->next != NULL
                         && (APR_STATUS_IS_ECONNREFUSED(status)
@@ -1523,7 +2436,9 @@ serf_connection_t *serf_connection_create(
     conn->closed_baton = closed_baton;
     conn->pool = pool;
     conn->allocator = serf_bucket_allocator_create(pool, NULL, NULL);
+    serf__bucket_allocator_account(conn->allocator, &ctx->mem_used);
     conn->stream = NULL;
+    conn->ssl_ctx = NULL;
     conn->ostream_head = NULL;
     conn->ostream_tail = NULL;
     conn->baton.type = SERF_IO_CONN;
@@ -1532,6 +2447,7 @@ serf_connection_t *serf_connection_create(
     conn->state = SERF_CONN_INIT;
     conn->latency = -1; /* unknown */
     conn->pipelining = 1;
+    conn->authn_info.pool = conn->pool;
 
     /* Create a subpool for our connection. */
     apr_pool_create(&conn->skt_pool, conn->pool);
@@ -1557,8 +2473,6 @@ apr_status_t serf_connection_create2(
     apr_pool_t *pool)
 {
     apr_status_t status = APR_SUCCESS;
-    serf_config_t *config;
-    serf_connection_t *c;
     apr_sockaddr_t *host_address = NULL;
 
     /* Set the port number explicitly, needed to create the socket later. */
@@ -1576,6 +2490,26 @@ apr_status_t serf_connection_create2(
             return status;
     }
 
+    return serf__connection_create_at(conn, ctx, host_info, host_address,
+                                      setup, setup_baton,
+                                      closed, closed_baton, pool);
+}
+
+apr_status_t serf__connection_create_at(
+    serf_connection_t **conn,
+    serf_context_t *ctx,
+    apr_uri_t host_info,
+    apr_sockaddr_t *host_address,
+    serf_connection_setup_t setup,
+    void *setup_baton,
+    serf_connection_closed_t closed,
+    void *closed_baton,
+    apr_pool_t *pool)
+{
+    apr_status_t status = APR_SUCCESS;
+    serf_config_t *config;
+    serf_connection_t *c;
+
     c = serf_connection_create(ctx, host_address, setup, setup_baton,
                                closed, closed_baton, pool);
 
@@ -1629,13 +2563,16 @@ apr_status_t serf_connection_close(
         if (conn_seq == conn) {
             /* The application asked to close the connection, no need to notify
                it for each cancelled request. */
-            while (conn->written_reqs) {
-                cancel_request(conn->written_reqs, &conn->written_reqs, 0);
+            while (conn->written.head) {
+                cancel_request(conn->written.head, 0);
             }
-            while (conn->unwritten_reqs) {
-                cancel_request(conn->unwritten_reqs, &conn->unwritten_reqs, 0);
+            while (conn->unwritten.head) {
+                cancel_request(conn->unwritten.head, 0);
             }
-            if (conn->skt != NULL) {
+            while (conn->cached.head) {
+                cancel_request(conn->cached.head, 0);
+            }
+            if (conn->skt != NULL || conn->mock_open) {
                 remove_connection(ctx, conn);
                 status = clean_skt(conn);
                 if (conn->closed != NULL) {
@@ -1646,6 +2583,7 @@ apr_status_t serf_connection_close(
                 serf_bucket_destroy(conn->stream);
                 conn->stream = NULL;
             }
+            conn->ssl_ctx = NULL;
 
             destroy_ostream(conn);
 
@@ -1701,6 +2639,14 @@ void serf__connection_set_pipelining(serf_connection_t *conn, int enabled)
     conn->pipelining = enabled;
 }
 
+void serf__connection_set_mock_transport(serf_connection_t *conn,
+                                         serf__conn_writev_t writev,
+                                         void *baton)
+{
+    conn->mock_writev = writev;
+    conn->mock_baton = baton;
+}
+
 void serf_connection_set_async_responses(
     serf_connection_t *conn,
     serf_response_acceptor_t acceptor,
@@ -1735,8 +2681,37 @@ create_request(serf_connection_t *conn,
     request->priority = priority;
     request->writing_started = 0;
     request->ssltunnel = ssltunnel;
+    request->priority_class = SERF_PRIORITY_NORMAL;
+    request->deadline = 0;
+    request->paused = 0;
+    request->expect_state = SERF__EXPECT_NONE;
+    request->expect_timeout = 0;
+    request->expect_until = 0;
+    request->expect_body = NULL;
+    request->expect_hold = NULL;
+    request->queue = NULL;
     request->next = NULL;
+    request->prev = NULL;
     request->auth_baton = NULL;
+    request->auth_uri = NULL;
+    request->auth_header = NULL;
+    request->capture = NULL;
+    request->capture_time = conn->ctx->capture ? apr_time_now() : 0;
+    request->cache = NULL;
+    request->cached = 0;
+    request->coalesce = NULL;
+    request->coalesce_stream = NULL;
+    request->looked_up = 0;
+    request->resume = NULL;
+    request->hedge_state = SERF__HEDGE_NONE;
+    request->hedge_sent = 0;
+    request->hedge_at = 0;
+    request->hedge_peer = NULL;
+    request->gathered_bkt = NULL;
+    request->gathered_end = 0;
+    request->written_time = 0;
+
+    conn->ctx->reqs_per_class[SERF_PRIORITY_NORMAL]++;
 
     return request;
 }
@@ -1753,8 +2728,7 @@ serf_request_t *serf_connection_request_create(
                              0  /* ssl tunnel */);
 
     /* Link the request to the end of the request chain. */
-    link_requests(&conn->unwritten_reqs, &conn->unwritten_reqs_tail, request);
-    conn->nr_of_unwritten_reqs++;
+    insert_request(conn, request);
 
     /* Ensure our pollset becomes writable in context run */
     conn->ctx->dirty_pollset = 1;
@@ -1770,44 +2744,16 @@ priority_request_create(serf_connection_t *conn,
                         void *setup_baton)
 {
     serf_request_t *request;
-    serf_request_t *iter, *prev;
 
     request = create_request(conn, setup, setup_baton,
                              1, /* priority */
                              ssltunnelreq);
 
-    /* Link the new request after the last written request. */
-    iter = conn->unwritten_reqs;
-    prev = NULL;
-
-    /* TODO: what if a request is partially written? */
-    /* Find a request that has data which needs to be delivered. */
-    while (iter != NULL && iter->req_bkt == NULL && iter->writing_started) {
-        prev = iter;
-        iter = iter->next;
-    }
-
-    /* A CONNECT request to setup an ssltunnel has absolute priority over all
-       other requests on the connection, so:
-       a. add it first to the queue 
-       b. ensure that other priority requests are added after the CONNECT
-          request */
-    if (!request->ssltunnel) {
-        /* Advance to next non priority request */
-        while (iter != NULL && iter->priority) {
-            prev = iter;
-            iter = iter->next;
-        }
-    }
-
-    if (prev) {
-        request->next = iter;
-        prev->next = request;
-    } else {
-        request->next = iter;
-        conn->unwritten_reqs = request;
-    }
-    conn->nr_of_unwritten_reqs++;
+    /* Link the new request after the requests that are being written.
+       A CONNECT request to setup an ssltunnel has absolute priority over all
+       other requests on the connection, other priority requests go after
+       the priority requests already queued. */
+    insert_request(conn, request);
 
     /* Ensure our pollset becomes writable in context run */
     conn->ctx->dirty_pollset = 1;
@@ -1838,28 +2784,106 @@ serf_request_t *serf__ssltunnel_request_create(serf_connection_t *conn,
 
 serf_request_t *serf__request_requeue(const serf_request_t *request)
 {
+    serf_request_t *new_req;
+
     /* ### in the future, maybe we could reset REQUEST and try again?  */
-    return priority_request_create(request->conn,
-                                   request->ssltunnel,
-                                   request->setup,
-                                   request->setup_baton);
+    new_req = priority_request_create(request->conn,
+                                      request->ssltunnel,
+                                      request->setup,
+                                      request->setup_baton);
+    new_req->expect_timeout = request->expect_timeout;
+
+    /* Its rank changes, queue it again. */
+    unlink_unwritten_request(new_req->conn, new_req);
+    set_priority_class(new_req, request->priority_class);
+    new_req->deadline = request->deadline;
+    insert_request(new_req->conn, new_req);
+
+    return new_req;
 }
 
+apr_status_t serf_request_set_priority(serf_request_t *request,
+                                       int priority_class,
+                                       apr_time_t deadline)
+{
+    serf_connection_t *conn = request->conn;
 
-apr_status_t serf_request_cancel(serf_request_t *request)
+    if (request->writing_started)
+        return APR_EBUSY;
+
+    if (priority_class < 0)
+        priority_class = 0;
+    else if (priority_class >= SERF_PRIORITY_CLASSES)
+        priority_class = SERF_PRIORITY_CLASSES - 1;
+
+    /* Move the request to its new place in the queue, if it's queued to
+       be written. */
+    if (request->queue == &conn->unwritten) {
+        unlink_unwritten_request(conn, request);
+        set_priority_class(request, priority_class);
+        request->deadline = deadline;
+        insert_request(conn, request);
+    }
+    else {
+        set_priority_class(request, priority_class);
+        request->deadline = deadline;
+    }
+
+    conn->ctx->dirty_pollset = 1;
+    conn->dirty_conn = 1;
+
+    return APR_SUCCESS;
+}
+
+
+apr_status_t serf_request_set_expect_continue(serf_request_t *request,
+                                              apr_interval_time_t timeout)
+{
+    if (request->writing_started)
+        return APR_EBUSY;
+
+    request->expect_timeout = timeout > 0 ? timeout : 0;
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf_request_pause(serf_request_t *request)
+{
+    serf_connection_t *conn = request->conn;
+
+    if (!request->paused) {
+        request->paused = 1;
+        conn->dirty_conn = 1;
+        conn->ctx->dirty_pollset = 1;
+    }
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf_request_resume(serf_request_t *request)
 {
     serf_connection_t *conn = request->conn;
-    serf_request_t *tmp = conn->unwritten_reqs;
 
-    /* Find out which queue holds the request */
-    while (tmp != NULL && tmp != request)
-        tmp = tmp->next;
+    if (request->paused) {
+        request->paused = 0;
+        conn->dirty_conn = 1;
+        conn->read_resumed = 1;
+        conn->ctx->dirty_pollset = 1;
+        conn->ctx->reads_resumed = 1;
+        if (request->cached)
+            conn->ctx->cached_pending = 1;
+    }
+
+    return APR_SUCCESS;
+}
 
-    if (tmp)
-        return cancel_request(request, &conn->unwritten_reqs, 0);
-    else
-        return cancel_request(request, &conn->written_reqs, 0);
+apr_status_t serf_request_cancel(serf_request_t *request)
+{
+    /* Its duplicate, or the original, isn't needed either. */
+    if (request->hedge_peer)
+        serf__hedge_request_cancelled(request);
 
+    return cancel_request(request, 0);
 }
 
 apr_status_t serf_request_is_written(serf_request_t *request)
@@ -1954,10 +2978,10 @@ apr_interval_time_t serf_connection_get_latency(serf_connection_t *conn)
 
 unsigned int serf_connection_queued_requests(serf_connection_t *conn)
 {
-    return conn->nr_of_unwritten_reqs;
+    return conn->unwritten.length;
 }
 
 unsigned int serf_connection_pending_requests(serf_connection_t *conn)
 {
-    return conn->nr_of_unwritten_reqs + conn->nr_of_written_reqs;
+    return conn->unwritten.length + conn->written.length;
 }
@@ -0,0 +1,132 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Adaptive pipelining.
+
+   The number of requests a connection has in flight, its depth, is
+   controlled like a TCP congestion window. It starts at 1 and grows by one
+   per response up to SSTHRESH (slow start), then by one per DEPTH
+   responses (additive increase).
+
+   Every response gives a sample of the time from writing its request to
+   the first byte of the response. With a pipeline of DEPTH requests and
+   the smallest sample seen as the round trip time, DEPTH * (1 - min/sample)
+   requests are waiting in the server's queue rather than on the wire. When
+   that exceeds MAX_QUEUED, more depth only adds latency: the depth is
+   halved (multiplicative decrease). So is it when the connection is reset
+   with requests in flight.
+
+   After a decrease, the depth isn't lowered again until the requests that
+   were in flight at that time have been answered.
+ */
+
+#include <apr_pools.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+/* Requests allowed to queue up at the server before backing off. */
+#define MAX_QUEUED 3
+
+/* The depth at which slow start ends, until the first decrease. */
+#define INITIAL_SSTHRESH 16
+
+static void decrease(serf_connection_t *conn, const char *reason)
+{
+    serf__pipeline_t *pl = &conn->pipeline;
+
+    pl->ssthresh = pl->depth / 2;
+    if (pl->ssthresh < 1)
+        pl->ssthresh = 1;
+    pl->depth = pl->ssthresh;
+    pl->acked = 0;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "%s on conn 0x%x, pipelining depth %u\n", reason, conn,
+              pl->depth);
+}
+
+void serf__pipeline_response_started(serf_request_t *request)
+{
+    serf_connection_t *conn = request->conn;
+    serf__pipeline_t *pl = &conn->pipeline;
+    apr_interval_time_t sample = apr_time_now() - request->written_time;
+    unsigned int queued;
+
+    if (sample <= 0)
+        sample = 1;
+    if (pl->min_rtt < 0 || sample < pl->min_rtt)
+        pl->min_rtt = sample;
+
+    queued = (unsigned int)((apr_uint64_t)pl->depth *
+                            (sample - pl->min_rtt) / sample);
+
+    if (queued > MAX_QUEUED) {
+        /* Lower the depth once per round trip. */
+        if (conn->completed_responses >= pl->recover) {
+            decrease(conn, "server queueing");
+            pl->recover = conn->completed_requests;
+        }
+        return;
+    }
+
+    if (pl->depth >= pl->max_depth)
+        return;
+
+    if (pl->depth < pl->ssthresh) {
+        pl->depth++;
+    }
+    else if (++pl->acked >= pl->depth) {
+        pl->depth++;
+        pl->acked = 0;
+    }
+}
+
+void serf__pipeline_reset(serf_connection_t *conn)
+{
+    /* A connection closed by the server between requests is fine, one that
+       drops requests in flight is not. */
+    if (conn->completed_requests > conn->completed_responses)
+        decrease(conn, "requests lost");
+
+    conn->pipeline.recover = 0;
+}
+
+unsigned int serf__pipeline_limit(serf_connection_t *conn)
+{
+    unsigned int limit = conn->max_outstanding_requests;
+
+    if (conn->pipeline.max_depth &&
+        (!limit || conn->pipeline.depth < limit))
+        limit = conn->pipeline.depth;
+
+    return limit;
+}
+
+void serf_connection_set_adaptive_pipelining(
+    serf_connection_t *conn,
+    unsigned int max_depth)
+{
+    serf__pipeline_t *pl = &conn->pipeline;
+
+    pl->max_depth = max_depth;
+    pl->depth = 1;
+    pl->ssthresh = INITIAL_SSTHRESH;
+    pl->acked = 0;
+    pl->recover = 0;
+    pl->min_rtt = conn->latency;
+}
@@ -0,0 +1,361 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Rate limiting.
+
+   Token buckets limit the bytes written, the bytes read and the number of
+   requests started per second. They can be set on a connection, on all
+   connections to a host and on the whole context; a connection has to pass
+   all of them.
+
+   A throttled connection is taken out of the pollset for writing and/or
+   reading until the buckets have refilled. serf_context_run shortens its
+   poll timeout to wake up in time, so the loop keeps handling the other
+   connections meanwhile.
+
+   Reads can't be limited exactly, as the application's response handler
+   decides how much it reads. What is read is charged afterwards, which can
+   put the bucket in debt; the connection then waits until the debt is paid
+   off. On average the rate is respected.
+ */
+
+#include <apr_pools.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+/* Minimal bucket sizes, so a slow rate doesn't result in tiny writes. A
+   throttled connection waits until its byte buckets are a quarter full. */
+#define MIN_BYTES_BURST 16384
+#define MIN_REQUESTS_BURST 1
+
+static void bucket_init(serf__token_bucket_t *tb, apr_uint64_t rate,
+                        apr_uint64_t min_burst)
+{
+    tb->rate = rate;
+    tb->burst = rate / 10;   /* 100 ms worth of tokens */
+    if (tb->burst < min_burst)
+        tb->burst = min_burst;
+    tb->credit = (apr_int64_t)tb->burst * APR_USEC_PER_SEC;
+    tb->last = apr_time_now();
+}
+
+static void bucket_refill(serf__token_bucket_t *tb, apr_time_t now)
+{
+    apr_int64_t max = (apr_int64_t)tb->burst * APR_USEC_PER_SEC;
+    apr_time_t elapsed = now - tb->last;
+
+    if (elapsed <= 0)
+        return;
+    tb->last = now;
+
+    /* Stop at a full bucket, without overflowing on long idle times. */
+    if (elapsed >= (max - tb->credit) / (apr_int64_t)tb->rate + 1)
+        tb->credit = max;
+    else
+        tb->credit += (apr_int64_t)tb->rate * elapsed;
+}
+
+/* Returns the number of whole tokens available in TB. */
+static apr_uint64_t bucket_tokens(serf__token_bucket_t *tb, apr_time_t now)
+{
+    bucket_refill(tb, now);
+
+    return tb->credit > 0 ? tb->credit / APR_USEC_PER_SEC : 0;
+}
+
+/* Returns when TB will have at least TOKENS tokens again. */
+static apr_time_t bucket_ready_at(const serf__token_bucket_t *tb,
+                                  apr_uint64_t tokens,
+                                  apr_time_t now)
+{
+    apr_int64_t missing = (apr_int64_t)tokens * APR_USEC_PER_SEC - tb->credit;
+
+    if (missing <= 0)
+        return now;
+
+    return now + missing / (apr_int64_t)tb->rate + 1;
+}
+
+static void bucket_take(serf__token_bucket_t *tb, apr_uint64_t tokens)
+{
+    tb->credit -= (apr_int64_t)tokens * APR_USEC_PER_SEC;
+}
+
+/* Returns the rate limits that apply to CONN, the connection's own limits
+   first. Returns the number of limits in LIMITS. */
+static int get_limits(serf__ratelimit_t *limits[3], serf_connection_t *conn)
+{
+    serf_context_t *ctx = conn->ctx;
+    int nr = 0;
+
+    limits[nr++] = &conn->ratelimit;
+
+    if (!conn->host_ratelimit && ctx->host_ratelimits && conn->host_url) {
+        conn->host_ratelimit = apr_hash_get(ctx->host_ratelimits,
+                                            conn->host_url,
+                                            APR_HASH_KEY_STRING);
+    }
+    if (conn->host_ratelimit)
+        limits[nr++] = conn->host_ratelimit;
+
+    limits[nr++] = &ctx->ratelimit;
+
+    return nr;
+}
+
+/* Throttle CONN until THROTTLE_UNTIL, by taking it out of the pollset for
+   reading or writing. */
+static void throttle(serf_connection_t *conn, apr_time_t *until,
+                     apr_time_t throttle_until)
+{
+    serf_context_t *ctx = conn->ctx;
+
+    *until = throttle_until;
+    conn->dirty_conn = 1;
+    ctx->dirty_pollset = 1;
+
+    if (!ctx->ratelimit_wakeup || throttle_until < ctx->ratelimit_wakeup)
+        ctx->ratelimit_wakeup = throttle_until;
+}
+
+apr_size_t serf__ratelimit_write_avail(serf_connection_t *conn)
+{
+    serf__ratelimit_t *limits[3];
+    apr_uint64_t avail = SERF_READ_ALL_AVAIL;
+    apr_time_t now, ready = 0;
+    int i, nr;
+
+    if (!conn->ctx->ratelimit_enabled)
+        return SERF_READ_ALL_AVAIL;
+
+    now = apr_time_now();
+    nr = get_limits(limits, conn);
+    for (i = 0; i < nr; i++) {
+        serf__token_bucket_t *tb = &limits[i]->write;
+        apr_uint64_t tokens;
+
+        if (!tb->rate)
+            continue;
+
+        tokens = bucket_tokens(tb, now);
+        if (tokens < avail)
+            avail = tokens;
+        if (!tokens) {
+            apr_time_t at = bucket_ready_at(tb, tb->burst / 4, now);
+            if (at > ready)
+                ready = at;
+        }
+    }
+
+    if (!avail) {
+        throttle(conn, &conn->write_throttled_until, ready);
+        return 0;
+    }
+
+    return avail >= SERF_READ_ALL_AVAIL ? SERF_READ_ALL_AVAIL
+                                        : (apr_size_t)avail;
+}
+
+void serf__ratelimit_written(serf_connection_t *conn, apr_size_t len)
+{
+    serf__ratelimit_t *limits[3];
+    int i, nr;
+
+    if (!conn->ctx->ratelimit_enabled || !len)
+        return;
+
+    nr = get_limits(limits, conn);
+    for (i = 0; i < nr; i++) {
+        if (limits[i]->write.rate)
+            bucket_take(&limits[i]->write, len);
+    }
+}
+
+int serf__ratelimit_start_request(serf_connection_t *conn)
+{
+    serf__ratelimit_t *limits[3];
+    apr_time_t now, ready = 0;
+    int i, nr;
+
+    if (!conn->ctx->ratelimit_enabled)
+        return 1;
+
+    now = apr_time_now();
+    nr = get_limits(limits, conn);
+    for (i = 0; i < nr; i++) {
+        serf__token_bucket_t *tb = &limits[i]->requests;
+
+        if (tb->rate && !bucket_tokens(tb, now)) {
+            apr_time_t at = bucket_ready_at(tb, 1, now);
+            if (at > ready)
+                ready = at;
+        }
+    }
+
+    if (ready) {
+        throttle(conn, &conn->write_throttled_until, ready);
+        return 0;
+    }
+
+    for (i = 0; i < nr; i++) {
+        if (limits[i]->requests.rate)
+            bucket_take(&limits[i]->requests, 1);
+    }
+
+    return 1;
+}
+
+int serf__ratelimit_may_read(serf_connection_t *conn)
+{
+    serf__ratelimit_t *limits[3];
+    apr_time_t now, ready = 0;
+    int i, nr;
+
+    if (!conn->ctx->ratelimit_enabled)
+        return 1;
+
+    now = apr_time_now();
+    nr = get_limits(limits, conn);
+    for (i = 0; i < nr; i++) {
+        serf__token_bucket_t *tb = &limits[i]->read;
+
+        if (tb->rate && !bucket_tokens(tb, now)) {
+            apr_time_t at = bucket_ready_at(tb, tb->burst / 4, now);
+            if (at > ready)
+                ready = at;
+        }
+    }
+
+    if (ready) {
+        throttle(conn, &conn->read_throttled_until, ready);
+        return 0;
+    }
+
+    return 1;
+}
+
+void serf__ratelimit_read(serf_connection_t *conn, apr_off_t len)
+{
+    serf__ratelimit_t *limits[3];
+    int i, nr;
+
+    if (!conn->ctx->ratelimit_enabled || len <= 0)
+        return;
+
+    nr = get_limits(limits, conn);
+    for (i = 0; i < nr; i++) {
+        if (limits[i]->read.rate)
+            bucket_take(&limits[i]->read, len);
+    }
+}
+
+apr_interval_time_t serf__ratelimit_wakeup(serf_context_t *ctx)
+{
+    apr_time_t now, next = 0;
+    int i;
+
+    if (!ctx->ratelimit_wakeup)
+        return -1;
+
+    now = apr_time_now();
+    if (ctx->ratelimit_wakeup > now)
+        return ctx->ratelimit_wakeup - now;
+
+    /* At least one connection can continue, put those back in the pollset
+       and find out when the next one can. */
+    for (i = 0; i < ctx->conns->nelts; i++) {
+        serf_connection_t *conn = GET_CONN(ctx, i);
+
+        if (conn->write_throttled_until && conn->write_throttled_until <= now) {
+            conn->write_throttled_until = 0;
+            conn->dirty_conn = 1;
+            ctx->dirty_pollset = 1;
+        }
+        if (conn->read_throttled_until && conn->read_throttled_until <= now) {
+            conn->read_throttled_until = 0;
+            conn->dirty_conn = 1;
+            ctx->dirty_pollset = 1;
+        }
+
+        if (conn->write_throttled_until &&
+            (!next || conn->write_throttled_until < next))
+            next = conn->write_throttled_until;
+        if (conn->read_throttled_until &&
+            (!next || conn->read_throttled_until < next))
+            next = conn->read_throttled_until;
+    }
+
+    ctx->ratelimit_wakeup = next;
+
+    return next ? next - now : -1;
+}
+
+static void ratelimit_init(serf__ratelimit_t *limit,
+                           apr_uint64_t write_rate,
+                           apr_uint64_t read_rate,
+                           unsigned int request_rate)
+{
+    bucket_init(&limit->write, write_rate, MIN_BYTES_BURST);
+    bucket_init(&limit->read, read_rate, MIN_BYTES_BURST);
+    bucket_init(&limit->requests, request_rate, MIN_REQUESTS_BURST);
+}
+
+void serf_context_set_rate_limit(serf_context_t *ctx,
+                                 apr_uint64_t write_rate,
+                                 apr_uint64_t read_rate,
+                                 unsigned int request_rate)
+{
+    ratelimit_init(&ctx->ratelimit, write_rate, read_rate, request_rate);
+    if (write_rate || read_rate || request_rate)
+        ctx->ratelimit_enabled = 1;
+}
+
+void serf_context_set_host_rate_limit(serf_context_t *ctx,
+                                      const char *host_url,
+                                      apr_uint64_t write_rate,
+                                      apr_uint64_t read_rate,
+                                      unsigned int request_rate)
+{
+    serf__ratelimit_t *limit;
+
+    if (!ctx->host_ratelimits)
+        ctx->host_ratelimits = apr_hash_make(ctx->pool);
+
+    limit = apr_hash_get(ctx->host_ratelimits, host_url, APR_HASH_KEY_STRING);
+    if (!limit) {
+        limit = apr_pcalloc(ctx->pool, sizeof(*limit));
+        apr_hash_set(ctx->host_ratelimits, apr_pstrdup(ctx->pool, host_url),
+                     APR_HASH_KEY_STRING, limit);
+    }
+
+    ratelimit_init(limit, write_rate, read_rate, request_rate);
+    if (write_rate || read_rate || request_rate)
+        ctx->ratelimit_enabled = 1;
+}
+
+void serf_connection_set_rate_limit(serf_connection_t *conn,
+                                    apr_uint64_t write_rate,
+                                    apr_uint64_t read_rate,
+                                    unsigned int request_rate)
+{
+    ratelimit_init(&conn->ratelimit, write_rate, read_rate, request_rate);
+    if (write_rate || read_rate || request_rate)
+        conn->ctx->ratelimit_enabled = 1;
+}
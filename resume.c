@@ -0,0 +1,498 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Resuming interrupted responses.
+
+   The acceptor of a GET request gets a stream of its own instead of the
+   connection's stream. It passes the data of the connection on, and keeps
+   the header block of the response to learn if it can be resumed: a 200
+   with a Content-Length, no transfer encoding and a validator, a strong
+   ETag or a Last-Modified date. For such a response it counts the body
+   bytes the response bucket read.
+
+   If the connection is lost before the body was read completely, the
+   stream returns APR_EAGAIN instead of the error, and the connection is
+   reset, see read_from_connection. Instead of being cancelled, the request
+   is set up again and sent with Range and If-Range headers for the rest of
+   the body. When the 206 arrives the stream continues with its body, so
+   the response bucket of the application sees no gap.
+
+   If the server doesn't answer with the expected range, e.g. because the
+   resource changed, the response is reported as truncated.
+ */
+
+#include <string.h>
+
+#include <apr_pools.h>
+#include <apr_strings.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+/* Responses with a larger header block can't be resumed. */
+#define MAX_HEADERS_SIZE 8192
+
+typedef enum resume_state_t {
+    RESUME_HEADERS,         /* reading the header block of the response */
+    RESUME_BODY,            /* reading the body from the connection */
+    RESUME_INTERRUPTED,     /* the connection was lost during the body */
+    RESUME_RANGE,           /* sent again, reading the headers of the 206 */
+    RESUME_RANGE_BODY,      /* reading the rest of the body from the 206 */
+    RESUME_NONE             /* the response can't be resumed */
+} resume_state_t;
+
+struct serf__resume_req_t {
+    serf_request_t *request;
+    resume_state_t state;
+
+    /* The stream passed to the acceptor. */
+    serf_bucket_t *stream;
+
+    /* The header block read so far, and the nr. of line ends seen in a row
+       at its end. */
+    char *hdrs;
+    apr_size_t hdrs_len;
+    int eols;
+
+    /* The If-Range value, the Content-Length and the nr. of body bytes read
+       by the response bucket. */
+    const char *validator;
+    apr_off_t length;
+    apr_off_t received;
+
+    /* The 206 response while its headers are read, and then its body. */
+    serf_bucket_t *range_resp;
+    serf_bucket_t *body;
+};
+
+static const serf_bucket_type_t serf_bucket_type_resume;
+
+
+static void free_hdrs(serf__resume_req_t *rs)
+{
+    if (rs->hdrs) {
+        serf_bucket_mem_free(rs->request->allocator, rs->hdrs);
+        rs->hdrs = NULL;
+    }
+}
+
+/* Parse the header block in RS, and find out if the response can be
+   resumed. */
+static void parse_headers(serf__resume_req_t *rs)
+{
+    serf_bucket_alloc_t *allocator = rs->request->allocator;
+    serf_bucket_t *resp, *hdrs;
+    serf_status_line sl;
+    const char *cl, *etag, *v;
+    apr_status_t status;
+
+    resp = serf_bucket_response_create(
+               serf_bucket_simple_create(rs->hdrs, rs->hdrs_len, NULL, NULL,
+                                         allocator),
+               allocator);
+
+    /* Reaching the body can return EOF, the headers are complete then. */
+    status = serf_bucket_response_wait_for_headers(resp);
+    if (APR_STATUS_IS_EOF(status))
+        status = serf_bucket_response_wait_for_headers(resp);
+    if (!status)
+        status = serf_bucket_response_status(resp, &sl);
+    if (status) {
+        rs->state = RESUME_NONE;
+        serf_bucket_destroy(resp);
+        return;
+    }
+
+    /* An interim response, the real one follows. */
+    if (sl.code >= 100 && sl.code < 200) {
+        rs->hdrs_len = 0;
+        serf_bucket_destroy(resp);
+        return;
+    }
+
+    rs->state = RESUME_NONE;
+    hdrs = serf_bucket_response_get_headers(resp);
+    cl = serf_bucket_headers_get(hdrs, "Content-Length");
+    etag = serf_bucket_headers_get(hdrs, "ETag");
+
+    if (sl.code == 200 && cl &&
+        !serf_bucket_headers_get(hdrs, "Transfer-Encoding") &&
+        !apr_strtoff(&rs->length, cl, NULL, 10) && rs->length > 0) {
+
+        v = serf_bucket_headers_get(hdrs, "Accept-Ranges");
+        if (v && strcasecmp(v, "none") == 0) {
+            /* Not resumable. */
+        }
+        else if (etag && strncmp(etag, "W/", 2) != 0) {
+            rs->validator = apr_pstrdup(rs->request->respool, etag);
+            rs->state = RESUME_BODY;
+        }
+        else if ((v = serf_bucket_headers_get(hdrs, "Last-Modified"))) {
+            rs->validator = apr_pstrdup(rs->request->respool, v);
+            rs->state = RESUME_BODY;
+        }
+    }
+
+    serf_bucket_destroy(resp);
+}
+
+/* Keep the DATA of the header block that the response bucket read, and
+   count the body bytes that follow it. */
+static void scan_headers(serf__resume_req_t *rs, const char *data,
+                         apr_size_t len)
+{
+    apr_size_t i;
+
+    for (i = 0; i < len && rs->state == RESUME_HEADERS; i++) {
+        char c = data[i];
+
+        if (rs->hdrs_len == MAX_HEADERS_SIZE) {
+            rs->state = RESUME_NONE;
+            break;
+        }
+        rs->hdrs[rs->hdrs_len++] = c;
+
+        /* An empty line ends the header block. */
+        if (c == '\n') {
+            if (++rs->eols == 2) {
+                rs->eols = 0;
+                parse_headers(rs);
+            }
+        }
+        else if (c != '\r') {
+            rs->eols = 0;
+        }
+    }
+
+    if (rs->state == RESUME_BODY)
+        rs->received = len - i;
+    if (rs->state != RESUME_HEADERS)
+        free_hdrs(rs);
+}
+
+/* Parse the content range VALUE of the 206 response, which must start at
+   OFFSET and end at the end of the body of LENGTH bytes. */
+static int range_matches(const char *value, apr_off_t offset,
+                         apr_off_t length)
+{
+    apr_off_t start, end, total;
+    char *p;
+
+    if (!value || strncmp(value, "bytes ", 6) != 0)
+        return 0;
+    value += 6;
+
+    if (apr_strtoff(&start, value, &p, 10) || *p != '-')
+        return 0;
+    if (apr_strtoff(&end, p + 1, &p, 10) || *p != '/')
+        return 0;
+    if (p[1] != '*' && (apr_strtoff(&total, p + 1, &p, 10) || total != length))
+        return 0;
+
+    return start == offset && end == length - 1;
+}
+
+/* Read the headers of the response to the resumed request, and switch to
+   its body if it is the expected range. */
+static apr_status_t read_range_headers(serf__resume_req_t *rs)
+{
+    serf_connection_t *conn = rs->request->conn;
+    serf_bucket_alloc_t *allocator = rs->request->allocator;
+    serf_bucket_t *hdrs;
+    serf_status_line sl;
+    const char *cl;
+    apr_off_t len;
+    apr_status_t status;
+
+    while (1) {
+        if (!rs->range_resp) {
+            rs->range_resp = serf_bucket_response_create(
+                                 serf_bucket_barrier_create(conn->stream,
+                                                            allocator),
+                                 allocator);
+        }
+
+        status = serf_bucket_response_wait_for_headers(rs->range_resp);
+        if (APR_STATUS_IS_EOF(status))
+            status = serf_bucket_response_wait_for_headers(rs->range_resp);
+        if (!status)
+            status = serf_bucket_response_status(rs->range_resp, &sl);
+        if (status)
+            return status;
+
+        if (sl.code < 100 || sl.code >= 200)
+            break;
+
+        /* Skip the interim response. */
+        serf_bucket_destroy(rs->range_resp);
+        rs->range_resp = NULL;
+    }
+
+    hdrs = serf_bucket_response_get_headers(rs->range_resp);
+    cl = serf_bucket_headers_get(hdrs, "Content-Length");
+
+    if (sl.code != 206 || !cl || apr_strtoff(&len, cl, NULL, 10) ||
+        len != rs->length - rs->received ||
+        serf_bucket_headers_get(hdrs, "Transfer-Encoding") ||
+        !range_matches(serf_bucket_headers_get(hdrs, "Content-Range"),
+                       rs->received, rs->length)) {
+
+        serf__log(LOGLVL_WARNING, LOGCOMP_CONN, __FILE__, conn->config,
+                  "can't resume response of request 0x%x, got status %d\n",
+                  rs->request, sl.code);
+        rs->state = RESUME_NONE;
+        return SERF_ERROR_TRUNCATED_HTTP_RESPONSE;
+    }
+
+    /* Read the body as is, the response bucket of the application applies
+       the content encoding of the whole response. */
+    rs->body = serf_bucket_response_body_create(
+                   serf_bucket_barrier_create(conn->stream, allocator),
+                   len, allocator);
+    serf_bucket_destroy(rs->range_resp);
+    rs->range_resp = NULL;
+    rs->state = RESUME_RANGE_BODY;
+
+    return APR_SUCCESS;
+}
+
+/* Returns non-zero if STATUS means the connection was lost. */
+static int connection_lost(apr_status_t status)
+{
+    return APR_STATUS_IS_EOF(status) ||
+           APR_STATUS_IS_ECONNRESET(status) ||
+           APR_STATUS_IS_ECONNABORTED(status) ||
+           status == SERF_ERROR_TRUNCATED_HTTP_RESPONSE ||
+           status == SERF_ERROR_ABORTED_CONNECTION;
+}
+
+static apr_status_t resume_read(serf__resume_req_t *rs, int readline,
+                                apr_size_t requested, int acceptable,
+                                int *found, const char **data,
+                                apr_size_t *len)
+{
+    serf_bucket_t *source;
+    apr_status_t status;
+
+    *len = 0;
+
+    if (rs->state == RESUME_INTERRUPTED)
+        return APR_EAGAIN;
+
+    if (rs->state == RESUME_RANGE) {
+        status = read_range_headers(rs);
+        if (status)
+            return status;
+    }
+
+    if (rs->state == RESUME_RANGE_BODY)
+        source = rs->body;
+    else
+        source = rs->request->conn->stream;
+
+    if (readline)
+        status = serf_bucket_readline(source, acceptable, found, data, len);
+    else
+        status = serf_bucket_read(source, requested, data, len);
+
+    if (SERF_BUCKET_READ_ERROR(status))
+        *len = 0;
+
+    if (rs->state == RESUME_HEADERS) {
+        scan_headers(rs, *data, *len);
+    }
+    else if (rs->state == RESUME_BODY || rs->state == RESUME_RANGE_BODY) {
+        rs->received += *len;
+
+        if (rs->received < rs->length && connection_lost(status)) {
+            serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__,
+                      rs->request->conn->config,
+                      "response of request 0x%x interrupted after %"
+                      APR_OFF_T_FMT " bytes\n", rs->request, rs->received);
+            rs->state = RESUME_INTERRUPTED;
+            return APR_EAGAIN;
+        }
+    }
+
+    return status;
+}
+
+static apr_status_t serf_resume_read(serf_bucket_t *bucket,
+                                     apr_size_t requested,
+                                     const char **data, apr_size_t *len)
+{
+    return resume_read(bucket->data, 0, requested, 0, NULL, data, len);
+}
+
+static apr_status_t serf_resume_readline(serf_bucket_t *bucket,
+                                         int acceptable, int *found,
+                                         const char **data, apr_size_t *len)
+{
+    *found = SERF_NEWLINE_NONE;
+
+    return resume_read(bucket->data, 1, 0, acceptable, found, data, len);
+}
+
+static apr_status_t serf_resume_peek(serf_bucket_t *bucket,
+                                     const char **data,
+                                     apr_size_t *len)
+{
+    serf__resume_req_t *rs = bucket->data;
+    serf_bucket_t *source;
+    apr_status_t status;
+
+    if (rs->state == RESUME_INTERRUPTED || rs->state == RESUME_RANGE) {
+        *len = 0;
+        return APR_SUCCESS;
+    }
+
+    if (rs->state == RESUME_RANGE_BODY)
+        source = rs->body;
+    else
+        source = rs->request->conn->stream;
+
+    status = serf_bucket_peek(source, data, len);
+
+    /* Don't report the end of an incomplete body. */
+    if (APR_STATUS_IS_EOF(status) && rs->received + *len < rs->length &&
+        (rs->state == RESUME_BODY || rs->state == RESUME_RANGE_BODY))
+        return APR_SUCCESS;
+
+    return status;
+}
+
+static void serf_resume_destroy(serf_bucket_t *bucket)
+{
+    serf__resume_req_t *rs = bucket->data;
+
+    if (rs->range_resp)
+        serf_bucket_destroy(rs->range_resp);
+    if (rs->body)
+        serf_bucket_destroy(rs->body);
+    free_hdrs(rs);
+
+    serf_default_destroy(bucket);
+}
+
+static const serf_bucket_type_t serf_bucket_type_resume = {
+    "RESUME",
+    serf_resume_read,
+    serf_resume_readline,
+    serf_default_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_buckets_are_v2,
+    serf_resume_peek,
+    serf_resume_destroy,
+    serf_default_read_bucket,
+    serf_default_ignore_config,
+};
+
+void serf__resume_request_start(serf_request_t *request)
+{
+    serf__resume_req_t *rs;
+    serf_bucket_t *body;
+    const char *method, *uri;
+
+    if (request->resume || request->ssltunnel || request->cache ||
+        request->coalesce || !SERF_BUCKET_IS_REQUEST(request->req_bkt))
+        return;
+
+    serf__bucket_request_get_line(request->req_bkt, &method, &uri);
+    if (strcmp(method, "GET") != 0)
+        return;
+
+    body = serf__bucket_request_swap_body(request->req_bkt, NULL);
+    serf__bucket_request_swap_body(request->req_bkt, body);
+    if (body)
+        return;
+
+    /* A partial response can't be resumed. */
+    if (serf_bucket_headers_get(
+            serf_bucket_request_get_headers(request->req_bkt), "Range"))
+        return;
+
+    rs = apr_pcalloc(request->respool, sizeof(*rs));
+    rs->request = request;
+    rs->state = RESUME_HEADERS;
+    rs->hdrs = serf_bucket_mem_alloc(request->allocator, MAX_HEADERS_SIZE);
+    rs->stream = serf_bucket_create(&serf_bucket_type_resume,
+                                    request->allocator, rs);
+
+    request->resume = rs;
+}
+
+serf_bucket_t *serf__resume_get_stream(serf_request_t *request)
+{
+    return request->resume->stream;
+}
+
+int serf__resume_interrupted(serf_request_t *request)
+{
+    return request->resume &&
+           request->resume->state == RESUME_INTERRUPTED;
+}
+
+int serf__resume_prepare(serf_request_t *request)
+{
+    serf__resume_req_t *rs = request->resume;
+
+    /* Only a response that was partly read by the response bucket. */
+    if (!rs || !request->resp_bkt ||
+        (rs->state != RESUME_BODY && rs->state != RESUME_INTERRUPTED &&
+         rs->state != RESUME_RANGE && rs->state != RESUME_RANGE_BODY))
+        return 0;
+
+    /* The buckets over the old connection's stream. */
+    if (rs->range_resp) {
+        serf_bucket_destroy(rs->range_resp);
+        rs->range_resp = NULL;
+    }
+    if (rs->body) {
+        serf_bucket_destroy(rs->body);
+        rs->body = NULL;
+    }
+
+    rs->state = RESUME_RANGE;
+
+    return 1;
+}
+
+void serf__resume_set_range(serf_request_t *request)
+{
+    serf__resume_req_t *rs = request->resume;
+    serf_bucket_t *hdrs;
+
+    hdrs = serf_bucket_request_get_headers(request->req_bkt);
+    serf_bucket_headers_setn(hdrs, "Range",
+                             apr_psprintf(request->respool,
+                                          "bytes=%" APR_OFF_T_FMT "-",
+                                          rs->received));
+    serf_bucket_headers_setn(hdrs, "If-Range", rs->validator);
+}
+
+void serf__resume_request_done(serf_request_t *request)
+{
+    if (request->resume) {
+        serf_bucket_destroy(request->resume->stream);
+        request->resume = NULL;
+    }
+}
+
+void serf_context_set_resume_responses(serf_context_t *ctx, int enabled)
+{
+    ctx->resume_responses = enabled;
+}
@@ -261,6 +261,175 @@ void serf_context_set_progress_cb(
     const serf_progress_t progress_func,
     void *progress_baton);
 
+/**
+ * Capture the shape of the traffic of all connections in @a ctx to @a file.
+ * For every completed request one line is written, with the time the request
+ * was created, its latency, method, uri, the header and body sizes of request
+ * and response and the response status. The contents of headers and bodies
+ * are not stored. With https the data is measured above the SSL layer.
+ *
+ * Only connections set up after this call are captured. Pass NULL as
+ * @a file to stop capturing. @a file must stay open, and @a pool alive,
+ * until then.
+ *
+ * test/serf_replay replays a capture file against a local server.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_context_capture_traffic(
+    serf_context_t *ctx,
+    apr_file_t *file,
+    apr_pool_t *pool);
+
+/**
+ * Cache the responses to GET requests of @a ctx in @a directory, which is
+ * created if needed, following the rules of RFC 7234 for a private cache.
+ *
+ * A fresh cached response is delivered to the request's acceptor and
+ * handler without contacting the server. For a stale response with a
+ * validator the request is sent with If-None-Match and/or If-Modified-Since;
+ * if the server answers 304 Not Modified the cached response is delivered.
+ * The cached responses are read through mmap where available.
+ *
+ * When the cache is enabled, the setup callback of a request is called
+ * before its connection is opened. Responses with a Vary header are not
+ * cached. Pass NULL as @a directory to disable the cache.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_context_set_response_cache(
+    serf_context_t *ctx,
+    const char *directory);
+
+/**
+ * Enable or disable coalescing of identical GET requests in @a ctx.
+ *
+ * When enabled, a GET request for which an identical GET is in flight is
+ * not sent; its acceptor and handler get a copy of the response of the
+ * request in flight. Requests are identical if they are for the same url
+ * and have the same Accept, Accept-Encoding, Accept-Language, Authorization
+ * and Cookie headers. Requests with a Range or a conditional header are
+ * never coalesced.
+ *
+ * A request can only join while the response of the request in flight
+ * didn't start to arrive. If that request is cancelled, loses its
+ * connection or gets an authentication challenge, the handlers of the
+ * joined requests are called without a response, as when their connection
+ * is reset, and they can be sent again.
+ *
+ * @since New in 1.4.
+ */
+void serf_context_set_request_coalescing(
+    serf_context_t *ctx,
+    int enabled);
+
+/**
+ * Enable or disable resuming of interrupted responses in @a ctx.
+ *
+ * When enabled, serf counts the body bytes delivered to the response
+ * bucket of a GET request without a body, if the response is a 200 with a
+ * Content-Length and a validator: a strong ETag or a Last-Modified date.
+ * If the connection is lost before the body was read completely, the
+ * request is not cancelled. It is set up again, its setup callback is
+ * called for a new request bucket, and sent with Range and If-Range
+ * headers for the rest of the body. The response bucket continues with
+ * the body of the 206 response, without a gap.
+ *
+ * If the server doesn't answer with the requested range, e.g. because the
+ * resource changed, reading the response returns
+ * SERF_ERROR_TRUNCATED_HTTP_RESPONSE.
+ *
+ * @since New in 1.4.
+ */
+void serf_context_set_resume_responses(
+    serf_context_t *ctx,
+    int enabled);
+
+/**
+ * Enable hedging of late idempotent requests in @a ctx: GET, HEAD and
+ * OPTIONS requests without a body.
+ *
+ * For every host, serf keeps a histogram of the time between sending such
+ * a request and the start of its response. A request that got no response
+ * after the latency at @a percentile of its host's histogram, e.g. 95.0,
+ * gets a duplicate on another connection to the same host, created with
+ * the same setup callback and baton. The first of the two to get a
+ * response delivers it; the other is cancelled with serf_request_cancel,
+ * or, if it was written already, its response is read and dropped.
+ * The acceptor and handler can thus be called with the duplicate as their
+ * request argument.
+ *
+ * Hedging starts once a host has enough samples, and needs the
+ * application to have more than one connection to the host. Pass 0 as
+ * @a percentile to disable hedging.
+ *
+ * Returns APR_EINVAL if @a percentile is not in the range [0, 100).
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_context_set_hedging(
+    serf_context_t *ctx,
+    double percentile);
+
+/**
+ * Trim the memory of the connections of @a ctx that had no requests for
+ * @a idle_time, see serf_connection_trim(). A connection is trimmed once
+ * per idle period. Pass 0 as @a idle_time to disable trimming (the
+ * default).
+ *
+ * @since New in 1.4.
+ */
+void serf_context_set_idle_trim(
+    serf_context_t *ctx,
+    apr_interval_time_t idle_time);
+
+/**
+ * Callback function for memory pressure. Called with @a over_budget set
+ * when the memory used by the connections of the context went over its
+ * budget, and with @a over_budget 0 when it came back under it. @a used is
+ * the number of bytes in use.
+ *
+ * @since New in 1.4.
+ */
+typedef void (*serf_memory_pressure_t)(
+    void *pressure_baton,
+    int over_budget,
+    apr_size_t used);
+
+/**
+ * Limit the memory the bucket allocators of the connections and requests
+ * of @a ctx hold to @a budget bytes. Pass 0 as @a budget for no limit (the
+ * default).
+ *
+ * When the budget is exceeded, the idle memory of all connections is
+ * trimmed first, see serf_connection_trim(). If that isn't enough, no new
+ * requests are written until the memory in use drops below 7/8 of the
+ * budget. Requests that were partly written are finished, responses are
+ * still read, and priority requests and tunnel setup are still sent.
+ * @a pressure_func, if not NULL, is called with @a pressure_baton on both
+ * transitions. If the memory is held by responses the application doesn't
+ * consume, it should cancel requests or raise the budget.
+ *
+ * Memory of bucket allocators the application created itself isn't
+ * counted.
+ *
+ * @since New in 1.4.
+ */
+void serf_context_set_memory_budget(
+    serf_context_t *ctx,
+    apr_size_t budget,
+    serf_memory_pressure_t pressure_func,
+    void *pressure_baton);
+
+/**
+ * Returns the number of bytes the bucket allocators of the connections of
+ * @a ctx hold.
+ *
+ * @since New in 1.4.
+ */
+apr_size_t serf_context_get_memory_used(
+    serf_context_t *ctx);
+
 /** @} */
 
 /**
@@ -527,6 +696,47 @@ void serf_connection_set_max_outstanding_requests(
     serf_connection_t *conn,
     unsigned int max_requests);
 
+/**
+ * Let the number of outstanding requests on @a conn follow the server: it
+ * starts at 1, grows while responses keep coming as fast as the fastest
+ * one seen, and is halved when requests start queueing up at the server or
+ * the connection is reset with requests in flight. It never exceeds
+ * @a max_depth, nor the limit set with
+ * serf_connection_set_max_outstanding_requests(). A @a max_depth of 0
+ * switches the adaptive limit off.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_set_adaptive_pipelining(
+    serf_connection_t *conn,
+    unsigned int max_depth);
+
+/**
+ * Give back the memory @a conn holds without using it: the free blocks of
+ * its bucket allocator and, when the stream created by its setup callback
+ * is an SSL decrypt bucket, the buffers of the SSL context, see
+ * serf_ssl_release_buffers(). Buffers are allocated again when needed.
+ *
+ * This is safe to call at any time, but most useful on a connection
+ * without requests, e.g. a keep-alive connection that will be idle for a
+ * while.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_trim(
+    serf_connection_t *conn);
+
+/**
+ * Like serf_context_set_rate_limit, but for connection @a conn only.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_set_rate_limit(
+    serf_connection_t *conn,
+    apr_uint64_t write_rate,
+    apr_uint64_t read_rate,
+    unsigned int request_rate);
+
 void serf_connection_set_async_responses(
     serf_connection_t *conn,
     serf_response_acceptor_t acceptor,
@@ -598,6 +808,92 @@ serf_request_t *serf_connection_priority_request_create(
     serf_request_setup_t setup,
     void *setup_baton);
 
+/* Priority classes of requests, see serf_request_set_priority. */
+#define SERF_PRIORITY_BACKGROUND  0
+#define SERF_PRIORITY_NORMAL      1
+#define SERF_PRIORITY_INTERACTIVE 2
+#define SERF_PRIORITY_CLASSES     3
+
+/**
+ * Set the priority class of @a request to @a priority_class, one of the
+ * SERF_PRIORITY_* values, and its @a deadline (0 for none). New requests
+ * are in class SERF_PRIORITY_NORMAL without deadline.
+ *
+ * The unwritten requests of a connection are sent in order of class, with
+ * the highest class first. Within a class, requests with a deadline go
+ * first, earliest deadline first. Other requests go in the order they were
+ * created. Requests created with serf_connection_priority_request_create
+ * still go before all of these.
+ *
+ * The classes are also taken into account across the connections of the
+ * context. While a request of a higher class is queued or in progress on
+ * any connection, a connection won't send a lower class request until its
+ * earlier requests are answered. This leaves the bandwidth to e.g.
+ * interactive requests, instead of filling the pipes with background
+ * downloads.
+ *
+ * Returns APR_EBUSY if writing @a request has already started, its priority
+ * can't be changed anymore then.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_request_set_priority(
+    serf_request_t *request,
+    int priority_class,
+    apr_time_t deadline);
+
+
+/**
+ * Pause reading the response of @a request, e.g. when the application can't
+ * keep up with writing it to disk.
+ *
+ * The response handler isn't called anymore until the request is resumed
+ * with serf_request_resume. The connection stops reading from its socket,
+ * so TCP flow control slows down the server instead of the response being
+ * buffered in memory. As responses arrive in order, the responses of the
+ * requests after @a request on the same connection wait too.
+ *
+ * This may be called from within the response handler, which should then
+ * return APR_EAGAIN or APR_SUCCESS. A request can be paused before its
+ * response arrives, it then takes effect once its response comes in.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_request_pause(
+    serf_request_t *request);
+
+/**
+ * Resume reading the response of @a request, paused earlier with
+ * serf_request_pause. Reading continues on the next run of the context.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_request_resume(
+    serf_request_t *request);
+
+
+/**
+ * Send @a request with an Expect: 100-continue header, and hold back its
+ * body until the server answers with 100 Continue.
+ *
+ * If the server answers with a final status instead, e.g. 401, 413 or a
+ * redirect, the body isn't sent at all. The response is handled as usual,
+ * after which the connection is closed and reopened, as the server may
+ * still be waiting for the body. If the server doesn't answer within
+ * @a timeout, the body is sent anyway, as not all servers support
+ * 100-continue. A @a timeout of 0 disables the handling again.
+ *
+ * This only applies to requests created with serf_bucket_request_create or
+ * serf_request_bucket_request_create that have a body. Requests after
+ * @a request on the same connection wait until its body was sent.
+ *
+ * Returns APR_EBUSY if writing @a request has already started.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_request_set_expect_continue(
+    serf_request_t *request,
+    apr_interval_time_t timeout);
 
 /** Returns detected network latency for the @a conn connection. Negative
  *  value means that latency is unknwon.
@@ -706,6 +1002,190 @@ void serf_config_credentials_callback(
     serf_context_t *ctx,
     serf_credentials_callback_t cred_cb);
 
+/**
+ * Limit the authentication state that @a ctx keeps per server, like Basic
+ * credentials and Digest nonces. This state is shared by all connections to
+ * the same server, so new connections authenticate with the first request.
+ *
+ * At most @a max_servers servers are remembered, the least recently used
+ * server is forgotten first. The state of a server is forgotten @a ttl after
+ * its credentials were obtained, 0 means it doesn't expire. A forgotten
+ * server gets a 401 response again on its next request.
+ *
+ * The defaults are 64 servers and one hour.
+ *
+ * @since New in 1.4.
+ */
+void serf_config_authn_cache(
+    serf_context_t *ctx,
+    unsigned int max_servers,
+    apr_interval_time_t ttl);
+
+/**
+ * Limit the rate at which all connections of @a ctx together write bytes
+ * (@a write_rate, in bytes per second), read bytes (@a read_rate, in bytes
+ * per second) and start new requests (@a request_rate, per second). 0 means
+ * no limit. Short bursts of about 100 ms worth of traffic are allowed.
+ * The bytes read are counted by socket buckets created with
+ * serf_context_bucket_socket_create, the read limit has no effect on other
+ * connections.
+ *
+ * A throttled connection is not polled for writing or reading until it may
+ * continue. serf_context_run wakes up in time for that, applications that
+ * use their own pollset should call serf_context_prerun regularly.
+ *
+ * @since New in 1.4.
+ */
+void serf_context_set_rate_limit(
+    serf_context_t *ctx,
+    apr_uint64_t write_rate,
+    apr_uint64_t read_rate,
+    unsigned int request_rate);
+
+/**
+ * Like serf_context_set_rate_limit, but for all connections of @a ctx to
+ * the host at @a host_url, e.g. "http://www.example.com:8080". These limits
+ * apply in addition to those of the context and the connection.
+ *
+ * @since New in 1.4.
+ */
+void serf_context_set_host_rate_limit(
+    serf_context_t *ctx,
+    const char *host_url,
+    apr_uint64_t write_rate,
+    apr_uint64_t read_rate,
+    unsigned int request_rate);
+
+/**
+ * Enable (@a reuse non-zero) or disable reusing Negotiate authentication
+ * state across connections. When enabled, new connections to a server that
+ * required Negotiate (Kerberos) authentication before send a token with
+ * their first request, so they authenticate without an extra 401 response.
+ * What was learned about how often the server wants to authenticate is
+ * reused as well.
+ *
+ * This costs a request for a service ticket for each new connection, even
+ * when the server would have accepted the request without one. It is
+ * disabled by default.
+ *
+ * @since New in 1.4.
+ */
+void serf_config_authn_negotiate_reuse(
+    serf_context_t *ctx,
+    int reuse);
+
+/**
+ * A download of one resource over several connections, see
+ * serf_download_create().
+ */
+typedef struct serf_download_t serf_download_t;
+
+/**
+ * Called when a download is done. @a status is APR_SUCCESS if all
+ * @a length bytes were written to the file, or the error that stopped the
+ * download.
+ */
+typedef void (*serf_download_done_t)(
+    void *done_baton,
+    apr_status_t status,
+    apr_off_t length);
+
+/**
+ * Download @a url into @a file, using up to @a max_conns connections to
+ * the server in parallel. The download runs in @a ctx, like any request;
+ * @a done is called when it is complete.
+ *
+ * The first request asks for the first @a segment_size bytes with a Range
+ * header. If the server answers with a 206 Partial Content, @a file is
+ * extended to the size of the resource and the rest is fetched in segments
+ * of @a segment_size bytes, each written at its offset in @a file. If the
+ * server doesn't support ranges the whole body is fetched with the first
+ * request. An empty resource, answered with a 416 with a length of 0, is
+ * done after the first request. The segments are requested with an
+ * If-Range header, a resource that changes during the download fails it
+ * with SERF_ERROR_BAD_HTTP_RESPONSE.
+ *
+ * The connections are created with @a setup and @a setup_baton, see
+ * serf_connection_create2(). They are allocated in @a pool, and closed when
+ * it is destroyed; most of them are closed as soon as the download is done.
+ * A @a segment_size of 0 means 1 MB.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_download_create(
+    serf_download_t **download,
+    serf_context_t *ctx,
+    const char *url,
+    apr_file_t *file,
+    int max_conns,
+    apr_off_t segment_size,
+    serf_connection_setup_t setup,
+    void *setup_baton,
+    serf_download_done_t done,
+    void *done_baton,
+    apr_pool_t *pool);
+
+/**
+ * Returns the size of the resource of @a download, -1 if not known yet.
+ *
+ * @since New in 1.4.
+ */
+apr_off_t serf_download_get_length(
+    const serf_download_t *download);
+
+/**
+ * A set of connections to all addresses of one host, see
+ * serf_balancer_create().
+ */
+typedef struct serf_balancer_t serf_balancer_t;
+
+/**
+ * Create a balancer for the host of @a host_info in @a ctx. The host is
+ * resolved, and @a conns_per_backend connections are created to each of
+ * its addresses of the family of the first address, with @a setup,
+ * @a closed and their batons, see serf_connection_create2(). When a proxy
+ * is configured, all connections go to the proxy.
+ *
+ * Requests created with serf_balancer_request_create() go to the address
+ * with the lowest average time to the first byte of a response, weighed
+ * by its nr. of outstanding requests. An address that responds much slower
+ * than the others, or that can't be connected to, gets no new requests for
+ * 30 seconds.
+ *
+ * The balancer and its connections are allocated in @a pool.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_balancer_create(
+    serf_balancer_t **balancer,
+    serf_context_t *ctx,
+    apr_uri_t host_info,
+    int conns_per_backend,
+    serf_connection_setup_t setup,
+    void *setup_baton,
+    serf_connection_closed_t closed,
+    void *closed_baton,
+    apr_pool_t *pool);
+
+/**
+ * Like serf_connection_request_create(), on the connection of
+ * @a balancer that is expected to respond first.
+ *
+ * @since New in 1.4.
+ */
+serf_request_t *serf_balancer_request_create(
+    serf_balancer_t *balancer,
+    serf_request_setup_t setup,
+    void *setup_baton);
+
+/**
+ * Returns the nr. of addresses @a balancer spreads its requests over.
+ *
+ * @since New in 1.4.
+ */
+int serf_balancer_get_nr_of_backends(
+    serf_balancer_t *balancer);
+
 /* ### maybe some connection control functions for flood? */
 
 /*** Special bucket creation functions ***/
@@ -663,6 +663,19 @@ apr_status_t serf_ssl_use_compression(
     serf_ssl_context_t *ssl_ctx,
     int enabled);
 
+/**
+ * Release the memory @a ssl_ctx holds for data that was read through the
+ * SSL buckets, if they have none pending, and let OpenSSL free its record
+ * buffers whenever they are empty. The buffers are allocated again when
+ * needed.
+ *
+ * Data returned by earlier reads of the SSL buckets becomes invalid.
+ *
+ * @since New in 1.4.
+ */
+void serf_ssl_release_buffers(
+    serf_ssl_context_t *ssl_ctx);
+
 serf_bucket_t *serf_bucket_ssl_encrypt_create(
     serf_bucket_t *stream,
     serf_ssl_context_t *ssl_context,
@@ -719,6 +732,46 @@ serf_bucket_t *serf_bucket_copy_create(
 
 /* ==================================================================== */
 
+extern const serf_bucket_type_t serf_bucket_type_spool;
+#define SERF_BUCKET_IS_SPOOL(b) SERF_BUCKET_CHECK((b), spool)
+
+/** Keeps the data read from a bucket, so it can be read again. */
+typedef struct serf_spool_t serf_spool_t;
+
+/**
+ * Create a spool for the data of @a source in @a pool. The first
+ * @a memory_size bytes are kept in memory, the rest is written to a
+ * temporary file, which is removed when @a pool is cleaned up.
+ *
+ * The spool takes ownership of @a source, which is destroyed as soon as it
+ * returns APR_EOF, or when @a pool is cleaned up before that. @a pool must
+ * not outlive the bucket allocator of @a source, so don't use a request's
+ * allocator for it.
+ *
+ * @since New in 1.4.
+ */
+serf_spool_t *serf_spool_create(
+    serf_bucket_t *source,
+    apr_size_t memory_size,
+    apr_pool_t *pool);
+
+/**
+ * Create a bucket that reads the data of @a spool from the start: first the
+ * data spooled already, then from the source, spooling it as it is read.
+ *
+ * Use this as the body of a request that may have to be sent again, e.g.
+ * after a connection reset or for authentication. The request's setup
+ * callback creates a new spool bucket each time, and the source data is
+ * only read once.
+ *
+ * @since New in 1.4.
+ */
+serf_bucket_t *serf_bucket_spool_create(
+    serf_spool_t *spool,
+    serf_bucket_alloc_t *allocator);
+
+/* ==================================================================== */
+
 /* ### do we need a PIPE bucket type? they are simple apr_file_t objects */
 
 
@@ -132,6 +132,19 @@ void serf_bucket_mem_free(
     serf_bucket_alloc_t *allocator,
     void *block);
 
+/**
+ * Return the blocks of @a allocator of which all memory was freed to its
+ * APR allocator. Small allocations are carved out of blocks and are kept
+ * on a freelist when freed, so without trimming an allocator never shrinks.
+ *
+ * Use apr_allocator_max_free_set() on the APR allocator to have it give
+ * the memory back to the system.
+ *
+ * @since New in 1.4.
+ */
+void serf_bucket_allocator_trim(
+    serf_bucket_alloc_t *allocator);
+
 
 /**
  * Analogous to apr_pstrmemdup, using a bucket allocator instead.
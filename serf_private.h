@@ -92,6 +92,47 @@
 
 typedef struct serf__authn_scheme_t serf__authn_scheme_t;
 
+/* Traffic capture state, see capture.c */
+typedef struct serf__capture_t serf__capture_t;
+typedef struct serf__capture_conn_t serf__capture_conn_t;
+typedef struct serf__capture_req_t serf__capture_req_t;
+
+/* Response cache state, see cache.c */
+typedef struct serf__cache_t serf__cache_t;
+typedef struct serf__cache_req_t serf__cache_req_t;
+
+/* Request coalescing state, see coalesce.c */
+typedef struct serf__coalesce_t serf__coalesce_t;
+typedef struct serf__coalesce_group_t serf__coalesce_group_t;
+
+/* Resume state of a request, see resume.c */
+typedef struct serf__resume_req_t serf__resume_req_t;
+
+/* A token bucket, see ratelimit.c */
+typedef struct serf__token_bucket_t {
+    apr_uint64_t rate;      /* tokens per second, 0 means no limit */
+    apr_uint64_t burst;     /* max. number of tokens */
+    apr_int64_t credit;     /* tokens * APR_USEC_PER_SEC, negative if in debt */
+    apr_time_t last;        /* time of the last refill */
+} serf__token_bucket_t;
+
+/* Rate limits of a connection, host or context. */
+typedef struct serf__ratelimit_t {
+    serf__token_bucket_t write;     /* bytes written */
+    serf__token_bucket_t read;      /* bytes read */
+    serf__token_bucket_t requests;  /* requests started */
+} serf__ratelimit_t;
+
+/* Adaptive pipelining state of a connection, see pipeline.c */
+typedef struct serf__pipeline_t {
+    unsigned int max_depth;     /* 0 if not adaptive */
+    unsigned int depth;         /* nr. of requests allowed in flight */
+    unsigned int ssthresh;      /* end of slow start */
+    unsigned int acked;         /* responses since DEPTH was raised */
+    unsigned int recover;       /* no decrease before this many responses */
+    apr_interval_time_t min_rtt; /* smallest response time, -1 if unknown */
+} serf__pipeline_t;
+
 typedef struct serf_io_baton_t {
     int type;
     union {
@@ -101,6 +142,41 @@ typedef struct serf_io_baton_t {
     } u;
 } serf_io_baton_t;
 
+/* States of a request sent with Expect: 100-continue. */
+typedef enum {
+    SERF__EXPECT_NONE,          /* no Expect header, or final status seen */
+    SERF__EXPECT_WAITING,       /* headers sent, body held back */
+    SERF__EXPECT_SENDING,       /* body released, 1xx responses dropped */
+    SERF__EXPECT_REJECTED       /* final status before the body was sent */
+} serf__expect_state_t;
+
+/* Hedging states of a request, see hedge.c. */
+typedef enum {
+    SERF__HEDGE_NONE,           /* not hedged */
+    SERF__HEDGE_WAITING,        /* sent, hedged at HEDGE_AT without response */
+    SERF__HEDGE_SENT,           /* a duplicate was sent, HEDGE_PEER */
+    SERF__HEDGE_DUPLICATE       /* the duplicate of HEDGE_PEER */
+} serf__hedge_state_t;
+
+/* Latency histograms for hedging, see hedge.c */
+typedef struct serf__hedge_t serf__hedge_t;
+
+/* An address of a balanced host, see balance.c */
+typedef struct serf__backend_t serf__backend_t;
+
+/* A queue of requests of a connection, doubly linked through their NEXT
+   and PREV fields. */
+typedef struct serf__req_queue_t {
+    struct serf_request_t *head;
+    struct serf_request_t *tail;
+    unsigned int length;
+} serf__req_queue_t;
+
+/* The unwritten requests are ordered by rank, see outgoing.c: one for
+   every combination of the ssltunnel and priority flags and priority
+   class. */
+#define SERF__NR_OF_RANKS (4 * SERF_PRIORITY_CLASSES)
+
 /* Holds all the information corresponding to a request/response pair. */
 struct serf_request_t {
     serf_connection_t *conn;
@@ -129,6 +205,25 @@ struct serf_request_t {
     /* 1 if this is a request to setup a SSL tunnel, 0 for normal requests. */
     int ssltunnel;
 
+    /* One of SERF_PRIORITY_*, and the deadline of the request or 0. See
+       serf_request_set_priority. */
+    int priority_class;
+    apr_time_t deadline;
+
+    /* 1 if the application paused reading the response, see
+       serf_request_pause. */
+    int paused;
+
+    /* Expect: 100-continue, see serf_request_set_expect_continue. While
+       waiting for the server the request body is held back in EXPECT_BODY,
+       in its place the request bucket has the empty aggregate EXPECT_HOLD.
+       After EXPECT_UNTIL the body is sent anyway. */
+    serf__expect_state_t expect_state;
+    apr_interval_time_t expect_timeout;
+    apr_time_t expect_until;
+    serf_bucket_t *expect_body;
+    serf_bucket_t *expect_hold;
+
     /* This baton is currently only used for digest authentication, which
        needs access to the uri of the request in the response handler.
        If serf_request_t is replaced by a serf_http_request_t in the future,
@@ -136,7 +231,56 @@ struct serf_request_t {
        anymore. */
     void *auth_baton;
 
+    /* The uri of the request, used to find the protection space of a realm
+       for preemptive authentication, and the Authorization header that was
+       sent with the request (NULL if none). */
+    const char *auth_uri;
+    const char *auth_header;
+
+    /* Traffic capture of this request, NULL if not captured. CAPTURE_TIME
+       is the time the request was created. */
+    serf__capture_req_t *capture;
+    apr_time_t capture_time;
+
+    /* Response cache state of this request, NULL if it wasn't looked up in
+       the cache. CACHED is set if it is answered from the cache, the
+       request is then in the cached queue of its connection. */
+    serf__cache_req_t *cache;
+    int cached;
+
+    /* The coalescing group of this request, as its leader or as a follower,
+       NULL if it isn't coalesced. A follower is CACHED too, and reads the
+       leader's response from COALESCE_STREAM. LOOKED_UP is set once the
+       request was looked up in the cache and the coalescing groups. */
+    serf__coalesce_group_t *coalesce;
+    serf_bucket_t *coalesce_stream;
+    int looked_up;
+
+    /* Resume state of this request, NULL if its response can't be resumed
+       after a connection reset. */
+    serf__resume_req_t *resume;
+
+    /* Hedging state. HEDGE_SENT is the time the request was written, 0 once
+       its response started. HEDGE_PEER is the duplicate, or the original,
+       while both are in flight. */
+    serf__hedge_state_t hedge_state;
+    apr_time_t hedge_sent;
+    apr_time_t hedge_at;
+    struct serf_request_t *hedge_peer;
+
+    /* The request bucket of a request that was read completely while its
+       data waits in the VEC of the connection, up to byte GATHERED_END. */
+    serf_bucket_t *gathered_bkt;
+    apr_uint64_t gathered_end;
+
+    /* Time the request was written on a balanced or adaptively pipelined
+       connection, 0 once its response started. */
+    apr_time_t written_time;
+
+    /* The queue that holds the request, NULL if none. */
+    serf__req_queue_t *queue;
     struct serf_request_t *next;
+    struct serf_request_t *prev;
 };
 
 typedef struct serf_pollset_t {
@@ -150,8 +294,15 @@ typedef struct serf__authn_info_t {
     void *baton;
 
     int failed_authn_types;
+
+    /* Pool for BATON and other scheme specific state, lives as long as this
+       object. */
+    apr_pool_t *pool;
 } serf__authn_info_t;
 
+/* An entry in the per server authentication cache, see auth.c */
+typedef struct serf__authn_cache_entry_t serf__authn_cache_entry_t;
+
 /*** Configuration store declarations ***/
 
 typedef struct serf__config_hdr_t serf__config_hdr_t;
@@ -178,16 +329,15 @@ typedef struct serf__config_store_t {
     serf__config_hdr_t *global_per_context;
 
     /* Configuration per host, dual-layered:
-     Key: hostname:port
-     Value: hash table of per host key/value pairs
+     Key: host url, e.g. http://localhost:12345
+     Value: per host key/value pairs
+     Only used when a connection is created, the connection's config object
+     keeps a reference to its host's values.
      */
     apr_hash_t *global_per_host;
 
-    /* Configuration per connection, dual-layered:
-     Key: string(connection ptr) (?)
-     Value: hash table of per host key/value pairs
-     */
-    apr_hash_t *global_per_conn;
+    /* Per connection values are owned by the connection's config object
+       (conn->config), there's no global table for them. */
 
 } serf__config_store_t;
 
@@ -203,7 +353,8 @@ apr_status_t serf__config_store_init(serf_context_t *ctx);
    If CONN is NULL, only the per context configuration will be available.
 
    The host and connection entries will be created in the configuration store
-   when not existing already.
+   when not existing already. Once CONN has a config object, its host and
+   connection values are reused without any lookups.
 
    The config object will be allocated in OUT_POOL. The config object's
    lifecycle cannot extend beyond that of the serf context!
@@ -240,6 +391,14 @@ struct serf_context_t {
     apr_array_header_t *conns;
 #define GET_CONN(ctx, i) (((serf_connection_t **)(ctx)->conns->elts)[i])
 
+    /* Number of requests per priority class that are queued or in progress
+       on all connections. */
+    unsigned int reqs_per_class[SERF_PRIORITY_CLASSES];
+
+    /* Number of requests waiting for a 100 Continue before their body is
+       sent. */
+    unsigned int expect_waiting;
+
     /* Proxy server address */
     apr_sockaddr_t *proxy_address;
 
@@ -252,9 +411,16 @@ struct serf_context_t {
     /* authentication info for the servers used in this context. Shared by all
        connections to the same server.
        Structure of the hashtable:  key: host url, e.g. https://localhost:80
-                                  value: serf__authn_info_t *
+                                  value: serf__authn_cache_entry_t *
+       The entries are also linked in least recently used order, the cache
+       holds at most AUTHN_CACHE_MAX servers and forgets credentials after
+       AUTHN_CACHE_TTL (see serf_config_authn_cache).
      */
     apr_hash_t *server_authn_info;
+    serf__authn_cache_entry_t *authn_lru_head;
+    serf__authn_cache_entry_t *authn_lru_tail;
+    unsigned int authn_cache_max;
+    apr_interval_time_t authn_cache_ttl;
 
     /* authentication info for the proxy configured in this context, shared by
        all connections. */
@@ -262,10 +428,59 @@ struct serf_context_t {
 
     /* List of authn types supported by the client.*/
     int authn_types;
+    /* Start Negotiate authentication on new connections to servers that are
+       known to need it, see serf_config_authn_negotiate_reuse. */
+    int negotiate_reuse;
+    /* Outbound credentials handles for Negotiate and NTLM authentication,
+       shared by all connections (serf__spnego_cred_t *, see
+       auth_spnego.c). */
+    void *negotiate_cred;
+    void *ntlm_cred;
     /* Callback function used to get credentials for a realm. */
     serf_credentials_callback_t cred_cb;
 
     serf_config_t *config;
+
+    /* Traffic capture, NULL if disabled. */
+    serf__capture_t *capture;
+
+    /* Rate limits for all connections, and per host (key: host url, value:
+       serf__ratelimit_t *). RATELIMIT_ENABLED is set once any limit was
+       configured. RATELIMIT_WAKEUP is the earliest time a throttled
+       connection can continue, 0 if none is throttled. */
+    serf__ratelimit_t ratelimit;
+    apr_hash_t *host_ratelimits;
+    int ratelimit_enabled;
+    apr_time_t ratelimit_wakeup;
+
+    /* Set when a paused request was resumed, see serf_request_resume. */
+    int reads_resumed;
+
+    /* Response cache, NULL if disabled. CACHED_PENDING is set while
+       responses from the cache wait to be delivered. */
+    serf__cache_t *cache;
+    int cached_pending;
+
+    /* Coalescing of identical GET requests, NULL if disabled. */
+    serf__coalesce_t *coalesce;
+
+    /* Set if interrupted responses are resumed with a Range request. */
+    int resume_responses;
+
+    /* Hedging of late idempotent requests, NULL if never enabled. */
+    serf__hedge_t *hedge;
+
+    /* Time after which idle connections are trimmed, 0 if never. */
+    apr_interval_time_t idle_trim;
+
+    /* Memory held by the allocators of the connections, and its limit, 0
+       if unlimited. OVER_BUDGET is set while requests and reads are held
+       back, see budget.c. */
+    apr_size_t mem_used;
+    apr_size_t mem_budget;
+    int over_budget;
+    serf_memory_pressure_t pressure_func;
+    void *pressure_baton;
 };
 
 struct serf_listener_t {
@@ -296,6 +511,13 @@ typedef enum {
                                    start a new socket */
 } serf__connection_state_t;
 
+/* Writes VECS to the (mock) transport of a connection, used instead of
+   apr_socket_sendv. Same semantics as apr_socket_sendv. */
+typedef apr_status_t (*serf__conn_writev_t)(void *baton,
+                                            const struct iovec *vecs,
+                                            int vecs_len,
+                                            apr_size_t *written);
+
 struct serf_connection_t {
     serf_context_t *ctx;
 
@@ -310,6 +532,14 @@ struct serf_connection_t {
     apr_socket_t *skt;
     apr_pool_t *skt_pool;
 
+    /* Mock transport, for testing and benchmarking without the kernel. If
+       MOCK_WRITEV is set no socket is created; outgoing data goes to
+       MOCK_WRITEV and the setup callback gets a NULL socket. MOCK_OPEN
+       takes the role of SKT != NULL. */
+    serf__conn_writev_t mock_writev;
+    void *mock_baton;
+    int mock_open;
+
     /* the last reqevents we gave to pollset_add */
     apr_int16_t reqevents;
 
@@ -350,20 +580,38 @@ struct serf_connection_t {
     /* Aggregate bucket used to send the CONNECT request. */
     serf_bucket_t *ssltunnel_ostream;
 
-    /* The list of requests that are written but no response has been received
+    /* The requests that are written but no response has been received
        yet. */
-    serf_request_t *written_reqs;
-    serf_request_t *written_reqs_tail;
-    unsigned int nr_of_written_reqs;
+    serf__req_queue_t written;
 
-    /* The list of requests that hasn't been written */
-    serf_request_t *unwritten_reqs;
-    serf_request_t *unwritten_reqs_tail;
-    unsigned int nr_of_unwritten_reqs;
+    /* The requests that haven't been written, in the order in which they
+       will be. RANK_TAILS has the last request of every rank of which
+       writing hasn't started, or NULL. */
+    serf__req_queue_t unwritten;
+    serf_request_t *rank_tails[SERF__NR_OF_RANKS];
+
+    /* The requests answered from the response cache, which are never
+       written. */
+    serf__req_queue_t cached;
 
     struct iovec vec[IOV_MAX];
     int vec_len;
 
+    /* Several small requests can be gathered in VEC to go out in one
+       writev. GATHER is set when the application didn't wrap the output
+       stream, so the data of a request stays valid as long as its bucket.
+       VEC_GATHERED is set while all data in VEC belongs to requests that
+       were read completely, NR_GATHERED of them still hold their bucket.
+       VEC_QUEUED and VEC_WRITTEN count the bytes put in and taken out of
+       VEC. VEC_COPY holds the data of VEC if a gathered request went away
+       before it was written. */
+    int gather;
+    int vec_gathered;
+    int nr_gathered;
+    apr_uint64_t vec_queued;
+    apr_uint64_t vec_written;
+    char *vec_copy;
+
     serf_connection_setup_t setup;
     void *setup_baton;
     serf_connection_closed_t closed;
@@ -376,6 +624,9 @@ struct serf_connection_t {
        only. */
     int pipelining;
 
+    /* Adaptive limit on the nr. of outstanding requests. */
+    serf__pipeline_t pipeline;
+
     int hit_eof;
 
     /* Host url, path ommitted, syntax: https://svn.apache.org . */
@@ -394,11 +645,39 @@ struct serf_connection_t {
     /* Calculated connection latency. Negative value if latency is unknown. */
     apr_interval_time_t latency;
 
+    /* The backend of the balancer this connection belongs to, or NULL. */
+    serf__backend_t *backend;
+
+    /* Time the connection was first seen without requests, 0 if it has
+       requests. TRIMMED is set once its memory was trimmed since. */
+    apr_time_t idle_since;
+    int trimmed;
+
+    /* The SSL context of the ssl_decrypt bucket the application set up as
+       the connection's stream, or NULL. The cache, coalesce and capture
+       taps wrap conn->stream, so it can't be recognized there later. */
+    serf_ssl_context_t *ssl_ctx;
+
     /* Needs to read first before we can write again. */
     int stop_writing;
 
     /* Configuration shared with buckets and authn plugins */
     serf_config_t *config;
+
+    /* Traffic capture state of the current transport connection. */
+    serf__capture_conn_t *capture;
+
+    /* Rate limits of this connection and of its host (NULL if none). While
+       throttled, the connection isn't polled for writing or reading until
+       the given time. */
+    serf__ratelimit_t ratelimit;
+    serf__ratelimit_t *host_ratelimit;
+    apr_time_t write_throttled_until;
+    apr_time_t read_throttled_until;
+
+    /* Set when the response being read was resumed. Data may already be
+       buffered in the stream, so read without waiting for the socket. */
+    int read_resumed;
 };
 
 /*** Internal bucket functions ***/
@@ -420,12 +699,69 @@ apr_status_t serf_response_full_become_aggregate(serf_bucket_t *bucket);
 void serf__bucket_response_set_error_on_eof(serf_bucket_t *bucket,
                                             apr_status_t error);
 
+/**
+ * Replace the body of request bucket @a bucket with @a body, and return the
+ * old body. Only possible before the request bucket was read from.
+ */
+serf_bucket_t *serf__bucket_request_swap_body(serf_bucket_t *bucket,
+                                              serf_bucket_t *body);
+
+/**
+ * Return the method and uri of request bucket @a bucket. Only possible
+ * before the request bucket was read from.
+ */
+void serf__bucket_request_get_line(serf_bucket_t *bucket,
+                                   const char **method,
+                                   const char **uri);
+
 /**
  * Remove the header from the list, do nothing if the header wasn't added.
  */
 void serf__bucket_headers_remove(serf_bucket_t *headers_bucket,
                                  const char *header);
 
+/**
+ * A line buffer without a line of its own, for buckets that keep one per
+ * message. A line that is read in one go is returned where the bucket it
+ * is read from keeps it, valid until the next read from that bucket. Only
+ * a line that spans reads is collected in BUF, allocated when needed and
+ * freed once the line was used. LINE isn't NUL terminated, it's followed
+ * by the newline that ended it or by a NUL.
+ */
+typedef struct serf__linebuf_t {
+    int state;              /* SERF_LINEBUF_* */
+    apr_size_t used;        /* length of LINE */
+    const char *line;
+    char *buf;              /* SERF_LINEBUF_LIMIT bytes, or NULL */
+} serf__linebuf_t;
+
+/**
+ * Initialize @a linebuf.
+ */
+void serf__linebuf_init(serf__linebuf_t *linebuf);
+
+/**
+ * Like serf_linebuf_fetch(), for @a linebuf, which allocates its buffer
+ * from @a allocator.
+ */
+apr_status_t serf__linebuf_fetch(serf__linebuf_t *linebuf,
+                                 serf_bucket_t *bucket,
+                                 int acceptable,
+                                 serf_bucket_alloc_t *allocator);
+
+/**
+ * Free the buffer of @a linebuf, if any.
+ */
+void serf__linebuf_destroy(serf__linebuf_t *linebuf,
+                           serf_bucket_alloc_t *allocator);
+
+/**
+ * Count the memory @a allocator holds, now and from now on, in @a *total.
+ * It's taken off again when the allocator is destroyed.
+ */
+void serf__bucket_allocator_account(serf_bucket_alloc_t *allocator,
+                                    apr_size_t *total);
+
 /*** Authentication handler declarations ***/
 
 typedef enum { PROXY, HOST } peer_t;
@@ -451,11 +787,8 @@ apr_status_t serf__handle_auth_response(int *consumed_response,
                                         apr_pool_t *pool);
 
 /* Get the cached serf__authn_info_t object for the target server, or create one
-   when this is the first connection to the server.
-   TODO: The serf__authn_info_t objects are allocated in the context pool, so
-   a context that's used to connect to many different servers using Basic or 
-   Digest authencation will hold on to many objects indefinitely. We should be
-   able to cleanup stale objects from time to time. */
+   when this is the first connection to the server. Creating an object can
+   evict the least recently used server from the cache. */
 serf__authn_info_t *serf__get_authn_info_for_server(serf_connection_t *conn);
 
 /* fromt context.c */
@@ -471,10 +804,30 @@ apr_status_t serf__open_connections(serf_context_t *ctx);
 apr_status_t serf__process_connection(serf_connection_t *conn,
                                        apr_int16_t events);
 apr_status_t serf__conn_update_pollset(serf_connection_t *conn);
+apr_status_t serf__process_resumed_reads(serf_context_t *ctx);
+apr_status_t serf__process_cached_requests(serf_context_t *ctx);
+apr_interval_time_t serf__expect_continue_wakeup(serf_context_t *ctx);
 serf_request_t *serf__ssltunnel_request_create(serf_connection_t *conn,
                                                serf_request_setup_t setup,
                                                void *setup_baton);
 void serf__connection_set_pipelining(serf_connection_t *conn, int enabled);
+/* Like serf_connection_create2, but to the resolved HOST_ADDRESS. The port
+   of HOST_INFO must be set. */
+apr_status_t serf__connection_create_at(
+    serf_connection_t **conn,
+    serf_context_t *ctx,
+    apr_uri_t host_info,
+    apr_sockaddr_t *host_address,
+    serf_connection_setup_t setup,
+    void *setup_baton,
+    serf_connection_closed_t closed,
+    void *closed_baton,
+    apr_pool_t *pool);
+/* Let CONN use WRITEV instead of a socket, see serf_connection_t. Must be
+   called before the first request is sent. */
+void serf__connection_set_mock_transport(serf_connection_t *conn,
+                                         serf__conn_writev_t writev,
+                                         void *baton);
 
 apr_status_t serf__provide_credentials(serf_context_t *ctx,
                                        char **username,
@@ -490,6 +843,139 @@ serf_request_t *serf__request_requeue(const serf_request_t *request);
 /* from ssltunnel.c */
 apr_status_t serf__ssltunnel_connect(serf_connection_t *conn);
 
+/* from capture.c */
+/* Start capturing the responses of CONN, called when the connection's
+   streams are set up. */
+void serf__capture_conn_setup(serf_connection_t *conn);
+/* Start capturing REQUEST, called right before it is written. */
+void serf__capture_request_start(serf_request_t *request);
+/* Write the capture record of REQUEST, called when its response is done. */
+void serf__capture_response_done(serf_request_t *request);
+
+/* from cache.c */
+/* Start storing the responses of CONN, called when the connection's
+   streams are set up. */
+void serf__cache_conn_setup(serf_connection_t *conn);
+/* Look up REQUEST, which is set up but not written, in the response cache.
+   Sets *FRESH if the cached response can be used without asking the
+   server. Makes the request conditional if the cached response is stale. */
+apr_status_t serf__cache_lookup(serf_request_t *request, int *fresh);
+/* Returns a stream over the cached response of REQUEST. */
+serf_bucket_t *serf__cache_get_stream(serf_request_t *request);
+/* Check if the response of REQUEST is a 304 Not Modified for its cached
+   response. If so, reads it and sets *NOT_MODIFIED; the cached response
+   should be delivered instead. */
+apr_status_t serf__cache_not_modified(serf_request_t *request,
+                                      int *not_modified);
+/* Store the response of REQUEST, or remove the cached response after a
+   successful unsafe request. Called when the response was read completely. */
+void serf__cache_response_done(serf_request_t *request);
+/* Release the cache state of REQUEST, called when it is destroyed. */
+void serf__cache_request_done(serf_request_t *request);
+
+/* from coalesce.c */
+/* Keep the responses of leaders on CONN for their followers, called when
+   the connection's streams are set up. */
+void serf__coalesce_conn_setup(serf_connection_t *conn);
+/* Look up REQUEST, which is set up but not written, in the coalescing
+   groups. Sets *FOLLOWER if an identical request is in flight; otherwise
+   REQUEST may become the leader of a new group. */
+apr_status_t serf__coalesce_lookup(serf_request_t *request, int *follower);
+/* Let the followers of REQUEST read its response once its status line
+   arrived, or abort them on an authentication challenge. */
+void serf__coalesce_check_response(serf_request_t *request);
+/* Mark the response of the leader REQUEST complete. */
+void serf__coalesce_response_done(serf_request_t *request);
+/* Returns non-zero if the group of the follower REQUEST was aborted. */
+int serf__coalesce_aborted(serf_request_t *request);
+/* Returns non-zero if the follower REQUEST didn't read any of the leader's
+   response yet. */
+int serf__coalesce_unread(serf_request_t *request);
+/* Returns the stream the follower REQUEST reads the response from. */
+serf_bucket_t *serf__coalesce_get_stream(serf_request_t *request);
+/* Leave the group of REQUEST, called when it is destroyed. */
+void serf__coalesce_request_done(serf_request_t *request);
+
+/* from resume.c */
+/* Start tracking the response of REQUEST if it could be resumed, called
+   right before it is written. */
+void serf__resume_request_start(serf_request_t *request);
+/* Returns the stream to pass to the acceptor of REQUEST instead of the
+   connection's stream. */
+serf_bucket_t *serf__resume_get_stream(serf_request_t *request);
+/* Returns non-zero if the connection was lost while the response of
+   REQUEST was read, and the response can be resumed. */
+int serf__resume_interrupted(serf_request_t *request);
+/* Prepare REQUEST, of which the connection is reset, to be sent again for
+   the rest of its response. Returns 0 if its response can't be resumed. */
+int serf__resume_prepare(serf_request_t *request);
+/* Add the Range and If-Range headers to the new request bucket of the
+   prepared REQUEST. */
+void serf__resume_set_range(serf_request_t *request);
+/* Release the resume state of REQUEST, called when it is destroyed. */
+void serf__resume_request_done(serf_request_t *request);
+
+/* from hedge.c */
+/* Note when REQUEST was sent, and when it should be hedged; called right
+   before it is written. */
+void serf__hedge_request_start(serf_request_t *request);
+/* Record the latency of REQUEST, and drop its peer, called before the
+   acceptor is called for its response. */
+void serf__hedge_response_started(serf_request_t *request);
+/* Send the duplicates of late requests. Returns the time until the next
+   request is late, or -1 if none is waiting. */
+apr_interval_time_t serf__hedge_wakeup(serf_context_t *ctx);
+/* Returns 0 if the application shouldn't be told that REQUEST is
+   cancelled, because its peer will deliver the response. */
+int serf__hedge_notify_cancel(serf_request_t *request);
+/* Drop the peer of REQUEST, which the application cancelled. */
+void serf__hedge_request_cancelled(serf_request_t *request);
+/* Unlink REQUEST from its peer, called when it is destroyed. */
+void serf__hedge_request_done(serf_request_t *request);
+
+/* from balance.c */
+/* Update the latency of the backend of REQUEST, called before the acceptor
+   is called for its response. */
+void serf__balancer_response_started(serf_request_t *request);
+/* Eject the backend of CONN, which failed to connect with STATUS. */
+void serf__balancer_conn_failed(serf_connection_t *conn, apr_status_t status);
+
+/* from pipeline.c */
+/* Adapt the pipelining depth of the connection of REQUEST to the time its
+   response took to start. */
+void serf__pipeline_response_started(serf_request_t *request);
+/* Back off when CONN is reset with requests in flight. */
+void serf__pipeline_reset(serf_connection_t *conn);
+/* Returns the max. nr. of outstanding requests on CONN, 0 if unlimited. */
+unsigned int serf__pipeline_limit(serf_connection_t *conn);
+
+/* from budget.c */
+/* Update the memory budget state of CTX. */
+void serf__budget_check(serf_context_t *ctx);
+
+/* from trim.c */
+/* Trim the connections of CTX that are idle long enough. Returns the time
+   until the next one is due, or -1. */
+apr_interval_time_t serf__idle_trim_wakeup(serf_context_t *ctx);
+
+/* from ratelimit.c */
+/* Returns how many bytes CONN may write now. If 0, the connection is
+   throttled for writing. */
+apr_size_t serf__ratelimit_write_avail(serf_connection_t *conn);
+/* Charge LEN written bytes to the rate limits of CONN. */
+void serf__ratelimit_written(serf_connection_t *conn, apr_size_t len);
+/* Returns non-zero if CONN may start writing a new request now, else
+   throttles the connection for writing. */
+int serf__ratelimit_start_request(serf_connection_t *conn);
+/* Returns non-zero if CONN may read now, else throttles the connection for
+   reading. */
+int serf__ratelimit_may_read(serf_connection_t *conn);
+/* Charge LEN read bytes to the rate limits of CONN. */
+void serf__ratelimit_read(serf_connection_t *conn, apr_off_t len);
+/* Put the connections of CTX that are no longer throttled back in the
+   pollset. Returns the time until the next one can continue, or -1. */
+apr_interval_time_t serf__ratelimit_wakeup(serf_context_t *ctx);
+
 
 /* Creates a bucket that logs all data returned by one of the read functions
    of the wrapped bucket. The new bucket will replace the wrapped bucket, so
@@ -498,6 +984,19 @@ serf_bucket_t *serf__bucket_log_wrapper_create(serf_bucket_t *wrapped,
                                                const char *prefix,
                                                serf_bucket_alloc_t *allocator);
 
+/* Called with every block of DATA read from a tapped bucket. */
+typedef void (*serf__bucket_tap_t)(void *baton, const char *data,
+                                   apr_size_t len);
+
+/* Creates a bucket that passes all data returned by one of the read functions
+   of the wrapped bucket to TAP. Like the log wrapper, the new bucket replaces
+   the wrapped bucket. Don't use this on buckets that change their own type
+   while being read, like the request bucket. */
+serf_bucket_t *serf__bucket_tap_create(serf_bucket_t *wrapped,
+                                       serf__bucket_tap_t tap,
+                                       void *tap_baton,
+                                       serf_bucket_alloc_t *allocator);
+
 /** Logging functions. **/
 
 /* Initialize the logging subsystem. This will store a log baton in the 
@@ -168,6 +168,15 @@ typedef struct mhResponseBldr_t mhResponseBldr_t;
 #define     InMainThread\
                 mhSetServerThreading(__servctx, mhThreadMain)
 
+/* Runs the server as fast as possible, for use in load tests and benchmarks.
+   Every request gets the default response (see DefaultResponse), which is
+   serialized only once and written with writev. Requests are not stored and
+   not matched, so only the statistics can be verified.
+   With nrOfThreads > 0, the server runs in that many separate threads.
+   Only supported for HTTP servers. */
+#define     InBenchmarkMode(nrOfThreads)\
+                mhSetServerBenchmarkMode(__servctx, nrOfThreads)
+
 #define   SetupProxy(...)\
                 __servctx = mhNewProxy(__mh);\
                 mhConfigServer(__servctx, __VA_ARGS__, NULL);\
@@ -607,6 +616,8 @@ mhServerSetupBldr_t *mhSetServerThreading(mhServCtx_t *ctx,
                                           mhThreading_t threading);
 mhServerSetupBldr_t *mhSetServerMaxRequestsPerConn(mhServCtx_t *ctx,
                                                    unsigned int maxRequests);
+mhServerSetupBldr_t *mhSetServerBenchmarkMode(mhServCtx_t *ctx,
+                                              unsigned int nrOfThreads);
 mhServerSetupBldr_t *mhSetServerCertPrefix(mhServCtx_t *ctx, const char *prefix);
 mhServerSetupBldr_t *mhSetServerCertKeyFile(mhServCtx_t *ctx,
                                             const char *keyFile);
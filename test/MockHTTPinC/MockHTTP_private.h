@@ -54,6 +54,7 @@ static const bool YES = 1;
 static const bool NO = 0;
 
 typedef struct _mhClientCtx_t _mhClientCtx_t;
+typedef struct _mhBenchWorker_t _mhBenchWorker_t;
 
 typedef enum expectation_t {
     RequestsReceivedOnce    = 0x00000001,
@@ -116,6 +117,15 @@ struct mhServCtx_t {
 
     apr_array_header_t *clients;        /* array of _mhClientCtx_t *'s */
 
+    /* Benchmark mode, see mhSetServerBenchmarkMode */
+    bool benchmark;
+    unsigned int benchThreads;          /* 0 = run in the main thread */
+    apr_array_header_t *benchWorkers;   /* array of _mhBenchWorker_t *'s */
+    const char *cannedResp;             /* serialized default response */
+    apr_size_t cannedRespLen;
+    const char *cannedCloseResp;        /* .. with Connection: close */
+    apr_size_t cannedCloseRespLen;
+
     /* HTTPS specific */
     const char *certFilesPrefix;
     const char *keyFile;
@@ -1511,6 +1511,479 @@ static void closeAndRemoveClientCtx(mhServCtx_t *ctx, _mhClientCtx_t *cctx)
     }
 }
 
+/******************************************************************************/
+/* Benchmark mode                                                             */
+/******************************************************************************/
+
+/* Max. nr of responses written with one writev call. */
+#define BENCH_MAX_IOVECS 64
+
+/* One client connection in benchmark mode. */
+typedef struct _mhBenchClient_t {
+    apr_pool_t *pool;
+    apr_socket_t *skt;
+    apr_int16_t reqevents;
+
+    char inbuf[BUFSIZE];       /* unparsed request data */
+    apr_size_t inlen;
+    apr_uint64_t bodyRem;      /* bytes of the current request body to skip */
+
+    unsigned int reqsReceived; /* # of reqs received on this connection */
+    unsigned int respsSent;    /* # of resps sent on this connection */
+    apr_size_t respOffset;     /* bytes sent of the current response */
+    bool closeConn;            /* close after the last response was sent */
+} _mhBenchClient_t;
+
+/* Serves clients on its own pollset, with one worker per thread. */
+struct _mhBenchWorker_t {
+    apr_pool_t *pool;
+    mhServCtx_t *serv_ctx;
+    apr_pollset_t *pollset;
+    mhStats_t *stats;
+#if APR_HAS_THREADS
+    apr_thread_t *threadid;
+#endif
+};
+
+/**
+ * Serializes the default response once, a second time with Connection: close
+ * for the last request on a connection.
+ */
+static void cannedResponses(mhServCtx_t *ctx)
+{
+    mhResponse_t *resp = ctx->mh->defResponse;
+    mhResponse_t *closeResp;
+
+    _mhBuildResponse(resp);
+    if (resp->raw_data) {
+        static const char closeHdr[] = "Connection: close\r\n";
+        const char *eol;
+
+        ctx->cannedResp = resp->raw_data;
+        ctx->cannedRespLen = resp->raw_data_length;
+        ctx->cannedCloseResp = ctx->cannedResp;
+        ctx->cannedCloseRespLen = ctx->cannedRespLen;
+
+        /* Add the header right after the status line. */
+        eol = memchr(resp->raw_data, '\n', resp->raw_data_length);
+        if (eol) {
+            apr_size_t statusLen = eol + 1 - resp->raw_data;
+            apr_size_t hdrLen = sizeof(closeHdr) - 1;
+            char *closeResp = apr_palloc(ctx->pool,
+                                         resp->raw_data_length + hdrLen);
+
+            memcpy(closeResp, resp->raw_data, statusLen);
+            memcpy(closeResp + statusLen, closeHdr, hdrLen);
+            memcpy(closeResp + statusLen + hdrLen, eol + 1,
+                   resp->raw_data_length - statusLen);
+            ctx->cannedCloseResp = closeResp;
+            ctx->cannedCloseRespLen = resp->raw_data_length + hdrLen;
+        }
+        return;
+    }
+
+    ctx->cannedResp = respToString(ctx->pool, resp);
+    ctx->cannedRespLen = strlen(ctx->cannedResp);
+
+    closeResp = cloneResponse(ctx->pool, resp);
+    setHeader(closeResp->hdrs, "Connection", "close");
+    ctx->cannedCloseResp = respToString(ctx->pool, closeResp);
+    ctx->cannedCloseRespLen = strlen(ctx->cannedCloseResp);
+}
+
+/**
+ * Creates a worker with its own pollset, listening for new clients on the
+ * server socket of CTX. If POOL is NULL, the worker uses the pool and pollset
+ * of CTX.
+ */
+static apr_status_t initBenchWorker(_mhBenchWorker_t **pworker,
+                                    mhServCtx_t *ctx, apr_pool_t *pool)
+{
+    _mhBenchWorker_t *worker;
+    apr_status_t status;
+
+    worker = apr_pcalloc(ctx->pool, sizeof(_mhBenchWorker_t));
+    worker->serv_ctx = ctx;
+
+    if (pool) {
+        apr_pollfd_t pfd = { 0 };
+
+        worker->pool = pool;
+        worker->stats = apr_pcalloc(pool, sizeof(mhStats_t));
+        STATUSERR(apr_pollset_create(&worker->pollset, 32, pool, 0));
+
+        pfd.desc_type = APR_POLL_SOCKET;
+        pfd.desc.s = ctx->skt;
+        pfd.reqevents = APR_POLLIN | APR_POLLHUP | APR_POLLERR;
+        STATUSERR(apr_pollset_add(worker->pollset, &pfd));
+    } else {
+        worker->pool = ctx->pool;
+        worker->stats = ctx->mh->verifyStats;
+        worker->pollset = ctx->pollset;
+    }
+
+    *((_mhBenchWorker_t **)apr_array_push(ctx->benchWorkers)) = worker;
+    *pworker = worker;
+
+    return APR_SUCCESS;
+}
+
+/**
+ * Returns the length of the request line + headers at DATA, including the
+ * empty line, or 0 if they're not complete yet.
+ */
+static apr_size_t findEndOfHeaders(const char *data, apr_size_t len)
+{
+    apr_size_t i;
+
+    for (i = 3; i < len; i++) {
+        if (data[i] == '\n' && data[i - 1] == '\r' &&
+            data[i - 2] == '\n' && data[i - 3] == '\r')
+            return i + 1;
+    }
+    return 0;
+}
+
+/**
+ * Finds the length of the body of the request with headers HDRS. Only
+ * Content-Length is supported, a chunked request returns APR_ENOTIMPL.
+ */
+static apr_status_t benchBodyLength(const char *hdrs, apr_size_t len,
+                                    apr_uint64_t *bodyLen)
+{
+    const char *end = hdrs + len;
+    const char *line = hdrs;
+
+    *bodyLen = 0;
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+
+        if (!eol)
+            break;
+        if (eol - line > 15 && strncasecmp(line, "Content-Length:", 15) == 0) {
+            /* The line ends with CRLF, so strtol will stop there. */
+            *bodyLen = apr_strtoi64(line + 15, NULL, 10);
+        } else if (eol - line > 18 &&
+                   strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            return APR_ENOTIMPL;
+        }
+        line = eol + 1;
+    }
+
+    return APR_SUCCESS;
+}
+
+/**
+ * Reads all available data from the client socket, and counts the complete
+ * requests in it. Returns APR_EOF when the connection should be closed.
+ */
+static apr_status_t benchReadRequests(_mhBenchWorker_t *worker,
+                                      _mhBenchClient_t *bc)
+{
+    mhServCtx_t *ctx = worker->serv_ctx;
+    apr_status_t status;
+
+    do {
+        apr_size_t len = BUFSIZE - bc->inlen;
+        apr_size_t consumed = 0;
+
+        status = apr_socket_recv(bc->skt, bc->inbuf + bc->inlen, &len);
+        if (READ_ERROR(status))
+            return status;
+        bc->inlen += len;
+
+        while (consumed < bc->inlen) {
+            const char *data = bc->inbuf + consumed;
+            apr_size_t avail = bc->inlen - consumed;
+
+            if (bc->bodyRem) {
+                apr_size_t skip = bc->bodyRem < avail ? (apr_size_t)bc->bodyRem
+                                                      : avail;
+                bc->bodyRem -= skip;
+                consumed += skip;
+            } else {
+                apr_size_t hdrsLen = findEndOfHeaders(data, avail);
+
+                if (!hdrsLen)
+                    break;
+                if (benchBodyLength(data, hdrsLen, &bc->bodyRem)) {
+                    _mhLog(MH_VERBOSE, bc->skt, "Chunked requests are not "
+                           "supported in benchmark mode.\n");
+                    return APR_EOF;
+                }
+                consumed += hdrsLen;
+            }
+
+            if (!bc->bodyRem) {
+                /* complete request received */
+                bc->reqsReceived++;
+                worker->stats->requestsReceived++;
+                if (ctx->maxRequests && bc->reqsReceived >= ctx->maxRequests) {
+                    /* Ignore any further pipelined requests. */
+                    bc->inlen = 0;
+                    return status;
+                }
+            }
+        }
+
+        if (consumed) {
+            memmove(bc->inbuf, bc->inbuf + consumed, bc->inlen - consumed);
+            bc->inlen -= consumed;
+        } else if (bc->inlen == BUFSIZE) {
+            _mhLog(MH_VERBOSE, bc->skt, "Request headers too long.\n");
+            return APR_EOF;
+        }
+    } while (status == APR_SUCCESS);
+
+    return status;
+}
+
+/**
+ * Writes the responses for all received requests to the client socket.
+ * Returns APR_EOF when the connection should be closed, APR_EAGAIN if not
+ * all responses could be written.
+ */
+static apr_status_t benchWriteResponses(_mhBenchWorker_t *worker,
+                                        _mhBenchClient_t *bc)
+{
+    mhServCtx_t *ctx = worker->serv_ctx;
+    apr_status_t status = APR_SUCCESS;
+
+    while (bc->respsSent < bc->reqsReceived) {
+        struct iovec vecs[BENCH_MAX_IOVECS];
+        unsigned int resp = bc->respsSent;
+        apr_size_t offset = bc->respOffset;
+        apr_size_t len;
+        int nvecs = 0;
+
+        /* Queue as many responses as possible, until the connection has to
+           be closed. */
+        while (resp < bc->reqsReceived && nvecs < BENCH_MAX_IOVECS) {
+            bool last = ctx->maxRequests && resp + 1 >= ctx->maxRequests;
+
+            if (last) {
+                vecs[nvecs].iov_base = (void *)(ctx->cannedCloseResp + offset);
+                vecs[nvecs].iov_len = ctx->cannedCloseRespLen - offset;
+            } else {
+                vecs[nvecs].iov_base = (void *)(ctx->cannedResp + offset);
+                vecs[nvecs].iov_len = ctx->cannedRespLen - offset;
+            }
+            nvecs++;
+            resp++;
+            offset = 0;
+            if (last)
+                break;
+        }
+
+        status = apr_socket_sendv(bc->skt, vecs, nvecs, &len);
+        if (READ_ERROR(status))
+            return status;
+
+        /* Account for the responses that were sent completely. */
+        while (len) {
+            bool last = ctx->maxRequests && bc->respsSent + 1 >= ctx->maxRequests;
+            apr_size_t respLen = last ? ctx->cannedCloseRespLen :
+                                        ctx->cannedRespLen;
+            apr_size_t rem = respLen - bc->respOffset;
+
+            if (len < rem) {
+                bc->respOffset += len;
+                break;
+            }
+            len -= rem;
+            bc->respOffset = 0;
+            bc->respsSent++;
+            worker->stats->requestsResponded++;
+            if (last) {
+                _mhLog(MH_VERBOSE, bc->skt, "Actively closing connection.\n");
+                return APR_EOF;
+            }
+        }
+
+        if (status)
+            return status;
+    }
+
+    return status;
+}
+
+static void closeBenchClient(_mhBenchWorker_t *worker, _mhBenchClient_t *bc)
+{
+    apr_pollfd_t pfd = { 0 };
+
+    pfd.desc_type = APR_POLL_SOCKET;
+    pfd.desc.s = bc->skt;
+    pfd.reqevents = bc->reqevents;
+    apr_pollset_remove(worker->pollset, &pfd);
+    apr_socket_close(bc->skt);
+    apr_pool_destroy(bc->pool);
+}
+
+/**
+ * Only poll for writability when there are responses waiting, otherwise the
+ * pollset would keep returning the socket.
+ */
+static apr_status_t benchUpdatePollset(_mhBenchWorker_t *worker,
+                                       _mhBenchClient_t *bc)
+{
+    apr_pollfd_t pfd = { 0 };
+    apr_int16_t reqevents = APR_POLLIN | APR_POLLHUP | APR_POLLERR;
+    apr_status_t status;
+
+    if (bc->respsSent < bc->reqsReceived)
+        reqevents |= APR_POLLOUT;
+    if (reqevents == bc->reqevents)
+        return APR_SUCCESS;
+
+    pfd.desc_type = APR_POLL_SOCKET;
+    pfd.desc.s = bc->skt;
+    pfd.client_data = bc;
+    if (bc->reqevents) {
+        pfd.reqevents = bc->reqevents;
+        STATUSERR(apr_pollset_remove(worker->pollset, &pfd));
+    }
+    pfd.reqevents = reqevents;
+    STATUSERR(apr_pollset_add(worker->pollset, &pfd));
+    bc->reqevents = reqevents;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t acceptBenchClient(_mhBenchWorker_t *worker)
+{
+    mhServCtx_t *ctx = worker->serv_ctx;
+    _mhBenchClient_t *bc;
+    apr_pool_t *pool;
+    apr_socket_t *cskt;
+    apr_status_t status;
+
+    apr_pool_create(&pool, worker->pool);
+    status = apr_socket_accept(&cskt, ctx->skt, pool);
+    if (status) {
+        apr_pool_destroy(pool);
+        /* Another worker was faster. */
+        if (APR_STATUS_IS_EAGAIN(status))
+            return APR_SUCCESS;
+        return status;
+    }
+
+    STATUSERR(apr_socket_opt_set(cskt, APR_SO_NONBLOCK, 1));
+    STATUSERR(apr_socket_timeout_set(cskt, 0));
+    STATUSERR(apr_socket_opt_set(cskt, APR_TCP_NODELAY, 1));
+
+    bc = apr_pcalloc(pool, sizeof(_mhBenchClient_t));
+    bc->pool = pool;
+    bc->skt = cskt;
+
+    return benchUpdatePollset(worker, bc);
+}
+
+/**
+ * Handles all events on the pollset of WORKER for at most TIMEOUT.
+ */
+static apr_status_t runBenchLoop(_mhBenchWorker_t *worker,
+                                 apr_interval_time_t timeout)
+{
+    mhServCtx_t *ctx = worker->serv_ctx;
+    apr_int32_t num;
+    const apr_pollfd_t *desc;
+    apr_status_t status;
+
+    STATUSERR(apr_pollset_poll(worker->pollset, timeout, &num, &desc));
+
+    while (num--) {
+        if (desc->desc.s == ctx->skt) {
+            STATUSERR(acceptBenchClient(worker));
+        } else {
+            _mhBenchClient_t *bc = desc->client_data;
+
+            status = APR_SUCCESS;
+            if (desc->rtnevents & (APR_POLLIN | APR_POLLHUP | APR_POLLERR))
+                status = benchReadRequests(worker, bc);
+
+            /* Write the responses right away, only wait for the socket to
+               become writable again if that didn't work. */
+            if (!READ_ERROR(status) && status != APR_EOF)
+                status = benchWriteResponses(worker, bc);
+            else if (status == APR_EOF && bc->respsSent < bc->reqsReceived)
+                /* Client closed its side, send what we have. */
+                benchWriteResponses(worker, bc);
+
+            if (status == APR_EOF || READ_ERROR(status)) {
+                closeBenchClient(worker, bc);
+            } else {
+                STATUSERR(benchUpdatePollset(worker, bc));
+            }
+        }
+        desc++;
+    }
+
+    return APR_SUCCESS;
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC run_bench_thread(apr_thread_t *tid, void *baton)
+{
+    _mhBenchWorker_t *worker = baton;
+    mhServCtx_t *ctx = worker->serv_ctx;
+
+    while (!ctx->cancelThread) {
+        runBenchLoop(worker, APR_USEC_PER_SEC / 100);
+    }
+
+    apr_thread_exit(tid, APR_SUCCESS);
+    return NULL;
+}
+#endif
+
+/**
+ * Starts the server CTX in benchmark mode.
+ */
+static apr_status_t startBenchServer(mhServCtx_t *ctx)
+{
+    _mhBenchWorker_t *worker;
+    apr_status_t status;
+
+    if (ctx->type == mhHTTPSv1Server || ctx->type == mhHTTPSv11Server ||
+        ctx->type == mhHTTPSv1Proxy || ctx->type == mhHTTPSv11Proxy)
+        return APR_ENOTIMPL;
+
+    STATUSERR(setupTCPServer(ctx));
+    cannedResponses(ctx);
+    ctx->benchWorkers = apr_array_make(ctx->pool, 5,
+                                       sizeof(_mhBenchWorker_t *));
+
+    if (!ctx->benchThreads) {
+        /* Run from mhRunServerLoop, like any other server. */
+        return initBenchWorker(&worker, ctx, NULL);
+    }
+
+#if APR_HAS_THREADS
+    {
+        unsigned int i;
+
+        for (i = 0; i < ctx->benchThreads; i++) {
+            apr_allocator_t *allocator;
+            apr_pool_t *pool;
+
+            /* Each thread has its own allocator, so it doesn't have to
+               synchronize with the others. */
+            STATUSERR(apr_allocator_create(&allocator));
+            STATUSERR(apr_pool_create_ex(&pool, ctx->pool, NULL, allocator));
+            apr_allocator_owner_set(allocator, pool);
+
+            STATUSERR(initBenchWorker(&worker, ctx, pool));
+            STATUSERR(apr_thread_create(&worker->threadid, NULL,
+                                        run_bench_thread, worker, ctx->pool));
+        }
+        ctx->threading = mhThreadSeparate;
+    }
+    return APR_SUCCESS;
+#else
+    return APR_ENOTIMPL;
+#endif
+}
+
 /**
  * Process all events on all sockets related to this server CTX, i.e. the server
  * socket for incoming connections, the client socket(s) and the outgoing
@@ -1524,6 +1997,12 @@ apr_status_t _mhRunServerLoop(mhServCtx_t *ctx)
 
     if (ctx->reqState == FullReqReceived)
         ctx->reqState = NoReqsReceived;
+
+    if (ctx->benchmark) {
+        _mhBenchWorker_t *worker = APR_ARRAY_IDX(ctx->benchWorkers, 0,
+                                                 _mhBenchWorker_t *);
+        return runBenchLoop(worker, APR_USEC_PER_SEC / 100);
+    }
 #if 0
     /* TODO: add a dirty flag to every socket wrapping context, only listen
        for writeable events with the socket is dirty */
@@ -1710,7 +2189,9 @@ void mhStartServer(mhServCtx_t *ctx)
     mhError_t err = MOCKHTTP_NO_ERROR;
     apr_status_t status;
 
-    if (ctx->threading == mhThreadSeparate) {
+    if (ctx->benchmark) {
+        status = startBenchServer(ctx);
+    } else if (ctx->threading == mhThreadSeparate) {
 #if APR_HAS_THREADS
         /* Setup a non-blocking TCP server */
         status = setupTCPServer(ctx);
@@ -1741,6 +2222,26 @@ void mhStopServer(mhServCtx_t *ctx)
     if (ctx->threading == mhThreadSeparate && ctx->threadid) {
         ctx->cancelThread = YES;
         apr_thread_join(&status, ctx->threadid);
+        ctx->threadid = NULL;
+    }
+    if (ctx->benchmark && ctx->benchThreads && ctx->benchWorkers) {
+        int i;
+
+        ctx->cancelThread = YES;
+        for (i = 0; i < ctx->benchWorkers->nelts; i++) {
+            _mhBenchWorker_t *worker;
+            mhStats_t *stats = ctx->mh->verifyStats;
+
+            worker = APR_ARRAY_IDX(ctx->benchWorkers, i, _mhBenchWorker_t *);
+            if (!worker->threadid)
+                continue;
+            apr_thread_join(&status, worker->threadid);
+            worker->threadid = NULL;
+
+            /* Now that the thread is gone, collect its statistics. */
+            stats->requestsReceived += worker->stats->requestsReceived;
+            stats->requestsResponded += worker->stats->requestsResponded;
+        }
     }
 #endif
 }
@@ -1804,6 +2305,31 @@ mhSetServerMaxRequestsPerConn(mhServCtx_t *ctx, unsigned int maxRequests)
     return ssb;
 }
 
+/**
+ * Builder callback, enables benchmark mode on server CTX.
+ */
+static bool
+set_server_benchmark_mode(const mhServerSetupBldr_t *ssb, mhServCtx_t *ctx)
+{
+    ctx->benchmark = YES;
+    ctx->benchThreads = ssb->ibaton;
+    return YES;
+}
+
+/**
+ * Create a builder of type mhServerSetupBldr_t, runs the server in benchmark
+ * mode with NRTHREADS separate threads (0 = in the main thread).
+ */
+mhServerSetupBldr_t *
+mhSetServerBenchmarkMode(mhServCtx_t *ctx, unsigned int nrOfThreads)
+{
+    apr_pool_t *pool = ctx->pool;
+    mhServerSetupBldr_t *ssb = createServerSetupBldr(pool);
+    ssb->ibaton = nrOfThreads;
+    ssb->serversetup = set_server_benchmark_mode;
+    return ssb;
+}
+
 unsigned int mhServerByIDPortNr(const MockHTTP *mh, const char *serverID)
 {
     mhServCtx_t *ctx = mhFindServerByID(mh, serverID);
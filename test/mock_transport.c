@@ -0,0 +1,497 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <apr_pools.h>
+#include <apr_strings.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+/* The mock transport is not part of the public API. */
+#include "serf_private.h"
+
+#include "mock_transport.h"
+
+/* Header lines are only inspected for a few short headers, the rest of a
+   longer line is ignored. */
+#define MOCK_LINE_SIZE 256
+
+typedef enum mock_req_state_t {
+    MOCK_REQ_HEADERS,       /* request line and headers */
+    MOCK_REQ_BODY,          /* body with a Content-Length */
+    MOCK_REQ_CHUNK_SIZE,    /* chunk-size line of a chunked body */
+    MOCK_REQ_CHUNK_DATA,    /* chunk data */
+    MOCK_REQ_CHUNK_END,     /* CRLF after the chunk data */
+    MOCK_REQ_TRAILERS,      /* trailers after the last chunk */
+} mock_req_state_t;
+
+/* The servers of a mock context, the user baton of its "pollset". */
+typedef struct mock_net_t {
+    mock_server_t *servers;
+} mock_net_t;
+
+struct mock_server_t {
+    serf_context_t *ctx;
+    mock_server_t *next;
+
+    /* Canned responses */
+    const char *resp;
+    apr_size_t resp_len;
+    const char *close_resp;
+    apr_size_t close_resp_len;
+    unsigned int keepalive;         /* responses per connection, 0 = no limit */
+    int answer_early;
+    apr_size_t write_window;        /* bytes accepted per write, 0 = all */
+    int silent;                     /* don't send responses */
+
+    /* Pollset state, maintained by mock_pollset_add/_rm. */
+    int in_pollset;
+    apr_int16_t reqevents;
+    void *serf_baton;
+
+    /* Parser state of the request being received. */
+    mock_req_state_t state;
+    char line[MOCK_LINE_SIZE];
+    apr_size_t line_len;
+    int request_line;               /* the next line is the request line */
+    apr_uint64_t body_rem;          /* bytes left of the body or chunk */
+    int chunked;
+    int expect_continue;
+    int answered;                   /* a response was queued already */
+
+    /* Requests received for which the response wasn't sent completely. */
+    unsigned int pending;
+    /* Responses sent on this connection. */
+    unsigned int served;
+    /* Offset in the response being sent. */
+    apr_size_t resp_offset;
+    /* The last response had Connection: close, no more data. */
+    int closed;
+
+    mock_server_stats_t stats;
+};
+
+/*** Receiving requests ***/
+
+static void reset_request(mock_server_t *srv)
+{
+    srv->state = MOCK_REQ_HEADERS;
+    srv->line_len = 0;
+    srv->request_line = 1;
+    srv->body_rem = 0;
+    srv->chunked = 0;
+    srv->expect_continue = 0;
+    srv->answered = 0;
+}
+
+static void request_done(mock_server_t *srv)
+{
+    srv->stats.requests++;
+    if (!srv->answered)
+        srv->pending++;
+
+    reset_request(srv);
+}
+
+/* Handles the line in SRV->line, without its CRLF. */
+static void handle_line(mock_server_t *srv)
+{
+    const char *line = srv->line;
+
+    switch (srv->state) {
+      case MOCK_REQ_HEADERS:
+        if (srv->request_line) {
+            /* Skip empty lines before the request line. */
+            if (srv->line_len)
+                srv->request_line = 0;
+            return;
+        }
+
+        if (srv->line_len) {
+            if (strncasecmp(line, "Content-Length:", 15) == 0)
+                srv->body_rem = apr_strtoi64(line + 15, NULL, 10);
+            else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+                srv->chunked = strstr(line + 18, "chunked") != NULL;
+            else if (strncasecmp(line, "Expect:", 7) == 0)
+                srv->expect_continue = strstr(line + 7, "100-continue") != NULL;
+            return;
+        }
+
+        /* End of the headers. */
+        if (srv->expect_continue && srv->answer_early) {
+            srv->pending++;
+            srv->answered = 1;
+        }
+
+        if (srv->chunked)
+            srv->state = MOCK_REQ_CHUNK_SIZE;
+        else if (srv->body_rem)
+            srv->state = MOCK_REQ_BODY;
+        else
+            request_done(srv);
+        break;
+      case MOCK_REQ_CHUNK_SIZE:
+        srv->body_rem = apr_strtoi64(line, NULL, 16);
+        srv->state = srv->body_rem ? MOCK_REQ_CHUNK_DATA : MOCK_REQ_TRAILERS;
+        break;
+      case MOCK_REQ_CHUNK_END:
+        srv->state = MOCK_REQ_CHUNK_SIZE;
+        break;
+      case MOCK_REQ_TRAILERS:
+        if (!srv->line_len)
+            request_done(srv);
+        break;
+      default:
+        break;
+    }
+}
+
+/* Implements serf__conn_writev_t. */
+static apr_status_t mock_writev(void *baton,
+                                const struct iovec *vecs,
+                                int vecs_len,
+                                apr_size_t *written)
+{
+    mock_server_t *srv = baton;
+    apr_size_t total = 0;
+    apr_status_t status = APR_SUCCESS;
+    int i;
+
+    srv->stats.writev_calls++;
+
+    for (i = 0; i < vecs_len; i++) {
+        const char *data = vecs[i].iov_base;
+        apr_size_t len = vecs[i].iov_len;
+        apr_size_t j = 0;
+
+        /* A full send buffer takes part of the data. */
+        if (srv->write_window && total + len > srv->write_window) {
+            len = srv->write_window - total;
+            status = APR_EAGAIN;
+        }
+
+        while (j < len) {
+            char c;
+
+            if (srv->state == MOCK_REQ_BODY ||
+                srv->state == MOCK_REQ_CHUNK_DATA) {
+                apr_size_t n = len - j;
+
+                if (n > srv->body_rem)
+                    n = (apr_size_t)srv->body_rem;
+                srv->body_rem -= n;
+                srv->stats.body_bytes += n;
+                j += n;
+
+                if (!srv->body_rem) {
+                    if (srv->state == MOCK_REQ_BODY)
+                        request_done(srv);
+                    else
+                        srv->state = MOCK_REQ_CHUNK_END;
+                }
+                continue;
+            }
+
+            c = data[j++];
+            if (c == '\n') {
+                if (srv->line_len && srv->line[srv->line_len - 1] == '\r')
+                    srv->line_len--;
+                srv->line[srv->line_len] = '\0';
+                handle_line(srv);
+                srv->line_len = 0;
+            }
+            else if (srv->line_len < sizeof(srv->line) - 1) {
+                srv->line[srv->line_len++] = c;
+            }
+        }
+        total += len;
+        if (status)
+            break;
+    }
+
+    *written = total;
+    return status;
+}
+
+/*** Sending responses ***/
+
+/* Returns the response that's currently being sent by SRV. */
+static const char *current_response(mock_server_t *srv, apr_size_t *len)
+{
+    if (srv->keepalive && srv->served + 1 >= srv->keepalive) {
+        *len = srv->close_resp_len;
+        return srv->close_resp;
+    }
+    *len = srv->resp_len;
+    return srv->resp;
+}
+
+/* Returns the status a socket bucket would return when all data available
+   has been read. */
+static apr_status_t mock_stream_status(mock_server_t *srv)
+{
+    if (srv->resp_offset || srv->pending)
+        return APR_SUCCESS;
+
+    return srv->closed ? APR_EOF : APR_EAGAIN;
+}
+
+static apr_status_t mock_stream_peek(serf_bucket_t *bucket,
+                                     const char **data,
+                                     apr_size_t *len)
+{
+    mock_server_t *srv = bucket->data;
+    const char *resp;
+    apr_size_t resp_len;
+
+    if (srv->closed || srv->silent || (!srv->pending && !srv->resp_offset)) {
+        *data = "";
+        *len = 0;
+        return srv->closed ? APR_EOF : APR_EAGAIN;
+    }
+
+    resp = current_response(srv, &resp_len);
+    *data = resp + srv->resp_offset;
+    *len = resp_len - srv->resp_offset;
+
+    return APR_SUCCESS;
+}
+
+static void mock_stream_consume(mock_server_t *srv, apr_size_t len)
+{
+    apr_size_t resp_len;
+
+    if (!len)
+        return;
+
+    (void)current_response(srv, &resp_len);
+    srv->resp_offset += len;
+    if (srv->resp_offset == resp_len) {
+        srv->resp_offset = 0;
+        srv->pending--;
+        srv->served++;
+        srv->stats.responses++;
+        if (srv->keepalive && srv->served >= srv->keepalive)
+            srv->closed = 1;
+    }
+
+    serf__context_progress_delta(srv->ctx, len, 0);
+}
+
+static apr_status_t mock_stream_read(serf_bucket_t *bucket,
+                                     apr_size_t requested,
+                                     const char **data,
+                                     apr_size_t *len)
+{
+    mock_server_t *srv = bucket->data;
+    apr_status_t status;
+
+    status = mock_stream_peek(bucket, data, len);
+    if (status)
+        return status;
+
+    if (requested != SERF_READ_ALL_AVAIL && requested < *len)
+        *len = requested;
+
+    mock_stream_consume(srv, *len);
+
+    return mock_stream_status(srv);
+}
+
+static apr_status_t mock_stream_readline(serf_bucket_t *bucket,
+                                         int acceptable, int *found,
+                                         const char **data,
+                                         apr_size_t *len)
+{
+    mock_server_t *srv = bucket->data;
+    const char *start, *end;
+    apr_size_t avail;
+    apr_status_t status;
+
+    status = mock_stream_peek(bucket, &start, &avail);
+    if (status) {
+        *found = SERF_NEWLINE_NONE;
+        *data = start;
+        *len = 0;
+        return status;
+    }
+
+    end = start;
+    serf_util_readline(&end, &avail, acceptable, found);
+    *data = start;
+    *len = end - start;
+
+    mock_stream_consume(srv, *len);
+
+    return mock_stream_status(srv);
+}
+
+static const serf_bucket_type_t mock_stream_type = {
+    "MOCK_STREAM",
+    mock_stream_read,
+    mock_stream_readline,
+    serf_default_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_buckets_are_v2,
+    mock_stream_peek,
+    serf_default_destroy,
+    serf_default_read_bucket,
+    serf_default_ignore_config,
+};
+
+/*** Pollset ***/
+
+static mock_server_t *mock_server_for(void *serf_baton)
+{
+    serf_io_baton_t *io = serf_baton;
+
+    return io->u.conn->mock_baton;
+}
+
+static apr_status_t mock_pollset_add(void *user_baton,
+                                     apr_pollfd_t *pfd,
+                                     void *serf_baton)
+{
+    mock_server_t *srv = mock_server_for(serf_baton);
+
+    srv->in_pollset = 1;
+    srv->reqevents = pfd->reqevents;
+    srv->serf_baton = serf_baton;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t mock_pollset_rm(void *user_baton,
+                                    apr_pollfd_t *pfd,
+                                    void *serf_baton)
+{
+    mock_server_t *srv = mock_server_for(serf_baton);
+
+    if (!srv->in_pollset)
+        return APR_NOTFOUND;
+
+    srv->in_pollset = 0;
+    return APR_SUCCESS;
+}
+
+/*** API ***/
+
+serf_context_t *mock_context_create(apr_pool_t *pool)
+{
+    mock_net_t *net = apr_pcalloc(pool, sizeof(*net));
+
+    return serf_context_create_ex(net, mock_pollset_add, mock_pollset_rm,
+                                  pool);
+}
+
+apr_status_t mock_context_run(serf_context_t *ctx)
+{
+    mock_net_t *net = ctx->pollset_baton;
+    mock_server_t *srv;
+    apr_status_t status;
+    int triggered = 0;
+
+    status = serf_context_prerun(ctx);
+    if (status)
+        return status;
+
+    for (srv = net->servers; srv; srv = srv->next) {
+        apr_pollfd_t pfd = { 0 };
+
+        if (!srv->in_pollset)
+            continue;
+
+        pfd.rtnevents = srv->reqevents & APR_POLLOUT;
+        if ((srv->reqevents & APR_POLLIN) && !srv->silent &&
+            (srv->pending || srv->resp_offset || srv->closed))
+            pfd.rtnevents |= APR_POLLIN;
+
+        if (!pfd.rtnevents)
+            continue;
+
+        triggered = 1;
+        status = serf_event_trigger(ctx, srv->serf_baton, &pfd);
+        if (status)
+            return status;
+    }
+
+    return triggered ? APR_SUCCESS : APR_EAGAIN;
+}
+
+mock_server_t *mock_server_create(serf_context_t *ctx,
+                                  const char *resp,
+                                  apr_size_t resp_len,
+                                  apr_pool_t *pool)
+{
+    mock_net_t *net = ctx->pollset_baton;
+    mock_server_t *srv = apr_pcalloc(pool, sizeof(*srv));
+
+    srv->ctx = ctx;
+    srv->resp = resp;
+    srv->resp_len = resp_len;
+    reset_request(srv);
+
+    srv->next = net->servers;
+    net->servers = srv;
+
+    return srv;
+}
+
+void mock_server_set_keepalive(mock_server_t *srv,
+                               unsigned int keepalive,
+                               const char *close_resp,
+                               apr_size_t close_resp_len)
+{
+    srv->keepalive = keepalive;
+    srv->close_resp = close_resp;
+    srv->close_resp_len = close_resp_len;
+}
+
+void mock_server_answer_early(mock_server_t *srv)
+{
+    srv->answer_early = 1;
+}
+
+void mock_server_set_write_window(mock_server_t *srv, apr_size_t window)
+{
+    srv->write_window = window;
+}
+
+void mock_server_set_silent(mock_server_t *srv, int silent)
+{
+    srv->silent = silent;
+}
+
+void mock_server_attach(mock_server_t *srv, serf_connection_t *conn)
+{
+    serf__connection_set_mock_transport(conn, mock_writev, srv);
+}
+
+serf_bucket_t *mock_server_connect(mock_server_t *srv,
+                                   serf_bucket_alloc_t *allocator)
+{
+    reset_request(srv);
+    srv->pending = 0;
+    srv->served = 0;
+    srv->resp_offset = 0;
+    srv->closed = 0;
+
+    return serf_bucket_create(&mock_stream_type, allocator, srv);
+}
+
+const mock_server_stats_t *mock_server_get_stats(const mock_server_t *srv)
+{
+    return &srv->stats;
+}
@@ -0,0 +1,99 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MOCK_TRANSPORT_H
+#define MOCK_TRANSPORT_H
+
+#include <apr_pools.h>
+
+#include "serf.h"
+
+/* In-memory HTTP servers behind the mock transport of serf connections, for
+   the test suite and serf_bench.
+
+   A connection attached to a mock server doesn't open a socket: serf writes
+   its requests to the server, and reads the responses from the bucket
+   returned by mock_server_connect. The context of such connections isn't
+   run with serf_context_run, but with mock_context_run, which triggers the
+   events a pollset would. This runs the complete connection state machine
+   without system calls, in a deterministic way.
+
+   The server parses the framing of the requests (Content-Length or chunked
+   bodies) and answers each of them with a canned response. This is test
+   infrastructure, not part of serf's API. */
+
+typedef struct mock_server_t mock_server_t;
+
+typedef struct mock_server_stats_t {
+    /* Requests received completely. */
+    unsigned int requests;
+    /* Bytes of request bodies received. */
+    apr_uint64_t body_bytes;
+    /* Responses sent completely. */
+    unsigned int responses;
+    /* Calls to the writev function of the transport. */
+    unsigned int writev_calls;
+} mock_server_stats_t;
+
+/* Creates a context for connections to mock servers, allocated in POOL. */
+serf_context_t *mock_context_create(apr_pool_t *pool);
+
+/* Triggers the events of all connections of CTX that want to write, or that
+   have data waiting to be read, once. Returns APR_EAGAIN if no connection
+   can make progress. */
+apr_status_t mock_context_run(serf_context_t *ctx);
+
+/* Creates a server on CTX, which answers every request with RESP of
+   RESP_LEN bytes. */
+mock_server_t *mock_server_create(serf_context_t *ctx,
+                                  const char *resp,
+                                  apr_size_t resp_len,
+                                  apr_pool_t *pool);
+
+/* Answer the KEEPALIVE'th request on a connection with CLOSE_RESP of
+   CLOSE_RESP_LEN bytes, and close the connection after it. */
+void mock_server_set_keepalive(mock_server_t *srv,
+                               unsigned int keepalive,
+                               const char *close_resp,
+                               apr_size_t close_resp_len);
+
+/* Answer requests with an Expect: 100-continue header as soon as their
+   headers were received, like a server that rejects the body. */
+void mock_server_answer_early(mock_server_t *srv);
+
+/* Accept at most WINDOW bytes per write, and return APR_EAGAIN when that
+   is less than what was offered, like a socket with a small send buffer.
+   0 means no limit. */
+void mock_server_set_write_window(mock_server_t *srv, apr_size_t window);
+
+/* While SILENT is set, SRV receives requests but doesn't send their
+   responses, like a server that hangs. */
+void mock_server_set_silent(mock_server_t *srv, int silent);
+
+/* Lets CONN send its requests to SRV. A server serves one connection. Must
+   be called before the first request of CONN is sent. The setup callback
+   of CONN gets a NULL socket, and should return the bucket of
+   mock_server_connect as input stream. */
+void mock_server_attach(mock_server_t *srv, serf_connection_t *conn);
+
+/* Starts a new connection on SRV, returns the bucket to read the responses
+   from. */
+serf_bucket_t *mock_server_connect(mock_server_t *srv,
+                                   serf_bucket_alloc_t *allocator);
+
+/* Returns the statistics of SRV, over all its connections. */
+const mock_server_stats_t *mock_server_get_stats(const mock_server_t *srv);
+
+#endif /* MOCK_TRANSPORT_H */
@@ -0,0 +1,902 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* serf_bench: a load generator for serf.
+
+   Two workloads are supported:
+
+   - closed loop (default): every connection keeps DEPTH requests in flight,
+     a new request is queued as soon as a response has been handled.
+   - fixed rate (-R): requests are queued at a constant rate, round robin
+     over the connections. Latency is measured from the moment a request
+     *should* have been sent, so a stalled server can't hide behind the
+     client backing off ("coordinated omission").
+
+   Latencies are recorded in a log-linear histogram in the style of
+   HdrHistogram: values are bucketed per power of two, and each power of two
+   is split in HIST_SUB_COUNT / 2 linear sub-buckets, giving a precision of
+   about 1.5% over the full range with a fixed amount of memory.
+
+   With -M the requests aren't sent to a server at all, but handled by an
+   in-memory server behind a mock transport: no sockets, no pollset and no
+   system calls in the request path. This runs the complete connection state
+   machine (writing, pipelining, response parsing, connection resets) in a
+   deterministic way, so the cost per request can be compared between builds
+   without network noise. */
+
+#include <stdlib.h>
+
+#include <apr.h>
+#include <apr_uri.h>
+#include <apr_strings.h>
+#include <apr_getopt.h>
+#include <apr_version.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "mock_transport.h"
+
+/*** Latency histogram ***/
+
+/* Number of linear sub-buckets in the first magnitude. Must be a power of 2;
+   128 gives 2 significant decimal digits. */
+#define HIST_SUB_BITS   7
+#define HIST_SUB_COUNT  (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT (HIST_SUB_COUNT / 2)
+
+/* Track values up to 2^(HIST_SUB_BITS + HIST_MAX_SHIFT) usec, larger values
+   are clamped. 2^37 usec is over 38 hours. */
+#define HIST_MAX_SHIFT  30
+#define HIST_NR_OF_COUNTS (HIST_SUB_COUNT + HIST_MAX_SHIFT * HIST_HALF_COUNT)
+
+typedef struct latency_hist_t {
+    apr_uint64_t counts[HIST_NR_OF_COUNTS];
+    apr_uint64_t total_count;
+    apr_int64_t min;
+    apr_int64_t max;
+    double sum;
+} latency_hist_t;
+
+static int hist_index(apr_int64_t value)
+{
+    int shift = 0;
+
+    if (value < 0)
+        value = 0;
+
+    while ((value >> shift) >= HIST_SUB_COUNT) {
+        shift++;
+        if (shift > HIST_MAX_SHIFT) {
+            return HIST_NR_OF_COUNTS - 1;
+        }
+    }
+
+    if (shift == 0)
+        return (int)value;
+
+    return shift * HIST_HALF_COUNT + (int)(value >> shift);
+}
+
+/* Returns the highest value that maps to the same bucket as INDEX. */
+static apr_int64_t hist_value_at_index(int index)
+{
+    int shift, sub;
+
+    if (index < HIST_SUB_COUNT)
+        return index;
+
+    shift = (index - HIST_SUB_COUNT) / HIST_HALF_COUNT + 1;
+    sub = index - shift * HIST_HALF_COUNT;
+
+    return (((apr_int64_t)sub + 1) << shift) - 1;
+}
+
+static void hist_record(latency_hist_t *hist, apr_int64_t value)
+{
+    hist->counts[hist_index(value)]++;
+    if (!hist->total_count || value < hist->min)
+        hist->min = value;
+    if (value > hist->max)
+        hist->max = value;
+    hist->total_count++;
+    hist->sum += (double)value;
+}
+
+/* Returns the value at PERCENTILE (0.0 - 100.0) of all recorded values. */
+static apr_int64_t hist_percentile(const latency_hist_t *hist,
+                                   double percentile)
+{
+    apr_uint64_t target, seen = 0;
+    int i;
+
+    if (!hist->total_count)
+        return 0;
+
+    target = (apr_uint64_t)((percentile / 100.0) * hist->total_count + 0.5);
+    if (target < 1)
+        target = 1;
+
+    for (i = 0; i < HIST_NR_OF_COUNTS; i++) {
+        seen += hist->counts[i];
+        if (seen >= target) {
+            apr_int64_t value = hist_value_at_index(i);
+            return value > hist->max ? hist->max : value;
+        }
+    }
+
+    return hist->max;
+}
+
+/*** Connections and requests ***/
+
+typedef struct app_baton_t {
+    const char *hostinfo;
+    const char *method;
+    const char *path;
+    int using_ssl;
+    int head_request;
+    serf_bucket_t *req_hdrs;
+    serf_bucket_alloc_t *bkt_alloc;
+    serf_context_t *serf_ctx;
+
+    /* Workload */
+    int depth;
+    apr_uint64_t max_requests;      /* 0 = no limit */
+    apr_time_t end_time;            /* 0 = no limit */
+    int stop_issuing;
+
+    /* Statistics */
+    apr_uint64_t issued;
+    apr_uint64_t completed;
+    apr_uint64_t errors;            /* responses with status >= 400 */
+    apr_uint64_t retries;
+    apr_uint64_t body_bytes;
+    apr_off_t wire_read;
+    apr_off_t wire_written;
+    latency_hist_t hist;
+
+    /* Recycled request batons */
+    struct req_baton_t *free_batons;
+    apr_pool_t *pool;
+
+    /* Mock mode */
+    int mock;
+    unsigned int mock_keepalive;    /* responses per connection, 0 = no limit */
+} app_baton_t;
+
+typedef struct conn_baton_t {
+    app_baton_t *app;
+    serf_connection_t *conn;
+    serf_ssl_context_t *ssl_ctx;
+    mock_server_t *mock;
+} conn_baton_t;
+
+typedef struct req_baton_t {
+    conn_baton_t *conn_ctx;
+
+    /* Time the request was (or should have been) sent. */
+    apr_time_t start;
+
+    struct req_baton_t *next;
+} req_baton_t;
+
+static apr_status_t setup_request(serf_request_t *request,
+                                  void *setup_baton,
+                                  serf_bucket_t **req_bkt,
+                                  serf_response_acceptor_t *acceptor,
+                                  void **acceptor_baton,
+                                  serf_response_handler_t *handler,
+                                  void **handler_baton,
+                                  apr_pool_t *pool);
+
+static req_baton_t *get_req_baton(app_baton_t *app)
+{
+    req_baton_t *baton = app->free_batons;
+
+    if (baton) {
+        app->free_batons = baton->next;
+    } else {
+        baton = apr_palloc(app->pool, sizeof(*baton));
+    }
+    baton->next = NULL;
+
+    return baton;
+}
+
+static void release_req_baton(app_baton_t *app, req_baton_t *baton)
+{
+    baton->next = app->free_batons;
+    app->free_batons = baton;
+}
+
+/* Queue a new request on CONN_CTX. A START time of 0 means that latency will
+   be measured from the time the request is set up for sending. */
+static void issue_request(conn_baton_t *conn_ctx, apr_time_t start)
+{
+    app_baton_t *app = conn_ctx->app;
+    req_baton_t *req_ctx = get_req_baton(app);
+
+    req_ctx->conn_ctx = conn_ctx;
+    req_ctx->start = start;
+
+    app->issued++;
+    serf_connection_request_create(conn_ctx->conn, setup_request, req_ctx);
+}
+
+static int may_issue(app_baton_t *app)
+{
+    if (app->stop_issuing)
+        return 0;
+    if (app->max_requests && app->issued >= app->max_requests) {
+        app->stop_issuing = 1;
+        return 0;
+    }
+    if (app->end_time && apr_time_now() >= app->end_time) {
+        app->stop_issuing = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static void closed_connection(serf_connection_t *conn,
+                              void *closed_baton,
+                              apr_status_t why,
+                              apr_pool_t *pool)
+{
+    conn_baton_t *conn_ctx = closed_baton;
+
+    conn_ctx->ssl_ctx = NULL;
+}
+
+static apr_status_t ignore_all_cert_errors(void *data, int failures,
+                                           const serf_ssl_certificate_t *cert)
+{
+    /* This is a load generator, not a browser. */
+    return APR_SUCCESS;
+}
+
+static apr_status_t conn_setup(apr_socket_t *skt,
+                               serf_bucket_t **input_bkt,
+                               serf_bucket_t **output_bkt,
+                               void *setup_baton,
+                               apr_pool_t *pool)
+{
+    serf_bucket_t *c;
+    conn_baton_t *conn_ctx = setup_baton;
+    app_baton_t *app = conn_ctx->app;
+
+    if (app->mock) {
+        *input_bkt = mock_server_connect(conn_ctx->mock, app->bkt_alloc);
+        return APR_SUCCESS;
+    }
+
+    c = serf_context_bucket_socket_create(app->serf_ctx, skt,
+                                          app->bkt_alloc);
+    if (app->using_ssl) {
+        c = serf_bucket_ssl_decrypt_create(c, conn_ctx->ssl_ctx,
+                                           app->bkt_alloc);
+        if (!conn_ctx->ssl_ctx) {
+            conn_ctx->ssl_ctx = serf_bucket_ssl_decrypt_context_get(c);
+        }
+        serf_ssl_server_cert_callback_set(conn_ctx->ssl_ctx,
+                                          ignore_all_cert_errors, NULL);
+        serf_ssl_set_hostname(conn_ctx->ssl_ctx, app->hostinfo);
+
+        *output_bkt = serf_bucket_ssl_encrypt_create(*output_bkt,
+                                                     conn_ctx->ssl_ctx,
+                                                     app->bkt_alloc);
+    }
+
+    *input_bkt = c;
+
+    return APR_SUCCESS;
+}
+
+static serf_bucket_t* accept_response(serf_request_t *request,
+                                      serf_bucket_t *stream,
+                                      void *acceptor_baton,
+                                      apr_pool_t *pool)
+{
+    serf_bucket_t *c;
+    serf_bucket_t *response;
+    serf_bucket_alloc_t *bkt_alloc;
+    app_baton_t *app = acceptor_baton;
+
+    bkt_alloc = serf_request_get_alloc(request);
+
+    /* Create a barrier so the response doesn't eat us! */
+    c = serf_bucket_barrier_create(stream, bkt_alloc);
+
+    response = serf_bucket_response_create(c, bkt_alloc);
+
+    if (app->head_request)
+        serf_bucket_response_set_head(response);
+
+    return response;
+}
+
+static int append_request_headers(void *baton,
+                                  const char *key,
+                                  const char *value)
+{
+    serf_bucket_t *hdrs_bkt = baton;
+    serf_bucket_headers_setc(hdrs_bkt, key, value);
+    return 0;
+}
+
+static apr_status_t handle_response(serf_request_t *request,
+                                    serf_bucket_t *response,
+                                    void *handler_baton,
+                                    apr_pool_t *pool)
+{
+    req_baton_t *req_ctx = handler_baton;
+    conn_baton_t *conn_ctx = req_ctx->conn_ctx;
+    app_baton_t *app = conn_ctx->app;
+    serf_status_line sl;
+    apr_status_t status;
+
+    if (!response) {
+        /* The connection was closed before the response arrived, send the
+           request again. Keep the original start time so the retry counts
+           against the latency of this request. */
+        app->retries++;
+        serf_connection_request_create(conn_ctx->conn, setup_request,
+                                       req_ctx);
+        return APR_SUCCESS;
+    }
+
+    status = serf_bucket_response_status(response, &sl);
+    if (status) {
+        return status;
+    }
+
+    while (1) {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_bucket_read(response, SERF_READ_ALL_AVAIL, &data, &len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        app->body_bytes += len;
+
+        if (APR_STATUS_IS_EOF(status)) {
+            hist_record(&app->hist, apr_time_now() - req_ctx->start);
+            app->completed++;
+            if (sl.code >= 400)
+                app->errors++;
+
+            release_req_baton(app, req_ctx);
+
+            /* Closed loop: replace the finished request. */
+            if (app->depth && may_issue(app))
+                issue_request(conn_ctx, 0);
+
+            return APR_EOF;
+        }
+
+        if (APR_STATUS_IS_EAGAIN(status))
+            return status;
+    }
+    /* NOTREACHED */
+}
+
+static apr_status_t setup_request(serf_request_t *request,
+                                  void *setup_baton,
+                                  serf_bucket_t **req_bkt,
+                                  serf_response_acceptor_t *acceptor,
+                                  void **acceptor_baton,
+                                  serf_response_handler_t *handler,
+                                  void **handler_baton,
+                                  apr_pool_t *pool)
+{
+    req_baton_t *req_ctx = setup_baton;
+    app_baton_t *app = req_ctx->conn_ctx->app;
+    serf_bucket_t *hdrs_bkt;
+
+    if (!req_ctx->start)
+        req_ctx->start = apr_time_now();
+
+    *req_bkt = serf_request_bucket_request_create(request, app->method,
+                                                  app->path, NULL,
+                                                  serf_request_get_alloc(request));
+
+    hdrs_bkt = serf_bucket_request_get_headers(*req_bkt);
+    serf_bucket_headers_setn(hdrs_bkt, "User-Agent",
+                             "Serf-bench/" SERF_VERSION_STRING);
+
+    if (app->req_hdrs != NULL) {
+        serf_bucket_headers_do(app->req_hdrs, append_request_headers,
+                               hdrs_bkt);
+    }
+
+    *acceptor = accept_response;
+    *acceptor_baton = app;
+    *handler = handle_response;
+    *handler_baton = req_ctx;
+
+    return APR_SUCCESS;
+}
+
+static void progress_cb(void *progress_baton,
+                        apr_off_t read,
+                        apr_off_t written)
+{
+    app_baton_t *app = progress_baton;
+
+    app->wire_read = read;
+    app->wire_written = written;
+}
+
+/*** Mock server ***/
+
+static const char *mock_response(app_baton_t *app, apr_size_t body_size,
+                                 int close, apr_size_t *len)
+{
+    const char *hdrs;
+    char *resp;
+    apr_size_t hdrs_len;
+
+    hdrs = apr_psprintf(app->pool,
+                        "HTTP/1.1 200 OK\r\n"
+                        "Content-Type: application/octet-stream\r\n"
+                        "Content-Length: %" APR_SIZE_T_FMT "\r\n"
+                        "%s"
+                        "\r\n",
+                        body_size, close ? "Connection: close\r\n" : "");
+    hdrs_len = strlen(hdrs);
+
+    /* A HEAD response has no body. */
+    if (app->head_request)
+        body_size = 0;
+
+    resp = apr_palloc(app->pool, hdrs_len + body_size + 1);
+    memcpy(resp, hdrs, hdrs_len);
+    memset(resp + hdrs_len, 'x', body_size);
+    resp[hdrs_len + body_size] = '\0';
+
+    *len = hdrs_len + body_size;
+    return resp;
+}
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define HAVE_CYCLE_COUNTER
+static apr_uint64_t read_cycle_counter(void)
+{
+    unsigned int lo, hi;
+
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((apr_uint64_t)hi << 32) | lo;
+}
+#endif
+
+/*** Reporting ***/
+
+static void print_report(app_baton_t *app, apr_interval_time_t elapsed,
+                         apr_uint64_t cycles)
+{
+    double secs = (double)elapsed / APR_USEC_PER_SEC;
+    const latency_hist_t *hist = &app->hist;
+
+    if (secs <= 0)
+        secs = 1e-6;
+
+    printf("Requests:     %" APR_UINT64_T_FMT " completed, "
+           "%" APR_UINT64_T_FMT " errors, %" APR_UINT64_T_FMT " retries\n",
+           app->completed, app->errors, app->retries);
+    printf("Duration:     %.3f s\n", secs);
+    printf("Throughput:   %.1f requests/s\n", app->completed / secs);
+    printf("Body data:    %.3f MB/s (%" APR_UINT64_T_FMT " bytes)\n",
+           app->body_bytes / secs / (1024 * 1024), app->body_bytes);
+    printf("Wire data:    %.3f MB/s read, %.3f MB/s written\n",
+           app->wire_read / secs / (1024 * 1024),
+           app->wire_written / secs / (1024 * 1024));
+    if (app->mock && app->completed) {
+        printf("Cost:         %.0f ns/request",
+               secs * 1e9 / app->completed);
+        if (cycles)
+            printf(", %.0f cycles/request",
+                   (double)cycles / app->completed);
+        printf("\n");
+    }
+    printf("Latency (usec):\n");
+    printf("  min    %10" APR_INT64_T_FMT "\n", hist->min);
+    printf("  mean   %10.0f\n",
+           hist->total_count ? hist->sum / hist->total_count : 0.0);
+    printf("  p50    %10" APR_INT64_T_FMT "\n", hist_percentile(hist, 50.0));
+    printf("  p90    %10" APR_INT64_T_FMT "\n", hist_percentile(hist, 90.0));
+    printf("  p99    %10" APR_INT64_T_FMT "\n", hist_percentile(hist, 99.0));
+    printf("  p99.9  %10" APR_INT64_T_FMT "\n", hist_percentile(hist, 99.9));
+    printf("  max    %10" APR_INT64_T_FMT "\n", hist->max);
+}
+
+static const apr_getopt_option_t options[] =
+{
+    {"help",    'h', 0, "Display this help"},
+    {NULL,      'v', 0, "Display version"},
+    {NULL,      'n', 1, "<count> Send <count> requests in total"},
+    {NULL,      't', 1, "<seconds> Send requests for <seconds> seconds"},
+    {NULL,      'c', 1, "<count> Use <count> concurrent connections"},
+    {NULL,      'x', 1, "<depth> Keep <depth> requests in flight per "
+                        "connection (pipelining depth)"},
+    {NULL,      'R', 1, "<rate> Send a fixed <rate> of requests/s instead "
+                        "of a closed loop"},
+    {NULL,      'm', 1, "<method> Use the <method> HTTP Method"},
+    {NULL,      'r', 1, "<header:value> Use <header:value> as request header"},
+    {"mock",    'M', 0, "Don't connect to URL, handle the requests with "
+                        "an in-memory server (no sockets)"},
+    {NULL,      'b', 1, "<bytes> Mock server: send bodies of <bytes> bytes"},
+    {NULL,      'k', 1, "<count> Mock server: close the connection after "
+                        "<count> responses"},
+    {"debug",   'd', 0, "Enable debugging"},
+};
+
+static void print_usage(apr_pool_t *pool)
+{
+    int i;
+
+    puts("serf_bench [options] URL\n");
+    puts("Options:");
+
+    for (i = 0; i < sizeof(options) / sizeof(apr_getopt_option_t); i++) {
+        const apr_getopt_option_t* o = &options[i];
+
+        if (o->optch <= 255) {
+            printf(" -%c", o->optch);
+            if (o->name)
+                printf(", ");
+        } else {
+            printf("     ");
+        }
+
+        printf("%s%s\t%s\n",
+               o->name ? "--" : "\t",
+               o->name ? o->name : "",
+               o->description);
+    }
+}
+
+int main(int argc, const char **argv)
+{
+    apr_status_t status;
+    apr_pool_t *pool;
+    serf_bucket_alloc_t *bkt_alloc;
+    serf_context_t *context;
+    conn_baton_t *conns;
+    app_baton_t app_ctx;
+    apr_uri_t url;
+    const char *raw_url;
+    apr_int64_t count = 0, seconds = 0;
+    int conn_count = 1, depth = 1, debug = 0;
+    apr_int64_t mock_body_size = 0;
+    const char *mock_resp = NULL, *mock_close_resp = NULL;
+    apr_size_t mock_resp_len = 0, mock_close_resp_len = 0;
+    apr_uint64_t cycles = 0;
+    double rate = 0;
+    apr_time_t start, next_send = 0;
+    apr_interval_time_t interval = 0;
+    unsigned int next_conn = 0;
+    int i;
+    apr_getopt_t *opt;
+    int opt_c;
+    const char *opt_arg;
+
+    apr_initialize();
+    atexit(apr_terminate);
+
+    apr_pool_create(&pool, NULL);
+    bkt_alloc = serf_bucket_allocator_create(pool, NULL, NULL);
+
+    memset(&app_ctx, 0, sizeof(app_ctx));
+    app_ctx.method = "GET";
+    app_ctx.pool = pool;
+
+    apr_getopt_init(&opt, pool, argc, argv);
+    while ((status = apr_getopt_long(opt, options, &opt_c, &opt_arg)) ==
+           APR_SUCCESS) {
+
+        switch (opt_c) {
+        case 'h':
+            print_usage(pool);
+            exit(0);
+            break;
+        case 'v':
+            puts("Serf version: " SERF_VERSION_STRING);
+            exit(0);
+        case 'd':
+            debug = 1;
+            break;
+        case 'M':
+            app_ctx.mock = 1;
+            break;
+        case 'b':
+            errno = 0;
+            mock_body_size = apr_strtoi64(opt_arg, NULL, 10);
+            if (errno || mock_body_size < 0) {
+                printf("Invalid body size (%s)\n", opt_arg);
+                return 1;
+            }
+            break;
+        case 'k':
+            errno = 0;
+            app_ctx.mock_keepalive = (unsigned int)apr_strtoi64(opt_arg,
+                                                                NULL, 10);
+            if (errno) {
+                printf("Invalid number of responses (%s)\n", opt_arg);
+                return 1;
+            }
+            break;
+        case 'n':
+            errno = 0;
+            count = apr_strtoi64(opt_arg, NULL, 10);
+            if (errno || count < 0) {
+                printf("Invalid number of requests (%s)\n", opt_arg);
+                return 1;
+            }
+            break;
+        case 't':
+            errno = 0;
+            seconds = apr_strtoi64(opt_arg, NULL, 10);
+            if (errno || seconds < 0) {
+                printf("Invalid duration (%s)\n", opt_arg);
+                return 1;
+            }
+            break;
+        case 'c':
+            errno = 0;
+            conn_count = (int)apr_strtoi64(opt_arg, NULL, 10);
+            if (errno || conn_count <= 0) {
+                printf("Invalid number of concurrent connections to use "
+                       "(%s)\n", opt_arg);
+                return 1;
+            }
+            break;
+        case 'x':
+            errno = 0;
+            depth = (int)apr_strtoi64(opt_arg, NULL, 10);
+            if (errno || depth <= 0) {
+                printf("Invalid pipelining depth (%s)\n", opt_arg);
+                return 1;
+            }
+            break;
+        case 'R':
+            rate = atof(opt_arg);
+            if (rate <= 0) {
+                printf("Invalid request rate (%s)\n", opt_arg);
+                return 1;
+            }
+            break;
+        case 'm':
+            app_ctx.method = opt_arg;
+            break;
+        case 'r':
+            {
+                char *sep;
+                char *hdr_val;
+
+                if (app_ctx.req_hdrs == NULL) {
+                    app_ctx.req_hdrs = serf_bucket_headers_create(bkt_alloc);
+                }
+                sep = strchr(opt_arg, ':');
+                if ((sep == NULL) || (sep == opt_arg) || (strlen(sep) <= 1)) {
+                    printf("Invalid request header string (%s)\n", opt_arg);
+                    return EINVAL;
+                }
+                hdr_val = sep + 1;
+                while (*hdr_val == ' ') {
+                    hdr_val++;
+                }
+                serf_bucket_headers_setx(app_ctx.req_hdrs, opt_arg,
+                                         (sep - opt_arg), 1,
+                                         hdr_val, strlen(hdr_val), 1);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (opt->ind != opt->argc - 1) {
+        print_usage(pool);
+        exit(-1);
+    }
+
+    /* Without any limit, send as many requests as serf_get would. */
+    if (!count && !seconds)
+        count = 1;
+
+    raw_url = argv[opt->ind];
+
+    apr_uri_parse(pool, raw_url, &url);
+    if (!url.scheme || !url.hostname) {
+        printf("Invalid URL (%s)\n", raw_url);
+        return 1;
+    }
+    if (!url.port) {
+        url.port = apr_uri_port_of_scheme(url.scheme);
+    }
+    if (!url.path) {
+        url.path = "/";
+    }
+
+    app_ctx.using_ssl = (strcasecmp(url.scheme, "https") == 0);
+    if (app_ctx.mock && (app_ctx.using_ssl || rate > 0)) {
+        printf("Mock mode supports neither https nor a fixed rate\n");
+        return 1;
+    }
+    app_ctx.head_request = (strcasecmp(app_ctx.method, "HEAD") == 0);
+    app_ctx.hostinfo = url.hostinfo;
+    app_ctx.path = apr_pstrcat(pool,
+                               url.path,
+                               url.query ? "?" : "",
+                               url.query ? url.query : "",
+                               NULL);
+    app_ctx.bkt_alloc = bkt_alloc;
+    app_ctx.max_requests = (apr_uint64_t)count;
+    /* In fixed rate mode new requests are issued by the main loop. */
+    app_ctx.depth = rate > 0 ? 0 : depth;
+
+    if (app_ctx.mock) {
+        mock_resp = mock_response(&app_ctx, (apr_size_t)mock_body_size, 0,
+                                  &mock_resp_len);
+        mock_close_resp = mock_response(&app_ctx, (apr_size_t)mock_body_size,
+                                        1, &mock_close_resp_len);
+        context = mock_context_create(pool);
+    }
+    else {
+        context = serf_context_create(pool);
+    }
+    app_ctx.serf_ctx = context;
+    serf_context_set_progress_cb(context, progress_cb, &app_ctx);
+
+    if (debug)
+    {
+        serf_log_output_t *output;
+
+        status = serf_logging_create_stream_output(&output,
+                                                   context,
+                                                   SERF_LOG_DEBUG,
+                                                   SERF_LOGCOMP_ALL_MSG,
+                                                   SERF_LOG_DEFAULT_LAYOUT,
+                                                   stderr,
+                                                   pool);
+        if (!status)
+            serf_logging_add_output(context, output);
+    }
+
+    conns = apr_pcalloc(pool, conn_count * sizeof(*conns));
+    for (i = 0; i < conn_count; i++)
+    {
+        conn_baton_t *conn_ctx = &conns[i];
+        conn_ctx->app = &app_ctx;
+
+        status = serf_connection_create2(&conn_ctx->conn, context, url,
+                                         conn_setup, conn_ctx,
+                                         closed_connection, conn_ctx,
+                                         pool);
+        if (status) {
+            printf("Error creating connection: %d\n", status);
+            apr_pool_destroy(pool);
+            exit(1);
+        }
+
+        serf_connection_set_max_outstanding_requests(conn_ctx->conn, depth);
+
+        if (app_ctx.mock) {
+            conn_ctx->mock = mock_server_create(context, mock_resp,
+                                                mock_resp_len, pool);
+            mock_server_set_keepalive(conn_ctx->mock, app_ctx.mock_keepalive,
+                                      mock_close_resp, mock_close_resp_len);
+            mock_server_attach(conn_ctx->mock, conn_ctx->conn);
+        }
+    }
+
+    start = apr_time_now();
+#ifdef HAVE_CYCLE_COUNTER
+    cycles = read_cycle_counter();
+#endif
+    if (seconds)
+        app_ctx.end_time = start + apr_time_from_sec(seconds);
+
+    if (rate > 0) {
+        interval = (apr_interval_time_t)(APR_USEC_PER_SEC / rate);
+        if (interval < 1)
+            interval = 1;
+        next_send = start;
+    }
+    else {
+        /* Fill the pipeline of each connection. */
+        for (i = 0; i < depth; i++) {
+            int j;
+            for (j = 0; j < conn_count && may_issue(&app_ctx); j++)
+                issue_request(&conns[j], 0);
+        }
+    }
+
+    while (1) {
+        apr_short_interval_time_t duration = SERF_DURATION_FOREVER;
+
+        /* Closed loop with a time limit: notice when the time is up even
+           when no responses are handled. */
+        if (rate <= 0)
+            (void)may_issue(&app_ctx);
+
+        if (rate > 0) {
+            apr_time_t now = apr_time_now();
+
+            /* Queue all requests that are due by now, each with the time it
+               was scheduled to go out. */
+            while (next_send <= now && may_issue(&app_ctx)) {
+                issue_request(&conns[next_conn++ % conn_count], next_send);
+                next_send += interval;
+            }
+
+            if (!app_ctx.stop_issuing)
+                duration = (apr_short_interval_time_t)(next_send - now);
+        }
+        else if (app_ctx.end_time && !app_ctx.stop_issuing) {
+            /* Wake up in time to stop the test. */
+            duration = (apr_short_interval_time_t)
+                           (app_ctx.end_time - apr_time_now());
+            if (duration < 0)
+                duration = 0;
+        }
+
+        if (app_ctx.stop_issuing && app_ctx.completed >= app_ctx.issued)
+            break;
+
+        if (app_ctx.mock) {
+            status = mock_context_run(context);
+            if (APR_STATUS_IS_EAGAIN(status)) {
+                printf("Error: no progress on the mock connections\n");
+                apr_pool_destroy(pool);
+                exit(1);
+            }
+        }
+        else {
+            status = serf_context_run(context, duration, pool);
+        }
+        if (APR_STATUS_IS_TIMEUP(status))
+            continue;
+        if (status) {
+            char buf[200];
+            const char *err_string;
+            err_string = serf_error_string(status);
+            if (!err_string) {
+                err_string = apr_strerror(status, buf, sizeof(buf));
+            }
+
+            printf("Error running context: (%d) %s\n", status, err_string);
+            apr_pool_destroy(pool);
+            exit(1);
+        }
+    }
+
+#ifdef HAVE_CYCLE_COUNTER
+    cycles = read_cycle_counter() - cycles;
+#else
+    cycles = 0;
+#endif
+    print_report(&app_ctx, apr_time_now() - start, cycles);
+
+    for (i = 0; i < conn_count; i++)
+    {
+        serf_connection_close(conns[i].conn);
+    }
+
+    apr_pool_destroy(pool);
+    return 0;
+}
@@ -0,0 +1,636 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* serf_replay: replays a traffic capture against a local mock server.
+
+   The capture file is written by serf_context_capture_traffic (see
+   capture.c for the format). It holds the shape of the traffic, not the
+   content: for every request the method, uri, header and body sizes of
+   request and response, the status and the time it was created.
+
+   The mock server gets one stub per distinct response shape. Every request
+   is sent with an X-Replay-Response header that selects its stub, padded
+   with an X-Replay-Pad header to about the recorded header size and with a
+   body of the recorded size. Requests go out on the same number of
+   connections and at the same relative times as captured, scaled with -s.
+
+   The client and the server run in this process, so the numbers measure
+   serf's own overhead on a realistic mix of requests. */
+
+#include <stdlib.h>
+
+#include <apr.h>
+#include <apr_strings.h>
+#include <apr_getopt.h>
+#include <apr_file_io.h>
+#include <apr_hash.h>
+
+#include "serf.h"
+
+#include "MockHTTPinC/MockHTTP.h"
+
+#define REPLAY_RESPONSE_HDR "X-Replay-Response"
+#define REPLAY_PAD_HDR "X-Replay-Pad"
+
+/* One line of the capture file. */
+typedef struct replay_rec_t {
+    unsigned int conn;
+    apr_time_t offset;
+    apr_interval_time_t latency;
+    const char *method;
+    const char *uri;
+    apr_int64_t req_hdr;
+    apr_int64_t req_body;
+    int status;
+    apr_int64_t resp_hdr;
+    apr_int64_t resp_body;
+
+    const char *resp_id;        /* value of the X-Replay-Response header */
+    int index;                  /* position in the capture file */
+} replay_rec_t;
+
+typedef struct app_baton_t {
+    apr_pool_t *pool;
+    serf_context_t *serf_ctx;
+    serf_bucket_alloc_t *bkt_alloc;
+    apr_uri_t url;
+    const char *body_data;      /* shared request body data */
+
+    /* Statistics */
+    int completed;
+    int mismatches;             /* status or body size differs */
+    int retries;
+    apr_interval_time_t total_latency;
+    apr_interval_time_t total_recorded_latency;
+} app_baton_t;
+
+typedef struct conn_baton_t {
+    app_baton_t *app;
+    serf_connection_t *conn;
+} conn_baton_t;
+
+typedef struct req_baton_t {
+    app_baton_t *app;
+    conn_baton_t *conn_ctx;
+    const replay_rec_t *rec;
+    apr_time_t start;
+    apr_int64_t body_read;
+} req_baton_t;
+
+/*** Capture file ***/
+
+static apr_status_t parse_record(replay_rec_t *rec, char *line,
+                                 apr_pool_t *pool)
+{
+    char *fields[10];
+    char *last;
+    int i;
+
+    for (i = 0; i < 10; i++) {
+        fields[i] = apr_strtok(i ? NULL : line, " \t\r\n", &last);
+        if (!fields[i])
+            return APR_EINVAL;
+    }
+
+    rec->conn = (unsigned int)apr_strtoi64(fields[0], NULL, 10);
+    rec->offset = apr_strtoi64(fields[1], NULL, 10);
+    rec->latency = apr_strtoi64(fields[2], NULL, 10);
+    rec->method = apr_pstrdup(pool, fields[3]);
+    rec->uri = apr_pstrdup(pool, fields[4]);
+    rec->req_hdr = apr_strtoi64(fields[5], NULL, 10);
+    rec->req_body = apr_strtoi64(fields[6], NULL, 10);
+    rec->status = (int)apr_strtoi64(fields[7], NULL, 10);
+    rec->resp_hdr = apr_strtoi64(fields[8], NULL, 10);
+    rec->resp_body = apr_strtoi64(fields[9], NULL, 10);
+
+    /* Requests without a request line, e.g. if the response arrived before
+       the request was written, are replayed as GET /. */
+    if (strcmp(rec->method, "-") == 0) {
+        rec->method = "GET";
+        rec->uri = "/";
+    }
+    if (!rec->status)
+        rec->status = 200;
+
+    return APR_SUCCESS;
+}
+
+static int compare_records(const void *a, const void *b)
+{
+    const replay_rec_t *ra = a;
+    const replay_rec_t *rb = b;
+
+    if (ra->offset != rb->offset)
+        return ra->offset < rb->offset ? -1 : 1;
+    return ra->index - rb->index;
+}
+
+static apr_status_t read_capture(apr_array_header_t **recs,
+                                 const char *path,
+                                 apr_pool_t *pool)
+{
+    apr_file_t *file;
+    apr_status_t status;
+    char line[8192];
+    int line_nr = 0;
+
+    status = apr_file_open(&file, path, APR_READ, APR_OS_DEFAULT, pool);
+    if (status)
+        return status;
+
+    *recs = apr_array_make(pool, 64, sizeof(replay_rec_t));
+
+    while ((status = apr_file_gets(line, sizeof(line), file)) ==
+           APR_SUCCESS) {
+        replay_rec_t *rec;
+
+        line_nr++;
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\0')
+            continue;
+
+        rec = apr_array_push(*recs);
+        memset(rec, 0, sizeof(*rec));
+        rec->index = (*recs)->nelts - 1;
+        if (parse_record(rec, line, pool)) {
+            printf("Invalid record on line %d of %s\n", line_nr, path);
+            apr_file_close(file);
+            return APR_EINVAL;
+        }
+    }
+    apr_file_close(file);
+
+    if (!APR_STATUS_IS_EOF(status))
+        return status;
+
+    qsort((*recs)->elts, (*recs)->nelts, sizeof(replay_rec_t),
+          compare_records);
+
+    return APR_SUCCESS;
+}
+
+/* Returns a string of LEN padding characters, or NULL if LEN <= 0. */
+static const char *padding(apr_int64_t len, apr_pool_t *pool)
+{
+    char *pad;
+
+    if (len <= 0)
+        return NULL;
+
+    pad = apr_palloc(pool, (apr_size_t)len + 1);
+    memset(pad, 'p', (apr_size_t)len);
+    pad[len] = '\0';
+
+    return pad;
+}
+
+/*** Mock server ***/
+
+/* Add a stub for every distinct response shape in RECS, and set the
+   resp_id of every record. */
+static void setup_stubs(MockHTTP *mh, apr_array_header_t *recs,
+                        apr_pool_t *pool)
+{
+    mhServCtx_t *servctx = mhFindServerByID(mh, DEFAULT_SERVER_ID);
+    apr_hash_t *shapes = apr_hash_make(pool);
+    int i;
+
+    for (i = 0; i < recs->nelts; i++) {
+        replay_rec_t *rec = &APR_ARRAY_IDX(recs, i, replay_rec_t);
+        const char *key;
+        const char *id;
+        const char *pad;
+        mhRequestMatcher_t *rm;
+        mhResponse_t *resp;
+        apr_int64_t pad_len;
+
+        key = apr_psprintf(pool, "%d %" APR_INT64_T_FMT " %" APR_INT64_T_FMT,
+                           rec->status, rec->resp_hdr, rec->resp_body);
+        id = apr_hash_get(shapes, key, APR_HASH_KEY_STRING);
+        if (id) {
+            rec->resp_id = id;
+            continue;
+        }
+
+        id = apr_itoa(pool, apr_hash_count(shapes) + 1);
+        apr_hash_set(shapes, key, APR_HASH_KEY_STRING, id);
+        rec->resp_id = id;
+
+        /* The mock server sends a status line and a Content-Length header,
+           about 40 bytes, and the padding header adds its name. */
+        pad_len = rec->resp_hdr - 40 - (apr_int64_t)strlen(REPLAY_PAD_HDR) - 4;
+        pad = padding(pad_len, pool);
+
+        rm = mhGivenRequest(mh, mhMatchHeaderEqualTo(mh, REPLAY_RESPONSE_HDR,
+                                                     id),
+                            NULL);
+        mhPushRequest(mh, servctx, rm);
+        resp = mhNewResponseForRequest(mh, servctx, rm);
+        mhConfigResponse(resp, mhRespSetCode(resp, rec->status), NULL);
+        if (pad)
+            mhConfigResponse(resp, mhRespAddHeader(resp, REPLAY_PAD_HDR, pad),
+                             NULL);
+        if (rec->resp_body > 0)
+            mhConfigResponse(resp,
+                             mhRespSetBodyPattern(resp, "x",
+                                                  (unsigned int)rec->resp_body),
+                             NULL);
+        else
+            mhConfigResponse(resp, mhRespSetBody(resp, ""), NULL);
+    }
+}
+
+/*** Client ***/
+
+static apr_status_t conn_setup(apr_socket_t *skt,
+                               serf_bucket_t **input_bkt,
+                               serf_bucket_t **output_bkt,
+                               void *setup_baton,
+                               apr_pool_t *pool)
+{
+    conn_baton_t *conn_ctx = setup_baton;
+
+    *input_bkt = serf_context_bucket_socket_create(conn_ctx->app->serf_ctx,
+                                                   skt,
+                                                   conn_ctx->app->bkt_alloc);
+    return APR_SUCCESS;
+}
+
+static void closed_connection(serf_connection_t *conn,
+                              void *closed_baton,
+                              apr_status_t why,
+                              apr_pool_t *pool)
+{
+}
+
+static serf_bucket_t* accept_response(serf_request_t *request,
+                                      serf_bucket_t *stream,
+                                      void *acceptor_baton,
+                                      apr_pool_t *pool)
+{
+    req_baton_t *req_ctx = acceptor_baton;
+    serf_bucket_alloc_t *bkt_alloc = serf_request_get_alloc(request);
+    serf_bucket_t *c;
+    serf_bucket_t *response;
+
+    /* Create a barrier so the response doesn't eat us! */
+    c = serf_bucket_barrier_create(stream, bkt_alloc);
+
+    response = serf_bucket_response_create(c, bkt_alloc);
+
+    if (strcmp(req_ctx->rec->method, "HEAD") == 0)
+        serf_bucket_response_set_head(response);
+
+    return response;
+}
+
+static apr_status_t setup_request(serf_request_t *request,
+                                  void *setup_baton,
+                                  serf_bucket_t **req_bkt,
+                                  serf_response_acceptor_t *acceptor,
+                                  void **acceptor_baton,
+                                  serf_response_handler_t *handler,
+                                  void **handler_baton,
+                                  apr_pool_t *pool);
+
+static apr_status_t handle_response(serf_request_t *request,
+                                    serf_bucket_t *response,
+                                    void *handler_baton,
+                                    apr_pool_t *pool)
+{
+    req_baton_t *req_ctx = handler_baton;
+    app_baton_t *app = req_ctx->app;
+    serf_status_line sl;
+    apr_status_t status;
+
+    if (!response) {
+        /* The connection was closed before the response arrived. */
+        app->retries++;
+        req_ctx->body_read = 0;
+        serf_connection_request_create(req_ctx->conn_ctx->conn, setup_request,
+                                       req_ctx);
+        return APR_SUCCESS;
+    }
+
+    status = serf_bucket_response_status(response, &sl);
+    if (status)
+        return status;
+
+    while (1) {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_bucket_read(response, SERF_READ_ALL_AVAIL, &data, &len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        req_ctx->body_read += len;
+
+        if (APR_STATUS_IS_EOF(status)) {
+            const replay_rec_t *rec = req_ctx->rec;
+
+            app->completed++;
+            app->total_latency += apr_time_now() - req_ctx->start;
+            app->total_recorded_latency += rec->latency;
+            if (sl.code != rec->status || req_ctx->body_read != rec->resp_body)
+                app->mismatches++;
+
+            return APR_EOF;
+        }
+
+        if (APR_STATUS_IS_EAGAIN(status))
+            return status;
+    }
+    /* NOTREACHED */
+}
+
+static apr_status_t setup_request(serf_request_t *request,
+                                  void *setup_baton,
+                                  serf_bucket_t **req_bkt,
+                                  serf_response_acceptor_t *acceptor,
+                                  void **acceptor_baton,
+                                  serf_response_handler_t *handler,
+                                  void **handler_baton,
+                                  apr_pool_t *pool)
+{
+    req_baton_t *req_ctx = setup_baton;
+    app_baton_t *app = req_ctx->app;
+    const replay_rec_t *rec = req_ctx->rec;
+    serf_bucket_alloc_t *bkt_alloc = serf_request_get_alloc(request);
+    serf_bucket_t *body_bkt = NULL;
+    serf_bucket_t *hdrs_bkt;
+    const char *pad;
+    apr_int64_t pad_len;
+
+    if (rec->req_body > 0)
+        body_bkt = serf_bucket_simple_create(app->body_data,
+                                             (apr_size_t)rec->req_body,
+                                             NULL, NULL, bkt_alloc);
+
+    *req_bkt = serf_request_bucket_request_create(request, rec->method,
+                                                  rec->uri, body_bkt,
+                                                  bkt_alloc);
+    hdrs_bkt = serf_bucket_request_get_headers(*req_bkt);
+    serf_bucket_headers_setn(hdrs_bkt, REPLAY_RESPONSE_HDR, rec->resp_id);
+
+    /* The request line, Host and the replay headers account for about
+       60 bytes plus the method and uri. */
+    pad_len = rec->req_hdr - 60 - (apr_int64_t)strlen(rec->method)
+                  - (apr_int64_t)strlen(rec->uri)
+                  - (apr_int64_t)strlen(app->url.hostinfo);
+    pad = padding(pad_len, pool);
+    if (pad)
+        serf_bucket_headers_setn(hdrs_bkt, REPLAY_PAD_HDR, pad);
+
+    *acceptor = accept_response;
+    *acceptor_baton = req_ctx;
+    *handler = handle_response;
+    *handler_baton = req_ctx;
+
+    return APR_SUCCESS;
+}
+
+/*** Main ***/
+
+static const apr_getopt_option_t options[] =
+{
+    {"help",    'h', 0, "Display this help"},
+    {NULL,      'v', 0, "Display version"},
+    {NULL,      'p', 1, "<port> Let the mock server listen on <port> "
+                        "(default 30080)"},
+    {NULL,      's', 1, "<factor> Replay at <factor> times the captured "
+                        "speed, 0 = as fast as possible (default 1)"},
+};
+
+static void print_usage(apr_pool_t *pool)
+{
+    int i;
+
+    puts("serf_replay [options] CAPTURE-FILE\n");
+    puts("Options:");
+
+    for (i = 0; i < sizeof(options) / sizeof(apr_getopt_option_t); i++) {
+        const apr_getopt_option_t* o = &options[i];
+
+        if (o->optch <= 255) {
+            printf(" -%c", o->optch);
+            if (o->name)
+                printf(", ");
+        } else {
+            printf("     ");
+        }
+
+        printf("%s%s\t%s\n",
+               o->name ? "--" : "\t",
+               o->name ? o->name : "",
+               o->description);
+    }
+}
+
+int main(int argc, const char **argv)
+{
+    apr_status_t status;
+    apr_pool_t *pool;
+    apr_array_header_t *recs;
+    apr_hash_t *conns;
+    app_baton_t app_ctx;
+    MockHTTP *mh;
+    double speed = 1.0;
+    unsigned int port = 30080;
+    apr_int64_t max_body = 0;
+    apr_time_t start, elapsed;
+    int next = 0;
+    int i;
+    apr_getopt_t *opt;
+    int opt_c;
+    const char *opt_arg;
+    char *body;
+
+    apr_initialize();
+    atexit(apr_terminate);
+
+    apr_pool_create(&pool, NULL);
+
+    memset(&app_ctx, 0, sizeof(app_ctx));
+    app_ctx.pool = pool;
+    app_ctx.bkt_alloc = serf_bucket_allocator_create(pool, NULL, NULL);
+
+    apr_getopt_init(&opt, pool, argc, argv);
+    while ((status = apr_getopt_long(opt, options, &opt_c, &opt_arg)) ==
+           APR_SUCCESS) {
+
+        switch (opt_c) {
+        case 'h':
+            print_usage(pool);
+            exit(0);
+            break;
+        case 'v':
+            puts("Serf version: " SERF_VERSION_STRING);
+            exit(0);
+        case 'p':
+            errno = 0;
+            port = (unsigned int)apr_strtoi64(opt_arg, NULL, 10);
+            if (errno || !port || port > 65535) {
+                printf("Invalid port (%s)\n", opt_arg);
+                return 1;
+            }
+            break;
+        case 's':
+            speed = atof(opt_arg);
+            if (speed < 0) {
+                printf("Invalid speed factor (%s)\n", opt_arg);
+                return 1;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (opt->ind != opt->argc - 1) {
+        print_usage(pool);
+        exit(-1);
+    }
+
+    status = read_capture(&recs, argv[opt->ind], pool);
+    if (status) {
+        char buf[200];
+        printf("Error reading capture file %s: %s\n", argv[opt->ind],
+               apr_strerror(status, buf, sizeof(buf)));
+        return 1;
+    }
+    if (!recs->nelts) {
+        printf("No requests in capture file %s\n", argv[opt->ind]);
+        return 1;
+    }
+
+    mh = mhInit();
+    InitMockServers(mh)
+      SetupServer(WithHTTP, WithPort(port))
+    EndInit
+    setup_stubs(mh, recs, pool);
+
+    /* One body buffer, big enough for the largest request. */
+    for (i = 0; i < recs->nelts; i++) {
+        const replay_rec_t *rec = &APR_ARRAY_IDX(recs, i, replay_rec_t);
+        if (rec->req_body > max_body)
+            max_body = rec->req_body;
+    }
+    body = apr_palloc(pool, (apr_size_t)max_body + 1);
+    memset(body, 'x', (apr_size_t)max_body);
+    app_ctx.body_data = body;
+
+    apr_uri_parse(pool, apr_psprintf(pool, "http://localhost:%u",
+                                     mhServerPortNr(mh)),
+                  &app_ctx.url);
+    app_ctx.serf_ctx = serf_context_create(pool);
+    conns = apr_hash_make(pool);
+
+    start = apr_time_now();
+    while (app_ctx.completed < recs->nelts) {
+        apr_short_interval_time_t duration = 0;
+        mhError_t err;
+
+        /* Issue all requests that are due. */
+        while (next < recs->nelts) {
+            const replay_rec_t *rec = &APR_ARRAY_IDX(recs, next,
+                                                     replay_rec_t);
+            conn_baton_t *conn_ctx;
+            req_baton_t *req_ctx;
+
+            if (speed > 0) {
+                apr_time_t due = start + (apr_time_t)(rec->offset / speed);
+                apr_time_t now = apr_time_now();
+
+                if (due > now) {
+                    duration = (apr_short_interval_time_t)(due - now);
+                    break;
+                }
+            }
+
+            /* Same connections as in the capture. */
+            conn_ctx = apr_hash_get(conns, &rec->conn, sizeof(rec->conn));
+            if (!conn_ctx) {
+                conn_ctx = apr_pcalloc(pool, sizeof(*conn_ctx));
+                conn_ctx->app = &app_ctx;
+                status = serf_connection_create2(&conn_ctx->conn,
+                                                 app_ctx.serf_ctx,
+                                                 app_ctx.url,
+                                                 conn_setup, conn_ctx,
+                                                 closed_connection, conn_ctx,
+                                                 pool);
+                if (status) {
+                    printf("Error creating connection: %d\n", status);
+                    exit(1);
+                }
+                apr_hash_set(conns, &rec->conn, sizeof(rec->conn), conn_ctx);
+            }
+
+            req_ctx = apr_pcalloc(pool, sizeof(*req_ctx));
+            req_ctx->app = &app_ctx;
+            req_ctx->conn_ctx = conn_ctx;
+            req_ctx->rec = rec;
+            req_ctx->start = apr_time_now();
+            serf_connection_request_create(conn_ctx->conn, setup_request,
+                                           req_ctx);
+            next++;
+        }
+
+        /* Don't sleep in serf while the server has work to do. */
+        if (duration > 1000)
+            duration = 1000;
+
+        err = mhRunServerLoop(mh);
+        if (err == MOCKHTTP_TEST_FAILED) {
+            printf("Error running the mock server\n");
+            exit(1);
+        }
+
+        status = serf_context_run(app_ctx.serf_ctx, duration, pool);
+        if (APR_STATUS_IS_TIMEUP(status))
+            continue;
+        if (status) {
+            char buf[200];
+            const char *err_string;
+            err_string = serf_error_string(status);
+            if (!err_string) {
+                err_string = apr_strerror(status, buf, sizeof(buf));
+            }
+
+            printf("Error running context: (%d) %s\n", status, err_string);
+            exit(1);
+        }
+    }
+    elapsed = apr_time_now() - start;
+
+    printf("Requests:     %d completed, %d mismatches, %d retries, "
+           "%u connections\n",
+           app_ctx.completed, app_ctx.mismatches, app_ctx.retries,
+           apr_hash_count(conns));
+    printf("Duration:     %.3f s (captured %.3f s)\n",
+           (double)elapsed / APR_USEC_PER_SEC,
+           (double)APR_ARRAY_IDX(recs, recs->nelts - 1, replay_rec_t).offset /
+               APR_USEC_PER_SEC);
+    printf("Throughput:   %.1f requests/s\n",
+           app_ctx.completed * (double)APR_USEC_PER_SEC /
+               (elapsed ? elapsed : 1));
+    printf("Mean latency: %.0f usec (captured %.0f usec)\n",
+           (double)app_ctx.total_latency / app_ctx.completed,
+           (double)app_ctx.total_recorded_latency / app_ctx.completed);
+
+    mhCleanup(mh);
+    apr_pool_destroy(pool);
+
+    return app_ctx.mismatches ? 1 : 0;
+}
@@ -1035,6 +1035,61 @@ static void test_linebuf_crlf_split(CuTest *tc)
     CuAssert(tc, "Read less data than expected.", strlen(expected) == 0);
 }
 
+/* Test that status and header lines spread over several reads are collected
+   correctly, and lines read in one go are parsed in place. */
+static void test_response_bucket_split_lines(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_t *mock_bkt, *bkt, *hdrs;
+    serf_status_line sline;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+
+    mockbkt_action actions[]= {
+        { 1, "HTTP/1.1 20", APR_SUCCESS },
+        { 1, "3 Non-Authoritative", APR_EAGAIN },
+        { 1, " Information" CRLF "Server: Apa", APR_SUCCESS },
+        { 1, "che" CRLF "Content-Length: 3" CRLF "X-Empty:", APR_SUCCESS },
+        { 1, CRLF CRLF "abc", APR_SUCCESS }, };
+    apr_status_t status;
+    const char *expected = "abc";
+
+    mock_bkt = serf_bucket_mock_create(actions, 5, alloc);
+    bkt = serf_bucket_response_create(mock_bkt, alloc);
+
+    do
+    {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_bucket_read(bkt, SERF_READ_ALL_AVAIL, &data, &len);
+        CuAssert(tc, "Got error during bucket reading.",
+                 !SERF_BUCKET_READ_ERROR(status));
+        CuAssert(tc, "Read more data than expected.",
+                 strlen(expected) >= len);
+        CuAssert(tc, "Read data is not equal to expected.",
+                 strncmp(expected, data, len) == 0);
+
+        expected += len;
+
+        if (len == 0 && status == APR_EAGAIN)
+            serf_bucket_mock_more_data_arrived(mock_bkt);
+    } while(!APR_STATUS_IS_EOF(status));
+
+    CuAssert(tc, "Read less data than expected.", strlen(expected) == 0);
+
+    serf_bucket_response_status(bkt, &sline);
+    CuAssertTrue(tc, sline.version == SERF_HTTP_11);
+    CuAssertIntEquals(tc, 203, sline.code);
+    CuAssertStrEquals(tc, "Non-Authoritative Information", sline.reason);
+
+    hdrs = serf_bucket_response_get_headers(bkt);
+    CuAssertStrEquals(tc, "Apache", serf_bucket_headers_get(hdrs, "Server"));
+    CuAssertStrEquals(tc, "3",
+                      serf_bucket_headers_get(hdrs, "Content-Length"));
+    CuAssertStrEquals(tc, "", serf_bucket_headers_get(hdrs, "X-Empty"));
+}
+
 /* Test that the Content-Length header will be ignored when the response
    should not have returned a body. See RFC2616, section 4.4, nbr. 1. */
 static void test_response_no_body_expected(CuTest *tc)
@@ -1677,6 +1732,70 @@ static void test_deflate_4GBplus_buckets(CuTest *tc)
 #undef BUFSIZE
 }
 
+/* Validate that a spool returns the same data to every spool bucket, also
+   when the first one was destroyed halfway, and when part of the data went
+   to the spool file. */
+static void test_spool_buckets(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    const char *body = "line1" CRLF "line2" CRLF "line3" CRLF "line4";
+    serf_spool_t *spool;
+    serf_bucket_t *src, *bkt;
+    const char *data;
+    apr_size_t len;
+    apr_status_t status;
+    int i;
+
+    /* Only 8 bytes in memory, the rest in the file. */
+    src = SERF_BUCKET_SIMPLE_STRING(body, alloc);
+    spool = serf_spool_create(src, 8, tb->pool);
+
+    /* The first attempt reads part of the data. */
+    bkt = serf_bucket_spool_create(spool, alloc);
+    status = serf_bucket_read(bkt, 12, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 12, len);
+    CuAssert(tc, "Read data is not equal to expected.",
+             strncmp(body, data, len) == 0);
+    serf_bucket_destroy(bkt);
+
+    /* The next reads the spooled data, then continues with the source. */
+    bkt = serf_bucket_spool_create(spool, alloc);
+    read_and_check_bucket(tc, bkt, body);
+    serf_bucket_destroy(bkt);
+
+    /* Now all data comes from the spool. */
+    bkt = serf_bucket_spool_create(spool, alloc);
+    readlines_and_check_bucket(tc, bkt, SERF_NEWLINE_CRLF, body, 4);
+    serf_bucket_destroy(bkt);
+
+    /* Two spool buckets read interleaved, each from its own position: the
+       first one reads from the source, then the second one spools the rest,
+       then the first one continues from the spool. Once with all data in
+       memory, once with part of it in the file. */
+    for (i = 0; i < 2; i++) {
+        serf_bucket_t *other;
+
+        src = SERF_BUCKET_SIMPLE_STRING(body, alloc);
+        spool = serf_spool_create(src, i ? 8 : 1024, tb->pool);
+        bkt = serf_bucket_spool_create(spool, alloc);
+        other = serf_bucket_spool_create(spool, alloc);
+
+        status = serf_bucket_read(bkt, 5, &data, &len);
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+        CuAssertIntEquals(tc, 5, len);
+        CuAssert(tc, "Read data is not equal to expected.",
+                 strncmp(body, data, len) == 0);
+
+        read_and_check_bucket(tc, other, body);
+        read_and_check_bucket(tc, bkt, body + 5);
+        serf_bucket_destroy(other);
+        serf_bucket_destroy(bkt);
+    }
+}
+
 /* Basic test for serf_linebuf_fetch(). */
 static void test_linebuf_fetch_crlf(CuTest *tc)
 {
@@ -1729,6 +1848,57 @@ static void test_linebuf_fetch_crlf(CuTest *tc)
 
 }
 
+/* Test that trimming an allocator keeps the memory still in use intact, and
+   that the allocator can be used afterwards. */
+static void test_allocator_trim(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    char *blocks[300];
+    apr_size_t held = 0, held_before;
+    int i, j;
+
+    /* Count the memory the allocator holds, like the memory budget. */
+    serf__bucket_allocator_account(alloc, &held);
+
+    /* Enough small allocations to fill a few blocks. */
+    for (i = 0; i < 300; i++) {
+        blocks[i] = serf_bucket_mem_alloc(alloc, 64);
+        memset(blocks[i], i & 0xff, 64);
+    }
+
+    /* Free all but every 100th allocation, then trim: the blocks without
+       a live allocation are returned. */
+    for (i = 0; i < 300; i++) {
+        if (i % 100)
+            serf_bucket_mem_free(alloc, blocks[i]);
+    }
+    held_before = held;
+    serf_bucket_allocator_trim(alloc);
+    CuAssertTrue(tc, held < held_before);
+
+    for (i = 0; i < 300; i += 100) {
+        for (j = 0; j < 64; j++)
+            CuAssertIntEquals(tc, i & 0xff, (unsigned char)blocks[i][j]);
+    }
+
+    /* The freelist is still consistent. */
+    for (i = 0; i < 300; i++) {
+        if (i % 100)
+            blocks[i] = serf_bucket_mem_alloc(alloc, 64);
+        memset(blocks[i], 0, 64);
+    }
+    for (i = 0; i < 300; i++)
+        serf_bucket_mem_free(alloc, blocks[i]);
+    serf_bucket_allocator_trim(alloc);
+    CuAssertTrue(tc, held == 0);
+
+    blocks[0] = serf_bucket_mem_alloc(alloc, 64);
+    CuAssertPtrNotNull(tc, blocks[0]);
+    serf_bucket_mem_free(alloc, blocks[0]);
+}
+
 CuSuite *test_buckets(void)
 {
     CuSuite *suite = CuSuiteNew();
@@ -1754,6 +1924,7 @@ CuSuite *test_buckets(void)
     SUITE_ADD_TEST(suite, test_aggregate_bucket_readline);
     SUITE_ADD_TEST(suite, test_header_buckets);
     SUITE_ADD_TEST(suite, test_linebuf_crlf_split);
+    SUITE_ADD_TEST(suite, test_response_bucket_split_lines);
     SUITE_ADD_TEST(suite, test_response_no_body_expected);
     SUITE_ADD_TEST(suite, test_random_eagain_in_response);
     SUITE_ADD_TEST(suite, test_dechunk_buckets);
@@ -1769,6 +1940,8 @@ CuSuite *test_buckets(void)
 #endif
 
     SUITE_ADD_TEST(suite, test_linebuf_fetch_crlf);
+    SUITE_ADD_TEST(suite, test_spool_buckets);
+    SUITE_ADD_TEST(suite, test_allocator_trim);
 
     return suite;
 }
@@ -303,6 +303,59 @@ static void test_config_store_remove_objects(CuTest *tc)
     CuAssertPtrEquals(tc, NULL, actual);
 }
 
+/* Serf's own keys and application keys share a scope, a connection's host
+   and connection values are the same for every config object of that
+   connection. */
+static void test_config_store_serf_and_app_keys(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_config_t *cfg1, *cfg2;
+    serf_connection_t *conn;
+    apr_uri_t url;
+    const char *actual;
+
+    serf_context_t *ctx = serf_context_create(tb->pool);
+
+    apr_uri_parse(tb->pool, "http://localhost:12345", &url);
+    serf_connection_create2(&conn, ctx, url, conn_setup, NULL,
+                            conn_closed, NULL, tb->pool);
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf__config_store_get_config(ctx, conn, &cfg1,
+                                                    tb->pool));
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_config_set_string(cfg1, SERF_CONFIG_CONN_LOCALIP,
+                                             "127.0.0.1:1234"));
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_config_set_string(cfg1, PER_CONN_TEST_KEY,
+                                             "app_value"));
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf__config_store_get_config(ctx, conn, &cfg2,
+                                                    tb->pool));
+    CuAssertPtrEquals(tc, cfg1->per_conn, cfg2->per_conn);
+    CuAssertPtrEquals(tc, cfg1->per_host, cfg2->per_host);
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_config_get_string(cfg2, SERF_CONFIG_CONN_LOCALIP,
+                                             &actual));
+    CuAssertStrEquals(tc, "127.0.0.1:1234", actual);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_config_get_string(cfg2, PER_CONN_TEST_KEY,
+                                             &actual));
+    CuAssertStrEquals(tc, "app_value", actual);
+
+    /* Set by serf_connection_create2 */
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_config_get_string(cfg2, SERF_CONFIG_HOST_NAME,
+                                             &actual));
+    CuAssertStrEquals(tc, "localhost", actual);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_config_get_string(cfg2, SERF_CONFIG_HOST_PORT,
+                                             &actual));
+    CuAssertStrEquals(tc, "12345", actual);
+}
+
 /* Add and remove some headers from the headers bucket. */
 /* Note: serf__bucket_headers_remove is an internal function */
 static void test_header_buckets_remove(CuTest *tc)
@@ -391,6 +444,7 @@ CuSuite *test_internal(void)
     SUITE_ADD_TEST(suite, test_config_store_per_connection_same_host);
     SUITE_ADD_TEST(suite, test_config_store_error_handling);
     SUITE_ADD_TEST(suite, test_config_store_remove_objects);
+    SUITE_ADD_TEST(suite, test_config_store_serf_and_app_keys);
     SUITE_ADD_TEST(suite, test_header_buckets_remove);
 
     return suite;
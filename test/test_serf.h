@@ -25,6 +25,7 @@
 #include "serf.h"
 
 #include "MockHTTPinC/MockHTTP.h"
+#include "mock_transport.h"
 
 /* Test logging facilities, set flag to 1 to enable console logging for
    the test suite. */
@@ -279,6 +280,20 @@ run_client_and_mock_servers_loops_expect_ok(CuTest *tc, test_baton_t *tb,
                                             handler_baton_t handler_ctx[],
                                             apr_pool_t *pool);
 
+/* Initiate a serf context with one connection to an in-memory server,
+   which answers every request with RESP of RESP_LEN bytes. No sockets are
+   used, run the context with run_client_and_mock_transport_loops. */
+mock_server_t *setup_test_mock_transport(test_baton_t *tb,
+                                         const char *resp,
+                                         apr_size_t resp_len);
+
+/* Helper function, runs the client context on the mock transport until all
+   requests are handled. */
+apr_status_t
+run_client_and_mock_transport_loops(test_baton_t *tb,
+                                    int num_requests,
+                                    handler_baton_t handler_ctx[]);
+
 /* Logs a standard event, with filename & timestamp header */
 void test__log(int verbose_flag, const char *filename, const char *fmt, ...);
 
@@ -1726,6 +1726,152 @@ static void test_server_spnego_authn(CuTest *tc)
 }
 
 
+/* Sets up a mock server that asks for Negotiate authentication on URL /,
+   and accepts any token. On /reject, every token is refused. */
+static void setup_spnego_server(CuTest *tc, test_baton_t *tb)
+{
+    apr_status_t status;
+
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_config_authn_types(tb->context, SERF_AUTHN_NEGOTIATE);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"), HeaderSet("Authorization"))
+        Respond(WithCode(200), WithChunkedBody(""))
+      GETRequest(URLEqualTo("/"), HeaderNotSet("Authorization"))
+        Respond(WithCode(401), WithHeader("WWW-Authenticate", "Negotiate"),
+                WithChunkedBody(""))
+      GETRequest(URLEqualTo("/reject"))
+        Respond(WithCode(401), WithHeader("WWW-Authenticate", "Negotiate"),
+                WithChunkedBody(""))
+    EndGiven
+}
+
+static unsigned int spnego_requests_received(test_baton_t *tb)
+{
+    unsigned int received;
+
+    Verify(tb->mh)
+      received = VerifyStats->requestsReceived;
+    EndVerify
+
+    return received;
+}
+
+/* Runs a Negotiate handshake on the current connection. Returns TRUE if it
+   completed, which needs SPNEGO support and Kerberos credentials for
+   HTTP@localhost. Without them the handshake fails on the first 401. */
+static int spnego_handshake(CuTest *tc, test_baton_t *tb,
+                            handler_baton_t *handler_ctx)
+{
+    apr_status_t status;
+
+    create_new_request(tb, handler_ctx, "GET", "/", 1);
+    status = run_client_and_mock_servers_loops(tb, 1, handler_ctx, tb->pool);
+    if (status == APR_SUCCESS) {
+        /* The initial 401, then the request with the token. */
+        CuAssertIntEquals(tc, 2, spnego_requests_received(tb));
+        return TRUE;
+    }
+
+    CuAssertIntEquals(tc, 1, spnego_requests_received(tb));
+    return FALSE;
+}
+
+/* Validate that with serf_config_authn_negotiate_reuse, a new connection to
+   a server that completed a Negotiate handshake sends a token with its first
+   request. Without credentials nothing is established, so the new connection
+   mustn't try to send a token either. */
+static void test_server_spnego_preemptive(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    unsigned int received;
+    apr_status_t status;
+    int established;
+
+    setup_spnego_server(tc, tb);
+    serf_config_authn_negotiate_reuse(tb->context, 1);
+
+    established = spnego_handshake(tc, tb, &handler_ctx[0]);
+    received = spnego_requests_received(tb);
+
+    status = use_new_connection(tb, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+    status = run_client_and_mock_servers_loops(tb, 1, &handler_ctx[1],
+                                               tb->pool);
+
+    /* Either the token was accepted right away, or there was no token and
+       the request got the 401 again. */
+    CuAssertIntEquals(tc, received + 1, spnego_requests_received(tb));
+    if (established)
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+}
+
+/* Validate that a token sent preemptively that's rejected by the server
+   leads to a normal handshake, instead of failing the request. */
+static void test_server_spnego_preemptive_rejected(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    unsigned int received;
+    apr_status_t status;
+
+    setup_spnego_server(tc, tb);
+    serf_config_authn_negotiate_reuse(tb->context, 1);
+
+    /* Nothing to reuse without credentials. */
+    if (!spnego_handshake(tc, tb, &handler_ctx[0]))
+        return;
+    received = spnego_requests_received(tb);
+
+    status = use_new_connection(tb, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    create_new_request(tb, &handler_ctx[1], "GET", "/reject", 2);
+    status = run_client_and_mock_servers_loops(tb, 1, &handler_ctx[1],
+                                               tb->pool);
+
+    /* The preemptive token was refused, then the token of the new
+       handshake. Only the second refusal fails the request. */
+    CuAssertIntEquals(tc, SERF_ERROR_AUTHN_CREDENTIALS_REJECTED, status);
+    CuAssertIntEquals(tc, received + 2, spnego_requests_received(tb));
+}
+
+/* Validate that without serf_config_authn_negotiate_reuse, every new
+   connection waits for the 401 of the server before it sends a token. */
+static void test_server_spnego_no_reuse(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    unsigned int received;
+    apr_status_t status;
+    int established;
+
+    setup_spnego_server(tc, tb);
+
+    established = spnego_handshake(tc, tb, &handler_ctx[0]);
+    received = spnego_requests_received(tb);
+
+    status = use_new_connection(tb, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+    status = run_client_and_mock_servers_loops(tb, 1, &handler_ctx[1],
+                                               tb->pool);
+
+    if (established) {
+        /* The initial 401 again, then the request with the token. */
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+        CuAssertIntEquals(tc, received + 2, spnego_requests_received(tb));
+    }
+    else {
+        CuAssertIntEquals(tc, received + 1, spnego_requests_received(tb));
+    }
+}
+
 static void test_ssl_renegotiate(CuTest *tc)
 {
     test_baton_t *tb = tc->testBaton;
@@ -2141,6 +2287,9 @@ CuSuite *test_ssl(void)
     SUITE_ADD_TEST(suite, test_ssltunnel_digest_auth);
     SUITE_ADD_TEST(suite, test_ssltunnel_spnego_authn);
     SUITE_ADD_TEST(suite, test_server_spnego_authn);
+    SUITE_ADD_TEST(suite, test_server_spnego_preemptive);
+    SUITE_ADD_TEST(suite, test_server_spnego_preemptive_rejected);
+    SUITE_ADD_TEST(suite, test_server_spnego_no_reuse);
     SUITE_ADD_TEST(suite, test_ssl_missing_client_certificate);
     SUITE_ADD_TEST(suite, test_connect_to_non_http_server);
     SUITE_ADD_TEST(suite, test_ssl_ocsp_response_error_and_override);
@@ -546,6 +546,62 @@ run_client_and_mock_servers_loops_expect_ok(CuTest *tc, test_baton_t *tb,
     CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
 }
 
+/* Connection setup for the mock transport, reads the responses of the
+   server in tb->user_baton. */
+static apr_status_t mock_transport_conn_setup(apr_socket_t *skt,
+                                              serf_bucket_t **input_bkt,
+                                              serf_bucket_t **output_bkt,
+                                              void *setup_baton,
+                                              apr_pool_t *pool)
+{
+    test_baton_t *tb = setup_baton;
+
+    *input_bkt = mock_server_connect(tb->user_baton, tb->bkt_alloc);
+    return APR_SUCCESS;
+}
+
+mock_server_t *setup_test_mock_transport(test_baton_t *tb,
+                                         const char *resp,
+                                         apr_size_t resp_len)
+{
+    mock_server_t *srv;
+
+    tb->serv_url = "http://localhost";
+    tb->context = mock_context_create(tb->pool);
+    tb->conn_setup = mock_transport_conn_setup;
+    if (use_new_connection(tb, tb->pool))
+        return NULL;
+
+    srv = mock_server_create(tb->context, resp, resp_len, tb->pool);
+    mock_server_attach(srv, tb->connection);
+    tb->user_baton = srv;
+
+    return srv;
+}
+
+apr_status_t
+run_client_and_mock_transport_loops(test_baton_t *tb,
+                                    int num_requests,
+                                    handler_baton_t handler_ctx[])
+{
+    int i, done = 0;
+
+    while (!done)
+    {
+        apr_status_t status;
+
+        status = mock_context_run(tb->context);
+        if (status)
+            return status;
+
+        done = 1;
+        for (i = 0; i < num_requests; i++)
+            done &= handler_ctx[i].done;
+    }
+
+    return APR_SUCCESS;
+}
+
 void setup_test_mock_server(test_baton_t *tb)
 {
     if (!tb->mh)    /* TODO: move this to test_setup */
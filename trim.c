@@ -0,0 +1,85 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Trimming the memory of idle connections.
+
+   A keep-alive connection without requests still holds the blocks of its
+   bucket allocator, which only grows, and with SSL the buffers of the
+   encrypt and decrypt streams and those of OpenSSL. Trimming gives back
+   what isn't in use; everything is allocated again on the next request.
+ */
+
+#include <apr_pools.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+void serf_connection_trim(serf_connection_t *conn)
+{
+    /* Data read from the SSL buckets may still wait to be written. */
+    if (conn->ssl_ctx && !conn->vec_len)
+        serf_ssl_release_buffers(conn->ssl_ctx);
+
+    serf_bucket_allocator_trim(conn->allocator);
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "trimmed conn 0x%x\n", conn);
+}
+
+void serf_context_set_idle_trim(serf_context_t *ctx,
+                                apr_interval_time_t idle_time)
+{
+    ctx->idle_trim = idle_time > 0 ? idle_time : 0;
+}
+
+apr_interval_time_t serf__idle_trim_wakeup(serf_context_t *ctx)
+{
+    apr_time_t now, next = 0;
+    int i;
+
+    if (!ctx->idle_trim)
+        return -1;
+
+    now = apr_time_now();
+    for (i = 0; i < ctx->conns->nelts; i++) {
+        serf_connection_t *conn = GET_CONN(ctx, i);
+        apr_time_t due;
+
+        if (conn->written.length || conn->unwritten.length) {
+            conn->idle_since = 0;
+            conn->trimmed = 0;
+            continue;
+        }
+
+        if (conn->trimmed)
+            continue;
+
+        if (!conn->idle_since)
+            conn->idle_since = now;
+
+        due = conn->idle_since + ctx->idle_trim;
+        if (due <= now) {
+            serf_connection_trim(conn);
+            conn->trimmed = 1;
+        }
+        else if (!next || due < next) {
+            next = due;
+        }
+    }
+
+    return next ? next - now : -1;
+}